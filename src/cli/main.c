@@ -6,6 +6,7 @@
 #include "pipe/global.h"
 #include "pipe/modules/api.h"
 #include "core/log.h"
+#include "core/trace.h"
 #include "core/version.h"
 
 #include <stdlib.h>
@@ -46,6 +47,8 @@ int main(int argc, char *argv[])
   dt_log_init(s_log_cli);
   dt_log_init_arg(argc, argv);
   dt_pipe_global_init();
+  dt_trace_init();
+  dt_trace_thread_name("cli");
   threads_global_init();
 
   int dump_nodes = 0;
@@ -152,6 +155,7 @@ int main(int argc, char *argv[])
 
   dt_graph_cleanup(&graph);
   threads_global_cleanup();
+  dt_trace_cleanup();
   qvk_cleanup();
   exit(res);
 }
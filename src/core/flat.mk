@@ -1,7 +1,9 @@
 CORE_O=core/log.o \
-       core/threads.o
+       core/threads.o \
+       core/trace.o
 CORE_H=core/core.h \
        core/log.h \
-       core/threads.h
+       core/threads.h \
+       core/trace.h
 CORE_CFLAGS=
 CORE_LDFLAGS=-pthread -ldl
@@ -0,0 +1,123 @@
+#pragma once
+// in-place msd radix sort of 64-bit keys (american flag sort), after
+// https://github.com/vvnguyen/parallel-in-place-radix-sort
+// the first byte that actually differs between the keys is distributed
+// serially, the resulting buckets are then sorted in parallel on the
+// thread pool. not stable, so encode tie breakers in the low bits.
+#include "threads.h"
+
+#include <stdint.h>
+
+#define RADIX_SORT_SERIAL 32      // use insertion sort below this many elements
+#define RADIX_SORT_PARALLEL 16384 // don't bother the thread pool below this
+
+static inline void
+radix_sort_insertion(uint64_t *list, const uint32_t size)
+{
+  for(uint32_t i=1;i<size;i++)
+  {
+    const uint64_t tmp = list[i];
+    uint32_t j = i;
+    for(;j>0 && list[j-1] > tmp;j--)
+      list[j] = list[j-1];
+    list[j] = tmp;
+  }
+}
+
+// build the histogram of the byte at shift and swap all elements into their
+// buckets. returns the number of non-empty buckets.
+static inline int
+radix_sort_distribute(
+    uint64_t *list,
+    const uint32_t size,
+    const int shift,
+    uint32_t histogram[256],
+    uint64_t *marker[256])
+{
+  for(int k=0;k<256;k++) histogram[k] = 0;
+  for(uint32_t i=0;i<size;i++)
+    histogram[(list[i] >> shift) & 0xff]++;
+  int buckets = 0;
+  for(int k=0;k<256;k++) buckets += histogram[k] > 0;
+  if(buckets <= 1) return buckets; // nothing to do for this byte
+
+  uint64_t *end[256];
+  marker[0] = list;
+  for(int k=0;k<255;k++) marker[k+1] = marker[k] + histogram[k];
+  for(int k=0;k<256;k++) end[k] = marker[k] + histogram[k];
+  for(int k=0;k<256;k++)
+  {
+    while(marker[k] < end[k])
+    { // swap elements to the beginning of their bucket until one fits here
+      uint64_t v = *marker[k];
+      int b = (v >> shift) & 0xff;
+      while(b != k)
+      {
+        const uint64_t tmp = *marker[b];
+        *marker[b]++ = v;
+        v = tmp;
+        b = (v >> shift) & 0xff;
+      }
+      *marker[k]++ = v;
+    }
+  }
+  // markers now point to the end of their buckets
+  return buckets;
+}
+
+static inline void
+radix_sort_block(uint64_t *list, const uint32_t size, int shift)
+{
+  if(size <= RADIX_SORT_SERIAL)
+  {
+    radix_sort_insertion(list, size);
+    return;
+  }
+  uint32_t histogram[256];
+  uint64_t *marker[256];
+  while(radix_sort_distribute(list, size, shift, histogram, marker) <= 1)
+    if((shift -= 8) < 0) return; // all keys equal
+  if(!shift) return;
+  for(int k=0;k<256;k++)
+    if(histogram[k] > 1)
+      radix_sort_block(marker[k] - histogram[k], histogram[k], shift-8);
+}
+
+typedef struct radix_sort_job_t
+{
+  uint32_t  histogram[256];
+  uint64_t *marker[256];
+  int       shift;
+}
+radix_sort_job_t;
+
+static inline void
+radix_sort_work(uint32_t beg, uint32_t end, void *data)
+{
+  radix_sort_job_t *j = data;
+  for(uint32_t k=beg;k<end;k++)
+    if(j->histogram[k] > 1)
+      radix_sort_block(j->marker[k] - j->histogram[k], j->histogram[k], j->shift-8);
+}
+
+// sort size keys in ascending order
+static inline void
+radix_sort(uint64_t *list, const uint32_t size)
+{
+  if(size < 2) return;
+  uint64_t diff = 0; // skip the leading bytes that are the same for all keys
+  for(uint32_t i=1;i<size;i++) diff |= list[i] ^ list[0];
+  if(!diff) return;
+  int shift = 56;
+  while(!(diff >> shift)) shift -= 8;
+
+  if(size < RADIX_SORT_PARALLEL || threads_num() < 2)
+  {
+    radix_sort_block(list, size, shift);
+    return;
+  }
+
+  radix_sort_job_t j = { .shift = shift };
+  radix_sort_distribute(list, size, shift, j.histogram, j.marker);
+  if(shift) threads_parallel_for(0, 256, 1, radix_sort_work, &j);
+}
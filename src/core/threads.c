@@ -1,4 +1,6 @@
 #include "threads.h"
+#include "trace.h"
+#include "core.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +28,7 @@ typedef enum threads_task_state_t
   s_task_state_ready   = -1u,
   s_task_state_initing = -2u,
   s_task_state_recycle = -3u,
+  s_task_state_waiting = -4u, // waiting for other jobs to finish first
   // everything else is the threadid of the worker thread
 }
 threads_task_state_t;
@@ -34,10 +37,18 @@ threads_task_state_t;
 typedef struct threads_task_t
 {
   atomic_uint     work_item;     // work item counter (if not referring to another task)
-  atomic_uint     done;          // counting how many tasks are *done* (not just *picked*), to coordinate cleanup.
+  atomic_uint     done;          // counting how many work items are *done* (not just *picked*)
+  atomic_uint     active;        // number of tasks referring to us that did not finish their loop yet
   uint32_t        work_item_cnt; // global number of work items. externally set to 0 if abortion is triggered.
-  uint32_t        tid;           // id of thread working on this task, or -1u if not assigned yet
+  atomic_uint     tid;           // id of thread working on this task, or one of the states above
+  atomic_int      aborted;       // set by threads_task_abort(), no more items will be started
+  threads_priority_t prio;       // which queues this task goes to
   int32_t         reftask;       // use the atomics of this task (can be us)
+  _Atomic int32_t next_user;     // singly linked list of tasks sharing our reftask, -1 terminated
+  atomic_int      queued;        // set once the task has been handed to a worker queue
+  atomic_int      deps;          // number of jobs that need to finish before this one can start
+  int32_t         succ;          // list of edges to jobs waiting for us, -1 empty, -2 closed (we're done)
+  atomic_uint     gen;           // bumped every time the slot is reused, part of the task id we hand out
   threads_run_t   run;           // work function
   void           *data;          // user data to be passed to run function
   threads_free_t  free;          // optionally clean up user data
@@ -45,25 +56,370 @@ typedef struct threads_task_t
 }
 threads_task_t;
 
+// bounded multi producer multi consumer queue of task ids (dmitry vyukov's design).
+// pushing and popping are one CAS each, any thread can do both.
+typedef struct threads_queue_cell_t
+{
+  atomic_size_t seq;
+  uint32_t      val;
+}
+threads_queue_cell_t;
+
+typedef struct threads_queue_t
+{
+  threads_queue_cell_t *cell;
+  size_t                mask;    // capacity - 1, capacity is a power of two
+  char                  pad0[48];
+  atomic_size_t         head;    // next position to push to
+  char                  pad1[56];
+  atomic_size_t         tail;    // next position to pop from
+  char                  pad2[56];
+}
+threads_queue_t;
+
+// every worker owns a queue and sleeps on its own condition variable,
+// so pushing a task wakes exactly one idle thread.
+typedef struct threads_worker_t
+{
+  threads_queue_t queue[s_threads_prio_cnt];
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  atomic_int      idle;          // set while sleeping on cond (or about to)
+  pthread_t       thread;
+}
+threads_worker_t;
+
+// dependency edge, successors of a job are a linked list of these
+typedef struct threads_edge_t
+{
+  int32_t task;                  // the waiting job
+  int32_t next;                  // next edge in the list or -1
+}
+threads_edge_t;
+
 typedef struct threads_t
 {
-  uint32_t        num_threads;
-  atomic_int      shutdown;
+  uint32_t          num_threads;
+  atomic_int        shutdown;
 
   // worker list
-  pthread_t      *worker;
-  uint32_t       *cpuid;
+  threads_worker_t *worker;
+  uint32_t         *cpuid;       // cpu every worker is pinned to
+  threads_placement_t placement; // how cpuid was chosen
+  atomic_int        queued;      // number of tasks sitting in any of the worker queues
+  atomic_int        queued_prio[s_threads_prio_cnt]; // same, per priority class
+  atomic_uint       next_worker; // round robin start for pushing tasks
   // pool of tasks
-  uint32_t        task_max;
-  threads_task_t *task;
-  pthread_cond_t  cond_task_done;
-  pthread_cond_t  cond_task_push;
-  pthread_mutex_t mutex_done;
-  pthread_mutex_t mutex_push;
-  pthread_t       main_thread;
+  uint32_t          task_max;
+  threads_task_t   *task;
+  threads_queue_t   task_free;   // ids of recyclable tasks
+  // dependency edges between jobs. only touched when adding edges and when
+  // jobs with successors finish, so one mutex is fine here.
+  pthread_mutex_t   mutex_deps;
+  threads_edge_t   *edge;
+  uint32_t          edge_max;
+  int32_t           edge_free;   // free list of edges
+  uint32_t          edge_free_cnt;
+  pthread_cond_t    cond_task_done;
+  pthread_mutex_t   mutex_done;
+  pthread_t         main_thread;
+#ifdef __linux__
+  cpu_set_t         cpus;        // what the process may run on, workers are pinned inside this
+#endif
 }
 threads_t;
 
+static void
+threads_queue_init(threads_queue_t *q, uint32_t size)
+{
+  size_t cap = 1;
+  while(cap < size) cap <<= 1;
+  q->cell = malloc(sizeof(threads_queue_cell_t)*cap);
+  q->mask = cap - 1;
+  for(size_t k=0;k<cap;k++) atomic_init(&q->cell[k].seq, k);
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+}
+
+static void
+threads_queue_cleanup(threads_queue_t *q)
+{
+  free(q->cell);
+  q->cell = 0;
+}
+
+static int // returns 0 on success, 1 if the queue is full
+threads_queue_push(threads_queue_t *q, uint32_t val)
+{
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  threads_queue_cell_t *c;
+  while(1)
+  {
+    c = q->cell + (pos & q->mask);
+    const size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if(dif == 0)
+    {
+      if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos+1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if(dif < 0) return 1;
+    else pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  }
+  c->val = val;
+  atomic_store_explicit(&c->seq, pos+1, memory_order_release);
+  return 0;
+}
+
+static int // returns 0 on success, 1 if the queue is empty
+threads_queue_pop(threads_queue_t *q, uint32_t *val)
+{
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  threads_queue_cell_t *c;
+  while(1)
+  {
+    c = q->cell + (pos & q->mask);
+    const size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    const intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+    if(dif == 0)
+    {
+      if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos+1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if(dif < 0) return 1;
+    else pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  }
+  *val = c->val;
+  atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+  return 0;
+}
+
+static inline int // find an idle worker, starting the search at the given one. -1 if all are busy
+threads_find_idle(uint32_t beg)
+{
+  for(uint32_t k=0;k<thr.num_threads;k++)
+  {
+    const uint32_t w = (beg + k) % thr.num_threads;
+    if(atomic_load(&thr.worker[w].idle)) return w;
+  }
+  return -1;
+}
+
+static inline void
+threads_wake(uint32_t w)
+{
+  pthread_mutex_lock(&thr.worker[w].mutex);
+  pthread_cond_signal(&thr.worker[w].cond);
+  pthread_mutex_unlock(&thr.worker[w].mutex);
+}
+
+// hand a ready task to a worker, preferably an idle one, and wake it up.
+static void
+threads_enqueue(uint32_t taskid)
+{
+  const threads_priority_t prio = thr.task[taskid].prio;
+  const uint32_t rr = atomic_fetch_add(&thr.next_worker, 1) % thr.num_threads;
+  // the first workers sit on the best cpus according to the placement policy:
+  int w = threads_find_idle(0);
+  const uint32_t q = w >= 0 ? w : rr;
+  // capacity is >= task_max, so this never fails:
+  threads_queue_push(thr.worker[q].queue + prio, taskid);
+  atomic_fetch_add(thr.queued_prio + prio, 1);
+  atomic_fetch_add(&thr.queued, 1);
+  // search again: idle workers that checked `queued' before our increment
+  // have set their flag by now, everybody else will see the task anyways.
+  w = threads_find_idle(q);
+  if(w >= 0) threads_wake(w);
+}
+
+static int // highest priority first, and within one class our own queue first, then steal from the others.
+threads_dequeue(    // returns -1 if there is no work
+    uint32_t           tid,
+    threads_priority_t min_prio) // only consider tasks up to and including this priority
+{
+  uint32_t taskid;
+  for(int p=0;p<=min_prio;p++)
+  {
+    if(atomic_load(thr.queued_prio + p) <= 0) continue;
+    for(uint32_t k=0;k<thr.num_threads;k++)
+    {
+      if(!threads_queue_pop(thr.worker[(tid + k) % thr.num_threads].queue + p, &taskid))
+      {
+        atomic_fetch_sub(thr.queued_prio + p, 1);
+        atomic_fetch_sub(&thr.queued, 1);
+        return taskid;
+      }
+    }
+  }
+  return -1;
+}
+
+static void
+threads_sleep(uint32_t tid)
+{
+  threads_worker_t *w = thr.worker + tid;
+  pthread_mutex_lock(&w->mutex);
+  atomic_store(&w->idle, 1);
+  while(!thr.shutdown && atomic_load(&thr.queued) <= 0)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  atomic_store(&w->idle, 0);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+static void
+threads_signal_done()
+{
+  pthread_mutex_lock(&thr.mutex_done);
+  pthread_cond_broadcast(&thr.cond_task_done);
+  pthread_mutex_unlock(&thr.mutex_done);
+}
+
+// hand the job and all tasks that joined it so far to the workers. tasks joining
+// later enqueue themselves, the queued flag makes sure it happens only once.
+static void
+threads_task_ready(threads_task_t *ref)
+{
+  for(int32_t t = ref - thr.task; t >= 0;)
+  {
+    threads_task_t *u = thr.task + t;
+    t = atomic_load(&u->next_user);
+    int expected = 0;
+    if(atomic_compare_exchange_strong(&u->queued, &expected, 1))
+      threads_enqueue(u - thr.task);
+  }
+}
+
+// the job is done, notify everybody who waits for it
+static void
+threads_task_release_successors(threads_task_t *ref)
+{
+  pthread_mutex_lock(&thr.mutex_deps);
+  int32_t e = ref->succ;
+  ref->succ = -2; // closed, nobody can wait for us any more
+  int32_t last = -1;
+  for(int32_t k=e;k>=0;k=thr.edge[k].next)
+  {
+    thr.edge_free_cnt++;
+    threads_task_t *s = thr.task + thr.edge[k].task;
+    // a pipeline doesn't make sense any more if one stage has been aborted:
+    if(ref->aborted) atomic_store(&s->aborted, 1);
+    if(atomic_fetch_sub(&s->deps, 1) == 1) threads_task_ready(s);
+    last = k;
+  }
+  if(last >= 0)
+  { // give edges back to the free list
+    thr.edge[last].next = thr.edge_free;
+    thr.edge_free = e;
+  }
+  pthread_mutex_unlock(&thr.mutex_deps);
+}
+
+// the given task (and all that help out on the same job) left the work loop.
+// the last one to leave calls all the free callbacks and recycles the tasks:
+// since every thread only leaves after finishing its items, all items are done now.
+static void
+threads_task_finish(threads_task_t *task)
+{
+  threads_task_t *ref = thr.task + task->reftask;
+  if(atomic_fetch_sub(&ref->active, 1) != 1) return;
+  // after an abort not all items have been run, but all that will ever be:
+  atomic_store(&ref->done, ref->work_item_cnt);
+  for(int32_t t = task->reftask; t >= 0;)
+  {
+    threads_task_t *u = thr.task + t;
+    t = atomic_load(&u->next_user);
+    if(u->free) u->free(u->data);
+  }
+  threads_signal_done(); // wake up people waiting for the cleanup to happen
+  threads_task_release_successors(ref);
+  for(int32_t t = atomic_load(&ref->next_user); t >= 0;)
+  {
+    threads_task_t *u = thr.task + t;
+    t = atomic_load(&u->next_user);
+    atomic_store(&u->tid, s_task_state_recycle);
+    threads_queue_push(&thr.task_free, u - thr.task);
+  }
+  // recycle the reftask last, its counters are what people are looking at
+  atomic_store(&ref->tid, s_task_state_recycle);
+  threads_queue_push(&thr.task_free, ref - thr.task);
+}
+
+// task ids handed out to the outside are the slot in the low bits and the
+// generation of the slot above, so an id that is kept around after the job
+// finished can't refer to whatever job reuses the slot later.
+#define THREADS_GEN_SHIFT 16
+#define THREADS_GEN_MASK  0x7fff
+
+static inline int
+threads_task_id(const threads_task_t *task)
+{
+  return (int)((task - thr.task) | ((atomic_load(&task->gen) & THREADS_GEN_MASK) << THREADS_GEN_SHIFT));
+}
+
+static threads_task_t * // the task behind the id, or 0 if the id is invalid or the job is long gone
+threads_task_get(int taskid)
+{
+  if(taskid < 0) return 0;
+  const uint32_t slot = taskid & ((1u<<THREADS_GEN_SHIFT)-1);
+  if(slot >= thr.task_max) return 0;
+  threads_task_t *task = thr.task + slot;
+  if((atomic_load(&task->gen) & THREADS_GEN_MASK) != (taskid >> THREADS_GEN_SHIFT)) return 0;
+  return task;
+}
+
+static void threads_preempt();
+
+// work on the items of the given task until there are none left
+static void
+threads_run_task(uint32_t tid, int taskid)
+{
+  threads_task_t *task = thr.task + taskid;
+  threads_task_t *ref  = thr.task + task->reftask;
+  const threads_tls_t tls = thr_tls; // we may be nested inside a preempted task
+  thr_tls.prio = task->prio;
+  thr_tls.task = ref;
+  atomic_store(&task->tid, tid);
+  while(!ref->aborted)
+  { // work on this task
+    uint32_t item = ref->work_item++;
+    if(item >= ref->work_item_cnt) break;
+    const uint64_t beg = dt_trace_now();
+    task->run(item, task->data);
+    dt_trace_event("task", task->desc, beg);
+    if(atomic_fetch_add(&ref->done, 1) + 1 == ref->work_item_cnt)
+      threads_signal_done();
+    if(thr.shutdown) break;
+    threads_preempt(); // let more important work go first before we start the next item
+  }
+  thr_tls = tls;
+  // don't recycle task. in fact don't clean up and leak whatever we still have (better than lockup)
+  if(thr.shutdown) return;
+  threads_task_finish(task);
+}
+
+// run all queued tasks of strictly higher priority than the current one
+static void
+threads_preempt()
+{
+  while(!thr.shutdown && thr_tls.prio > s_threads_prio_interactive)
+  {
+    const int taskid = threads_dequeue(thr_tls.tid, thr_tls.prio - 1);
+    if(taskid < 0) return;
+    threads_run_task(thr_tls.tid, taskid);
+  }
+}
+
+int threads_task_yield()
+{
+  if(thr.num_threads) threads_preempt();
+  return thr.shutdown || (thr_tls.task && thr_tls.task->aborted);
+}
+
+void threads_task_abort(int taskid)
+{
+  threads_task_t *task = threads_task_get(taskid);
+  if(task) atomic_store(&task->aborted, 1);
+}
 
 // thread worker function
 void *threads_work(void *arg)
@@ -71,6 +427,11 @@ void *threads_work(void *arg)
   // global init: set tls storage thread id
   const uint64_t tid = (uint64_t)arg;
   thr_tls.tid = tid;
+  thr_tls.prio = s_threads_prio_background;
+  thr_tls.task = 0;
+  char name[32];
+  snprintf(name, sizeof(name), "worker %u", (uint32_t)tid);
+  dt_trace_thread_name(name);
 #ifdef __linux__
   // pin ourselves to a cpu:
   cpu_set_t set;
@@ -79,49 +440,11 @@ void *threads_work(void *arg)
   sched_setaffinity(0, sizeof(cpu_set_t), &set);
 #endif
 
-  while(1)
+  while(!thr.shutdown)
   {
-    pthread_mutex_lock(&thr.mutex_push);
-    pthread_cond_wait(&thr.cond_task_push, &thr.mutex_push);
-    pthread_mutex_unlock(&thr.mutex_push);
-    if(thr.shutdown) break;
-    threads_task_t *task = 0;
-    for(int k=0;k<thr.task_max;k++)
-    { // brute force search for task
-      task = thr.task + k;
-      uint32_t oldval = __sync_val_compare_and_swap(&task->tid, s_task_state_ready, tid);
-      if(oldval == s_task_state_ready) break;
-      else task = 0;
-    }
-    if(task == 0) continue; // wait for a bit more
-    while(1)
-    { // work on this task
-      uint32_t item = thr.task[task->reftask].work_item++;
-      if(item >= task->work_item_cnt) break;
-      task->run(item, task->data);
-      thr.task[task->reftask].done++;
-      if(thr.shutdown) break;
-    }
-    if(thr.shutdown) break; // don't recycle task. in fact don't clean up and leak whatever we still have (better than lockup)
-    if(task->free)
-    { // only run cleanup once all tasks are finished:
-      // if we knew how many threads are working on this, we could test
-      // the every-increasing work_item for > work_item_cnt + num_threads
-      // and avoid the done pointer.
-      while(!thr.shutdown && (thr.task[task->reftask].done < task->work_item_cnt)) sched_yield();
-      if(thr.shutdown) break; // don't clean up, we didn't wait for everybody!
-      task->free(task->data);
-    }
-    // signal everybody that we're done with the task
-    pthread_mutex_lock(&thr.mutex_done);
-    pthread_cond_broadcast(&thr.cond_task_done);
-    pthread_mutex_unlock(&thr.mutex_done);
-    // mark task as recyclable:
-    uint32_t oldval = __sync_val_compare_and_swap(&task->tid, tid, s_task_state_recycle);
-    assert(oldval == tid); // this should never fail, people shall not mess with our task
-#ifdef NDEBUG
-    (void)oldval;
-#endif
+    const int taskid = threads_dequeue(tid, s_threads_prio_background);
+    if(taskid < 0) threads_sleep(tid);
+    else threads_run_task(tid, taskid);
   }
   return 0;
 }
@@ -130,11 +453,18 @@ void threads_global_cleanup()
 {
   threads_shutdown();
   for(int i=0;i<thr.num_threads;i++)
-    pthread_join(thr.worker[i], 0);
+  {
+    pthread_join(thr.worker[i].thread, 0);
+    pthread_cond_destroy(&thr.worker[i].cond);
+    pthread_mutex_destroy(&thr.worker[i].mutex);
+    for(int p=0;p<s_threads_prio_cnt;p++)
+      threads_queue_cleanup(thr.worker[i].queue + p);
+  }
   pthread_cond_destroy(&thr.cond_task_done);
-  pthread_cond_destroy(&thr.cond_task_push);
   pthread_mutex_destroy(&thr.mutex_done);
-  pthread_mutex_destroy(&thr.mutex_push);
+  pthread_mutex_destroy(&thr.mutex_deps);
+  threads_queue_cleanup(&thr.task_free);
+  free(thr.edge);
   free(thr.cpuid);
   free(thr.task);
   free(thr.worker);
@@ -160,76 +490,306 @@ threads_task_print_all()
     threads_task_print(t);
 }
 
-// push task
+// push task, optionally waiting for other jobs to finish first
 // return:
 // -1 no more recyclable tasks, too many tasks running
 // -2 argument error, run function is zero or no work to be done cnt <= item
 // -3 invalid taskid
+// -4 no more dependency edges
 // or >= 0: the new task id
-int threads_task(
+static int
+threads_task_push(
     const char *desc,
     uint32_t    work_item_cnt,
     int         taskid,
+    const int  *after,
+    int         after_cnt,
     void       *data,
     void      (*run)(uint32_t item, void *data),
-    void      (*free)(void*))
+    void      (*free)(void*),
+    threads_priority_t prio)
 {
-  if(taskid >= (int)thr.task_max) return -3;
   if(run == 0 || work_item_cnt == 0) return -2;
-  if(taskid >= 0 && thr.task[taskid].work_item_cnt <= thr.task[taskid].work_item) return -2;
-  threads_task_t *task = 0;
-  for(int k=0;k<thr.task_max;k++)
-  { // brute force search for task
-    task = thr.task + k;
-    uint32_t oldval = __sync_val_compare_and_swap(&task->tid, s_task_state_recycle, s_task_state_initing);
-    if(oldval == s_task_state_recycle) break;
-    else task = 0;
+  threads_task_t *ref = 0;
+  if(taskid >= 0)
+  { // join the job, unless everybody already left it:
+    ref = threads_task_get(taskid);
+    if(!ref) return (taskid & ((1u<<THREADS_GEN_SHIFT)-1)) >= thr.task_max ? -3 : -2;
+    if(ref->work_item_cnt <= ref->work_item || ref->aborted) return -2;
+    uint32_t active = atomic_load(&ref->active);
+    do if(active == 0) return -2;
+    while(!atomic_compare_exchange_weak(&ref->active, &active, active+1));
+    if(!threads_task_get(taskid))
+    { // the slot has been reused in the meantime, that's not our job
+      threads_task_finish(ref);
+      return -2;
+    }
   }
-  if(task == 0)
+  uint32_t id;
+  if(threads_queue_pop(&thr.task_free, &id))
   {
     fprintf(stderr, "[threads] no more free tasks!\n");
     threads_task_print_all();
+    if(ref) threads_task_finish(ref); // undo our reference
     return -1;
   }
+  threads_task_t *task = thr.task + id;
+  atomic_store(&task->tid, s_task_state_initing);
+  // threads_task_after() may still look at the previous job in this slot,
+  // retire it under the lock so nobody links an edge onto the new one:
+  pthread_mutex_lock(&thr.mutex_deps);
+  atomic_fetch_add(&task->gen, 1);
+  task->deps = 1; // hold on to it until we're done setting it up
+  task->succ = -1;
+  pthread_mutex_unlock(&thr.mutex_deps);
   // set all required entries on task
   task->run  = run;
   task->free = free;
   task->data = data;
   task->work_item_cnt = work_item_cnt;
-  task->reftask = taskid >= 0 ? taskid : task - thr.task;
+  task->reftask = ref ? ref - thr.task : id;
   task->work_item = 0;
-  task->done = 0;
+  // helpers never count their own items, don't let anyone wait on them forever:
+  task->done = ref ? work_item_cnt : 0;
+  task->aborted = 0;
+  task->queued = 0;
+  task->prio = CLAMP(prio, s_threads_prio_interactive, s_threads_prio_background);
   (void)snprintf(task->desc, sizeof(task->desc), "%s", desc);
+  if(ref)
+  { // insert right after the reftask, which is the head of the list of users
+    atomic_store(&task->tid, atomic_load(&ref->deps) ? s_task_state_waiting : s_task_state_ready);
+    int32_t next = atomic_load(&ref->next_user);
+    do atomic_store(&task->next_user, next);
+    while(!atomic_compare_exchange_weak(&ref->next_user, &next, id));
+    // go right away if the job is not (or no longer) waiting for anything
+    int expected = 0;
+    if(atomic_load(&ref->deps) == 0 && atomic_compare_exchange_strong(&task->queued, &expected, 1))
+      threads_enqueue(id);
+    return taskid;
+  }
+  atomic_store(&task->next_user, -1);
+  atomic_store(&task->active, 1);
 
-  // mark as ready
-  uint32_t oldval = __sync_val_compare_and_swap(&task->tid, s_task_state_initing, s_task_state_ready);
-  assert(oldval == s_task_state_initing); // should never fail, nobody should write initing tasks
-#ifdef NDEBUG
-  (void)oldval;
-#endif
-  // wake up one thread by signaling the condition
-  pthread_mutex_lock(&thr.mutex_push);
-  pthread_cond_signal(&thr.cond_task_push);
-  pthread_mutex_unlock(&thr.mutex_push);
-  return task->reftask; // return taskid of original job we're working on
+  if(after_cnt > 0)
+  {
+    atomic_store(&task->tid, s_task_state_waiting);
+    pthread_mutex_lock(&thr.mutex_deps);
+    if(thr.edge_free_cnt < after_cnt)
+    {
+      pthread_mutex_unlock(&thr.mutex_deps);
+      fprintf(stderr, "[threads] no more dependency edges!\n");
+      atomic_store(&task->tid, s_task_state_recycle);
+      threads_queue_push(&thr.task_free, id);
+      return -4;
+    }
+    for(int k=0;k<after_cnt;k++)
+    {
+      const threads_task_t *t = threads_task_get(after[k]);
+      if(!t) continue; // invalid, or done and recycled long ago
+      threads_task_t *pred = thr.task + t->reftask;
+      if(pred->succ == -2 || atomic_load(&pred->tid) == s_task_state_recycle) continue; // done already
+      thr.edge_free_cnt--;
+      const int32_t e = thr.edge_free;
+      thr.edge_free = thr.edge[e].next;
+      thr.edge[e].task = id;
+      thr.edge[e].next = pred->succ;
+      pred->succ = e;
+      atomic_fetch_add(&task->deps, 1);
+    }
+    pthread_mutex_unlock(&thr.mutex_deps);
+  }
+  else atomic_store(&task->tid, s_task_state_ready);
+
+  // release our own hold, hand over to a worker if nothing else is pending
+  const int handle = threads_task_id(task);
+  if(atomic_fetch_sub(&task->deps, 1) == 1) threads_task_ready(task);
+  return handle;
+}
+
+int threads_task(
+    const char *desc,
+    uint32_t    work_item_cnt,
+    int         taskid,
+    void       *data,
+    void      (*run)(uint32_t item, void *data),
+    void      (*free)(void*),
+    threads_priority_t prio)
+{
+  return threads_task_push(desc, work_item_cnt, taskid, 0, 0, data, run, free, prio);
+}
+
+int threads_task_after(
+    const char *desc,
+    uint32_t    work_item_cnt,
+    const int  *after,
+    int         after_cnt,
+    void       *data,
+    void      (*run)(uint32_t item, void *data),
+    void      (*free)(void*),
+    threads_priority_t prio)
+{
+  return threads_task_push(desc, work_item_cnt, -1, after, after_cnt, data, run, free, prio);
 }
 
 void threads_wait(int taskid)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return;
-  while(thr.task[taskid].done < thr.task[taskid].work_item_cnt)
+  if(!threads_task_get(taskid)) return;
+  pthread_mutex_lock(&thr.mutex_done);
+  while(!thr.shutdown && threads_task_running(taskid))
+    pthread_cond_wait(&thr.cond_task_done, &thr.mutex_done);
+  pthread_mutex_unlock(&thr.mutex_done);
+}
+
+#ifdef __linux__
+// what we know about one logical cpu, read from /sys/devices/system/cpu
+typedef struct threads_cpu_t
+{
+  uint32_t cpu;      // logical cpu number, as passed to sched_setaffinity
+  uint32_t node;     // numa node
+  uint32_t llc;      // lowest cpu sharing the last level cache with us
+  uint32_t core;     // lowest cpu of our hyperthread siblings, i.e. the physical core
+  uint32_t smt;      // index among the hyperthread siblings, 0 for the first
+  uint32_t capacity; // relative performance, p-cores have larger numbers than e-cores
+  uint32_t key[4];   // sort key for the placement policy
+}
+threads_cpu_t;
+
+static int // read the first number of a sysfs file, such as an int or a cpu list
+threads_sysfs_uint(const char *path, uint32_t *val)
+{
+  FILE *f = fopen(path, "rb");
+  if(!f) return 1;
+  int read = fscanf(f, "%u", val);
+  fclose(f);
+  return read != 1;
+}
+
+static int // return non-zero if the cpu list file (such as "0-3,8,10-11") contains the cpu
+threads_sysfs_cpulist_has(const char *path, uint32_t cpu)
+{
+  FILE *f = fopen(path, "rb");
+  if(!f) return 0;
+  uint32_t lo, hi;
+  int has = 0;
+  while(!has && fscanf(f, "%u", &lo) == 1)
   {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += 1; // wait for one second max
-    // this is because the threads may finish in between us checking the condition
-    // and waiting on the condition (so the condition will not be triggered again)
-    pthread_mutex_lock(&thr.mutex_done);
-    pthread_cond_timedwait(&thr.cond_task_done, &thr.mutex_done, &ts);
-    pthread_mutex_unlock(&thr.mutex_done);
+    hi = lo;
+    int c = fgetc(f);
+    if(c == '-' && fscanf(f, "%u", &hi) == 1) c = fgetc(f);
+    if(cpu >= lo && cpu <= hi) has = 1;
+    if(c != ',') break;
   }
+  fclose(f);
+  return has;
 }
 
+static int
+threads_cpu_cmp(const void *a, const void *b)
+{
+  const threads_cpu_t *ca = a, *cb = b;
+  for(int k=0;k<4;k++)
+    if(ca->key[k] != cb->key[k]) return ca->key[k] < cb->key[k] ? -1 : 1;
+  return ca->cpu < cb->cpu ? -1 : ca->cpu > cb->cpu;
+}
+
+// read the topology of all cpus we are allowed to run on and return them in
+// the order workers should be placed according to the policy. returns the
+// number of cpus written to cpuid (which needs to hold CPU_SETSIZE entries).
+static uint32_t
+threads_topology(
+    threads_placement_t placement,
+    uint32_t           *cpuid)
+{
+  cpu_set_t allowed;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+  threads_cpu_t *cpu = calloc(sizeof(threads_cpu_t), CPU_SETSIZE);
+  uint32_t cnt = 0;
+  char path[256];
+  for(uint32_t c=0;c<CPU_SETSIZE;c++)
+  {
+    if(!CPU_ISSET(c, &allowed)) continue;
+    threads_cpu_t *t = cpu + cnt++;
+    t->cpu = c;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", c);
+    if(threads_sysfs_uint(path, &t->core)) t->core = c;
+    // the highest cache level that exists decides the llc:
+    t->llc = t->core;
+    for(int i=3;i>=1;i--)
+    {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list", c, i);
+      if(!threads_sysfs_uint(path, &t->llc)) break;
+    }
+    t->node = 0;
+    for(uint32_t n=0;n<1024;n++)
+    { // nodes are numbered densely on all machines we care about
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", n);
+      if(access(path, R_OK)) break;
+      if(threads_sysfs_cpulist_has(path, c)) { t->node = n; break; }
+    }
+    // arm and recent x86 kernels report capacity, otherwise use the max frequency.
+    // intel hybrid chips list the e-cores in cpu_atom.
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cpu_capacity", c);
+    if(threads_sysfs_uint(path, &t->capacity))
+    {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cpufreq/cpuinfo_max_freq", c);
+      if(threads_sysfs_uint(path, &t->capacity)) t->capacity = 1024;
+      if(threads_sysfs_cpulist_has("/sys/devices/cpu_atom/cpus", c)) t->capacity /= 2;
+    }
+  }
+  uint32_t max_capacity = 0;
+  for(uint32_t k=0;k<cnt;k++)
+  { // find smt index, the siblings share the core id:
+    for(uint32_t i=0;i<k;i++) if(cpu[i].core == cpu[k].core) cpu[k].smt++;
+    max_capacity = MAX(max_capacity, cpu[k].capacity);
+  }
+  if(placement == s_threads_place_performance)
+  { // keep only the fastest kind of cores
+    uint32_t j = 0;
+    for(uint32_t k=0;k<cnt;k++)
+      if(cpu[k].capacity == max_capacity) cpu[j++] = cpu[k];
+    cnt = j;
+  }
+  // compact order: numa node, shared cache, core, hyperthreads next to each other
+  for(uint32_t k=0;k<cnt;k++)
+  {
+    cpu[k].key[0] = cpu[k].node;
+    cpu[k].key[1] = cpu[k].llc;
+    cpu[k].key[2] = cpu[k].core;
+    cpu[k].key[3] = cpu[k].smt;
+  }
+  qsort(cpu, cnt, sizeof(threads_cpu_t), threads_cpu_cmp);
+  if(placement != s_threads_place_compact)
+  { // spread: all physical cores before hyperthreads, round robin over last
+    // level caches and then nodes, so neighbouring workers share as little as possible.
+    uint32_t *idx = calloc(sizeof(uint32_t), 2*cnt);
+    for(uint32_t k=0;k<cnt;k++)
+    {
+      uint32_t in_llc = 0, llc_in_node = 0;
+      for(uint32_t i=0;i<k;i++)
+      {
+        if(cpu[i].llc == cpu[k].llc && cpu[i].smt == cpu[k].smt) in_llc++;
+        if(cpu[i].node == cpu[k].node && cpu[i].llc != cpu[k].llc && (i == 0 || cpu[i-1].llc != cpu[i].llc))
+          llc_in_node++; // count the other cache domains before ours, the array is sorted compact
+      }
+      idx[2*k+0] = in_llc;
+      idx[2*k+1] = llc_in_node;
+    }
+    for(uint32_t k=0;k<cnt;k++)
+    {
+      cpu[k].key[0] = cpu[k].smt;
+      cpu[k].key[1] = idx[2*k+0];
+      cpu[k].key[2] = idx[2*k+1];
+      cpu[k].key[3] = cpu[k].node;
+    }
+    free(idx);
+    qsort(cpu, cnt, sizeof(threads_cpu_t), threads_cpu_cmp);
+  }
+  for(uint32_t k=0;k<cnt;k++) cpuid[k] = cpu[k].cpu;
+  free(cpu);
+  return cnt;
+}
+#endif
+
 void threads_global_init()
 {
 #ifdef _WIN64
@@ -238,20 +798,53 @@ void threads_global_init()
   thr.num_threads = si.dwNumberOfProcessors;
 #else
   thr.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  thr.placement = s_threads_place_default;
+  const char *placement = getenv("VKDT_THREAD_PLACEMENT");
+  if(placement)
+  {
+    if     (!strcmp(placement, "compact"))     thr.placement = s_threads_place_compact;
+    else if(!strcmp(placement, "spread"))      thr.placement = s_threads_place_spread;
+    else if(!strcmp(placement, "performance")) thr.placement = s_threads_place_performance;
+    else fprintf(stderr, "[threads] unknown placement `%s', use compact, spread, or performance\n", placement);
+  }
+  uint32_t *cpuid = 0, cpu_cnt = 0;
+#ifdef __linux__
+  if(thr.placement != s_threads_place_default)
+  {
+    cpuid = malloc(sizeof(uint32_t)*CPU_SETSIZE);
+    cpu_cnt = threads_topology(thr.placement, cpuid);
+    if(cpu_cnt) thr.num_threads = cpu_cnt;
+    fprintf(stderr, "[threads] placement `%s': %u workers on cpus", placement, cpu_cnt);
+    for(uint32_t k=0;k<cpu_cnt;k++) fprintf(stderr, " %u", cpuid[k]);
+    fprintf(stderr, "\n");
+  }
 #endif
   thr.shutdown = 0;
-  thr.task_max = thr.num_threads * 10;
-  thr.task     = malloc(sizeof(threads_task_t)*thr.task_max);
+  thr.task_max = MIN(thr.num_threads * 10, 1u<<THREADS_GEN_SHIFT);
+  thr.task     = calloc(sizeof(threads_task_t), thr.task_max);
   thr.cpuid    = malloc(sizeof(uint32_t)*thr.num_threads);
-  thr.worker   = malloc(sizeof(pthread_t)*thr.num_threads);
+  thr.worker   = calloc(sizeof(threads_worker_t), thr.num_threads);
+  atomic_init(&thr.queued, 0);
+  for(int p=0;p<s_threads_prio_cnt;p++)
+    atomic_init(thr.queued_prio + p, 0);
+  atomic_init(&thr.next_worker, 0);
 
   thr.main_thread = pthread_self();
+#ifdef __linux__
+  if(sched_getaffinity(0, sizeof(thr.cpus), &thr.cpus)) CPU_ZERO(&thr.cpus);
+#endif
 
+  threads_queue_init(&thr.task_free, thr.task_max);
   for(int k=0;k<thr.task_max;k++)
+  {
     thr.task[k].tid = s_task_state_recycle;
+    threads_queue_push(&thr.task_free, k);
+  }
 
   for(int k=0;k<thr.num_threads;k++)
-    thr.cpuid[k] = k; // default init
+    thr.cpuid[k] = cpu_cnt ? cpuid[k] : k; // default init
+  free(cpuid);
 
   const char *def_file = "affinity";
   const char *filename = def_file;
@@ -264,7 +857,7 @@ void threads_global_init()
   // or numactl --hardware
   // and then edit it to your needs (this list will start with one thread per core, no hyperthreading used)
   // TODO: add search path relative to binary?
-  FILE *f = fopen(filename, "rb");
+  FILE *f = cpu_cnt ? 0 : fopen(filename, "rb"); // an explicit placement policy wins
   if(f)
   {
     int k = 0;
@@ -288,25 +881,40 @@ void threads_global_init()
   }
 
   pthread_cond_init(&thr.cond_task_done, 0);
-  pthread_cond_init(&thr.cond_task_push, 0);
   pthread_mutex_init(&thr.mutex_done, 0);
-  pthread_mutex_init(&thr.mutex_push, 0);
 
-  thr.worker = malloc(sizeof(pthread_t)*thr.num_threads);
+  pthread_mutex_init(&thr.mutex_deps, 0);
+  thr.edge_max  = 4 * thr.task_max;
+  thr.edge      = malloc(sizeof(threads_edge_t)*thr.edge_max);
+  thr.edge_free = 0;
+  thr.edge_free_cnt = thr.edge_max;
+  for(int k=0;k<thr.edge_max;k++)
+    thr.edge[k].next = k < thr.edge_max-1 ? k+1 : -1;
+
+  // all queues can hold all tasks, so pushing never fails
+  for(uint64_t k=0;k<thr.num_threads;k++)
+  {
+    for(int p=0;p<s_threads_prio_cnt;p++)
+      threads_queue_init(thr.worker[k].queue + p, thr.task_max);
+    pthread_mutex_init(&thr.worker[k].mutex, 0);
+    pthread_cond_init(&thr.worker[k].cond, 0);
+    atomic_init(&thr.worker[k].idle, 0);
+  }
   for(uint64_t k=0;k<thr.num_threads;k++)
-    pthread_create(thr.worker+k, 0, threads_work, (void*)k);
+    pthread_create(&thr.worker[k].thread, 0, threads_work, (void*)k);
 }
 
 void threads_shutdown()
 {
   thr.shutdown = 1;
   // unblock everyone, even though we're not done:
-  pthread_mutex_lock(&thr.mutex_done);
-  pthread_cond_broadcast(&thr.cond_task_done);
-  pthread_mutex_unlock(&thr.mutex_done);
-  pthread_mutex_lock(&thr.mutex_push);
-  pthread_cond_broadcast(&thr.cond_task_push);
-  pthread_mutex_unlock(&thr.mutex_push);
+  threads_signal_done();
+  for(int k=0;k<thr.num_threads;k++)
+  {
+    pthread_mutex_lock(&thr.worker[k].mutex);
+    pthread_cond_broadcast(&thr.worker[k].cond);
+    pthread_mutex_unlock(&thr.worker[k].mutex);
+  }
 }
 
 int threads_shutting_down()
@@ -322,18 +930,215 @@ int threads_num()
 // returns zero if the task is done
 int threads_task_running(int taskid)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return 0;
-  return thr.task[taskid].done < thr.task[taskid].work_item_cnt;
+  const threads_task_t *task = threads_task_get(taskid);
+  return task && task->done < task->work_item_cnt;
 }
 
 // returns a progress indicator
 float threads_task_progress(int taskid)
 {
-  if(taskid < 0 || taskid >= thr.task_max) return 0.0f;
-  return thr.task[taskid].done / (float) thr.task[taskid].work_item_cnt;
+  const threads_task_t *task = threads_task_get(taskid);
+  if(!task) return taskid < 0 ? 0.0f : 1.0f; // recycled means done
+  return task->done / (float) task->work_item_cnt;
 }
 
 int threads_i_am_gui()
 {
   return pthread_self() == thr.main_thread;
 }
+
+void threads_unpin()
+{
+#ifdef __linux__
+  if(thr.num_threads && CPU_COUNT(&thr.cpus))
+    sched_setaffinity(0, sizeof(cpu_set_t), &thr.cpus);
+#endif
+}
+
+void threads_pin()
+{
+#ifdef __linux__
+  if(!thr.num_threads || !thr_tls.task) return; // not a worker
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(thr.cpuid[thr_tls.tid], &set);
+  sched_setaffinity(0, sizeof(cpu_set_t), &set);
+#endif
+}
+
+// parallel for: one slice [lo, hi) per participant, packed into one 64-bit
+// word so popping from the front and stealing from the back are single CAS.
+typedef struct threads_pfor_slice_t
+{
+  _Atomic uint64_t range;        // lo | (uint64_t)hi << 32
+  char             pad[56];      // keep slices on separate cache lines
+}
+threads_pfor_slice_t;
+
+typedef struct threads_pfor_t
+{
+  void          (*fn)(uint32_t beg, uint32_t end, void *data);
+  void           *data;
+  uint32_t        grain;
+  uint32_t        slice_cnt;
+  atomic_uint     slice_next;    // next free slice for helpers to adopt
+  atomic_uint     remaining;     // number of items not yet processed
+  atomic_uint     ref;           // caller + helper work items still holding on to this
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;          // signalled when remaining drops to zero
+  threads_pfor_slice_t *slice;  // cache line aligned, points into slice_mem
+  void           *slice_mem;
+}
+threads_pfor_t;
+
+static inline uint64_t threads_pfor_pack(uint32_t lo, uint32_t hi) { return lo | ((uint64_t)hi << 32); }
+static inline uint32_t threads_pfor_lo(uint64_t r) { return r & 0xffffffffu; }
+static inline uint32_t threads_pfor_hi(uint64_t r) { return r >> 32; }
+
+static void
+threads_pfor_unref(threads_pfor_t *p)
+{
+  if(atomic_fetch_sub(&p->ref, 1) != 1) return;
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
+  free(p->slice_mem);
+  free(p);
+}
+
+static void
+threads_pfor_done(threads_pfor_t *p, uint32_t cnt)
+{
+  if(atomic_fetch_sub(&p->remaining, cnt) != cnt) return;
+  pthread_mutex_lock(&p->mutex);
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+// pop one chunk off the front of the given slice. returns 0 if it ran dry.
+static int
+threads_pfor_pop(threads_pfor_t *p, uint32_t s, uint32_t *beg, uint32_t *end)
+{
+  uint64_t r = atomic_load(&p->slice[s].range);
+  while(1)
+  {
+    const uint32_t lo = threads_pfor_lo(r), hi = threads_pfor_hi(r);
+    if(lo >= hi) return 0;
+    const uint32_t mid = hi - lo > p->grain ? lo + p->grain : hi;
+    if(atomic_compare_exchange_weak(&p->slice[s].range, &r, threads_pfor_pack(mid, hi)))
+    {
+      *beg = lo; *end = mid;
+      return 1;
+    }
+  }
+}
+
+// steal the back half of the largest slice of somebody else and make it our own.
+// returns 0 if there is nothing left anywhere.
+static int
+threads_pfor_steal(threads_pfor_t *p, uint32_t s)
+{
+  while(1)
+  {
+    uint32_t victim = -1u, size = 0;
+    uint64_t r = 0;
+    for(uint32_t k=0;k<p->slice_cnt;k++)
+    {
+      const uint64_t rk = atomic_load(&p->slice[k].range);
+      const uint32_t lo = threads_pfor_lo(rk), hi = threads_pfor_hi(rk);
+      if(k != s && hi > lo && hi - lo > size) { victim = k; size = hi - lo; r = rk; }
+    }
+    if(victim == -1u) return 0;
+    const uint32_t lo = threads_pfor_lo(r), hi = threads_pfor_hi(r);
+    // leave the front chunk to the owner, it is likely already touching that memory:
+    const uint32_t mid = size > p->grain ? lo + (size+1)/2 : lo;
+    if(atomic_compare_exchange_strong(&p->slice[victim].range, &r, threads_pfor_pack(lo, mid)))
+    { // our own slice is empty, nobody will touch it but us:
+      atomic_store(&p->slice[s].range, threads_pfor_pack(mid, hi));
+      return 1;
+    }
+  }
+}
+
+static void
+threads_pfor_work(threads_pfor_t *p, uint32_t s)
+{
+  uint32_t beg, end;
+  // no shutdown checks here: the caller waits for all items, and items owned by
+  // a participant can only be processed by it.
+  do while(threads_pfor_pop(p, s, &beg, &end))
+  {
+    p->fn(beg, end, p->data);
+    threads_pfor_done(p, end - beg);
+  }
+  while(threads_pfor_steal(p, s));
+}
+
+static void
+threads_pfor_run(uint32_t item, void *data)
+{ // helper work item, adopt the next slice and start working
+  threads_pfor_t *p = data;
+  const uint32_t s = atomic_fetch_add(&p->slice_next, 1);
+  if(s < p->slice_cnt) threads_pfor_work(p, s);
+  threads_pfor_unref(p);
+}
+
+void threads_parallel_for(
+    uint32_t    begin,
+    uint32_t    end,
+    uint32_t    grain,
+    void      (*fn)(uint32_t beg, uint32_t end, void *data),
+    void       *data)
+{
+  if(end <= begin) return;
+  const uint32_t cnt = end - begin;
+  const uint32_t nt  = thr.num_threads + 1; // we are working too
+  if(grain == 0) grain = MAX(1, cnt / (8*nt));
+  // not worth waking anybody up (or the pool isn't running, as in some tools):
+  if(thr.num_threads == 0 || thr.shutdown || cnt <= grain)
+  {
+    for(uint32_t b=begin;b<end;b+=MIN(grain, end-b))
+      fn(b, b + MIN(grain, end-b), data);
+    return;
+  }
+
+  threads_pfor_t *p = malloc(sizeof(*p));
+  p->fn        = fn;
+  p->data      = data;
+  p->grain     = grain;
+  p->slice_cnt = MIN(nt, (cnt + grain - 1) / grain);
+  // align by hand, there is no aligned_alloc on windows:
+  p->slice_mem = malloc(sizeof(threads_pfor_slice_t)*p->slice_cnt + 63);
+  p->slice     = (threads_pfor_slice_t *)(((uintptr_t)p->slice_mem + 63) & ~(uintptr_t)63);
+  for(uint32_t s=0;s<p->slice_cnt;s++)
+    atomic_init(&p->slice[s].range, threads_pfor_pack(
+          begin + (uint64_t)cnt* s   /p->slice_cnt,
+          begin + (uint64_t)cnt*(s+1)/p->slice_cnt));
+  atomic_init(&p->slice_next, 1); // slice 0 is ours
+  atomic_init(&p->remaining, cnt);
+  atomic_init(&p->ref, p->slice_cnt); // us + one per helper item
+  pthread_mutex_init(&p->mutex, 0);
+  pthread_cond_init(&p->cond, 0);
+
+  // one task with one work item per helper slice, picked up by up to that many threads.
+  // if the pool is busy the helpers start late or find nothing left to do, which is fine:
+  // we never wait for them, only for the items.
+  const uint32_t helpers = p->slice_cnt - 1;
+  int taskid = -1;
+  for(uint32_t k=0;k<helpers;k++)
+  {
+    int res = threads_task("pfor", helpers, taskid, p, threads_pfor_run, 0, thr_tls.prio);
+    if(res < 0)
+    {
+      if(taskid < 0) atomic_fetch_sub(&p->ref, helpers); // no helper will ever run
+      break;
+    }
+    taskid = res;
+  }
+
+  threads_pfor_work(p, 0);
+  pthread_mutex_lock(&p->mutex);
+  while(atomic_load(&p->remaining))
+    pthread_cond_wait(&p->cond, &p->mutex);
+  pthread_mutex_unlock(&p->mutex);
+  threads_pfor_unref(p);
+}
@@ -8,11 +8,37 @@
 #define threads_mutex_destroy(m) pthread_mutex_destroy(m)
 #define threads_mutex_init(m, p) pthread_mutex_init(m, p)
 
+// workers always pick up queued tasks of a higher priority class first, and
+// check for them in between the work items of lower priority tasks.
+typedef enum threads_priority_t
+{
+  s_threads_prio_interactive = 0, // the user is waiting for this (darkroom, single thumbnails)
+  s_threads_prio_normal      = 1, // long running but user requested, such as export
+  s_threads_prio_background  = 2, // bulk work: caching thumbnails for folders, copying files
+  s_threads_prio_cnt         = 3,
+}
+threads_priority_t;
+
+// how worker threads are pinned to cpus. everything but the default reads the
+// topology from /sys/devices/system/cpu and is selected by setting the
+// environment variable VKDT_THREAD_PLACEMENT to compact, spread, or performance.
+typedef enum threads_placement_t
+{
+  s_threads_place_default     = 0, // worker i on cpu i, or as listed in the file `affinity' in the working directory
+  s_threads_place_compact     = 1, // fill hyperthreads, then cores sharing a cache, then numa nodes
+  s_threads_place_spread      = 2, // one worker per physical core first, round robin over caches and numa nodes
+  s_threads_place_performance = 3, // like spread, but only use the fastest cores (p-cores on hybrid chips)
+}
+threads_placement_t;
+
 // only fwd declare
 typedef struct threads_t threads_t;
+typedef struct threads_task_t threads_task_t;
 typedef struct threads_tls_t
 {
-  uint32_t tid; // thread id from 0..num_threads-1
+  uint32_t            tid;  // thread id from 0..num_threads-1
+  threads_priority_t  prio; // priority of the task we're running (interactive for the gui thread)
+  threads_task_t     *task; // job we're currently working on, or 0
 }
 threads_tls_t;
 
@@ -27,6 +53,10 @@ extern _Thread_local threads_tls_t thr_tls;
 void threads_global_init();
 void threads_global_cleanup();
 
+// task ids stay valid after the job is done: they carry a generation count,
+// so an old id never refers to another job that reuses its slot later. waiting
+// for, aborting or depending on a job that is long gone does nothing.
+
 // push a new task (task < threads_num()) with given function and argument.
 // one task is going to be worked on by one thread. if you want multiple threads
 // do the same job, call this multiple times and pass the same work_item
@@ -38,7 +68,38 @@ threads_task(
     int         taskid,         // if >= 0, refer to previously added task (schedule another thread to help out there)
     void       *data,           // opaque user data that will be passed to the run function
     void      (*run)(uint32_t item, void *data),
-    void      (*free)(void*));  // this is called only at the very end to clean up (for every thread working on a job)
+    void      (*free)(void*),   // this is called only at the very end to clean up (for every thread working on a job)
+    threads_priority_t prio);   // priority class, helpers should pass the same as the original job
+
+// like threads_task(), but the new job only starts once all the jobs in after[]
+// have finished (all their work items are done and their free callbacks ran).
+// this way jobs form pipelines (decode -> convert -> write) without any thread
+// blocking in threads_wait(). other threads can join the new job right away by
+// passing the returned id to threads_task(), they'll wait just the same.
+// if one of the jobs in after[] is aborted, the new job will be aborted too.
+// ids of jobs that are finished already are ignored.
+int // returns the task id of the new job, or < 0 on error
+threads_task_after(
+    const char *desc,
+    uint32_t    work_item_cnt,
+    const int  *after,          // list of task ids to wait for
+    int         after_cnt,      // number of entries in the list
+    void       *data,
+    void      (*run)(uint32_t item, void *data),
+    void      (*free)(void*),
+    threads_priority_t prio);
+
+// ask a job to stop. work items that have already been started run to completion,
+// all others are skipped. threads_task_running() returns zero once the last
+// thread left the job and the free callbacks ran.
+void threads_task_abort(int taskid);
+
+// preemption point for long running work items: if tasks of a higher priority
+// than the current one are queued, run them on this thread before returning.
+// don't call this while holding locks the other tasks may need.
+// returns non-zero if the current job has been aborted or the pool is shutting
+// down, in which case the work item should return as soon as possible.
+int threads_task_yield();
 
 // returns zero if the task is done
 int threads_task_running(int taskid);
@@ -59,9 +120,29 @@ int threads_num();
 // called threads_global_init)
 int threads_i_am_gui();
 
+// workers are pinned to one cpu each, and threads they start (such as an
+// openmp team inside a raw decoder) inherit that. threads_unpin() lets the
+// calling thread use all cpus of the process, threads_pin() puts a worker back
+// on its cpu when the job is done with it (and does nothing on other threads).
+void threads_unpin();
+void threads_pin();
+
 // wait for a task to finish (pass the taskid that threads_task returned)
 void threads_wait(int taskid);
 
+// run fn(beg, end, data) on disjoint sub-ranges covering [begin, end), using
+// the calling thread and all idle workers of the pool. every participant
+// owns a contiguous slice and pops chunks of `grain' items off its front.
+// when it runs dry it steals the back half of the largest remaining slice
+// of some other participant. pass grain = 0 to derive a chunk size from the
+// range and the number of threads. returns when all items have been processed.
+void threads_parallel_for(
+    uint32_t    begin,    // first item
+    uint32_t    end,      // one past the last item
+    uint32_t    grain,    // max number of items per call to fn, or 0
+    void      (*fn)(uint32_t beg, uint32_t end, void *data),
+    void       *data);    // opaque user data passed to fn
+
 static inline uint32_t threads_id()
 {
   return thr_tls.tid;
@@ -0,0 +1,133 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define DT_TRACE_EVENTS  (1<<16) // per thread, power of two
+#define DT_TRACE_THREADS 256
+
+typedef struct dt_trace_event_t
+{
+  uint64_t    beg, end;
+  const char *cat;
+  char        name[24];
+}
+dt_trace_event_t;
+
+typedef struct dt_trace_buf_t
+{
+  uint64_t         cnt;  // number of events written, the ring wraps around
+  uint32_t         tid;  // index in the list of buffers, used as thread id in the json
+  char             name[32];
+  dt_trace_event_t ev[DT_TRACE_EVENTS];
+}
+dt_trace_buf_t;
+
+dt_trace_t dt_trace_global;
+
+static struct
+{
+  pthread_mutex_t mutex;  // only protects registration of new threads
+  dt_trace_buf_t *buf[DT_TRACE_THREADS];
+  uint32_t        cnt;
+  uint64_t        t0;     // start of the session
+  char            filename[1024];
+}
+trace;
+
+static _Thread_local dt_trace_buf_t *trace_buf;
+
+static dt_trace_buf_t *
+dt_trace_get_buf()
+{
+  if(trace_buf) return trace_buf;
+  pthread_mutex_lock(&trace.mutex);
+  if(trace.cnt < DT_TRACE_THREADS)
+  {
+    trace_buf = calloc(sizeof(dt_trace_buf_t), 1);
+    trace_buf->tid = trace.cnt;
+    snprintf(trace_buf->name, sizeof(trace_buf->name), "thread %u", trace.cnt);
+    trace.buf[trace.cnt++] = trace_buf;
+  }
+  pthread_mutex_unlock(&trace.mutex);
+  return trace_buf;
+}
+
+void dt_trace_init()
+{
+  const char *filename = getenv("VKDT_TRACE");
+  if(!filename || !filename[0]) return;
+  pthread_mutex_init(&trace.mutex, 0);
+  snprintf(trace.filename, sizeof(trace.filename), "%s", filename);
+  trace.cnt = 0;
+  dt_trace_global.enabled = 1;
+  trace.t0 = dt_trace_now();
+}
+
+void dt_trace_thread_name(const char *name)
+{
+  if(!dt_trace_global.enabled) return;
+  dt_trace_buf_t *b = dt_trace_get_buf();
+  if(b) snprintf(b->name, sizeof(b->name), "%s", name);
+}
+
+void dt_trace_record(const char *cat, const char *name, uint64_t beg, uint64_t end)
+{
+  dt_trace_buf_t *b = dt_trace_get_buf();
+  if(!b) return;
+  dt_trace_event_t *e = b->ev + (b->cnt & (DT_TRACE_EVENTS-1));
+  e->beg = beg;
+  e->end = end;
+  e->cat = cat;
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  b->cnt++;
+}
+
+static void // print a string that came from outside (task descriptions, module names) as json
+dt_trace_print_str(FILE *f, const char *str)
+{
+  fputc('"', f);
+  for(const char *c=str;*c;c++)
+  {
+    if(*c == '"' || *c == '\\') fputc('\\', f);
+    if((unsigned char)*c >= 0x20) fputc(*c, f);
+  }
+  fputc('"', f);
+}
+
+void dt_trace_cleanup()
+{
+  if(!dt_trace_global.enabled) return;
+  dt_trace_global.enabled = 0;
+  FILE *f = fopen(trace.filename, "wb");
+  if(!f) fprintf(stderr, "[trace] could not write `%s'\n", trace.filename);
+  else
+  {
+    uint64_t num = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(uint32_t t=0;t<trace.cnt;t++)
+    {
+      const dt_trace_buf_t *b = trace.buf[t];
+      fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", num++ ? ",\n" : "", b->tid);
+      dt_trace_print_str(f, b->name);
+      fprintf(f, "}}");
+      const uint64_t beg = b->cnt > DT_TRACE_EVENTS ? b->cnt - DT_TRACE_EVENTS : 0;
+      for(uint64_t i=beg;i<b->cnt;i++)
+      {
+        const dt_trace_event_t *e = b->ev + (i & (DT_TRACE_EVENTS-1));
+        fprintf(f, ",\n{\"name\":");
+        dt_trace_print_str(f, e->name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            e->cat, b->tid, (e->beg - trace.t0)*1e-3, (e->end - e->beg)*1e-3);
+      }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    fprintf(stderr, "[trace] wrote timeline of %u threads to `%s'\n", trace.cnt, trace.filename);
+  }
+  for(uint32_t t=0;t<trace.cnt;t++) free(trace.buf[t]);
+  trace.cnt = 0;
+  trace_buf = 0;
+  pthread_mutex_destroy(&trace.mutex);
+}
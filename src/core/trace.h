@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// opt-in timeline of what all threads are doing, written as chrome trace json
+// (open it in chrome://tracing or ui.perfetto.dev). set the environment
+// variable VKDT_TRACE to the output file name to record a session.
+// every thread writes complete events (category, name, begin, end) to its
+// own ring buffer, no locks involved. if a session runs long the oldest
+// events are overwritten.
+
+typedef struct dt_trace_t
+{
+  int enabled;
+}
+dt_trace_t;
+
+extern dt_trace_t dt_trace_global;
+
+// read the environment and start recording if requested
+void dt_trace_init();
+
+// write the json file and free all buffers. call this after all threads
+// that recorded anything have been joined.
+void dt_trace_cleanup();
+
+// name the calling thread in the timeline
+void dt_trace_thread_name(const char *name);
+
+// append an event to the ring buffer of the calling thread.
+// cat needs to be a string literal, name is copied.
+void dt_trace_record(const char *cat, const char *name, uint64_t beg, uint64_t end);
+
+// current time in nanoseconds, or 0 if tracing is off.
+// pass this as begin time to dt_trace_event() later.
+static inline uint64_t
+dt_trace_now()
+{
+  if(!dt_trace_global.enabled) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// record an event from beg until now
+static inline void
+dt_trace_event(const char *cat, const char *name, uint64_t beg)
+{
+  if(dt_trace_global.enabled) dt_trace_record(cat, name, beg, dt_trace_now());
+}
+
+// same, but the name is a token (such as a module name)
+static inline void
+dt_trace_event_tkn(const char *cat, uint64_t name, uint64_t beg)
+{
+  if(!dt_trace_global.enabled) return;
+  char str[9] = {0};
+  memcpy(str, &name, 8);
+  dt_trace_record(cat, str, beg, dt_trace_now());
+}
@@ -0,0 +1,644 @@
+#include "archive.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN64
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
+#define DT_ARCHIVE_VERSION  1
+#define DT_ARCHIVE_SEGMENT  (64u<<20) // max size of one segment file
+#define DT_ARCHIVE_MIN_CAP  4096      // slots in a fresh index
+#define DT_ARCHIVE_MAX_OPEN 4
+#define DT_ARCHIVE_REMOVED  -1u       // segment of a removed entry
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct dt_archive_header_t
+{ // start of the index file, same size as a slot
+  char     magic[8];   // "vkdtarch"
+  uint32_t version;
+  uint32_t cap;        // number of slots following the header, power of two
+  uint32_t segment;    // the segment we append to, all lower ones are sealed
+  uint32_t pad[3];
+}
+dt_archive_header_t;
+
+typedef struct dt_archive_slot_t
+{
+  uint64_t key;        // 0 marks an empty slot
+  uint32_t seg;        // segment file, DT_ARCHIVE_REMOVED if the entry is gone
+  uint32_t off;        // of the record header in the segment
+  uint32_t len;        // of the data following the record header
+  uint32_t atime;      // last read, seconds since the epoch, 0 if never
+  int64_t  mtime;      // when it was written
+}
+dt_archive_slot_t;
+
+typedef struct dt_archive_record_t
+{ // in front of every entry in the segments
+  uint64_t key;
+  uint32_t len;
+  uint32_t magic;      // "bc1a"
+}
+dt_archive_record_t;
+
+struct dt_archive_t
+{
+  threads_mutex_t      mutex;
+  int                  ref;
+  int                  fd;        // index file
+  int                  lock_fd;   // holds the lock against other processes
+  dt_archive_header_t *header;    // mapped index
+  dt_archive_slot_t   *slot;      // cap slots after the header
+  size_t               size;      // of the index in bytes
+  uint32_t             used;      // slots with a key, including removed ones
+  uint32_t             dead;      // slots of removed entries, their keys stay until the next rehash
+  uint32_t             rehashed;  // counts rehashes, slot indices are only stable in between
+  atomic_int           compacting;// set while archive_compact() runs
+  uint64_t             live;      // bytes in the records of live entries
+  int                  seg_fd;    // the segment we append to
+  uint32_t             seg_end;   // and its size
+  uint32_t             seg_cnt;   // size of the arrays below
+  uint8_t            **seg_map;   // read-only mappings of the segments, by id
+  uint32_t            *seg_size;  // size of the sealed segments, by id
+  char                 dirname[1024];
+};
+
+static threads_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dt_archive_t   *archive_open[DT_ARCHIVE_MAX_OPEN];
+
+static inline uint32_t
+record_size(uint32_t len)
+{ // keep the records 16 byte aligned
+  return (sizeof(dt_archive_record_t) + len + 15) & ~15u;
+}
+
+static uint32_t // find the slot of the key, or the empty one where it would go
+archive_find(const dt_archive_slot_t *slot, uint32_t cap, uint64_t key)
+{
+  uint32_t k = key & (cap-1);
+  while(slot[k].key && slot[k].key != key) k = (k+1) & (cap-1);
+  return k;
+}
+
+static void
+archive_segment_name(const dt_archive_t *a, uint32_t seg, char *fn, size_t size)
+{
+  snprintf(fn, size, "%s/%08x.seg", a->dirname, seg);
+}
+
+static void
+archive_unmap_segment(dt_archive_t *a, uint32_t seg)
+{
+  if(seg >= a->seg_cnt || !a->seg_map[seg]) return;
+#ifndef _WIN64
+  munmap(a->seg_map[seg], DT_ARCHIVE_SEGMENT);
+#else
+  free(a->seg_map[seg]);
+#endif
+  a->seg_map[seg] = 0;
+}
+
+static const uint8_t * // map the segment for reading. the active one is mapped at full size, we only look at what we wrote.
+archive_map_segment(dt_archive_t *a, uint32_t seg)
+{
+  if(seg >= a->seg_cnt)
+  {
+    uint32_t cnt = seg + 16;
+    a->seg_map  = realloc(a->seg_map,  sizeof(uint8_t *)*cnt);
+    a->seg_size = realloc(a->seg_size, sizeof(uint32_t)*cnt);
+    memset(a->seg_map  + a->seg_cnt, 0, sizeof(uint8_t *)*(cnt - a->seg_cnt));
+    memset(a->seg_size + a->seg_cnt, 0, sizeof(uint32_t)*(cnt - a->seg_cnt));
+    a->seg_cnt = cnt;
+  }
+  if(a->seg_map[seg]) return a->seg_map[seg];
+  char fn[1040];
+  archive_segment_name(a, seg, fn, sizeof(fn));
+  int fd = open(fn, O_RDONLY|O_BINARY);
+  if(fd < 0) return 0;
+  struct stat sb;
+  if(fstat(fd, &sb)) { close(fd); return 0; }
+  a->seg_size[seg] = sb.st_size > DT_ARCHIVE_SEGMENT ? DT_ARCHIVE_SEGMENT : sb.st_size;
+#ifndef _WIN64
+  void *m = mmap(0, DT_ARCHIVE_SEGMENT, PROT_READ, MAP_SHARED, fd, 0);
+  a->seg_map[seg] = m == MAP_FAILED ? 0 : m;
+#else // no mapping, and the active segment is read back after every write (see archive_put)
+  a->seg_map[seg] = malloc(DT_ARCHIVE_SEGMENT);
+  if(read(fd, a->seg_map[seg], a->seg_size[seg]) != a->seg_size[seg]) { free(a->seg_map[seg]); a->seg_map[seg] = 0; }
+#endif
+  close(fd);
+  return a->seg_map[seg];
+}
+
+static const dt_archive_record_t * // return the record the slot points to if it checks out
+archive_record(dt_archive_t *a, const dt_archive_slot_t *s)
+{
+  if(!s->key || s->seg == DT_ARCHIVE_REMOVED) return 0;
+  const uint8_t *m = archive_map_segment(a, s->seg);
+  if(!m) return 0;
+  const uint64_t end = s->seg == a->header->segment ? a->seg_end : a->seg_size[s->seg];
+  if(s->off + (uint64_t)record_size(s->len) > end) return 0;
+  const dt_archive_record_t *r = (const dt_archive_record_t *)(m + s->off);
+  if(r->key != s->key || r->len != s->len || r->magic != dt_token("bc1a")) return 0;
+  return r;
+}
+
+static int // open the segment to append to
+archive_open_segment(dt_archive_t *a)
+{
+  if(a->seg_fd >= 0) close(a->seg_fd);
+  char fn[1040];
+  archive_segment_name(a, a->header->segment, fn, sizeof(fn));
+  a->seg_fd = open(fn, O_RDWR|O_CREAT|O_BINARY, 0644);
+  if(a->seg_fd < 0) return 1;
+  off_t end = lseek(a->seg_fd, 0, SEEK_END);
+  a->seg_end = (end + 15) & ~15;
+  return end < 0;
+}
+
+static int
+archive_map_index(dt_archive_t *a, size_t size)
+{
+  a->size = size;
+#ifndef _WIN64
+  void *m = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, a->fd, 0);
+  a->header = m == MAP_FAILED ? 0 : m;
+#else
+  a->header = calloc(size, 1);
+  lseek(a->fd, 0, SEEK_SET);
+  if(read(a->fd, a->header, size) < 0) memset(a->header, 0, size);
+#endif
+  if(!a->header) return 1;
+  a->slot = (dt_archive_slot_t *)(a->header + 1);
+  return 0;
+}
+
+static void
+archive_unmap_index(dt_archive_t *a)
+{
+  if(!a->header) return;
+#ifndef _WIN64
+  munmap(a->header, a->size);
+#else
+  lseek(a->fd, 0, SEEK_SET);
+  if(write(a->fd, a->header, a->size) != a->size)
+    dt_log(s_log_db|s_log_err, "could not write thumbnail archive index in `%s'", a->dirname);
+  free(a->header);
+#endif
+  a->header = 0;
+  a->slot = 0;
+}
+
+#ifdef _WIN64
+static void // write the index back, there are no shared mappings here
+archive_sync(dt_archive_t *a)
+{
+  lseek(a->fd, 0, SEEK_SET);
+  if(write(a->fd, a->header, a->size) != a->size) return;
+  fsync(a->fd);
+}
+#endif
+
+static int // write a fresh index of the given capacity with all live slots, atomically replacing the old one
+archive_rehash(dt_archive_t *a, uint32_t cap)
+{
+  const size_t size = sizeof(dt_archive_header_t) + sizeof(dt_archive_slot_t)*(size_t)cap;
+  dt_archive_header_t *h = calloc(size, 1);
+  dt_archive_slot_t *slot = (dt_archive_slot_t *)(h+1);
+  memcpy(h->magic, "vkdtarch", 8);
+  h->version = DT_ARCHIVE_VERSION;
+  h->cap     = cap;
+  h->segment = a->header ? a->header->segment : 0;
+  uint32_t used = 0;
+  if(a->header) for(uint32_t k=0;k<a->header->cap;k++)
+  {
+    if(!a->slot[k].key || a->slot[k].seg == DT_ARCHIVE_REMOVED) continue;
+    slot[archive_find(slot, cap, a->slot[k].key)] = a->slot[k];
+    used++;
+  }
+  char fn[1040], tmp[1050];
+  snprintf(fn,  sizeof(fn),  "%s/index", a->dirname);
+  snprintf(tmp, sizeof(tmp), "%s/index.temp", a->dirname);
+  int fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  int err = fd < 0 || write(fd, h, size) != size || fsync(fd);
+  free(h);
+  if(!err) err = rename(tmp, fn);
+  if(err)
+  {
+    if(fd >= 0) close(fd);
+    unlink(tmp);
+    return 1;
+  }
+  archive_unmap_index(a);
+  if(a->fd >= 0) close(a->fd);
+  a->fd = fd;
+  a->used = used;
+  a->dead = 0;
+  a->rehashed++;
+  return archive_map_index(a, size);
+}
+
+static int
+archive_put(dt_archive_t *a, uint64_t key, const void *data, uint32_t len, int64_t mtime)
+{
+  const uint32_t rsize = record_size(len);
+  if(rsize > DT_ARCHIVE_SEGMENT) return 1;
+  if(a->seg_end + (uint64_t)rsize > DT_ARCHIVE_SEGMENT)
+  { // seal this segment, continue with the next one
+    if(a->header->segment < a->seg_cnt) a->seg_size[a->header->segment] = a->seg_end;
+    a->header->segment++;
+    if(archive_open_segment(a)) return 1;
+  }
+  uint8_t *buf = malloc(rsize);
+  dt_archive_record_t *r = (dt_archive_record_t *)buf;
+  *r = (dt_archive_record_t){ .key = key, .len = len, .magic = dt_token("bc1a") };
+  memcpy(r+1, data, len);
+  memset(buf + sizeof(*r) + len, 0, rsize - sizeof(*r) - len);
+#ifndef _WIN64
+  int err = pwrite(a->seg_fd, buf, rsize, a->seg_end) != rsize;
+#else
+  int err = lseek(a->seg_fd, a->seg_end, SEEK_SET) != a->seg_end || write(a->seg_fd, buf, rsize) != rsize;
+  if(!err && a->header->segment < a->seg_cnt && a->seg_map[a->header->segment])
+    memcpy(a->seg_map[a->header->segment] + a->seg_end, buf, rsize);
+#endif
+  free(buf);
+  if(err) return 1;
+
+  uint32_t k = archive_find(a->slot, a->header->cap, key);
+  if(a->slot[k].key && a->slot[k].seg != DT_ARCHIVE_REMOVED)
+    a->live -= record_size(a->slot[k].len);
+  else if(a->slot[k].key) a->dead--; // comes back to life
+  if(!a->slot[k].key)
+  { // new entry, make sure the table stays at most 3/4 full
+    if(a->used + 1 > a->header->cap/4*3)
+    { // removed entries take up slots for now, but they don't survive the rehash:
+      uint32_t cap = a->header->cap;
+      while(a->used - a->dead + 1 > cap/4) cap <<= 1;
+      if(archive_rehash(a, cap)) return 1;
+      k = archive_find(a->slot, a->header->cap, key);
+    }
+    a->used++;
+  }
+  // the data is there, now point the slot to it. the key goes last:
+  dt_archive_slot_t *s = a->slot + k;
+  s->seg   = a->header->segment;
+  s->off   = a->seg_end;
+  s->len   = len;
+  s->atime = mtime;
+  s->mtime = mtime;
+  s->key   = key;
+  a->seg_end += rsize;
+  a->live += rsize;
+  return 0;
+}
+
+static void
+archive_remove_slot(dt_archive_t *a, dt_archive_slot_t *s)
+{ // the key stays to keep the probe sequences intact
+  if(!s->key || s->seg == DT_ARCHIVE_REMOVED) return;
+  a->live -= record_size(s->len);
+  a->dead++;
+  s->seg = DT_ARCHIVE_REMOVED;
+}
+
+static int // move the live entries out of the sealed segment and delete it. locks a->mutex once per record.
+archive_compact_segment(dt_archive_t *a, uint32_t seg)
+{
+  uint32_t k = 0, rehashed = -1u;
+  for(;;)
+  {
+    threads_mutex_lock(&a->mutex);
+    if(rehashed != a->rehashed)
+    { // start over, the slots moved around (the records we moved already are not in seg any more)
+      rehashed = a->rehashed;
+      k = 0;
+    }
+    for(;k<a->header->cap;k++)
+    {
+      dt_archive_slot_t *s = a->slot + k;
+      if(!s->key || s->seg != seg) continue;
+      const dt_archive_record_t *r = archive_record(a, s);
+      if(!r) { archive_remove_slot(a, s); continue; } // broken, regenerate
+      // the key is in the index already, so this will not rehash:
+      const uint32_t atime = s->atime;
+      if(archive_put(a, s->key, r+1, r->len, s->mtime))
+      {
+        threads_mutex_unlock(&a->mutex);
+        return 1;
+      }
+      s->atime = atime;
+      k++;
+      break; // let the others in
+    }
+    if(k < a->header->cap)
+    {
+      threads_mutex_unlock(&a->mutex);
+      continue;
+    }
+    // only delete the segment once the index points elsewhere on disk,
+    // but don't keep everybody waiting for the disk:
+#ifndef _WIN64
+    const int fd[2] = { dup(a->seg_fd), dup(a->fd) };
+    threads_mutex_unlock(&a->mutex);
+    for(int i=0;i<2;i++) if(fd[i] >= 0) { fsync(fd[i]); close(fd[i]); } // includes the mapped index
+    threads_mutex_lock(&a->mutex);
+#else
+    fsync(a->seg_fd);
+    archive_sync(a);
+#endif
+    char fn[1040];
+    archive_segment_name(a, seg, fn, sizeof(fn));
+    archive_unmap_segment(a, seg);
+    unlink(fn);
+    threads_mutex_unlock(&a->mutex);
+    return 0;
+  }
+}
+
+// copy the live entries of segments that are mostly garbage to the active one,
+// delete the rest. this runs in the background while the archive is in use, so
+// it only takes the lock for one record at a time.
+static void
+archive_compact(dt_archive_t *a)
+{
+  int expected = 0;
+  if(!atomic_compare_exchange_strong(&a->compacting, &expected, 1)) return;
+  threads_mutex_lock(&a->mutex);
+  const uint32_t active = a->header->segment;
+  uint64_t *live = calloc(sizeof(uint64_t), active+1);
+  for(uint32_t k=0;k<a->header->cap;k++)
+    if(a->slot[k].key && a->slot[k].seg < active)
+      live[a->slot[k].seg] += record_size(a->slot[k].len);
+  threads_mutex_unlock(&a->mutex);
+  uint32_t move_cnt = 0;
+  uint64_t bytes = 0;
+  for(uint32_t s=0;s<active;s++)
+  { // the segments below the active one at the start are sealed, nobody else writes there
+    char fn[1040];
+    struct stat sb;
+    archive_segment_name(a, s, fn, sizeof(fn));
+    if(stat(fn, &sb) || live[s] >= (uint64_t)sb.st_size/2) continue;
+    if(archive_compact_segment(a, s)) break;
+    move_cnt++;
+    bytes += live[s];
+  }
+  if(move_cnt)
+    dt_log(s_log_db, "thumbnail archive: compacted %u segments, kept %.1f MB", move_cnt, bytes/(1024.0*1024.0));
+  free(live);
+  atomic_store(&a->compacting, 0);
+}
+
+dt_archive_t *dt_archive_open(const char *dirname)
+{
+  threads_mutex_lock(&archive_mutex);
+  for(int i=0;i<DT_ARCHIVE_MAX_OPEN;i++)
+  {
+    if(archive_open[i] && !strcmp(archive_open[i]->dirname, dirname))
+    {
+      archive_open[i]->ref++;
+      threads_mutex_unlock(&archive_mutex);
+      return archive_open[i];
+    }
+  }
+  int slot = 0;
+  while(slot < DT_ARCHIVE_MAX_OPEN && archive_open[slot]) slot++;
+  dt_archive_t *a = 0;
+  if(slot == DT_ARCHIVE_MAX_OPEN) goto error;
+
+  a = calloc(sizeof(dt_archive_t), 1);
+  a->fd = a->lock_fd = a->seg_fd = -1;
+  threads_mutex_init(&a->mutex, 0);
+  snprintf(a->dirname, sizeof(a->dirname), "%s", dirname);
+  int err = fs_mkdir_p(a->dirname, 0755);
+  if(err && errno != EEXIST) goto error;
+
+  char fn[1040];
+  snprintf(fn, sizeof(fn), "%s/lock", a->dirname);
+  a->lock_fd = open(fn, O_RDWR|O_CREAT|O_BINARY, 0644);
+  if(a->lock_fd < 0) goto error;
+#ifndef _WIN64
+  if(flock(a->lock_fd, LOCK_EX|LOCK_NB))
+  {
+    dt_log(s_log_db, "thumbnail archive `%s' is in use by another process", a->dirname);
+    goto error;
+  }
+#endif
+
+  dt_archive_header_t hdr = {{0}};
+  struct stat sb;
+  snprintf(fn, sizeof(fn), "%s/index", a->dirname);
+  a->fd = open(fn, O_RDWR|O_BINARY);
+  if(a->fd >= 0 && read(a->fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+     !memcmp(hdr.magic, "vkdtarch", 8) && hdr.version == DT_ARCHIVE_VERSION &&
+     hdr.cap && !(hdr.cap & (hdr.cap-1)) && !fstat(a->fd, &sb) &&
+     sb.st_size >= sizeof(hdr) + sizeof(dt_archive_slot_t)*(size_t)hdr.cap)
+  {
+    if(archive_map_index(a, sizeof(hdr) + sizeof(dt_archive_slot_t)*(size_t)hdr.cap)) goto error;
+    for(uint32_t k=0;k<hdr.cap;k++) a->used += a->slot[k].key != 0;
+    for(uint32_t k=0;k<hdr.cap;k++) a->dead += a->slot[k].key && a->slot[k].seg == DT_ARCHIVE_REMOVED;
+  }
+  else
+  { // start from scratch, also if the index is broken. old segments are deleted by the compaction below
+    uint32_t seg = 0;
+    for(;;seg++)
+    {
+      char sfn[1040];
+      struct stat sb;
+      archive_segment_name(a, seg, sfn, sizeof(sfn));
+      if(stat(sfn, &sb)) break;
+    }
+    if(archive_rehash(a, DT_ARCHIVE_MIN_CAP)) goto error;
+    a->header->segment = seg;
+  }
+  if(archive_open_segment(a)) goto error;
+  for(uint32_t k=0;k<a->header->cap;k++)
+    if(a->slot[k].key && a->slot[k].seg != DT_ARCHIVE_REMOVED)
+      a->live += record_size(a->slot[k].len);
+  archive_open[slot] = a;
+  a->ref = 1;
+  threads_mutex_unlock(&archive_mutex);
+  archive_compact(a); // others can use it already
+  return a;
+error:
+  threads_mutex_unlock(&archive_mutex);
+  if(!a) return 0;
+  dt_log(s_log_db|s_log_err, "could not open thumbnail archive `%s'", a->dirname);
+  archive_unmap_index(a);
+  if(a->fd >= 0)      close(a->fd);
+  if(a->seg_fd >= 0)  close(a->seg_fd);
+  if(a->lock_fd >= 0) close(a->lock_fd);
+  for(uint32_t s=0;s<a->seg_cnt;s++) archive_unmap_segment(a, s);
+  free(a->seg_map);
+  free(a->seg_size);
+  threads_mutex_destroy(&a->mutex);
+  free(a);
+  return 0;
+}
+
+void dt_archive_close(dt_archive_t *a)
+{
+  if(!a) return;
+  threads_mutex_lock(&archive_mutex);
+  if(--a->ref > 0)
+  {
+    threads_mutex_unlock(&archive_mutex);
+    return;
+  }
+  for(int i=0;i<DT_ARCHIVE_MAX_OPEN;i++) if(archive_open[i] == a) archive_open[i] = 0;
+  threads_mutex_unlock(&archive_mutex);
+  archive_unmap_index(a);
+  close(a->fd);
+  close(a->seg_fd);
+  close(a->lock_fd); // releases the lock
+  for(uint32_t s=0;s<a->seg_cnt;s++) archive_unmap_segment(a, s);
+  free(a->seg_map);
+  free(a->seg_size);
+  threads_mutex_destroy(&a->mutex);
+  free(a);
+}
+
+dt_archive_t *dt_archive_find(const char *filename, uint64_t *key)
+{
+  dt_archive_t *a = 0;
+  threads_mutex_lock(&archive_mutex);
+  for(int i=0;i<DT_ARCHIVE_MAX_OPEN;i++)
+  {
+    if(!archive_open[i]) continue;
+    const size_t len = strlen(archive_open[i]->dirname);
+    if(strncmp(filename, archive_open[i]->dirname, len) || filename[len] != '/') continue;
+    char *end = 0;
+    *key = strtoull(filename + len + 1, &end, 16);
+    if(end == filename + len + 1 || (*end && *end != '.')) continue;
+    a = archive_open[i];
+    break;
+  }
+  threads_mutex_unlock(&archive_mutex);
+  return a;
+}
+
+int dt_archive_put(dt_archive_t *a, uint64_t key, const void *data, uint64_t size)
+{
+  if(!key) key = 1; // zero marks empty slots
+  if(size > DT_ARCHIVE_SEGMENT) return 1;
+  threads_mutex_lock(&a->mutex);
+  int err = archive_put(a, key, data, size, time(0));
+  threads_mutex_unlock(&a->mutex);
+  return err;
+}
+
+int64_t dt_archive_get(dt_archive_t *a, uint64_t key, void *data, uint64_t offset, uint64_t size)
+{
+  if(!key) key = 1;
+  threads_mutex_lock(&a->mutex);
+  dt_archive_slot_t *s = a->slot + archive_find(a->slot, a->header->cap, key);
+  const dt_archive_record_t *r = archive_record(a, s);
+  int64_t len = r ? (int64_t)r->len : -1;
+  if(r && data && offset < r->len)
+  {
+    memcpy(data, (const uint8_t *)(r+1) + offset, r->len - offset < size ? r->len - offset : size);
+    const uint32_t now = time(0);
+    if(now > s->atime + 60) s->atime = now; // don't dirty the index pages on every read
+  }
+  threads_mutex_unlock(&a->mutex);
+  return len;
+}
+
+void dt_archive_prefetch(dt_archive_t *a, uint64_t key)
+{
+#ifndef _WIN64
+  if(!key) key = 1;
+  threads_mutex_lock(&a->mutex);
+  const dt_archive_slot_t *s = a->slot + archive_find(a->slot, a->header->cap, key);
+  const uint8_t *m = s->key && s->seg != DT_ARCHIVE_REMOVED ? archive_map_segment(a, s->seg) : 0;
+  if(m && s->off + (uint64_t)record_size(s->len) <= DT_ARCHIVE_SEGMENT)
+  { // only look at the slot, touching the record would read it right here:
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t beg = (uintptr_t)(m + s->off) & ~(page-1);
+    const uintptr_t end = (uintptr_t)(m + s->off) + record_size(s->len);
+    madvise((void *)beg, end - beg, MADV_WILLNEED);
+  }
+  threads_mutex_unlock(&a->mutex);
+#endif
+}
+
+int64_t dt_archive_stat(dt_archive_t *a, uint64_t key, int64_t *mtime)
+{
+  if(!key) key = 1;
+  threads_mutex_lock(&a->mutex);
+  const dt_archive_slot_t *s = a->slot + archive_find(a->slot, a->header->cap, key);
+  const dt_archive_record_t *r = archive_record(a, s);
+  if(mtime) *mtime = r ? s->mtime : 0;
+  threads_mutex_unlock(&a->mutex);
+  return r ? (int64_t)r->len : -1;
+}
+
+void dt_archive_remove(dt_archive_t *a, uint64_t key)
+{
+  if(!key) key = 1;
+  threads_mutex_lock(&a->mutex);
+  archive_remove_slot(a, a->slot + archive_find(a->slot, a->header->cap, key));
+  threads_mutex_unlock(&a->mutex);
+}
+
+static int
+archive_cmp_u64(const void *a, const void *b)
+{
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+uint64_t dt_archive_gc(dt_archive_t *a, uint64_t budget)
+{
+  uint64_t freed = 0;
+  threads_mutex_lock(&a->mutex);
+  if(budget && a->live > budget)
+  { // sort live entries by last access, the slot index goes to the low bits:
+    uint64_t *sort = malloc(sizeof(uint64_t)*a->used);
+    uint32_t cnt = 0;
+    for(uint32_t k=0;k<a->header->cap;k++)
+    {
+      const dt_archive_slot_t *s = a->slot + k;
+      if(!s->key || s->seg == DT_ARCHIVE_REMOVED) continue;
+      const uint64_t t = s->atime ? s->atime : (uint32_t)s->mtime;
+      sort[cnt++] = (t << 32) | k;
+    }
+    qsort(sort, cnt, sizeof(uint64_t), archive_cmp_u64);
+    // leave some room such that we don't run again right away:
+    const uint64_t target = budget/8*7;
+    uint32_t removed = 0;
+    for(uint32_t i=0;i<cnt && a->live > target;i++)
+    {
+      dt_archive_slot_t *s = a->slot + (uint32_t)sort[i];
+      freed += record_size(s->len);
+      archive_remove_slot(a, s);
+      removed++;
+    }
+    free(sort);
+    dt_log(s_log_db, "thumbnail archive: evicted %u entries, %.1f MB", removed, freed/(1024.0*1024.0));
+  }
+  threads_mutex_unlock(&a->mutex);
+  if(freed) archive_compact(a); // give the space back, without blocking readers for long
+  return freed;
+}
+
+uint64_t dt_archive_size(dt_archive_t *a)
+{
+  threads_mutex_lock(&a->mutex);
+  const uint64_t live = a->live;
+  threads_mutex_unlock(&a->mutex);
+  return live;
+}
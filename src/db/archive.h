@@ -0,0 +1,69 @@
+#pragma once
+#include "pipe/token.h"
+#include <stdint.h>
+
+// packed store of small files keyed by a 64-bit hash, used for the bc1
+// thumbnails in ~/.cache/vkdt/thumbs/ instead of one file per image.
+//
+// the data goes to append-only segment files of up to 64MB, each entry with
+// a short header such that the index can be checked against it. the index is
+// a memory mapped open addressing hash table pointing into the segments.
+// replacing an entry appends the new data and then switches the index slot
+// over, so a reader (or a crash) sees either the old or the new version. the
+// space of replaced and removed entries is reclaimed when the archive is
+// opened or garbage collected: segments that are less than half alive are
+// copied over and deleted.
+//
+// the archive is used by one process at a time, a second one gets 0 from
+// dt_archive_open() and has to do without.
+
+typedef struct dt_archive_t dt_archive_t;
+
+// open or create the archive in the given directory. opening the same
+// directory twice returns the same archive, close it as often.
+dt_archive_t *dt_archive_open(const char *dirname);
+void dt_archive_close(dt_archive_t *a);
+
+// if the file name is <dirname>/<hex key>.<ext> in the directory of an open
+// archive, return the archive and fill the key. returns 0 otherwise. this is
+// how the i-bc1 and o-bc1 modules find out where their data goes.
+VKDT_API dt_archive_t *dt_archive_find(const char *filename, uint64_t *key);
+
+// store size bytes under the key, replacing what was there. returns non-zero
+// on failure.
+VKDT_API int dt_archive_put(dt_archive_t *a, uint64_t key, const void *data, uint64_t size);
+
+// copy at most size bytes starting at offset of the entry to data. returns
+// the full size of the entry or -1 if there is none. data may be 0 to only
+// query the size.
+VKDT_API int64_t dt_archive_get(dt_archive_t *a, uint64_t key, void *data, uint64_t offset, uint64_t size);
+
+// start reading the entry from disk in the background, such that a
+// dt_archive_get() soon after does not have to wait for it.
+void dt_archive_prefetch(dt_archive_t *a, uint64_t key);
+
+// size of the entry and the time it was written (may be 0), -1 if there is none
+int64_t dt_archive_stat(dt_archive_t *a, uint64_t key, int64_t *mtime);
+
+// forget the entry, if there is one
+void dt_archive_remove(dt_archive_t *a, uint64_t key);
+
+// bytes in all live entries, including the record headers
+uint64_t dt_archive_size(dt_archive_t *a);
+
+// if the live entries take more than budget bytes, remove the ones that have
+// not been read for the longest time down to 7/8 of the budget, and compact
+// the segments to give the space back. a budget of 0 means no limit. the
+// time of the last read is kept in the index, with a resolution of a minute.
+// the compaction copies the survivors one record at a time and only holds the
+// lock for each one, so readers don't have to wait for it.
+// returns the number of bytes evicted.
+uint64_t dt_archive_gc(dt_archive_t *a, uint64_t budget);
+
+// key of another level of the same entry, such as the larger version of a
+// thumbnail. level 0 is the key itself.
+static inline uint64_t
+dt_archive_key_level(uint64_t key, int level)
+{
+  return level ? key ^ (0x9e3779b97f4a7c15ull * level) : key;
+}
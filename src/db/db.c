@@ -3,9 +3,13 @@
 #include "core/log.h"
 #include "core/fs.h"
 #include "core/sort.h"
+#include "core/radixsort.h"
 #include "pipe/graph-defaults.h"
 #include "stringpool.h"
-#include "exif.h"
+#include "meta.h"
+#include "journal.h"
+#include "watch.h"
+#include "tags.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,13 +38,17 @@ dt_db_init(dt_db_t *db)
 void
 dt_db_cleanup(dt_db_t *db)
 {
-  char dbname[1040];
-  snprintf(dbname, sizeof(dbname), "%s/vkdt.db", db->dirname);
-  // do not write if opened single image:
-  if(db->image_cnt > 1) dt_db_write(db, dbname, 0);
+  dt_db_watch_stop(db);
+  // ratings and labels are on disk already, only sort and filter are left to write:
+  dt_db_journal_close(db);
+  dt_db_meta_close(db);
+  dt_db_tags_close(db->tags);
   dt_stringpool_cleanup(&db->sp_filename);
   free(db->collection);
   free(db->selection);
+  free(db->colid);
+  free(db->selid);
+  for(int f=1;f<s_prop_cnt;f++) free(db->filter_bits[f]);
   free(db->image);
   threads_mutex_destroy(&db->image_mutex);
   memset(db, 0, sizeof(*db));
@@ -61,131 +69,354 @@ compare_filename(const void *a, const void *b, void *arg)
   return strcmp(db->image[ia[0]].filename, db->image[ib[0]].filename);
 }
 
-static int
-compare_rating(const void *a, const void *b, void *arg)
+void
+dt_db_read_createdate(dt_db_t *db, uint32_t imgid, char createdate[20])
 {
-  dt_db_t *db = arg;
-  const uint32_t *ia = a, *ib = b;
-  // higher rating comes first:
-  return db->image[ib[0]].rating - db->image[ia[0]].rating;
+  memcpy(createdate, dt_db_meta_get(db, imgid)->createdate, 20);
 }
 
-static int
-compare_labels(const void *a, const void *b, void *arg)
+static void
+update_filename_rank(dt_db_t *db)
+{ // sort by file name once, sorting the collection later on only looks at the rank
+  uint32_t *id = malloc(sizeof(uint32_t)*db->image_cnt);
+  for(uint32_t k=0;k<db->image_cnt;k++) id[k] = k;
+  sort(id, db->image_cnt, sizeof(id[0]), compare_filename, db);
+  for(uint32_t k=0;k<db->image_cnt;k++) db->image[id[k]].fnrank = k;
+  free(id);
+}
+
+static uint64_t
+createdate_key(const char createdate[20])
+{ // yyyy:mm:dd hh:mm:ss packed into 38 bits, in the same order as strcmp. 0 if unknown
+  const int pos[] = {0, 5, 8, 11, 14, 17}, len[] = {4, 2, 2, 2, 2, 2}, bits[] = {12, 4, 5, 5, 6, 6};
+  uint64_t key = 0;
+  for(int f=0;f<6;f++)
+  {
+    int v = 0;
+    for(int i=pos[f];i<pos[f]+len[f];i++)
+      if(isdigit(createdate[i])) v = 10*v + createdate[i] - '0';
+      else return 0;
+    key = (key << bits[f]) | MIN(v, (1<<bits[f])-1);
+  }
+  return key;
+}
+
+// the sort criterion of one image, as unsigned integer in ascending order.
+// ties are broken by image id.
+static uint64_t
+image_key(dt_db_t *db, uint32_t imgid)
 {
-  dt_db_t *db = arg;
-  const uint32_t *ia = a, *ib = b;
-  return db->image[ia[0]].labels - db->image[ib[0]].labels;
+  switch(db->collection_sort)
+  {
+  case s_prop_filename:
+    return db->image[imgid].fnrank;
+  case s_prop_rating: // higher rating comes first
+    return 0xffff - db->image[imgid].rating;
+  case s_prop_labels: // selecting an image does not move it
+    return db->image[imgid].labels & ~s_image_label_selected;
+  case s_prop_createdate:
+    return createdate_key(dt_db_meta_get(db, imgid)->createdate);
+  case s_prop_filetype:
+    return dt_graph_default_input_module(db->image[imgid].filename);
+  default:
+    return 0;
+  }
 }
 
-void
-dt_db_read_createdate(const dt_db_t *db, uint32_t imgid, char createdate[20])
+// sort the list of image ids by the current collection_sort criterion. every
+// image gets one 64-bit key with the image id in the low bits, such that equal
+// criteria are ordered by id and we can read the id back after sorting.
+static void
+sort_images(dt_db_t *db, uint32_t *list, uint32_t cnt)
 {
-  char fn[PATH_MAX], f[PATH_MAX];
-  dt_db_image_path(db, imgid, fn, sizeof(fn));
-  fs_realpath(fn, f);
-  size_t off = strnlen(f, sizeof(f));
-  if(off > 4) f[off - 4] = 0;
-  else f[off] = 0;
+  const dt_db_property_t prop = db->collection_sort;
+  if(prop == s_prop_none || prop >= s_prop_cnt || cnt < 2) return;
+  int idbits = 1;
+  while((1ull<<idbits) < db->image_cnt) idbits++;
+
+  uint64_t *key = malloc(sizeof(uint64_t)*cnt);
+  for(uint32_t i=0;i<cnt;i++) key[i] = image_key(db, list[i]);
+  if(prop == s_prop_filetype)
+  { // tokens use all 64 bits, replace them by their rank among the few distinct input modules
+    dt_token_t ft[64];
+    uint32_t ft_cnt = 0;
+    for(uint32_t i=0;i<cnt;i++)
+    {
+      uint32_t j = 0;
+      while(j < ft_cnt && ft[j] < key[i]) j++;
+      if(ft_cnt == sizeof(ft)/sizeof(ft[0]) || (j < ft_cnt && ft[j] == key[i])) continue;
+      memmove(ft+j+1, ft+j, sizeof(ft[0])*(ft_cnt-j));
+      ft[j] = key[i];
+      ft_cnt++;
+    }
+    for(uint32_t i=0;i<cnt;i++)
+    {
+      uint32_t j = 0;
+      while(j < ft_cnt && ft[j] < key[i]) j++;
+      key[i] = j;
+    }
+  }
+  for(uint32_t i=0;i<cnt;i++) key[i] = (key[i] << idbits) | list[i];
+  radix_sort(key, cnt);
+  for(uint32_t i=0;i<cnt;i++) list[i] = key[i] & ((1ull<<idbits)-1);
+  free(key);
+}
 
-  char model[32];
-  dt_db_exif_mini(f, createdate, model, sizeof(model));
+static inline void
+image_init(dt_image_t *img)
+{
+  // img->thumbnail = 0; // loading icon
+  memset(img, 0, sizeof(*img));
+  img->meta = -1u; // no record in the metadata index yet
 }
 
+// evaluate one filter property for one image
 static int
-compare_createdate(const void *a, const void *b, void *arg)
-{ // you ask for complicated sort, you get slow and stupid.
-  // we don't store the date in the db, since there is in general no clear 1:1 mapping
-  // between images and cfg file/graph. also, loading a directory becomes painfully slow
-  // when initialising metadata during ingestion.
-  dt_db_t *db = arg;
-  const uint32_t *ia = a, *ib = b;
-  char cda[20] = {0}, cdb[20] = {0};
-  dt_db_read_createdate(db, ia[0], cda);
-  dt_db_read_createdate(db, ib[0], cdb);
-  return strcmp(cda, cdb);
+filter_pass(dt_db_t *db, int f, uint32_t k)
+{
+  const dt_db_filter_t *ft = &db->collection_filter;
+  switch(f)
+  {
+  case s_prop_filename:
+    return strstr(db->image[k].filename, ft->filename) != 0;
+  case s_prop_rating:
+    if(ft->rating_cmp == 0) return db->image[k].rating >= ft->rating;
+    if(ft->rating_cmp == 1) return db->image[k].rating == ft->rating;
+    if(ft->rating_cmp == 2) return db->image[k].rating <  ft->rating;
+    return 1;
+  case s_prop_labels:
+    return (db->image[k].labels & ft->labels) != 0;
+  case s_prop_createdate:
+    return strstr(dt_db_meta_get(db, k)->createdate, ft->createdate) != 0;
+  case s_prop_filetype:
+    return dt_graph_default_input_module(db->image[k].filename) == ft->filetype;
+  default:
+    return 1;
+  }
 }
 
+// returns non-zero if the parameters of filter property f differ
 static int
-compare_filetype(const void *a, const void *b, void *arg)
+filter_changed(const dt_db_filter_t *a, const dt_db_filter_t *b, int f)
 {
-  dt_db_t *db = arg;
-  const uint32_t *ia = a, *ib = b;
-  dt_token_t ta = dt_graph_default_input_module(db->image[ia[0]].filename);
-  dt_token_t tb = dt_graph_default_input_module(db->image[ib[0]].filename);
-  // convert 64 to 32 bits:
-  if(ta > tb) return 1;
-  else if(tb > ta) return -1;
-  return 0;
+  switch(f)
+  {
+  case s_prop_filename:   return strncmp(a->filename, b->filename, sizeof(a->filename));
+  case s_prop_rating:     return a->rating != b->rating || a->rating_cmp != b->rating_cmp;
+  case s_prop_labels:     return a->labels != b->labels;
+  case s_prop_createdate: return strncmp(a->createdate, b->createdate, sizeof(a->createdate));
+  case s_prop_filetype:   return a->filetype != b->filetype;
+  default:                return 0;
+  }
+}
+
+static inline int
+filter_bit(const uint64_t *bits, uint32_t k)
+{
+  return (bits[k/64] >> (k&63)) & 1;
 }
 
 static inline void
-image_init(dt_image_t *img)
+filter_bit_set(uint64_t *bits, uint32_t k, int on)
 {
-  // img->thumbnail = 0; // loading icon
-  memset(img, 0, sizeof(*img));
+  if(on) bits[k/64] |=  (1ull<<(k&63));
+  else   bits[k/64] &= ~(1ull<<(k&63));
+}
+
+// returns non-zero if the image passes all active filters, as far as the bits know
+static int
+filter_pass_all(dt_db_t *db, uint32_t k)
+{
+  for(int f=1;f<s_prop_cnt;f++)
+    if((db->collection_filter.active & (1<<f)) && !filter_bit(db->filter_bits[f], k)) return 0;
+  return 1;
+}
+
+static void
+collection_alloc(dt_db_t *db)
+{
+  if(db->colid) return;
+  const size_t words = (db->image_max + 63) / 64;
+  db->colid = malloc(sizeof(uint32_t)*db->image_max);
+  db->selid = malloc(sizeof(uint32_t)*db->image_max);
+  memset(db->colid, 0xff, sizeof(uint32_t)*db->image_max);
+  memset(db->selid, 0xff, sizeof(uint32_t)*db->image_max);
+  for(int f=1;f<s_prop_cnt;f++) db->filter_bits[f] = calloc(sizeof(uint64_t), words);
+  db->filter_valid = 0;
 }
 
 void
 dt_db_update_collection(dt_db_t *db)
 {
-  // filter
-  char createdate[20];
+  collection_alloc(db);
+  // update the bits of the filters that changed since last time. the others,
+  // especially create date, don't need to look at the images again.
+  const dt_db_filter_t *ft = &db->collection_filter;
+  for(int f=1;f<s_prop_cnt;f++)
+  {
+    if(!(ft->active & (1<<f)))
+      db->filter_valid &= ~(1<<f);
+    else if(!(db->filter_valid & (1<<f)) || filter_changed(ft, &db->filter_bits_for, f))
+    {
+      for(uint32_t k=0;k<db->image_cnt;k++)
+        filter_bit_set(db->filter_bits[f], k, filter_pass(db, f, k));
+      db->filter_valid |= 1<<f;
+    }
+  }
+  db->filter_bits_for = *ft;
+
+  // collect all images that pass the filters
   db->collection_cnt = 0;
-  for(int k=0;k<db->image_cnt;k++)
+  const uint32_t words = (db->image_cnt + 63) / 64;
+  for(uint32_t w=0;w<words;w++)
   {
+    uint64_t m = w == words-1 && (db->image_cnt & 63) ? (1ull<<(db->image_cnt & 63))-1 : -1ull;
     for(int f=1;f<s_prop_cnt;f++)
+      if(ft->active & (1<<f)) m &= db->filter_bits[f][w];
+    for(;m;m&=m-1)
+      db->collection[db->collection_cnt++] = 64*w + __builtin_ctzll(m);
+  }
+  sort_images(db, db->collection, db->collection_cnt);
+
+  memset(db->colid, 0xff, sizeof(uint32_t)*db->image_max);
+  for(uint32_t i=0;i<db->collection_cnt;i++) db->colid[db->collection[i]] = i;
+  if(db->current_imgid != -1u) db->current_colid = db->colid[db->current_imgid];
+}
+
+static int // compare sort position of two images in the collection, same order as sort_images()
+compare_position(dt_db_t *db, uint64_t key_a, uint32_t a, uint32_t b)
+{
+  const uint64_t key_b = image_key(db, b);
+  if(key_a != key_b) return key_a < key_b ? -1 : 1;
+  return a < b ? -1 : a > b;
+}
+
+// evaluate the valid filters for one image again
+static void
+filter_update_image(dt_db_t *db, uint32_t imgid)
+{
+  for(int f=1;f<s_prop_cnt;f++)
+    if(db->filter_valid & (1<<f))
+      filter_bit_set(db->filter_bits[f], imgid, filter_pass(db, f, imgid));
+}
+
+// move one image to its place in the collection, or in or out of it
+static void
+collection_update_image(dt_db_t *db, uint32_t imgid)
+{
+  if(!db->colid || imgid >= db->image_cnt) return;
+  filter_update_image(db, imgid);
+  const int pass = filter_pass_all(db, imgid);
+  const uint32_t old = db->colid[imgid];
+  if(old == -1u && !pass) return;
+
+  uint32_t pos = old;
+  if(pass)
+  { // binary search in the collection as if the image wasn't there
+    const uint64_t key = image_key(db, imgid);
+    const uint32_t cnt = db->collection_cnt - (old != -1u);
+    uint32_t lo = 0, hi = cnt;
+    while(lo < hi)
     {
-      if(db->collection_filter.active & (1<<f))
-      {
-        switch(f)
-        {
-        case s_prop_none:
-          break;
-        case s_prop_filename:
-          if(!strstr(db->image[k].filename, db->collection_filter.filename)) goto discard;
-          break;
-        case s_prop_rating:
-          if(db->collection_filter.rating_cmp == 0 && !(db->image[k].rating >= db->collection_filter.rating)) goto discard;
-          if(db->collection_filter.rating_cmp == 1 && !(db->image[k].rating == db->collection_filter.rating)) goto discard;
-          if(db->collection_filter.rating_cmp == 2 && !(db->image[k].rating <  db->collection_filter.rating)) goto discard;
-          break;
-        case s_prop_labels:
-          if(!(db->image[k].labels & db->collection_filter.labels)) goto discard;
-          break;
-        case s_prop_createdate:
-          dt_db_read_createdate(db, k, createdate);
-          if(!strstr(createdate, db->collection_filter.createdate)) goto discard;
-          break;
-        case s_prop_filetype:
-          if(dt_graph_default_input_module(db->image[k].filename) != db->collection_filter.filetype) goto discard;
-          break;
-        }
-      }
+      const uint32_t mid = (lo + hi) / 2;
+      const uint32_t i = old != -1u && mid >= old ? mid+1 : mid;
+      if(compare_position(db, key, imgid, db->collection[i]) > 0) lo = mid+1;
+      else hi = mid;
     }
-    db->collection[db->collection_cnt++] = k;
-discard:;
+    pos = lo;
   }
-  // TODO: use db/tests/parallel radix sort
-  switch(db->collection_sort)
+  // only touch the entries between the old and the new position
+  uint32_t beg, end;
+  if(old == -1u)
+  { // insert
+    beg = pos; end = ++db->collection_cnt;
+    memmove(db->collection+pos+1, db->collection+pos, sizeof(uint32_t)*(end-1-pos));
+    db->collection[pos] = imgid;
+  }
+  else if(!pass)
+  { // remove
+    beg = old; end = --db->collection_cnt;
+    memmove(db->collection+old, db->collection+old+1, sizeof(uint32_t)*(end-old));
+    db->colid[imgid] = -1u;
+  }
+  else if(pos < old)
+  { // move up
+    beg = pos; end = old+1;
+    memmove(db->collection+pos+1, db->collection+pos, sizeof(uint32_t)*(old-pos));
+    db->collection[pos] = imgid;
+  }
+  else
+  { // move down (or stay)
+    beg = old; end = pos+1;
+    memmove(db->collection+old, db->collection+old+1, sizeof(uint32_t)*(pos-old));
+    db->collection[pos] = imgid;
+  }
+  for(uint32_t i=beg;i<end;i++) db->colid[db->collection[i]] = i;
+  if(db->current_imgid != -1u) db->current_colid = db->colid[db->current_imgid];
+}
+
+void
+dt_db_update_image(dt_db_t *db, uint32_t imgid)
+{
+  dt_db_journal_image(db, imgid);
+  collection_update_image(db, imgid);
+}
+
+void
+dt_db_update_image_in_place(dt_db_t *db, uint32_t imgid)
+{
+  dt_db_journal_image(db, imgid);
+  if(db->colid && imgid < db->image_cnt) filter_update_image(db, imgid);
+}
+
+typedef struct dt_db_dirent_t
+{ // names gathered from readdir
+  struct
   {
-  case s_prop_none: case s_prop_cnt:
-    break;
-  case s_prop_filename:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    sort(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filetype, db);
-    break;
+    uint32_t off;  // into buf
+    uint32_t len;
+    int32_t  type; // 1 regular file or link, 0 something else, -1 need to stat
+  } *entry;
+  uint32_t    cnt, max, unknown_cnt;
+  char       *buf;
+  size_t      buf_cnt, buf_max;
+  const char *dirname;
+}
+dt_db_dirent_t;
+
+static void
+dirent_add(dt_db_dirent_t *d, const char *name, int type)
+{
+  const size_t len = strlen(name);
+  if(d->cnt == d->max)
+  {
+    d->max = d->max ? 2*d->max : 1024;
+    d->entry = realloc(d->entry, sizeof(d->entry[0])*d->max);
+  }
+  if(d->buf_cnt + len + 1 > d->buf_max)
+  {
+    d->buf_max = MAX(2*d->buf_max, 65536 + len);
+    d->buf = realloc(d->buf, d->buf_max);
+  }
+  memcpy(d->buf + d->buf_cnt, name, len+1);
+  d->entry[d->cnt].off  = d->buf_cnt;
+  d->entry[d->cnt].len  = len;
+  d->entry[d->cnt].type = type;
+  d->buf_cnt += len + 1;
+  d->cnt++;
+  d->unknown_cnt += type < 0;
+}
+
+static void
+dirent_stat(uint32_t beg, uint32_t end, void *data)
+{
+  dt_db_dirent_t *d = data;
+  char fn[PATH_MAX];
+  for(uint32_t i=beg;i<end;i++)
+  {
+    if(d->entry[i].type >= 0) continue;
+    snprintf(fn, sizeof(fn), "%s/%s", d->dirname, d->buf + d->entry[i].off);
+    d->entry[i].type = fs_isreg_file(fn) || fs_islnk_file(fn);
   }
 }
 
@@ -207,15 +438,39 @@ void dt_db_load_directory(
     dt_log(s_log_err|s_log_db, "could not open directory '%s'!", dirname);
     return;
   }
+  // gather all candidate names in one pass. on most file systems readdir
+  // tells us the type, so we don't need to ask for every file.
+  double beg = dt_time();
+  dt_db_dirent_t dir = { .dirname = dirname };
   struct dirent *ep;
-  db->image_max = 0;
   while((ep = readdir(dp)))
   {
-    if(!fs_isreg(dirname, ep) && !fs_islnk(dirname, ep)) continue;
     if(!dt_db_accept_filename(ep->d_name)) continue;
-    db->image_max++;
+#ifdef _WIN64
+    const int type = -1;
+#else
+    const int type = ep->d_type == DT_REG || ep->d_type == DT_LNK ? 1 : ep->d_type == DT_UNKNOWN ? -1 : 0;
+#endif
+    if(type) dirent_add(&dir, ep->d_name, type);
+  }
+  closedir(dp);
+  // the others we stat in parallel, this helps a lot on network mounts:
+  if(dir.unknown_cnt) threads_parallel_for(0, dir.cnt, 0, dirent_stat, &dir);
+
+  // hash set of the .cfg names in the directory, to find images with sidecar without stat()ing it
+  dt_stringpool_t cfgs;
+  dt_stringpool_init(&cfgs, dir.cnt, 50);
+  for(uint32_t i=0;i<dir.cnt;i++)
+  {
+    const char *name = dir.buf + dir.entry[i].off;
+    const int len = dir.entry[i].len;
+    if(dir.entry[i].type > 0 && len > 4 && !strcasecmp(name + len - 4, ".cfg"))
+      dt_stringpool_get(&cfgs, name, len, 0, 0);
   }
 
+  db->image_max = 0;
+  for(uint32_t i=0;i<dir.cnt;i++) db->image_max += dir.entry[i].type > 0;
+
   db->image = malloc(sizeof(dt_image_t)*db->image_max);
   memset(db->image, 0, sizeof(dt_image_t)*db->image_max);
 
@@ -234,52 +489,48 @@ void dt_db_load_directory(
 
   // the gui thread in main.c starts two background threads creating thumbnails, if needed.
   // thumbnails_load_list() will load the created bc1, triggered in render.cc
-  rewinddir(dp);
-  char cfgfile[1500];
-  clock_t beg = clock();
-  while((ep = readdir(dp)))
+  char cfgfile[1040];
+  for(uint32_t i=0;i<dir.cnt;i++)
   {
-    if(!fs_isreg(dirname, ep) && !fs_islnk(dirname, ep)) continue;
-    if(!dt_db_accept_filename(ep->d_name)) continue;
-
-    const uint32_t imgid = db->image_cnt++;
-    image_init(db->image + imgid);
+    if(dir.entry[i].type <= 0) continue;
+    const char *name = dir.buf + dir.entry[i].off;
+    int ep_len = dir.entry[i].len;
 
     // now reject non-cfg files that have a cfg already:
-    int ep_len = strlen(ep->d_name);
     if(ep_len > 4)
     {
-      snprintf(cfgfile, sizeof(cfgfile), "%s/%s", db->dirname, ep->d_name);
-      int len = strlen(cfgfile);
-      char *f2 = cfgfile + len - 4;
-      if(strcasecmp(f2, ".cfg"))
+      if(strcasecmp(name + ep_len - 4, ".cfg"))
       { // not a cfg itself
-        sprintf(f2+4, ".cfg"); // this would be the corresponding default cfg
-        struct stat statbuf = {0};
-        if(!stat(cfgfile, &statbuf))
-        { // skip this image, it already has a cfg associated with it, we'll load that:
-          db->image_cnt--;
-          continue;
-        }
+        snprintf(cfgfile, sizeof(cfgfile), "%s.cfg", name); // this would be the corresponding default cfg
+        if(dt_stringpool_get(&cfgs, cfgfile, ep_len+4, -1u, 0) != -1u)
+          continue; // skip this image, it already has a cfg associated with it, we'll load that
       }
       else ep_len -= 4; // remove '.cfg' suffix
     }
 
+    const uint32_t imgid = db->image_cnt++;
+    image_init(db->image + imgid);
+
     // add base filename to string pool
-    if(dt_stringpool_get(&db->sp_filename, ep->d_name, ep_len, imgid, &db->image[imgid].filename) == -1u)
+    if(dt_stringpool_get(&db->sp_filename, name, ep_len, imgid, &db->image[imgid].filename) == -1u)
     {
       dt_log(s_log_err|s_log_db, "failed to add filename to index! aborting import.");
       db->image_cnt--;
       break; // no use trying again
     }
   }
-  clock_t end = clock();
-  dt_log(s_log_perf|s_log_db, "time to load images %2.3fs", (end-beg)/(double)CLOCKS_PER_SEC);
+  dt_stringpool_cleanup(&cfgs);
+  free(dir.entry);
+  free(dir.buf);
+  double end = dt_time();
+  dt_log(s_log_perf|s_log_db, "time to load images %2.3fs (%u files, %u stat)", end-beg, dir.cnt, dir.unknown_cnt);
 
-  char dbname[256];
-  snprintf(dbname, sizeof(dbname), "%s/vkdt.db", dirname);
-  dt_db_read(db, dbname);
+  // ratings, labels, sort and filter (imports vkdt.db if it is newer)
+  dt_db_journal_open(db);
 
+  // map cached metadata and refresh it in the background
+  dt_db_meta_open(db);
+  update_filename_rank(db);
   dt_db_update_collection(db);
 }
 
@@ -335,6 +586,8 @@ int dt_db_load_image(
   db->image[imgid].thumbnail = thumbid;
 
   // collect images:
+  dt_db_meta_open(db);
+  update_filename_rank(db);
   dt_db_update_collection(db);
   return 0;
 }
@@ -349,11 +602,161 @@ uint32_t dt_db_current_colid(dt_db_t *db)
   return db->current_colid;
 }
 
+uint32_t dt_db_image_id(dt_db_t *db, const char *basename)
+{
+  if(!db->sp_filename.slot) return -1u;
+  const char *fn = 0;
+  uint32_t imgid = dt_stringpool_get(&db->sp_filename, basename, strlen(basename), -1u, &fn);
+  if(imgid == -1u) return -1u;
+  if(imgid >= db->image_cnt || db->image[imgid].filename != fn)
+  { // removing images moves the others around, the pool only knows the id they were loaded with
+    for(imgid=0;imgid<db->image_cnt && db->image[imgid].filename != fn;imgid++);
+    if(imgid == db->image_cnt) return -1u;
+  }
+  return imgid;
+}
+
 uint32_t dt_db_filename_colid(dt_db_t *db, const char *basename)
+{ // look up the image id in the string pool, then the collection id in the reverse map
+  const uint32_t imgid = dt_db_image_id(db, basename);
+  if(imgid == -1u || !db->colid) return -1u;
+  return db->colid[imgid];
+}
+
+// make room for cnt more images in all per image arrays
+static int
+image_reserve(dt_db_t *db, uint32_t cnt)
 {
-  for(uint32_t i=0;i<db->collection_cnt;i++)
-    if(!strcmp(basename, db->image[db->collection[i]].filename)) return i;
-  return -1u;
+  if(db->image_cnt + (uint64_t)cnt <= db->image_max) return 0;
+  uint64_t max = MAX(db->image_max, 64);
+  while(max < db->image_cnt + (uint64_t)cnt) max *= 2;
+  if(max > 0x7fffffff) return 1;
+  const size_t words = (db->image_max + 63) / 64, new_words = (max + 63) / 64;
+
+  threads_mutex_lock(&db->image_mutex);
+  dt_image_t *image = realloc(db->image, sizeof(dt_image_t)*max);
+  if(image) db->image = image;
+  threads_mutex_unlock(&db->image_mutex);
+  if(!image) return 1;
+  uint32_t *collection = realloc(db->collection, sizeof(uint32_t)*max);
+  if(!collection) return 1;
+  db->collection = collection;
+  db->collection_max = max;
+  uint32_t *selection = realloc(db->selection, sizeof(uint32_t)*max);
+  if(!selection) return 1;
+  db->selection = selection;
+  db->selection_max = max;
+  if(db->colid)
+  { // the reverse maps and filter bits only exist once the collection has been set up
+    uint32_t *colid = realloc(db->colid, sizeof(uint32_t)*max);
+    if(colid) db->colid = colid;
+    uint32_t *selid = realloc(db->selid, sizeof(uint32_t)*max);
+    if(selid) db->selid = selid;
+    if(!colid || !selid) return 1;
+    for(int f=1;f<s_prop_cnt;f++)
+    {
+      uint64_t *bits = realloc(db->filter_bits[f], sizeof(uint64_t)*new_words);
+      if(!bits) return 1;
+      db->filter_bits[f] = bits;
+    }
+    memset(db->colid + db->image_max, 0xff, sizeof(uint32_t)*(max - db->image_max));
+    memset(db->selid + db->image_max, 0xff, sizeof(uint32_t)*(max - db->image_max));
+    for(int f=1;f<s_prop_cnt;f++)
+      memset(db->filter_bits[f] + words, 0, sizeof(uint64_t)*(new_words - words));
+  }
+  db->image_max = max;
+  return 0;
+}
+
+uint32_t dt_db_add_images(dt_db_t *db, const char **name, uint32_t cnt, uint32_t *imgid)
+{
+  for(uint32_t i=0;i<cnt;i++) imgid[i] = -1u;
+  if(image_reserve(db, cnt))
+  {
+    dt_log(s_log_err|s_log_db, "could not allocate memory for %u more images!", cnt);
+    return 0;
+  }
+  uint32_t beg = db->image_cnt;
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    if((imgid[i] = dt_db_image_id(db, name[i])) != -1u) continue; // have it already
+    const uint32_t k = db->image_cnt;
+    const char *fn = 0;
+    // names of images that have been removed are still in the pool, with a stale id
+    dt_stringpool_get(&db->sp_filename, name[i], strlen(name[i]), k, &fn);
+    if(!fn) continue;
+    image_init(db->image + k);
+    db->image[k].filename = fn;
+    db->image_cnt++;
+    dt_db_meta_add(db, k);
+    imgid[i] = k;
+  }
+  if(db->image_cnt == beg) return 0;
+  // existing images keep their order among themselves, so the collection stays sorted
+  update_filename_rank(db);
+  for(uint32_t k=beg;k<db->image_cnt;k++)
+    collection_update_image(db, k);
+  return db->image_cnt - beg;
+}
+
+void dt_db_remove_image(dt_db_t *db, dt_thumbnails_t *thumbnails, uint32_t imgid)
+{
+  if(imgid >= db->image_cnt) return;
+  if(db->colid && db->colid[imgid] != -1u)
+  { // take it out of the collection
+    const uint32_t pos = db->colid[imgid];
+    memmove(db->collection+pos, db->collection+pos+1, sizeof(uint32_t)*(db->collection_cnt-pos-1));
+    db->collection_cnt--;
+    db->colid[imgid] = -1u;
+    for(uint32_t i=pos;i<db->collection_cnt;i++) db->colid[db->collection[i]] = i;
+  }
+  if(db->selid && db->selid[imgid] != -1u)
+  { // and out of the selection
+    const uint32_t i = db->selid[imgid];
+    const uint32_t last = db->selection[--db->selection_cnt];
+    db->selection[i] = last;
+    db->selid[last]  = i;
+    db->selid[imgid] = -1u;
+  }
+  if(db->current_imgid == imgid) db->current_imgid = -1u;
+
+  // the last image takes over the id, as in dt_db_remove_selected_images()
+  const uint32_t keep = --db->image_cnt;
+  const uint32_t gone_th = db->image[imgid].thumbnail;
+  const uint32_t keep_th = db->image[keep].thumbnail;
+  db->image[imgid].thumbnail = -1u;
+  if(gone_th != -1u && gone_th) thumbnails->thumb[gone_th].imgid = -1u;
+  if(imgid != keep)
+  {
+    if(keep_th != -1u && keep_th) thumbnails->thumb[keep_th].imgid = imgid;
+    db->image[imgid] = db->image[keep];
+    if(db->colid)
+    {
+      db->colid[imgid] = db->colid[keep];
+      db->selid[imgid] = db->selid[keep];
+      if(db->colid[imgid] != -1u) db->collection[db->colid[imgid]] = imgid;
+      if(db->selid[imgid] != -1u) db->selection[db->selid[imgid]] = imgid;
+      db->colid[keep] = db->selid[keep] = -1u;
+      for(int f=1;f<s_prop_cnt;f++)
+        filter_bit_set(db->filter_bits[f], imgid, filter_bit(db->filter_bits[f], keep));
+    }
+    if(db->current_imgid == keep) db->current_imgid = imgid;
+  }
+  db->current_colid = db->current_imgid != -1u && db->colid ? db->colid[db->current_imgid] : -1u;
+}
+
+int dt_db_rename_image(dt_db_t *db, uint32_t imgid, const char *basename)
+{
+  if(imgid >= db->image_cnt) return 1;
+  const char *fn = 0;
+  dt_stringpool_get(&db->sp_filename, basename, strlen(basename), imgid, &fn);
+  if(!fn) return 1;
+  db->image[imgid].filename = fn;
+  dt_db_meta_add(db, imgid);
+  update_filename_rank(db);
+  // rating and labels go to the journal under the new name:
+  dt_db_update_image(db, imgid);
+  return 0;
 }
 
 void dt_db_current_set(dt_db_t *db, uint32_t colid)
@@ -377,8 +780,10 @@ void dt_db_selection_add(dt_db_t *db, uint32_t colid)
   db->current_imgid = imgid; // always make current, even if selection is full
   db->current_colid = colid;
   if(db->selection_cnt >= db->selection_max) return;
+  if(db->selid && db->selid[imgid] != -1u) return; // selected already
   int i = db->selection_cnt++;
   db->selection[i] = imgid;
+  if(db->selid) db->selid[imgid] = i;
   db->image[imgid].labels |= s_image_label_selected;
 }
 
@@ -397,16 +802,15 @@ void dt_db_selection_remove(dt_db_t *db, uint32_t colid)
     db->current_imgid = -1u;
     db->current_colid = -1u;
   }
+  if(colid >= db->collection_cnt) return;
   const uint32_t imgid = db->collection[colid];
-  for(int i=0;i<db->selection_cnt;i++)
-  {
-    if(db->selection[i] == imgid)
-    {
-      db->selection[i] = db->selection[--db->selection_cnt];
-      db->image[imgid].labels &= ~s_image_label_selected;
-      return;
-    }
-  }
+  const uint32_t i = db->selid ? db->selid[imgid] : -1u;
+  if(i == -1u) return;
+  const uint32_t last = db->selection[--db->selection_cnt];
+  db->selection[i] = last;
+  db->selid[last]  = i;
+  db->selid[imgid] = -1u;
+  db->image[imgid].labels &= ~s_image_label_selected;
 }
 
 void dt_db_selection_clear(dt_db_t *db)
@@ -415,6 +819,7 @@ void dt_db_selection_clear(dt_db_t *db)
   {
     const uint32_t imgid = db->selection[i];
     db->image[imgid].labels &= ~s_image_label_selected;
+    if(db->selid) db->selid[imgid] = -1u;
     // db->selection[i] = -1u; maybe less memory access is faster
   }
   db->selection_cnt = 0;
@@ -424,26 +829,9 @@ void dt_db_selection_clear(dt_db_t *db)
 
 const uint32_t *dt_db_selection_get(dt_db_t *db)
 {
-  switch(db->collection_sort)
-  { // sync sorting criterion with collection
-  case s_prop_none: case s_prop_cnt:
-    break;
-  case s_prop_filename:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    sort(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filetype, db);
-    break;
-  }
+  // sync sorting criterion with collection
+  sort_images(db, db->selection, db->selection_cnt);
+  if(db->selid) for(uint32_t i=0;i<db->selection_cnt;i++) db->selid[db->selection[i]] = i;
   return db->selection;
 }
 
@@ -537,14 +925,26 @@ int dt_db_image_path(const dt_db_t *db, const uint32_t imgid, char *fn, uint32_t
     return snprintf(fn, maxlen, "%s.cfg", db->image[imgid].filename) >= maxlen;
 }
 
-// add image to named collection/tag
-// get image_path, get hash
-// create directory ~/.config/vkdt/tags/<tag>/ and link <hash> to our image path
+static dt_db_tags_t *
+tags_index(dt_db_t *db)
+{ // read on first use, the folder doesn't need it
+  if(db->tags) return db->tags;
+  char filename[1040], dirname[1040];
+  snprintf(filename, sizeof(filename), "%s/tags.idx", db->basedir);
+  snprintf(dirname,  sizeof(dirname),  "%s/tags",     db->basedir);
+  return db->tags = dt_db_tags_open(filename, dirname);
+}
+
+// add image to named collection/tag:
+// record it in the tag index, and as before create directory ~/.config/vkdt/tags/<tag>/
+// and link <hash> to our image path, so the tag can be opened as a folder.
 // use relative path names in link? still useful if ~/.config top level?
-int dt_db_add_to_collection(const dt_db_t *db, const uint32_t imgid, const char *cname)
+int dt_db_add_to_collection(dt_db_t *db, const uint32_t imgid, const char *cname)
 {
-  char filename[PATH_MAX+100];
+  char filename[PATH_MAX+100], resolved[PATH_MAX];
   dt_db_image_path(db, imgid, filename, sizeof(filename));
+  // tagging from within a tag collection refers to the original image:
+  dt_db_tags_add(tags_index(db), cname, fs_realpath(filename, resolved) ? resolved : filename);
 
   uint64_t hash = hash64(filename);
   char dirname[1040];
@@ -557,6 +957,14 @@ int dt_db_add_to_collection(const dt_db_t *db, const uint32_t imgid, const char
   return 0;
 }
 
+int dt_db_query_tags(dt_db_t *db, const char *query, char *dirname, size_t size)
+{
+  char cachedir[1024];
+  fs_cachedir(cachedir, sizeof(cachedir));
+  if(snprintf(dirname, size, "%s/query", cachedir) >= size) return -1;
+  return dt_db_tags_export(tags_index(db), query, dirname);
+}
+
 void dt_db_remove_selected_images(
     dt_db_t *db,
     dt_thumbnails_t *thumbnails,
@@ -595,7 +1003,9 @@ void dt_db_remove_selected_images(
 
   // select none:
   db->selection_cnt = 0;
-  // freshly filter and sort collection
+  if(db->selid) memset(db->selid, 0xff, sizeof(uint32_t)*db->image_max);
+  // image ids changed, freshly filter and sort collection
+  db->filter_valid = 0;
   dt_db_update_collection(db);
 }
 
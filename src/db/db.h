@@ -27,6 +27,9 @@ typedef struct dt_image_t
   uint32_t    thumbnail; // index into thumbnails->thumb[] or -1u
   uint16_t    rating;    // -1u reject 0 1 2 3 4 5 stars
   uint16_t    labels;    // each bit is one colour label flag, 1<<15 is selected bit
+  uint32_t    meta;      // record in the metadata index, see meta.h
+  uint32_t    fnrank;    // position when sorted by file name, for the sort keys
+  uint64_t    thumbnail_key; // dt_thumbnails_key() if known, 0 otherwise
 }
 dt_image_t;
 
@@ -80,6 +83,18 @@ typedef struct dt_db_t
   // string pool for image file names
   dt_stringpool_t sp_filename;
 
+  // cached metadata such as create date, see meta.h
+  struct dt_db_meta_index_t *meta;
+
+  // ratings and labels on disk, see journal.h
+  struct dt_db_journal_t *journal;
+
+  // changes to the directory while it is open, see watch.h
+  struct dt_db_watch_t *watch;
+
+  // which images carry which tags, in all folders. see tags.h
+  struct dt_db_tags_t *tags;
+
   // TODO: light table edit history
 
   // current sort and filter criteria for collection
@@ -90,11 +105,19 @@ typedef struct dt_db_t
   uint32_t *collection;
   uint32_t  collection_cnt;
   uint32_t  collection_max;
+  uint32_t *colid;                     // imgid -> index into collection or -1u
+
+  // per filter property one bit per image that passes it. only the filters
+  // that changed are evaluated again when updating the collection.
+  uint64_t      *filter_bits[s_prop_cnt];
+  uint64_t       filter_valid;         // bitmask of properties with up to date filter_bits
+  dt_db_filter_t filter_bits_for;      // the filter parameters they have been computed for
 
   // selection
   uint32_t *selection;
   uint32_t  selection_cnt;
   uint32_t  selection_max;
+  uint32_t *selid;                     // imgid -> index into selection or -1u
 
   // currently selected image (when switching to darkroom mode, e.g.)
   uint32_t current_imgid;
@@ -151,7 +174,7 @@ dt_db_accept_filename(
 
 // add image to the list of selected images, O(1).
 void dt_db_selection_add   (dt_db_t *db, uint32_t colid);
-// remove image from the list of selected images, O(N).
+// remove image from the list of selected images, O(1).
 void dt_db_selection_remove(dt_db_t *db, uint32_t colid);
 void dt_db_selection_clear(dt_db_t *db);
 // returns 1 if image is selected, 0 if not
@@ -163,14 +186,27 @@ const uint32_t *dt_db_selection_get(dt_db_t *db);
 uint32_t dt_db_current_imgid(dt_db_t *db);
 // return current collection id (i.e. index into the collection list of imageids, db->collection[.])
 uint32_t dt_db_current_colid(dt_db_t *db);
-// return collection id of given base filename
+// return collection id of given base filename, O(1)
 uint32_t dt_db_filename_colid(dt_db_t *db, const char *basename);
+// return image id of given base filename (without .cfg) or -1u
+uint32_t dt_db_image_id(dt_db_t *db, const char *basename);
+
+// add images to the open directory by base filename, and insert them into the collection.
+// fills imgid with the ids (also of the ones that were there already, -1u on failure)
+// and returns the number of images that are new. may reallocate the image array, so
+// stop the thumbnail threads first (see dt_thumbnails_cache_abort).
+uint32_t dt_db_add_images(dt_db_t *db, const char **name, uint32_t cnt, uint32_t *imgid);
+// remove one image from db, collection and selection. the last image takes over its id.
+void dt_db_remove_image(dt_db_t *db, dt_thumbnails_t *thumbnails, uint32_t imgid);
+// give the image a new base filename, keeping rating, labels, and the thumbnail in memory
+int dt_db_rename_image(dt_db_t *db, uint32_t imgid, const char *basename);
 
 // work with lighttable history
 // TODO: modify image rating w/ adding history
 // TODO: modify image labels w/ adding history
 
-// read and write db config in ascii
+// read and write db config in ascii. the folder's db is kept in binary form (see
+// journal.h), these import it from or export it to text.
 int dt_db_read (dt_db_t *db, const char *filename);
 int dt_db_write(const dt_db_t *db, const char *filename, int append);
 
@@ -178,10 +214,21 @@ int dt_db_write(const dt_db_t *db, const char *filename, int append);
 // return 0 on success, else the buffer was too small.
 int dt_db_image_path(const dt_db_t *db, const uint32_t imgid, char *fn, uint32_t maxlen);
 
-// add image to named collection
-int dt_db_add_to_collection(const dt_db_t *db, const uint32_t imgid, const char *cname);
+// add image to named collection (tag it, see tags.h)
+int dt_db_add_to_collection(dt_db_t *db, const uint32_t imgid, const char *cname);
+// evaluate a tag query such as "best & !blurry" and fill dirname with a folder of the
+// matching images that can be opened as collection. returns the number of images, or
+// -1 if the query does not parse.
+int dt_db_query_tags(dt_db_t *db, const char *query, char *dirname, size_t size);
 // after changing filter and sort criteria, update the collection array
 void dt_db_update_collection(dt_db_t *db);
+// after changing rating or labels of one image, write it to the journal on disk and
+// move it to its new place in the collection (or in or out of it). only touches the
+// entries in between.
+void dt_db_update_image(dt_db_t *db, uint32_t imgid);
+// the same, but leave the collection as it is (darkroom steps through it). the
+// next dt_db_update_collection() filters on the new rating and labels.
+void dt_db_update_image_in_place(dt_db_t *db, uint32_t imgid);
 // remove selection from database. pass del=1 to physically delete from disk
 void dt_db_remove_selected_images(dt_db_t *db, dt_thumbnails_t *th, const int del);
 // sets the current image to given collection id. pass -1u to clear.
@@ -195,5 +242,5 @@ void dt_db_current_set(dt_db_t *db, uint32_t colid);
 void dt_db_duplicate_selected_images(dt_db_t *db);
 // replace the given .cfg (full path name, symlinks resolved) by the corresponding default cfg
 void dt_db_reset_to_defaults(const char *fullfn);
-// convenience function to read create date of an image
-void dt_db_read_createdate(const dt_db_t *db, uint32_t imgid, char createdate[20]);
+// convenience function to read create date of an image (from the metadata index)
+void dt_db_read_createdate(dt_db_t *db, uint32_t imgid, char createdate[20]);
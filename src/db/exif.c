@@ -0,0 +1,318 @@
+#include "exif.h"
+#include "core/fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#define EXIF_MAX_ENTRIES 512 // per directory, sanity limit
+#define EXIF_MAX_DEPTH   4   // nested directories
+
+typedef struct dt_db_exif_tiff_t
+{
+  int      fd;
+  uint64_t base;      // file offset of the tiff header, all offsets are relative to it
+  uint64_t end;       // end of the tiff stream in the file
+  int      be;        // big endian
+  int      rw2;       // panasonic: raw in ifd0, exif in an embedded jpeg
+  uint32_t visited;   // number of directories looked at, against loops
+}
+dt_db_exif_tiff_t;
+
+typedef struct dt_db_exif_ifd_t
+{ // the few entries of one directory that only make sense together
+  uint32_t compression, photometric, subfile;
+  uint32_t wd, ht;
+  uint64_t strip_off, jpeg_off;
+  uint32_t strip_len, jpeg_len;
+}
+dt_db_exif_ifd_t;
+
+int
+dt_db_exif_pread(int fd, void *buf, size_t n, uint64_t off)
+{
+#ifdef _WIN64
+  if(lseek(fd, off, SEEK_SET) != off) return 1;
+  return read(fd, buf, n) != n;
+#else
+  return pread(fd, buf, n, off) != n;
+#endif
+}
+
+static inline uint16_t
+get16(const dt_db_exif_tiff_t *t, const uint8_t *p)
+{
+  return t->be ? (p[0]<<8)|p[1] : (p[1]<<8)|p[0];
+}
+
+static inline uint32_t
+get32(const dt_db_exif_tiff_t *t, const uint8_t *p)
+{
+  return t->be ? ((uint32_t)p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3] : ((uint32_t)p[3]<<24)|(p[2]<<16)|(p[1]<<8)|p[0];
+}
+
+static inline uint32_t
+get32be(const uint8_t *p)
+{
+  return ((uint32_t)p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static uint32_t // integer value of a short or long entry, the first if there are more
+entry_uint(const dt_db_exif_tiff_t *t, const uint8_t *e)
+{
+  const uint16_t type = get16(t, e+2);
+  if(type == 3) return get16(t, e+8);
+  if(type == 4 || type == 9 || type == 13) return get32(t, e+8);
+  if(type == 1 || type == 7) return e[8];
+  return 0;
+}
+
+static float // value of a rational entry
+entry_rational(const dt_db_exif_tiff_t *t, const uint8_t *e)
+{
+  const uint16_t type = get16(t, e+2);
+  if(type != 5 && type != 10) return entry_uint(t, e);
+  uint8_t v[8];
+  if(dt_db_exif_pread(t->fd, v, 8, t->base + get32(t, e+8))) return 0.0f;
+  const uint32_t num = get32(t, v), den = get32(t, v+4);
+  if(!den) return 0.0f;
+  if(type == 10) return (int32_t)num / (float)(int32_t)den;
+  return num / (float)den;
+}
+
+static void // ascii entry to null terminated string, trailing spaces removed
+entry_string(const dt_db_exif_tiff_t *t, const uint8_t *e, char *dst, size_t size)
+{
+  const uint32_t cnt = get32(t, e+4);
+  size_t len = cnt < size ? cnt : size-1;
+  if(cnt <= 4) memcpy(dst, e+8, len);
+  else if(dt_db_exif_pread(t->fd, dst, len, t->base + get32(t, e+8))) len = 0;
+  dst[len] = 0;
+  for(int i=strnlen(dst, len)-1;i>=0 && dst[i] == ' ';i--) dst[i] = 0;
+}
+
+static void
+exif_preview(dt_db_exif_t *exif, uint64_t off, uint32_t len)
+{ // keep the largest one
+  if(off && len > exif->preview_len)
+  {
+    exif->preview_off = off;
+    exif->preview_len = len;
+  }
+}
+
+static void
+exif_dim(dt_db_exif_t *exif, uint32_t wd, uint32_t ht)
+{ // keep the largest one
+  if((uint64_t)wd*ht > (uint64_t)exif->wd*exif->ht)
+  {
+    exif->wd = wd;
+    exif->ht = ht;
+  }
+}
+
+static int exif_tiff(int fd, uint64_t base, uint64_t end, dt_db_exif_t *exif);
+static int exif_jpeg(int fd, uint64_t off, uint64_t end, dt_db_exif_t *exif);
+
+static void
+exif_ifd(dt_db_exif_tiff_t *t, uint32_t off, int depth, dt_db_exif_t *exif)
+{
+  while(off && depth < EXIF_MAX_DEPTH && t->visited++ < 64)
+  {
+    uint8_t b[2], e[12*EXIF_MAX_ENTRIES];
+    if(t->base + off + 2 > t->end || dt_db_exif_pread(t->fd, b, 2, t->base + off)) return;
+    uint32_t cnt = get16(t, b);
+    if(cnt > EXIF_MAX_ENTRIES) return;
+    // read all entries and the offset of the next directory in one go:
+    if(dt_db_exif_pread(t->fd, e, 12*cnt, t->base + off + 2)) return;
+    dt_db_exif_ifd_t ifd = {0};
+    for(uint32_t i=0;i<cnt;i++)
+    {
+      const uint8_t *en = e + 12*i;
+      switch(get16(t, en))
+      {
+      case 0x002e: // panasonic JpgFromRaw, has the exif data
+        if(t->rw2) exif_jpeg(t->fd, t->base + get32(t, en+8), t->base + get32(t, en+8) + get32(t, en+4), exif);
+        break;
+      case 0x00fe: ifd.subfile     = entry_uint(t, en); break;
+      case 0x0100: ifd.wd          = entry_uint(t, en); break;
+      case 0x0101: ifd.ht          = entry_uint(t, en); break;
+      case 0x0103: ifd.compression = entry_uint(t, en); break;
+      case 0x0106: ifd.photometric = entry_uint(t, en); break;
+      case 0x010f: if(!exif->maker[0]) entry_string(t, en, exif->maker, sizeof(exif->maker)); break;
+      case 0x0110: if(!exif->model[0]) entry_string(t, en, exif->model, sizeof(exif->model)); break;
+      case 0x0111: if(get32(t, en+4) == 1) ifd.strip_off = t->base + entry_uint(t, en); break;
+      case 0x0117: if(get32(t, en+4) == 1) ifd.strip_len = entry_uint(t, en); break;
+      case 0x0112: if(!exif->orientation) exif->orientation = entry_uint(t, en); break;
+      case 0x0132: // DateTime, modification date, only if there is nothing better
+        if(!exif->createdate[0]) entry_string(t, en, exif->createdate, sizeof(exif->createdate));
+        break;
+      case 0x014a: // SubIFDs, raw data and previews
+      {
+        const uint32_t n = get32(t, en+4);
+        if(n == 1) exif_ifd(t, get32(t, en+8), depth+1, exif);
+        else if(n <= 8)
+        {
+          uint8_t o[32];
+          if(!dt_db_exif_pread(t->fd, o, 4*n, t->base + get32(t, en+8)))
+            for(uint32_t k=0;k<n;k++) exif_ifd(t, get32(t, o+4*k), depth+1, exif);
+        }
+        break;
+      }
+      case 0x0201: ifd.jpeg_off = t->base + entry_uint(t, en); break;
+      case 0x0202: ifd.jpeg_len = entry_uint(t, en); break;
+      case 0x8769: exif_ifd(t, entry_uint(t, en), depth+1, exif); break; // exif
+      case 0x829a: exif->exposure     = entry_rational(t, en); break;
+      case 0x829d: exif->aperture     = entry_rational(t, en); break;
+      case 0x8827: exif->iso          = entry_uint(t, en); break;
+      case 0x9003: entry_string(t, en, exif->createdate, sizeof(exif->createdate)); break; // DateTimeOriginal
+      case 0x920a: exif->focal_length = entry_rational(t, en); break;
+      case 0xa002: ifd.wd = entry_uint(t, en); break; // PixelXDimension, in the exif directory
+      case 0xa003: ifd.ht = entry_uint(t, en); break;
+      }
+    }
+    exif_dim(exif, ifd.wd, ifd.ht);
+    exif_preview(exif, ifd.jpeg_off, ifd.jpeg_len);
+    // jpeg strips that are not the raw data itself (lossless jpeg in dng has the cfa or linear raw photometric)
+    if((ifd.compression == 6 || (ifd.compression == 7 && ifd.photometric != 32803 && ifd.photometric != 34892)) &&
+       !(ifd.subfile & ~1u))
+      exif_preview(exif, ifd.strip_off, ifd.strip_len);
+    // only the top level has a chain of directories (ifd0 -> ifd1 thumbnail)
+    if(depth || dt_db_exif_pread(t->fd, e, 4, t->base + off + 2 + 12*cnt)) return;
+    off = get32(t, e);
+  }
+}
+
+static int // parse a tiff stream starting at base
+exif_tiff(int fd, uint64_t base, uint64_t end, dt_db_exif_t *exif)
+{
+  uint8_t h[8];
+  if(base + 8 > end || dt_db_exif_pread(fd, h, 8, base)) return 1;
+  dt_db_exif_tiff_t t = { .fd = fd, .base = base, .end = end };
+  if     (h[0] == 'I' && h[1] == 'I') t.be = 0;
+  else if(h[0] == 'M' && h[1] == 'M') t.be = 1;
+  else return 1;
+  const uint16_t magic = get16(&t, h+2);
+  // tiff, olympus orf, panasonic rw2:
+  if(magic != 42 && magic != 0x4f52 && magic != 0x5352 && magic != 0x55) return 1;
+  t.rw2 = magic == 0x55;
+  exif_ifd(&t, get32(&t, h+4), 0, exif);
+  return 0;
+}
+
+static int // find the exif app1 segment in a jpeg at off
+exif_jpeg(int fd, uint64_t off, uint64_t end, dt_db_exif_t *exif)
+{
+  uint8_t m[10];
+  if(dt_db_exif_pread(fd, m, 2, off) || m[0] != 0xff || m[1] != 0xd8) return 1;
+  off += 2;
+  for(int i=0;i<32 && off + 4 <= end;i++)
+  {
+    if(dt_db_exif_pread(fd, m, 4, off) || m[0] != 0xff) return 1;
+    if(m[1] == 0xda || m[1] == 0xd9) return 1; // image data starts, no exif
+    const uint32_t len = (m[2]<<8)|m[3];
+    if(m[1] == 0xe1 && len >= 8 && !dt_db_exif_pread(fd, m, 6, off + 4) && !memcmp(m, "Exif\0\0", 6))
+      return exif_tiff(fd, off + 10, off + 2 + len, exif);
+    off += 2 + len;
+  }
+  return 1;
+}
+
+static int // canon cr3: iso base media, the tiff directories are boxes in a canon uuid box in moov
+exif_cr3(int fd, uint64_t end, dt_db_exif_t *exif)
+{
+  static const uint8_t canon[16] = {0x85,0xc0,0xb6,0x87,0x82,0x0f,0x11,0xe0,0x81,0x11,0xf4,0xce,0x46,0x2b,0x6a,0x48};
+  static const uint8_t preview[16] = {0xea,0xf4,0x2b,0x5e,0x1c,0x98,0x4b,0x88,0xb9,0xfb,0xb7,0xdc,0x40,0x6e,0x4d,0x16};
+  // ends of the boxes we descended into, [0] is the file. the preview box
+  // comes after moov on the top level, so we need to find our way back up.
+  uint64_t off = 0, box_end[4] = {end};
+  int depth = 0, found = 0;
+  for(int i=0;i<64;i++)
+  {
+    while(depth && off + 8 > box_end[depth]) off = box_end[depth--]; // done with this one
+    if(off + 8 > box_end[depth]) break;
+    uint8_t b[32];
+    if(dt_db_exif_pread(fd, b, 8, off)) break;
+    uint64_t size = get32be(b), hdr = 8;
+    if(size == 1)
+    { // 64-bit size
+      if(dt_db_exif_pread(fd, b+8, 8, off+8)) break;
+      size = ((uint64_t)get32be(b+8)<<32) | get32be(b+12);
+      hdr = 16;
+    }
+    else if(size == 0) size = box_end[depth] - off;
+    if(size < hdr || off + size > box_end[depth]) break;
+    if(!memcmp(b+4, "moov", 4) && depth < 3)
+    { // descend
+      box_end[++depth] = off + size;
+      off += hdr;
+      continue;
+    }
+    if(!memcmp(b+4, "uuid", 4) && !dt_db_exif_pread(fd, b+16, 16, off+hdr))
+    {
+      if(!memcmp(b+16, canon, 16) && depth < 3)
+      { // descend
+        box_end[++depth] = off + size;
+        off += hdr + 16;
+        continue;
+      }
+      if(!memcmp(b+16, preview, 16))
+      { // 8 bytes of something, then the PRVW box with a few words of header before the jpeg
+        uint8_t p[32];
+        const uint64_t poff = off + hdr + 16 + 8;
+        if(!dt_db_exif_pread(fd, p, 32, poff) && !memcmp(p+4, "PRVW", 4))
+          for(int k=8;k<30;k++) if(p[k] == 0xff && p[k+1] == 0xd8)
+          {
+            exif_preview(exif, poff + k, get32be(p) - k);
+            break;
+          }
+      }
+    }
+    if(!memcmp(b+4, "CMT1", 4) || !memcmp(b+4, "CMT2", 4))
+      found |= !exif_tiff(fd, off + hdr, off + size, exif);
+    off += size;
+  }
+  return !found;
+}
+
+int dt_db_exif_read(const char *filename, dt_db_exif_t *exif)
+{
+  memset(exif, 0, sizeof(*exif));
+  int err = 1;
+  int fd = open(filename, O_RDONLY|O_BINARY);
+  if(fd < 0) goto date;
+  struct stat sb;
+  if(fstat(fd, &sb)) goto done;
+  const uint64_t end = sb.st_size;
+  uint8_t h[16];
+  if(dt_db_exif_pread(fd, h, 16, 0)) goto done;
+  if(!memcmp(h, "FUJIFILMCCD-RAW", 15))
+  { // fuji raf: big endian offset and length of a jpeg with the exif data
+    uint8_t r[8];
+    if(!dt_db_exif_pread(fd, r, 8, 84))
+    {
+      exif_preview(exif, get32be(r), get32be(r+4));
+      err = exif_jpeg(fd, get32be(r), get32be(r) + get32be(r+4), exif);
+    }
+  }
+  else if(h[0] == 0xff && h[1] == 0xd8) err = exif_jpeg(fd, 0, end, exif);
+  else if(!memcmp(h+4, "ftyp", 4))      err = exif_cr3(fd, end, exif);
+  else                                  err = exif_tiff(fd, 0, end, exif);
+done:
+  close(fd);
+date:
+  // the date has to look like a date, some cameras write spaces or zeros:
+  if(exif->createdate[0] < '1' || exif->createdate[0] > '9' || strlen(exif->createdate) != 19)
+    fs_createdate(filename, exif->createdate);
+  // garbage in broken files:
+  if(exif->orientation > 8) exif->orientation = 0;
+  return err;
+}
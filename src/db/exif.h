@@ -1,80 +1,33 @@
 #pragma once
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
 
-// fake exif extraction unit. so far we extract the exif tag 0x9004 CreateDate (or similar)
-// admittedly the matching is a bit fuzzy, as you will observe:
-static inline int
-dt_db_exif_mini(
-    const char *filename,
-    char       *createdate,  // size is always 20
-    char       *model,
-    size_t      model_size)
-{
-  FILE *f = fopen(filename, "rb");
-  if(!f) return 1;
-
-  char buf[512];
-
-  fread(buf, sizeof(buf), 1, f);
-  fclose(f);
-
-  // scan for maker model as follows:
-  // SONY..ILCE-7M3
-  // FUJIFILM..X100F (not at position 0)
-  // Canon.Canon MODEL (search for "Canon ")
-  // NIKON CORPORATION...NIKON MODEL (discard the one with corporation)
-
-  for(int i=4;i<sizeof(buf)-20;i++)
-  { // check maker/model
-    if(!strncmp(buf+i, "SONY", 4))
-      i += 1 + snprintf(model, model_size, "Sony %s", buf+i+6);
-    else if(!strncmp(buf+i, "FUJIFILM", 8))
-      i += 1 + snprintf(model, model_size, "Fujifilm %s", buf+i+10);
-    else if(!strncmp(buf+i, "Canon", 5))
-      i += 6 + snprintf(model, model_size, "%s", buf+i+6);
-    else if(!strncmp(buf+i, "NIKON CORP", 10))
-      i += 18;
-    else if(!strncmp(buf+i, "NIKON ", 6))
-      i += snprintf(model, model_size, "%s", buf+i);
-    else
-    { // check for date string:
-      if(buf[i+4] != ':') continue;
-      if(buf[i+7] != ':') continue;
-      if(buf[i+13] != ':') continue;
-      if(buf[i+16] != ':') continue;
-      if(buf[i+10] != ' ') continue;
-
-#define NNUM(b) (buf[i+b] < '0' || buf[i+b] > '9')
-      if(NNUM(0)) continue;
-      if(NNUM(1)) continue;
-      if(NNUM(2)) continue;
-      if(NNUM(3)) continue;
+// minimal exif reader for the metadata index. this walks the tiff image file
+// directories of the raw formats we accept (most are tiff with a few quirks,
+// cr3 is iso media, raf and jpg carry a tiff inside a jpeg app1 segment) and
+// only reads the directory entries and values it needs, with pread(). no
+// maker notes, no full parsing, no allocations.
 
-      if(NNUM(5)) continue;
-      if(NNUM(6)) continue;
-
-      if(NNUM(8)) continue;
-      if(NNUM(9)) continue;
-      
-      if(NNUM(11)) continue;
-      if(NNUM(12)) continue;
-
-      if(NNUM(14)) continue;
-      if(NNUM(15)) continue;
-
-      if(NNUM(17)) continue;
-      if(NNUM(18)) continue;
-#undef NNUM
-
-      memcpy(createdate, buf+i, 19);
-      createdate[19] = 0;
-      // fprintf(stderr, "create date %s model %s\n", createdate, model);
-      return 0;
-    }
-  }
-  fs_createdate(filename, createdate);
-  return 1;
+typedef struct dt_db_exif_t
+{
+  char     createdate[20]; // DateTimeOriginal as yyyy:mm:dd hh:mm:ss
+  char     maker[32];
+  char     model[64];
+  uint32_t orientation;    // exif orientation 1..8, 0 if unknown
+  uint32_t iso;
+  float    exposure;       // in seconds
+  float    aperture;       // f-number
+  float    focal_length;   // in mm
+  uint64_t preview_off;    // file offset of the largest embedded jpeg, 0 if none
+  uint32_t preview_len;    // its size in bytes
+  uint32_t wd, ht;         // largest image in the file (usually the raw data), 0 if unknown
 }
+dt_db_exif_t;
+
+// read what we can find. if there is no create date in the file, the
+// modification time of the file is used. returns non-zero if the file
+// could not be parsed at all.
+int dt_db_exif_read(const char *filename, dt_db_exif_t *exif);
 
+// pread() with a fallback for windows. returns 0 if all n bytes were read.
+int dt_db_exif_pread(int fd, void *buf, size_t n, uint64_t off);
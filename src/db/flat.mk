@@ -1,12 +1,25 @@
 DB_O=\
+db/archive.o\
 db/db.o\
+db/exif.o\
+db/journal.o\
+db/meta.o\
+db/preview.o\
 db/rc.o\
-db/thumbnails.o
+db/tags.o\
+db/thumbnails.o\
+db/watch.o
 DB_H=\
+db/archive.h\
 db/db.h\
 db/exif.h\
 db/hash.h\
+db/journal.h\
+db/meta.h\
+db/preview.h\
 db/thumbnails.h\
-db/stringpool.h
-DB_CFLAGS=
-DB_LDFLAGS=
+db/stringpool.h\
+db/tags.h\
+db/watch.h
+DB_CFLAGS=$(VKDT_JPEG_CFLAGS)
+DB_LDFLAGS=$(VKDT_JPEG_LDFLAGS)
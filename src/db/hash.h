@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+#include <string.h>
 
 // quick hacky uncryptographic 64-bit hash from https://stackoverflow.com/questions/13325125/lightweight-8-byte-hash-function-algorithm
 static inline uint64_t
@@ -16,3 +18,53 @@ hash64(const char *str)
 {
   return hash64_l(str, -1ul);
 }
+
+// fnv-1a with the murmur3 finalizer. slower, but mixes well enough that the
+// hash can be used as the only key (with no string to compare against).
+// hash64() collides a lot on file names that differ in one or two digits.
+static inline uint64_t
+hash64_key_l(const char *str, size_t l)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for(size_t i=0;i<l&&*str;i++) h = (h ^ (uint8_t)*str++) * 0x100000001b3ull;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t
+hash64_key(const char *str)
+{
+  return hash64_key_l(str, -1ul);
+}
+
+// hash of binary data, 8 bytes at a time (murmur3 style mixing, same
+// finalizer as above). chain calls by passing the previous hash as seed.
+static inline uint64_t
+hash64_data(const void *data, size_t len, uint64_t seed)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ull), k;
+  for(;len>=8;len-=8,p+=8)
+  {
+    memcpy(&k, p, 8);
+    k *= 0x87c37b91114253d5ull;
+    k  = (k << 31) | (k >> 33);
+    k *= 0x4cf5ad432745937full;
+    h ^= k;
+    h  = (h << 27) | (h >> 37);
+    h  = h*5 + 0x52dce729;
+  }
+  k = 0;
+  memcpy(&k, p, len);
+  h ^= k * 0x87c37b91114253d5ull;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
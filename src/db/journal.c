@@ -0,0 +1,247 @@
+#include "db.h"
+#include "journal.h"
+#include "hash.h"
+#include "core/core.h"
+#include "core/log.h"
+#include "core/fs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN64
+#include <sys/mman.h>
+#endif
+
+#define DT_DB_JOURNAL_VERSION 1
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct dt_db_journal_header_t
+{
+  char           magic[8];  // "vkdtdbj"
+  uint32_t       version;
+  uint32_t       snap_cnt;  // number of records in the snapshot, the journal follows
+  uint32_t       sort;      // dt_db_property_t
+  uint32_t       pad;
+  dt_db_filter_t filter;
+}
+dt_db_journal_header_t;
+
+typedef struct dt_db_journal_record_t
+{
+  uint64_t hash;            // hash64_key() of the image file name
+  uint16_t rating;
+  uint16_t labels;          // without the selected bit
+  uint32_t pad;
+}
+dt_db_journal_record_t;
+
+typedef struct dt_db_journal_t
+{
+  int      fd;              // open for appending records
+  uint32_t snap_cnt;        // records in the snapshot
+  uint32_t journal_cnt;     // records appended after it
+  char     filename[1040];
+}
+dt_db_journal_t;
+
+static int
+journal_write(int fd, const void *buf, size_t size)
+{
+  const char *c = buf;
+  while(size)
+  {
+    const ssize_t w = write(fd, c, size);
+    if(w <= 0) return 1;
+    c += w;
+    size -= w;
+  }
+  return 0;
+}
+
+static dt_db_journal_record_t
+journal_record(const dt_db_t *db, uint32_t imgid)
+{
+  return (dt_db_journal_record_t) {
+    .hash   = hash64_key(db->image[imgid].filename),
+    .rating = db->image[imgid].rating,
+    .labels = db->image[imgid].labels & ~s_image_label_selected,
+  };
+}
+
+static void
+journal_apply(dt_db_t *db, const dt_db_journal_record_t *rec, uint32_t cnt)
+{ // hash table of image file names to find the records quickly
+  uint32_t size = 64;
+  while(size < 2*db->image_cnt) size <<= 1;
+  uint64_t *key = calloc(sizeof(uint64_t), size);
+  uint32_t *val = malloc(sizeof(uint32_t)*size);
+  for(uint32_t i=0;i<db->image_cnt;i++)
+  {
+    const uint64_t h = hash64_key(db->image[i].filename);
+    uint32_t k = h & (size-1);
+    while(key[k] && key[k] != h) k = (k+1) & (size-1);
+    key[k] = h;
+    val[k] = i;
+  }
+  for(uint32_t r=0;r<cnt;r++)
+  {
+    uint32_t k = rec[r].hash & (size-1);
+    while(key[k] && key[k] != rec[r].hash) k = (k+1) & (size-1);
+    if(!key[k]) continue; // image is gone
+    db->image[val[k]].rating = rec[r].rating;
+    db->image[val[k]].labels = (db->image[val[k]].labels & s_image_label_selected) | rec[r].labels;
+  }
+  free(key);
+  free(val);
+}
+
+void dt_db_journal_open(dt_db_t *db)
+{
+  if(!db->dirname[0]) return; // single image
+  dt_db_journal_t *j = calloc(sizeof(dt_db_journal_t), 1);
+  j->fd = -1;
+  db->journal = j;
+  snprintf(j->filename, sizeof(j->filename), "%s/vkdt.dbj", db->dirname);
+  char txtname[1040];
+  snprintf(txtname, sizeof(txtname), "%s/vkdt.db", db->dirname);
+
+  struct stat sb = {0}, st = {0};
+  const int have_bin = !stat(j->filename, &sb);
+  const int have_txt = !stat(txtname, &st);
+  if(have_txt && (!have_bin || st.st_mtime > sb.st_mtime))
+  { // import text version, written by hand or by an older version
+    dt_db_read(db, txtname);
+    if(!dt_db_journal_compact(db))
+      dt_log(s_log_db, "imported `%s'", txtname);
+    return;
+  }
+  if(!have_bin) goto create;
+
+  int fd = open(j->filename, O_RDWR|O_BINARY);
+  if(fd < 0) goto create;
+  const size_t size = sb.st_size;
+  const dt_db_journal_header_t *hdr = 0;
+#ifndef _WIN64
+  void *m = size >= sizeof(*hdr) ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if(m != MAP_FAILED) hdr = m;
+#else
+  void *m = size >= sizeof(*hdr) ? malloc(size) : 0;
+  if(m && read(fd, m, size) == size) hdr = m;
+#endif
+  if(!hdr || memcmp(hdr->magic, "vkdtdbj", 8) || hdr->version != DT_DB_JOURNAL_VERSION)
+  {
+    dt_log(s_log_db|s_log_err, "`%s' is corrupt, starting from scratch", j->filename);
+    close(fd);
+    goto unmap;
+  }
+  // a record that was cut short by a crash is ignored (and overwritten)
+  const uint32_t cnt = (size - sizeof(*hdr)) / sizeof(dt_db_journal_record_t);
+  j->snap_cnt    = MIN(hdr->snap_cnt, cnt);
+  j->journal_cnt = cnt - j->snap_cnt;
+  db->collection_sort   = hdr->sort < s_prop_cnt ? hdr->sort : s_prop_filename;
+  db->collection_filter = hdr->filter;
+  journal_apply(db, (const dt_db_journal_record_t *)(hdr + 1), cnt);
+  j->fd = fd;
+  lseek(fd, sizeof(*hdr) + sizeof(dt_db_journal_record_t)*(size_t)cnt, SEEK_SET);
+unmap:
+#ifndef _WIN64
+  if(m != MAP_FAILED) munmap(m, size);
+#else
+  free(m);
+#endif
+  if(j->fd >= 0) return;
+create:
+  dt_db_journal_compact(db);
+}
+
+void dt_db_journal_close(dt_db_t *db)
+{
+  dt_db_journal_t *j = db->journal;
+  if(!j) return;
+  if(j->journal_cnt > j->snap_cnt) dt_db_journal_compact(db);
+  else if(j->fd >= 0)
+  { // only update sort and filter in the header
+    dt_db_journal_header_t hdr = {
+      .magic    = "vkdtdbj",
+      .version  = DT_DB_JOURNAL_VERSION,
+      .snap_cnt = j->snap_cnt,
+      .sort     = db->collection_sort,
+      .filter   = db->collection_filter,
+    };
+    if(lseek(j->fd, 0, SEEK_SET) || journal_write(j->fd, &hdr, sizeof(hdr)))
+      dt_log(s_log_db|s_log_err, "could not write `%s'", j->filename);
+  }
+  if(j->fd >= 0) close(j->fd);
+  free(j);
+  db->journal = 0;
+}
+
+void dt_db_journal_image(dt_db_t *db, uint32_t imgid)
+{
+  dt_db_journal_t *j = db->journal;
+  if(!j || j->fd < 0 || imgid >= db->image_cnt) return;
+  const dt_db_journal_record_t rec = journal_record(db, imgid);
+  if(journal_write(j->fd, &rec, sizeof(rec)))
+  {
+    dt_log(s_log_db|s_log_err, "could not append to `%s'", j->filename);
+    return;
+  }
+  // keep the file small, but don't compact all the time in small folders:
+  if(++j->journal_cnt > MAX(4096, 2*j->snap_cnt)) dt_db_journal_compact(db);
+}
+
+int dt_db_journal_compact(dt_db_t *db)
+{
+  dt_db_journal_t *j = db->journal;
+  if(!j) return 1;
+  char tmpname[1050];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", j->filename);
+  int fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  if(fd < 0) goto error;
+
+  dt_db_journal_header_t hdr = {
+    .magic   = "vkdtdbj",
+    .version = DT_DB_JOURNAL_VERSION,
+    .sort    = db->collection_sort,
+    .filter  = db->collection_filter,
+  };
+  for(uint32_t i=0;i<db->image_cnt;i++)
+    hdr.snap_cnt += db->image[i].rating || (db->image[i].labels & ~s_image_label_selected);
+  dt_db_journal_record_t *rec = malloc(sizeof(hdr) + sizeof(*rec)*(size_t)hdr.snap_cnt);
+  memcpy(rec, &hdr, sizeof(hdr));
+  dt_db_journal_record_t *r = (dt_db_journal_record_t *)((char *)rec + sizeof(hdr));
+  for(uint32_t i=0;i<db->image_cnt;i++)
+    if(db->image[i].rating || (db->image[i].labels & ~s_image_label_selected))
+      *r++ = journal_record(db, i);
+  const int err = journal_write(fd, rec, sizeof(hdr) + sizeof(*rec)*(size_t)hdr.snap_cnt);
+  free(rec);
+  if(err) goto error;
+#ifdef _WIN64
+  close(fd); // can't rename or delete open files
+  fd = -1;
+  if(j->fd >= 0) close(j->fd);
+  j->fd = -1;
+  unlink(j->filename);
+  if(rename(tmpname, j->filename)) goto error;
+  fd = open(j->filename, O_RDWR|O_BINARY);
+  if(fd < 0) goto error;
+  lseek(fd, 0, SEEK_END);
+#else
+  if(rename(tmpname, j->filename)) goto error;
+#endif
+  if(j->fd >= 0) close(j->fd);
+  j->fd = fd;
+  j->snap_cnt = hdr.snap_cnt;
+  j->journal_cnt = 0;
+  return 0;
+error:
+  dt_log(s_log_db|s_log_err, "could not write `%s'", j->filename);
+  if(fd >= 0) close(fd);
+  unlink(tmpname);
+  return 1;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+// binary version of vkdt.db: star ratings, colour labels, sort and filter
+// criteria of one folder. the file vkdt.dbj next to the images holds a
+// header with sort and filter, a snapshot of all images with non-zero rating
+// or labels, and then an append-only journal of changes. every change to an
+// image appends one fixed size record, so it's on disk right away without
+// rewriting anything. when the journal grows larger than the snapshot, the
+// file is compacted into a fresh snapshot.
+//
+// if there is a text vkdt.db that is newer than the binary one (or the binary
+// one does not exist), the text version is imported instead.
+
+typedef struct dt_db_t dt_db_t;
+
+// read ratings, labels, sort and filter for the directory of the db and keep
+// the file open for appending. call after all images have been added.
+void dt_db_journal_open(dt_db_t *db);
+
+// write sort and filter criteria, compact if the journal is long, and close
+void dt_db_journal_close(dt_db_t *db);
+
+// append the current rating and labels of the image to the journal
+void dt_db_journal_image(dt_db_t *db, uint32_t imgid);
+
+// rewrite the file with a snapshot of the current state and an empty journal.
+// returns non-zero on failure.
+int dt_db_journal_compact(dt_db_t *db);
@@ -0,0 +1,421 @@
+#include "db.h"
+#include "meta.h"
+#include "hash.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/threads.h"
+#include "pipe/graph-defaults.h"
+#include "exif.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN64
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
+#define DT_DB_META_VERSION 5
+#define DT_DB_META_THREADS 2
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct dt_db_meta_header_t
+{ // first record of the file, same size as the others so they stay aligned
+  char     magic[8];   // "vkdtmeta"
+  uint32_t version;
+  uint32_t cap;        // number of records following the header, power of two
+  uint8_t  pad[sizeof(dt_db_meta_t)-16];
+}
+dt_db_meta_header_t;
+
+typedef enum dt_db_meta_state_t
+{
+  s_meta_unchecked = 0, // record may be missing or stale
+  s_meta_busy      = 1, // somebody is refreshing it right now
+  s_meta_valid     = 2, // checked against the file in this session
+}
+dt_db_meta_state_t;
+
+typedef struct dt_db_meta_index_t
+{
+  dt_db_meta_header_t *header;    // start of the mapped file
+  dt_db_meta_t        *rec;       // cap records right after the header
+  uint32_t             cap;
+  uint32_t             used;      // records with a hash
+  size_t               size;      // in bytes, including the header
+  int                  fd;        // backing file or -1 if we only live in memory
+  const char         **filename;  // per record: file name in the db string pool, or 0 if unused
+  atomic_uchar        *state;     // per record, dt_db_meta_state_t
+  atomic_int           abort;     // set to make the background threads leave early
+  atomic_int           running;   // number of records the background threads are working on right now
+  atomic_int           ref;       // the db and every background task, the last one frees the struct
+  char                 dirname[1024];
+  char                 path[1040];
+}
+dt_db_meta_index_t;
+
+static uint64_t // hash of the file name, with the duplicate suffix _01 stripped
+meta_key(const char *filename)
+{
+  int len = strlen(filename);
+  if(len > 3 && filename[len-3] == '_' && isdigit(filename[len-2]) && isdigit(filename[len-1]))
+    len -= 3;
+  const uint64_t h = hash64_key_l(filename, len);
+  return h ? h : 1; // zero marks empty slots
+}
+
+static uint32_t // find the record for the key, or the empty slot where it would go
+meta_find(const dt_db_meta_t *rec, uint32_t cap, uint64_t key)
+{
+  uint32_t k = key & (cap-1);
+  while(rec[k].hash && rec[k].hash != key) k = (k+1) & (cap-1);
+  return k;
+}
+
+static void
+meta_unmap(dt_db_meta_index_t *idx)
+{
+  if(!idx->header) goto done;
+#ifndef _WIN64
+  if(idx->fd >= 0) munmap(idx->header, idx->size);
+  else free(idx->header);
+#else
+  if(idx->fd >= 0)
+  { // no shared mappings here, write it all back
+    lseek(idx->fd, 0, SEEK_SET);
+    if(write(idx->fd, idx->header, idx->size) != idx->size)
+      dt_log(s_log_db|s_log_err, "could not write metadata index `%s'", idx->path);
+  }
+  free(idx->header);
+#endif
+  idx->header = 0;
+  idx->rec = 0;
+done:
+  if(idx->fd >= 0) close(idx->fd);
+  idx->fd = -1;
+}
+
+static int // open and lock the backing file, -1 if we can't have it to ourselves
+meta_open_file(const char *path)
+{
+  int fd = open(path, O_RDWR|O_CREAT|O_BINARY, 0644);
+  if(fd < 0)
+  {
+    dt_log(s_log_db|s_log_err, "could not open metadata index `%s'", path);
+    return -1;
+  }
+#ifndef _WIN64
+  if(flock(fd, LOCK_EX|LOCK_NB))
+  { // another instance has the folder open, it may resize the file under our feet
+    dt_log(s_log_db, "metadata index `%s' is in use by another process", path);
+    close(fd);
+    return -1;
+  }
+#endif
+  return fd;
+}
+
+static int // map size bytes of the backing file (or anonymous memory if there is none)
+meta_map(dt_db_meta_index_t *idx, size_t size)
+{
+  idx->size = size;
+#ifndef _WIN64
+  if(idx->fd >= 0)
+  {
+    void *m = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, idx->fd, 0);
+    idx->header = m == MAP_FAILED ? 0 : m;
+  }
+  else idx->header = calloc(size, 1);
+#else
+  idx->header = calloc(size, 1);
+  if(idx->fd >= 0)
+  {
+    lseek(idx->fd, 0, SEEK_SET);
+    if(read(idx->fd, idx->header, size) < 0) memset(idx->header, 0, size);
+  }
+#endif
+  if(!idx->header) return 1;
+  idx->rec = (dt_db_meta_t *)(idx->header + 1);
+  return 0;
+}
+
+void dt_db_meta_image_filename(const char *cfg, char *fn, size_t size)
+{
+  fn[0] = 0;
+  fs_realpath(cfg, fn); // tags are symlinks to the cfg next to the image
+  if(!fn[0]) snprintf(fn, size, "%s", cfg);
+  size_t len = strnlen(fn, size);
+  if(len > 4) fn[len -= 4] = 0; // strip .cfg
+  if(len > 3 && fn[len-3] == '_' && isdigit(fn[len-2]) && isdigit(fn[len-1]))
+    fn[len -= 3] = 0; // duplicates share the image file
+}
+
+uint64_t dt_db_meta_content(const char *filename)
+{
+  struct stat sb;
+  FILE *f = 0;
+  if(stat(filename, &sb) || !(f = fopen(filename, "rb"))) return 0;
+  uint8_t *buf = malloc(DT_DB_META_CONTENT_BYTES);
+  const size_t rd = fread(buf, 1, DT_DB_META_CONTENT_BYTES, f);
+  fclose(f);
+  const uint64_t h = hash64_data(buf, rd, (uint64_t)sb.st_size);
+  free(buf);
+  return h ? h : 1;
+}
+
+// bring the record up to date: stat the image file and read it if it changed
+static void
+meta_refresh(dt_db_meta_index_t *idx, uint32_t k)
+{
+  dt_db_meta_t *r = idx->rec + k;
+  char cfg[PATH_MAX], fn[PATH_MAX];
+  if(idx->dirname[0]) snprintf(cfg, sizeof(cfg), "%s/%s.cfg", idx->dirname, idx->filename[k]);
+  else                snprintf(cfg, sizeof(cfg), "%s.cfg", idx->filename[k]);
+  dt_db_meta_image_filename(cfg, fn, sizeof(fn));
+
+  struct stat sb;
+  const int64_t mtime = stat(fn, &sb) ? -1 : sb.st_mtime;
+  const int64_t size  = mtime == -1 ? 0 : sb.st_size;
+  if(mtime != -1 && r->mtime == mtime && r->size == size) return; // up to date
+  dt_db_meta_t m = {
+    .hash     = r->hash,
+    .mtime    = mtime,
+    .size     = size,
+    .content  = mtime == -1 ? 0 : dt_db_meta_content(fn),
+    .filetype = dt_graph_default_input_module(fn),
+  };
+  dt_db_exif_t ex;
+  dt_db_exif_read(fn, &ex);
+  memcpy(m.createdate, ex.createdate, sizeof(m.createdate));
+  m.iso          = ex.iso;
+  m.exposure     = ex.exposure;
+  m.aperture     = ex.aperture;
+  m.focal_length = ex.focal_length;
+  m.orientation  = ex.orientation;
+  m.preview_off  = ex.preview_off;
+  m.preview_len  = ex.preview_len;
+  m.wd           = ex.wd;
+  m.ht           = ex.ht;
+  // "Canon Canon EOS R5" and "NIKON CORPORATION NIKON Z 6" become the model only:
+  const size_t mk = strcspn(ex.maker, " ");
+  if(!mk || !strncasecmp(ex.model, ex.maker, mk))
+    snprintf(m.model, sizeof(m.model), "%s", ex.model);
+  else snprintf(m.model, sizeof(m.model), "%.*s %s", (int)mk, ex.maker, ex.model);
+  *r = m;
+}
+
+static void
+meta_ensure(dt_db_meta_index_t *idx, uint32_t k)
+{
+  unsigned char s = atomic_load(idx->state + k);
+  if(s == s_meta_valid) return;
+  s = s_meta_unchecked;
+  if(atomic_compare_exchange_strong(idx->state + k, &s, s_meta_busy))
+  {
+    meta_refresh(idx, k);
+    atomic_store(idx->state + k, s_meta_valid);
+    return;
+  }
+  while(atomic_load(idx->state + k) != s_meta_valid) sched_yield();
+}
+
+static void
+meta_work(uint32_t item, void *data)
+{
+  dt_db_meta_index_t *idx = data;
+  // after an abort only the struct itself is still there:
+  atomic_fetch_add(&idx->running, 1);
+  if(!atomic_load(&idx->abort) && idx->filename[item]) meta_ensure(idx, item);
+  atomic_fetch_sub(&idx->running, 1);
+}
+
+static void
+meta_unref(void *data)
+{
+  dt_db_meta_index_t *idx = data;
+  if(atomic_fetch_sub(&idx->ref, 1) == 1) free(idx);
+}
+
+void dt_db_meta_open(dt_db_t *db)
+{
+  dt_db_meta_index_t *idx = calloc(sizeof(dt_db_meta_index_t), 1);
+  db->meta = idx;
+  idx->fd = -1;
+  atomic_init(&idx->ref, 1);
+  snprintf(idx->dirname, sizeof(idx->dirname), "%s", db->dirname);
+  uint32_t cap = 64; // keep the table at most half full
+  while(cap < 2*db->image_cnt) cap <<= 1;
+
+  dt_db_meta_header_t hdr = {{0}};
+  if(db->dirname[0])
+  {
+    char cachedir[1024];
+    fs_cachedir(cachedir, sizeof(cachedir));
+    fs_mkdir_p(cachedir, 0755);
+    snprintf(idx->path, sizeof(idx->path), "%s/%"PRIx64".meta", cachedir, hash64(db->dirname));
+    idx->fd = meta_open_file(idx->path);
+    struct stat sb;
+    if(idx->fd < 0) {} // in memory only
+    else if(read(idx->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, "vkdtmeta", 8) || hdr.version != DT_DB_META_VERSION ||
+        hdr.cap & (hdr.cap-1))
+      hdr.cap = 0; // start from scratch
+    else if(fstat(idx->fd, &sb) || sb.st_size < sizeof(hdr) + sizeof(dt_db_meta_t)*(size_t)hdr.cap)
+      hdr.cap = 0; // truncated, mapping it would fault on the first access
+  }
+
+  // if the old table is large enough, use it in place:
+  dt_db_meta_t *old = 0;
+  uint32_t old_cap = hdr.cap;
+  if(hdr.cap >= cap)
+  {
+    if(meta_map(idx, sizeof(hdr) + sizeof(dt_db_meta_t)*(size_t)hdr.cap)) goto error;
+    cap = hdr.cap;
+    uint32_t used = 0, missing = 0;
+    for(uint32_t k=0;k<cap;k++) used += idx->rec[k].hash != 0;
+    for(uint32_t i=0;i<db->image_cnt;i++)
+      missing += !idx->rec[meta_find(idx->rec, cap, meta_key(db->image[i].filename))].hash;
+    if(used + missing > cap/4*3)
+    { // too many records of files that are gone by now, copy the live ones to a fresh table
+      old = malloc(sizeof(dt_db_meta_t)*(size_t)cap);
+      memcpy(old, idx->rec, sizeof(dt_db_meta_t)*(size_t)cap);
+      meta_unmap(idx);
+      idx->fd = meta_open_file(idx->path);
+      goto fresh;
+    }
+  }
+  else
+  {
+    if(old_cap)
+    {
+      old = malloc(sizeof(dt_db_meta_t)*(size_t)old_cap);
+      // the file position is right after the header:
+      if(read(idx->fd, old, sizeof(dt_db_meta_t)*(size_t)old_cap) != sizeof(dt_db_meta_t)*(size_t)old_cap)
+      {
+        free(old);
+        old = 0;
+      }
+    }
+fresh:;
+    const size_t size = sizeof(hdr) + sizeof(dt_db_meta_t)*(size_t)cap;
+    if(idx->fd >= 0 && (ftruncate(idx->fd, 0) || ftruncate(idx->fd, size)))
+    {
+      close(idx->fd);
+      idx->fd = -1;
+    }
+    if(meta_map(idx, size)) goto error;
+    memset(idx->header, 0, size);
+    memcpy(idx->header->magic, "vkdtmeta", 8);
+    idx->header->version = DT_DB_META_VERSION;
+    idx->header->cap = cap;
+  }
+  idx->cap = cap;
+  idx->filename = calloc(sizeof(const char *), cap);
+  idx->state    = calloc(sizeof(atomic_uchar), cap);
+
+  for(uint32_t i=0;i<db->image_cnt;i++)
+  {
+    const uint64_t key = meta_key(db->image[i].filename);
+    const uint32_t k = meta_find(idx->rec, cap, key);
+    if(!idx->rec[k].hash)
+    {
+      const uint32_t o = old ? meta_find(old, old_cap, key) : 0;
+      if(old && old[o].hash) idx->rec[k] = old[o];
+      else idx->rec[k] = (dt_db_meta_t){ .hash = key };
+    }
+    if(!idx->filename[k]) idx->filename[k] = db->image[i].filename;
+    db->image[i].meta = k;
+  }
+  free(old);
+  for(uint32_t k=0;k<cap;k++) idx->used += idx->rec[k].hash != 0;
+
+  // check everything in the background:
+  int taskid = -1;
+  for(int k=0;k<DT_DB_META_THREADS;k++)
+  {
+    atomic_fetch_add(&idx->ref, 1);
+    taskid = threads_task("meta", cap, taskid, idx, meta_work, meta_unref, s_threads_prio_background);
+    if(taskid < 0)
+    { // no worries, dt_db_meta_get() will do it on demand
+      atomic_fetch_sub(&idx->ref, 1);
+      break;
+    }
+  }
+  return;
+error:
+  dt_log(s_log_db|s_log_err, "could not map metadata index `%s'", idx->path);
+  free(old);
+  meta_unmap(idx);
+  free(idx);
+  db->meta = 0;
+}
+
+void dt_db_meta_close(dt_db_t *db)
+{
+  dt_db_meta_index_t *idx = db->meta;
+  if(!idx) return;
+  atomic_store(&idx->abort, 1);
+  // tasks that did not start yet won't touch the records any more, only wait
+  // for the ones in the middle of a record. the last task frees the struct:
+  while(atomic_load(&idx->running) > 0 && !threads_shutting_down())
+    sched_yield();
+  meta_unmap(idx);
+  free(idx->filename);
+  free(idx->state);
+  idx->filename = 0;
+  idx->state = 0;
+  meta_unref(idx);
+  db->meta = 0;
+}
+
+void dt_db_meta_add(dt_db_t *db, uint32_t imgid)
+{
+  dt_db_meta_index_t *idx = db->meta;
+  if(imgid >= db->image_cnt) return;
+  db->image[imgid].meta = -1u;
+  if(!idx) return;
+  const uint64_t key = meta_key(db->image[imgid].filename);
+  const uint32_t k = meta_find(idx->rec, idx->cap, key);
+  if(!idx->rec[k].hash)
+  { // the table doesn't grow while the folder is open, it's sized for the next time
+    if(idx->used + 1 > idx->cap/4*3) return;
+    idx->rec[k] = (dt_db_meta_t){ .hash = key };
+    idx->used++;
+  }
+  if(!idx->filename[k]) idx->filename[k] = db->image[imgid].filename;
+  // the file may have been replaced after we looked at it, check the time stamp again:
+  unsigned char s = s_meta_valid;
+  atomic_compare_exchange_strong(idx->state + k, &s, s_meta_unchecked);
+  db->image[imgid].meta = k;
+}
+
+const dt_db_meta_t *dt_db_meta_get(dt_db_t *db, uint32_t imgid)
+{
+  static const dt_db_meta_t empty = {0};
+  dt_db_meta_index_t *idx = db->meta;
+  if(!idx || imgid >= db->image_cnt || db->image[imgid].meta >= idx->cap) return &empty;
+  const uint32_t k = db->image[imgid].meta;
+  meta_ensure(idx, k);
+  return idx->rec + k;
+}
+
+int dt_db_meta_peek(dt_db_t *db, uint32_t imgid, dt_db_meta_t *meta)
+{
+  dt_db_meta_index_t *idx = db->meta;
+  if(!idx || imgid >= db->image_cnt || db->image[imgid].meta >= idx->cap) return 1;
+  const uint32_t k = db->image[imgid].meta;
+  if(atomic_load(idx->state + k) != s_meta_valid) return 1;
+  *meta = idx->rec[k];
+  return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+
+// persistent index of image metadata that is expensive to get at (it means
+// opening and parsing the image file). there is one index per folder, stored
+// in ~/.cache/vkdt/<hash of folder>.meta as an open addressing hash table of
+// fixed size records, keyed by file name. the file is memory mapped, so
+// loading a folder we've seen before costs nothing.
+//
+// when a folder is loaded, background threads check the modification time of
+// every image and refresh the records that are missing or stale. queries
+// that come in before the threads got to an image fill its record right away.
+
+typedef struct dt_db_t dt_db_t;
+
+#define DT_DB_META_CONTENT_BYTES (64u<<10) // of the image file that go into the content hash
+
+typedef struct dt_db_meta_t
+{ // this goes to disk as is, 144 bytes
+  uint64_t hash;           // hash64_key() of the image file name, 0 marks an empty slot
+  int64_t  mtime;          // modification time of the image file when the record was written
+  int64_t  size;           // and its size in bytes
+  uint64_t content;        // dt_db_meta_content() of the image file, 0 if it could not be read
+  uint64_t filetype;       // token of the input module
+  uint64_t preview_off;    // file offset of the largest embedded jpeg
+  uint32_t preview_len;    // and its size in bytes, 0 if there is none
+  uint32_t wd, ht;         // image dimensions, 0 if unknown
+  uint32_t iso;
+  float    exposure;       // in seconds
+  float    aperture;       // f-number
+  float    focal_length;   // in mm
+  uint16_t orientation;    // exif orientation 1..8, 0 if unknown
+  uint16_t pad;
+  char     createdate[20]; // yyyy:mm:dd hh:mm:ss
+  char     model[44];      // maker and model
+}
+dt_db_meta_t;
+
+// map the index for the directory of the db and assign records to all
+// images. starts the background refresh. if the db has no directory (single
+// image), the cache can't be written, or another process has the same folder
+// open, the index lives in memory only.
+void dt_db_meta_open(dt_db_t *db);
+
+// stop the background threads and unmap. only waits for the records that
+// are being refreshed right now, queued work is dropped.
+void dt_db_meta_close(dt_db_t *db);
+
+// assign a record to an image that was added after opening the folder. if
+// the index is full, the image goes without (and gets one next time).
+void dt_db_meta_add(dt_db_t *db, uint32_t imgid);
+
+// return the up to date record for the image. reads the file now if
+// the background threads didn't get to it yet. never returns 0.
+const dt_db_meta_t *dt_db_meta_get(dt_db_t *db, uint32_t imgid);
+
+// copy the record if it has been checked already, without touching the file
+// or waiting for anybody. returns non-zero if it has not.
+int dt_db_meta_peek(dt_db_t *db, uint32_t imgid, dt_db_meta_t *meta);
+
+// hash of the size and the first DT_DB_META_CONTENT_BYTES of the file, which
+// is where the metadata is. identifies the image independent of its name for
+// the thumbnail keys. reads the file, use the one in the record where you can.
+// returns 0 if the file can't be read.
+uint64_t dt_db_meta_content(const char *filename);
+
+// the image file behind the .cfg file name (PATH_MAX): follows the symlinks
+// of tags and strips the .cfg and the _01 suffix of duplicates.
+void dt_db_meta_image_filename(const char *cfg, char *fn, size_t size);
@@ -0,0 +1,191 @@
+#include "db/preview.h"
+#include "db/exif.h"
+#define STB_DXT_IMPLEMENTATION
+#include "pipe/modules/o-bc1/stb_dxt.h"
+
+#include <stdio.h>
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct preview_err_t
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+}
+preview_err_t;
+
+static void
+preview_error_exit(j_common_ptr cinfo)
+{ // no messages, a broken preview just means we wait for the real thumbnail
+  preview_err_t *err = (preview_err_t *)cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+static void
+preview_emit_message(j_common_ptr cinfo, int level)
+{ // warnings are about corrupt data, we'd rather not show that
+  if(level < 0) preview_error_exit(cinfo);
+}
+
+// srgb curve to linear for the jpeg bytes, and back on 4096 steps
+static float   lut_lin[256];
+static uint8_t lut_srgb[4096];
+
+static void
+preview_init_luts()
+{
+  for(int i=0;i<256;i++)
+  {
+    const float v = i/255.0f;
+    lut_lin[i] = v <= 0.04045f ? v/12.92f : powf((v+0.055f)/1.055f, 2.4f);
+  }
+  for(int i=0;i<4096;i++)
+  {
+    const float v = i/4095.0f;
+    const float e = v <= 0.0031308f ? 12.92f*v : 1.055f*powf(v, 1.0f/2.4f)-0.055f;
+    lut_srgb[i] = (uint8_t)fminf(255.0f, fmaxf(0.0f, 255.0f*e + 0.5f));
+  }
+}
+
+static inline uint8_t
+preview_encode(float v)
+{
+  return lut_srgb[(int)(4095.0f*fminf(1.0f, fmaxf(0.0f, v)) + 0.5f)];
+}
+
+size_t dt_db_preview_bc1(
+    const char *filename,
+    uint64_t    off,
+    uint32_t    len,
+    int         orientation,
+    uint32_t    magic,
+    int         max_wd,
+    int         max_ht,
+    uint32_t  **data)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, preview_init_luts);
+  *data = 0;
+  if(len < 4 || len > (64u<<20)) return 0;
+  int fd = open(filename, O_RDONLY|O_BINARY);
+  if(fd < 0) return 0;
+  uint8_t *jpg = malloc(len);
+  const int err = dt_db_exif_pread(fd, jpg, len, off);
+  close(fd);
+  if(err || jpg[0] != 0xff || jpg[1] != 0xd8)
+  {
+    free(jpg);
+    return 0;
+  }
+
+  struct jpeg_decompress_struct dinfo;
+  preview_err_t jerr;
+  uint8_t *volatile pixels = 0;
+  dinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit   = preview_error_exit;
+  jerr.pub.emit_message = preview_emit_message;
+  if(setjmp(jerr.setjmp_buffer))
+  {
+    jpeg_destroy_decompress(&dinfo);
+    free(jpg);
+    free(pixels);
+    return 0;
+  }
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, jpg, len);
+  jpeg_read_header(&dinfo, TRUE);
+
+  // size of the thumbnail after orientation, and before (the way we decode it):
+  const int swap = orientation >= 5 && orientation <= 8;
+  const int ow = swap ? dinfo.image_height : dinfo.image_width;
+  const int oh = swap ? dinfo.image_width  : dinfo.image_height;
+  const float scale = fminf(1.0f, fminf(max_wd/(float)ow, max_ht/(float)oh));
+  const int twd = 4*(int)(ow*scale/4), tht = 4*(int)(oh*scale/4); // oriented, full bc1 blocks
+  if(twd < 4 || tht < 4) longjmp(jerr.setjmp_buffer, 1);
+  const int swd = swap ? tht : twd, sht = swap ? twd : tht;        // as stored in the jpeg
+
+  // let the idct do most of the downscaling:
+  dinfo.scale_num   = 1;
+  dinfo.scale_denom = 8;
+  while(dinfo.scale_denom > 1 &&
+       (dinfo.image_width  / dinfo.scale_denom < swd ||
+        dinfo.image_height / dinfo.scale_denom < sht))
+    dinfo.scale_denom /= 2;
+  dinfo.out_color_space = JCS_RGB;
+  dinfo.dct_method = JDCT_IFAST;
+  dinfo.do_fancy_upsampling = FALSE;
+  jpeg_start_decompress(&dinfo);
+  const int dwd = dinfo.output_width, dht = dinfo.output_height;
+  pixels = malloc(sizeof(uint8_t)*3*dwd*dht);
+  while(dinfo.output_scanline < dht)
+  {
+    JSAMPROW row = (JSAMPROW)(pixels + 3*dwd*dinfo.output_scanline);
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  free(jpg);
+
+  // box filter the rest of the way in linear, convert srgb to rec2020
+  // primaries, encode to the srgb curve, and put the pixels where the
+  // orientation wants them:
+  uint8_t *rgba = malloc(sizeof(uint8_t)*4*twd*tht);
+  const float M[] = { // linear srgb to rec2020
+    0.6274040f, 0.3292820f, 0.0433136f,
+    0.0690970f, 0.9195400f, 0.0113612f,
+    0.0163916f, 0.0880132f, 0.8955950f};
+  for(int j=0;j<sht;j++) for(int i=0;i<swd;i++)
+  {
+    const int x0 = i*dwd/swd, x1 = (i+1)*dwd/swd, y0 = j*dht/sht, y1 = (j+1)*dht/sht;
+    float rgb[3] = {0.0f};
+    for(int y=y0;y<y1;y++) for(int x=x0;x<x1;x++) for(int c=0;c<3;c++)
+      rgb[c] += lut_lin[pixels[3*(dwd*y+x)+c]];
+    const float norm = 1.0f/((x1-x0)*(y1-y0));
+    int x = i, y = j; // destination pixel for orientation 1
+    switch(orientation)
+    {
+      case 2: x = swd-1-i; break;
+      case 3: x = swd-1-i; y = sht-1-j; break;
+      case 4: y = sht-1-j; break;
+      case 5: x = j; y = i; break;
+      case 6: x = sht-1-j; y = i; break;
+      case 7: x = sht-1-j; y = swd-1-i; break;
+      case 8: x = j; y = swd-1-i; break;
+      default: break;
+    }
+    uint8_t *px = rgba + 4*(twd*y+x);
+    for(int c=0;c<3;c++)
+      px[c] = preview_encode(norm*(M[3*c+0]*rgb[0] + M[3*c+1]*rgb[1] + M[3*c+2]*rgb[2]));
+    px[3] = 255;
+  }
+  free(pixels);
+
+  const int bx = twd/4, by = tht/4;
+  const size_t size = sizeof(uint32_t)*4 + sizeof(uint8_t)*8*bx*(size_t)by;
+  uint32_t *header = malloc(size);
+  uint8_t *blocks = (uint8_t *)(header + 4);
+  header[0] = magic;
+  header[1] = 1;
+  header[2] = twd;
+  header[3] = tht;
+  for(int j=0;j<tht;j+=4) for(int i=0;i<twd;i+=4)
+  { // same as o-bc1 does it:
+    uint8_t block[64];
+    for(int jj=0;jj<4;jj++)
+      memcpy(block + 16*jj, rgba + 4*(twd*(j+jj)+i), 16);
+    stb_compress_dxt_block(blocks + 8*(bx*(j/4)+(i/4)), block, 0, 0);
+  }
+  free(rgba);
+  *data = header;
+  return size;
+}
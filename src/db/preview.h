@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// quick thumbnails from the jpeg previews embedded in raw files, before the
+// real ones are rendered through a graph. this runs on the cpu only: libjpeg
+// decodes at 1/2, 1/4 or 1/8 scale (dct scaling) to get close to the
+// thumbnail size, we box filter down the rest of the way, apply the exif
+// orientation, convert to rec2020 primaries with srgb curve like the default
+// thumbnail graph does, and compress to bc1.
+
+// read len bytes of jpeg at offset off of the file and make a bc1 thumbnail
+// of at most max_wd x max_ht. returns the size in bytes of the allocated
+// buffer in *data, which starts with the thumbnail header {magic, 1, width,
+// height} followed by the bc1 blocks, or 0 on failure.
+size_t dt_db_preview_bc1(
+    const char *filename,
+    uint64_t    off,
+    uint32_t    len,
+    int         orientation,  // exif orientation 1..8, 0 if unknown
+    uint32_t    magic,        // goes to the header
+    int         max_wd,
+    int         max_ht,
+    uint32_t  **data);        // free() after use
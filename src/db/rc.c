@@ -13,26 +13,31 @@ dt_rc_init(
   rc->data = calloc(sizeof(rc->data[0]), rc->data_max);
 }
 
+static void
+rc_grow(dt_rc_t *rc)
+{ // make room for one more value in case the key is new
+  if(rc->data_cnt < rc->data_max) return;
+  char **data = realloc(rc->data, sizeof(rc->data[0])*2*rc->data_max);
+  if(!data) return;
+  memset(data + rc->data_max, 0, sizeof(rc->data[0])*rc->data_max);
+  rc->data = data;
+  rc->data_max *= 2;
+}
+
 void
 dt_rc_cleanup(
     dt_rc_t *rc)
 {
   // free all allocated string values.
   // for this find all strings in string pool:
-  for(int i=0;i<rc->sp.buf_max;)
+  for(uint32_t i=0;i<rc->sp.entry_cnt;i++)
   {
-    int len = strlen(rc->sp.buf+i);
-    // read string
-    if(!strncmp(rc->sp.buf+i, "str", 3))
+    const uint32_t pos = rc->sp.entry[i].val;
+    if(!strncmp(rc->sp.entry[i].buf, "str", 3) && pos < rc->data_max)
     {
-      uint32_t pos = dt_stringpool_get(&rc->sp, rc->sp.buf+i, len, -1u, 0);
-      if(pos != -1u && pos < rc->data_max)
-      {
-        free(rc->data[pos]);
-        rc->data[pos] = 0;
-      }
+      free(rc->data[pos]);
+      rc->data[pos] = 0;
     }
-    i += len+1; // eat terminating 0, too
   }
   free(rc->data);
   rc->data_cnt = rc->data_max = 0;
@@ -47,6 +52,7 @@ dt_rc_get(
 {
   char tkey[30] = "str";
   snprintf(tkey+3, 26, "%s", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
   if(pos == -1u || pos >= rc->data_max) return defval;
@@ -67,9 +73,10 @@ dt_rc_set(
 {
   char tkey[30] = "str";
   snprintf(tkey+3, 26, "%s", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
-  if(pos == -1u || pos >= rc->data_max) return; // string pool full :(
+  if(pos == -1u || pos >= rc->data_max) return; // out of memory :(
   free(rc->data[pos]);
   rc->data[pos] = calloc(strlen(val)+1, 1);
   if(pos == rc->data_cnt) rc->data_cnt++;
@@ -84,6 +91,7 @@ dt_rc_get_int(
 {
   char tkey[30] = "int";
   snprintf(tkey+3, 26, "%s", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
   if(pos == -1u || pos >= rc->data_max) return defval;
@@ -104,9 +112,10 @@ dt_rc_set_int(
   char tkey[30] = "int";
   if(snprintf(tkey+3, 26, "%.25s", key) >= 26) // this always prints a null termination byte
     fprintf(stderr, "[rc] truncating config key %s!\n", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
-  if(pos == -1u || pos >= rc->data_max) return; // string pool full :(
+  if(pos == -1u || pos >= rc->data_max) return; // out of memory :(
   if(pos == rc->data_cnt) rc->data_cnt++;
   ((int *)(rc->data+pos))[0] = val;
 }
@@ -119,6 +128,7 @@ dt_rc_get_float(
 {
   char tkey[30] = "flt";
   snprintf(tkey+3, 26, "%s", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
   if(pos == -1u || pos >= rc->data_max) return defval;
@@ -139,9 +149,10 @@ dt_rc_set_float(
   char tkey[30] = "flt";
   if(snprintf(tkey+3, 26, "%.25s", key) >= 26) // this always prints a null termination byte
     fprintf(stderr, "[rc] truncating config key %s!\n", key);
+  rc_grow(rc);
   uint32_t pos = rc->data_cnt;
   pos = dt_stringpool_get(&rc->sp, tkey, strlen(tkey), pos, 0);
-  if(pos == -1u || pos >= rc->data_max) return; // string pool full :(
+  if(pos == -1u || pos >= rc->data_max) return; // out of memory :(
   if(pos == rc->data_cnt) rc->data_cnt++;
   ((float *)(rc->data+pos))[0] = val;
 }
@@ -191,23 +202,19 @@ dt_rc_write(
 {
   FILE *f = fopen(filename, "wb");
   if(!f) return -1;
-  for(int i=0;i<rc->sp.buf_max;)
-  {
-    int len = strlen(rc->sp.buf+i);
-    if(len)
-    { // query value of this string:
-      uint32_t pos = dt_stringpool_get(&rc->sp, rc->sp.buf+i, len, -1u, 0);
-      if(pos != -1u && pos < rc->data_max)
-      {
-        if(!strncmp(rc->sp.buf+i, "flt", 3))
-          fprintf(f, "%s:%g\n", rc->sp.buf+i, *(float *)(rc->data+pos));
-        else if(!strncmp(rc->sp.buf+i, "int", 3))
-          fprintf(f, "%s:%d\n", rc->sp.buf+i, *(int *)(rc->data+pos));
-        else if(!strncmp(rc->sp.buf+i, "str", 3))
-          fprintf(f, "%s:%s\n", rc->sp.buf+i, rc->data[pos]);
-      }
+  for(uint32_t i=0;i<rc->sp.entry_cnt;i++)
+  { // entries are in insertion order, query value of this string:
+    const char *key = rc->sp.entry[i].buf;
+    const uint32_t pos = rc->sp.entry[i].val;
+    if(pos < rc->data_max)
+    {
+      if(!strncmp(key, "flt", 3))
+        fprintf(f, "%s:%g\n", key, *(float *)(rc->data+pos));
+      else if(!strncmp(key, "int", 3))
+        fprintf(f, "%s:%d\n", key, *(int *)(rc->data+pos));
+      else if(!strncmp(key, "str", 3))
+        fprintf(f, "%s:%s\n", key, rc->data[pos]);
     }
-    i += len+1; // eat terminating 0, too
   }
   fclose(f);
   return 0;
@@ -1,13 +1,20 @@
 #pragma once
+#include <stdint.h>
 // forward declare for stringpool.h
 typedef struct dt_stringpool_entry_t dt_stringpool_entry_t;
 typedef struct dt_stringpool_t
 {
-  uint32_t entry_max;
+  uint32_t entry_max;            // allocation size of entry[]
+  uint32_t entry_cnt;            // number of strings, entry[] is in insertion order
   dt_stringpool_entry_t *entry;
 
-  uint32_t buf_max;
-  uint32_t buf_cnt;
+  uint32_t slot_max;             // size of the hash table, power of two
+  uint64_t *slot;                // hash tag << 32 | entry index + 1, or 0 if empty
+
+  uint32_t buf_max;              // size of the current string block
+  uint32_t buf_cnt;              // bytes used in it
   char *buf;
+  uint32_t block_cnt;            // full blocks, kept so the strings never move
+  char **block;
 }
 dt_stringpool_t;
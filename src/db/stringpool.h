@@ -1,56 +1,116 @@
 #pragma once
 
-#include "hash.h"
-#include "stringpool-fwd.h"
-
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+#include "hash.h"
+#include "stringpool-fwd.h"
+
 // string pool. this serves two purposes:
 // store hashtable string -> id (e.g. for database to associate file names with imageid)
 // store null-terminated strings themselves in a compact memory layout (locality of reference)
+//
+// the hash table uses linear probing, and every slot carries 32 bits of the
+// hash next to the entry index, so most probes are decided without looking at
+// the entry or comparing strings. both table and string storage grow on
+// demand. strings are never moved, so pointers returned as dedup stay valid
+// until cleanup or reset.
 
 typedef struct dt_stringpool_entry_t
 {
-  uint32_t next; // -1u no next, else: next index
-  uint32_t val;
   char    *buf;  // null terminated
+  uint32_t val;
+  uint32_t len;
 }
 dt_stringpool_entry_t;
 
 static inline void
 dt_stringpool_init(
     dt_stringpool_t *sp,
-    uint32_t num_entries, // number of entries. will add some extra.
+    uint32_t num_entries, // expected number of entries. will grow if needed.
     uint32_t avg_len)     // assume average string length. filenames straight from cam are 12.
 {
-  num_entries += num_entries; // add slack
-  size_t buf_size = num_entries * (uint64_t)avg_len;
   memset(sp, 0, sizeof(*sp));
+  if(num_entries < 16) num_entries = 16;
+  sp->slot_max = 16;
+  while(sp->slot_max < 2*(uint64_t)num_entries) sp->slot_max <<= 1; // keep at most half full
+  sp->slot      = (uint64_t *)calloc(sizeof(uint64_t), sp->slot_max);
   sp->entry_max = num_entries;
   sp->entry     = (dt_stringpool_entry_t *)calloc(sizeof(dt_stringpool_entry_t), num_entries);
-  sp->buf       = (char *)calloc(buf_size, 1);
-  sp->buf_max   = buf_size;
+  sp->buf_max   = num_entries * (uint64_t)avg_len;
+  sp->buf       = (char *)calloc(sp->buf_max, 1);
   sp->buf_cnt   = 0;
 }
 
 static inline void
 dt_stringpool_cleanup(dt_stringpool_t *sp)
 {
+  for(uint32_t i=0;i<sp->block_cnt;i++) free(sp->block[i]);
+  free(sp->block);
+  free(sp->slot);
   free(sp->entry);
   free(sp->buf);
-  sp->entry = 0;
-  sp->buf   = 0;
+  memset(sp, 0, sizeof(*sp));
 }
 
 static inline void
 dt_stringpool_reset(dt_stringpool_t *sp)
 {
-  memset(sp->entry, 0, sizeof(dt_stringpool_entry_t)*sp->entry_max);
-  memset(sp->buf,   0, sp->buf_max);
-  sp->buf_cnt = 0;
+  for(uint32_t i=0;i<sp->block_cnt;i++) free(sp->block[i]);
+  sp->block_cnt = 0;
+  memset(sp->slot, 0, sizeof(uint64_t)*sp->slot_max);
+  sp->entry_cnt = 0;
+  sp->buf_cnt   = 0;
+}
+
+// double the hash table and reinsert everything
+static inline int
+dt_stringpool_grow(dt_stringpool_t *sp)
+{
+  const uint32_t slot_max = 2*sp->slot_max;
+  uint64_t *slot = (uint64_t *)calloc(sizeof(uint64_t), slot_max);
+  if(!slot) return 1;
+  for(uint32_t i=0;i<sp->slot_max;i++)
+  {
+    if(!sp->slot[i]) continue;
+    const dt_stringpool_entry_t *e = sp->entry + (uint32_t)sp->slot[i] - 1;
+    uint64_t j = hash64_key_l(e->buf, e->len);
+    while(slot[j & (slot_max-1)]) j++;
+    slot[j & (slot_max-1)] = sp->slot[i];
+  }
+  free(sp->slot);
+  sp->slot     = slot;
+  sp->slot_max = slot_max;
+  return 0;
+}
+
+// copy the string to the pool, start a new block if the current one is full
+static inline char*
+dt_stringpool_alloc(dt_stringpool_t *sp, const char *str, uint32_t sl)
+{
+  if(sp->buf_cnt + sl + 1 > sp->buf_max)
+  { // keep the full block around, the strings are referenced
+    char **block = (char **)realloc(sp->block, sizeof(char *)*(sp->block_cnt+1));
+    const uint64_t buf_max = 2*(uint64_t)sp->buf_max + sl + 1;
+    char *buf = buf_max < (1ull<<32) ? (char *)calloc(buf_max, 1) : 0;
+    if(block) sp->block = block;
+    if(!block || !buf)
+    {
+      free(buf);
+      return 0;
+    }
+    sp->block[sp->block_cnt++] = sp->buf;
+    sp->buf     = buf;
+    sp->buf_max = buf_max;
+    sp->buf_cnt = 0;
+  }
+  char *ret = sp->buf + sp->buf_cnt;
+  memcpy(ret, str, sl);
+  ret[sl] = 0;
+  sp->buf_cnt += sl+1;
+  return ret;
 }
 
 // return primary key (may be different to what was passed in case it was already there)
@@ -62,44 +122,51 @@ dt_stringpool_get(
     uint32_t         val,   // primary key to associate with the string, in case it's not been inserted before. pass -1u if you don't want to insert. will return old primary key if the string already exists.
     const char     **dedup) // deduplicated string from pool, or 0
 {
-  uint64_t j = hash64_l(str, sl);
-  const int step = 7919; // large prime number. up to entry_max < this we will always step through all entries in the list then.
+  const uint64_t hash = hash64_key_l(str, sl);
+  sl = strnlen(str, sl); // the hash stops at the terminator too
+  const uint64_t tag  = hash & 0xffffffff00000000ull;
+  uint64_t j = hash;
   while(1)
   {
-    j = j % sp->entry_max;
-    dt_stringpool_entry_t *entry = sp->entry + j;
-    if(entry->buf)
-    { // entry already taken
-      if(!strncmp(entry->buf, str, sl) && (entry->buf[sl] == 0))
-      {
-        if(dedup) *dedup = entry->buf;
-        return entry->val; // this is us, we have been inserted before
-      }
-      // else jump to next candidate
-      if(entry->next == -1u)
+    const uint64_t s = sp->slot[j & (sp->slot_max-1)];
+    if(!s) break;
+    if((s & 0xffffffff00000000ull) == tag)
+    { // only compare strings if the hash matches
+      const dt_stringpool_entry_t *e = sp->entry + (uint32_t)s - 1;
+      if(e->len == sl && !memcmp(e->buf, str, sl))
       {
-        if(val == -1u) return -1u; // no modifying entries if no insertion planned
-        entry->next = j + step;
+        if(dedup) *dedup = e->buf;
+        return e->val; // this is us, we have been inserted before
       }
-      j = entry->next;
-    }
-    else
-    { // free entry found, allocate string:
-      if(val == -1u) return -1u; // no insert requested
-      if(sp->buf_cnt + sl >= sp->buf_max)
-      {
-        fprintf(stderr, "[stringpool] ran out of memory!\n");
-        return -1u; // would need +one for null terminator
-      }
-      entry->buf   = sp->buf + sp->buf_cnt;
-      sp->buf_cnt += sl+1;
-      entry->next  = -1u;
-      entry->val   = val;
-      snprintf(entry->buf, sl+1, "%s", str);
-      if(dedup) *dedup = entry->buf;
-      return entry->val;
     }
+    j++;
+  }
+  if(val == -1u) return -1u; // no insert requested
+
+  // free slot found, allocate string:
+  if(2*(uint64_t)(sp->entry_cnt+1) > sp->slot_max)
+  { // keep the table at most half full
+    if(dt_stringpool_grow(sp)) goto oom;
+    j = hash;
+    while(sp->slot[j & (sp->slot_max-1)]) j++;
+  }
+  if(sp->entry_cnt == sp->entry_max)
+  {
+    dt_stringpool_entry_t *entry = (dt_stringpool_entry_t *)realloc(sp->entry, sizeof(dt_stringpool_entry_t)*2*sp->entry_max);
+    if(!entry) goto oom;
+    sp->entry = entry;
+    sp->entry_max *= 2;
   }
-  // yes, as if you can reach here. good luck.
+  char *buf = dt_stringpool_alloc(sp, str, sl);
+  if(!buf) goto oom;
+  dt_stringpool_entry_t *e = sp->entry + sp->entry_cnt++;
+  e->buf = buf;
+  e->val = val;
+  e->len = sl;
+  sp->slot[j & (sp->slot_max-1)] = tag | sp->entry_cnt;
+  if(dedup) *dedup = e->buf;
   return val;
+oom:
+  fprintf(stderr, "[stringpool] ran out of memory!\n");
+  return -1u;
 }
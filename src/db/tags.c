@@ -0,0 +1,424 @@
+#include "tags.h"
+#include "stringpool.h"
+#include "core/core.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/sort.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define DT_DB_TAGS_VERSION 1
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct dt_db_tags_header_t
+{
+  char     magic[8];  // "vkdttag"
+  uint32_t version;
+  uint32_t pad;
+}
+dt_db_tags_header_t;
+
+typedef struct dt_db_tags_record_t
+{ // followed by tag name and path, without terminators
+  uint16_t add;       // 1 to add the image to the tag, 0 to remove it
+  uint16_t tag_len;
+  uint32_t path_len;
+}
+dt_db_tags_record_t;
+
+typedef struct dt_db_tags_list_t
+{
+  uint32_t *id;       // image ids with this tag
+  uint32_t  cnt, max;
+  int       dirty;    // appended out of order, sort before use
+  uint64_t *bits;     // the same as bitset, for queries, or 0 if out of date
+  uint32_t  words;    // size of bits
+}
+dt_db_tags_list_t;
+
+typedef struct dt_db_tags_t
+{
+  dt_stringpool_t    sp_tag;    // tag name -> tag id
+  dt_stringpool_t    sp_path;   // cfg path -> image id
+  dt_db_tags_list_t *tag;
+  uint32_t           tag_cnt, tag_max;
+  const char       **path;      // image id -> cfg path in sp_path
+  uint32_t           path_cnt, path_max;
+  int                fd;        // index file, open for appending
+  char               filename[PATH_MAX];
+}
+dt_db_tags_t;
+
+static int
+compare_id(const void *a, const void *b, void *arg)
+{
+  const uint32_t *ia = a, *ib = b;
+  return ia[0] < ib[0] ? -1 : ia[0] > ib[0];
+}
+
+static void
+list_clean(dt_db_tags_list_t *l)
+{ // sort and remove duplicates
+  if(!l->dirty) return;
+  sort(l->id, l->cnt, sizeof(l->id[0]), compare_id, 0);
+  uint32_t j = 0;
+  for(uint32_t i=0;i<l->cnt;i++)
+    if(!j || l->id[i] != l->id[j-1]) l->id[j++] = l->id[i];
+  l->cnt = j;
+  l->dirty = 0;
+}
+
+static uint32_t // position of the image in the list, or where it would go
+list_find(dt_db_tags_list_t *l, uint32_t iid)
+{
+  list_clean(l);
+  uint32_t lo = 0, hi = l->cnt;
+  while(lo < hi)
+  {
+    const uint32_t mid = (lo + hi) / 2;
+    if(l->id[mid] < iid) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static uint32_t // id of the tag, inserted if it's new
+tags_tag(dt_db_tags_t *t, const char *tag, uint32_t len, int insert)
+{
+  uint32_t id = dt_stringpool_get(&t->sp_tag, tag, len, insert ? t->tag_cnt : -1u, 0);
+  if(id != t->tag_cnt || !insert) return id;
+  if(t->tag_cnt == t->tag_max)
+  {
+    t->tag_max = t->tag_max ? 2*t->tag_max : 64;
+    t->tag = realloc(t->tag, sizeof(t->tag[0])*t->tag_max);
+  }
+  t->tag[t->tag_cnt++] = (dt_db_tags_list_t){0};
+  return id;
+}
+
+static uint32_t // id of the image, inserted if it's new
+tags_image(dt_db_tags_t *t, const char *path, uint32_t len, int insert)
+{
+  const char *dedup = 0;
+  uint32_t id = dt_stringpool_get(&t->sp_path, path, len, insert ? t->path_cnt : -1u, &dedup);
+  if(id != t->path_cnt || !insert) return id;
+  if(t->path_cnt == t->path_max)
+  {
+    t->path_max = t->path_max ? 2*t->path_max : 1024;
+    t->path = realloc(t->path, sizeof(t->path[0])*t->path_max);
+  }
+  t->path[t->path_cnt++] = dedup;
+  return id;
+}
+
+// apply one record to the lists in memory
+static void
+tags_apply(dt_db_tags_t *t, int add, const char *tag, uint32_t tag_len, const char *path, uint32_t path_len)
+{
+  const uint32_t tid = tags_tag(t, tag, tag_len, add);
+  const uint32_t iid = tags_image(t, path, path_len, add);
+  if(tid == -1u || iid == -1u) return;
+  dt_db_tags_list_t *l = t->tag + tid;
+  free(l->bits);
+  l->bits = 0;
+  if(add)
+  {
+    if(l->cnt == l->max)
+    {
+      l->max = l->max ? 2*l->max : 16;
+      l->id = realloc(l->id, sizeof(l->id[0])*l->max);
+    }
+    if(l->cnt && l->id[l->cnt-1] >= iid) l->dirty = 1;
+    l->id[l->cnt++] = iid;
+    return;
+  }
+  const uint32_t pos = list_find(l, iid);
+  if(pos < l->cnt && l->id[pos] == iid)
+    memmove(l->id + pos, l->id + pos + 1, sizeof(l->id[0])*(--l->cnt - pos));
+}
+
+static int
+tags_write(dt_db_tags_t *t, int add, const char *tag, const char *path)
+{
+  const dt_db_tags_record_t rec = { .add = add, .tag_len = strnlen(tag, 0xffff), .path_len = strlen(path) };
+  const uint32_t tid = tags_tag(t, tag, rec.tag_len, 0);
+  const uint32_t iid = tags_image(t, path, rec.path_len, 0);
+  if(tid != -1u && iid != -1u)
+  { // don't write records that don't change anything
+    const uint32_t pos = list_find(t->tag + tid, iid);
+    const int has = pos < t->tag[tid].cnt && t->tag[tid].id[pos] == iid;
+    if(has == add) return 0;
+  }
+  else if(!add) return 0;
+  const size_t size = sizeof(rec) + rec.tag_len + rec.path_len;
+  char *buf = malloc(size);
+  memcpy(buf, &rec, sizeof(rec));
+  memcpy(buf + sizeof(rec), tag, rec.tag_len);
+  memcpy(buf + sizeof(rec) + rec.tag_len, path, rec.path_len);
+  int err = t->fd < 0 || write(t->fd, buf, size) != size;
+  free(buf);
+  if(err) dt_log(s_log_db|s_log_err, "could not write tag index `%s'", t->filename);
+  tags_apply(t, add, tag, rec.tag_len, path, rec.path_len);
+  return err;
+}
+
+static void
+tags_import(dt_db_tags_t *t, const char *dirname)
+{ // every tag is a directory of symlinks to the tagged cfg
+  DIR *dp = opendir(dirname);
+  if(!dp) return;
+  struct dirent *ep;
+  char fn[PATH_MAX+300], path[PATH_MAX];
+  uint32_t cnt = 0;
+  while((ep = readdir(dp)))
+  {
+    if(ep->d_name[0] == '.' || !fs_isdir(dirname, ep)) continue;
+    snprintf(fn, sizeof(fn), "%s/%s", dirname, ep->d_name);
+    DIR *tp = opendir(fn);
+    if(!tp) continue;
+    struct dirent *tep;
+    while((tep = readdir(tp)))
+    {
+      const size_t len = strlen(tep->d_name);
+      if(len <= 4 || strcasecmp(tep->d_name + len - 4, ".cfg")) continue;
+      snprintf(fn, sizeof(fn), "%s/%s/%s", dirname, ep->d_name, tep->d_name);
+      if(!fs_realpath(fn, path)) continue;
+      tags_write(t, 1, ep->d_name, path);
+      cnt++;
+    }
+    closedir(tp);
+  }
+  closedir(dp);
+  if(cnt) dt_log(s_log_db, "imported %u tagged images from `%s'", cnt, dirname);
+}
+
+dt_db_tags_t *dt_db_tags_open(const char *filename, const char *import_dir)
+{
+  dt_db_tags_t *t = calloc(sizeof(dt_db_tags_t), 1);
+  dt_stringpool_init(&t->sp_tag, 64, 16);
+  dt_stringpool_init(&t->sp_path, 1024, 100);
+  snprintf(t->filename, sizeof(t->filename), "%s", filename);
+  t->fd = open(filename, O_RDWR|O_BINARY);
+  if(t->fd >= 0)
+  {
+    struct stat sb = {0};
+    fstat(t->fd, &sb);
+    char *buf = malloc(sb.st_size + 1);
+    const dt_db_tags_header_t *hdr = (const dt_db_tags_header_t *)buf;
+    if(sb.st_size < (off_t)sizeof(*hdr) || read(t->fd, buf, sb.st_size) != sb.st_size ||
+       memcmp(hdr->magic, "vkdttag", 8) || hdr->version != DT_DB_TAGS_VERSION)
+    {
+      dt_log(s_log_db|s_log_err, "`%s' is corrupt, starting from scratch", filename);
+      close(t->fd);
+      t->fd = -1;
+    }
+    else
+    {
+      size_t pos = sizeof(*hdr);
+      while(pos + sizeof(dt_db_tags_record_t) <= sb.st_size)
+      {
+        dt_db_tags_record_t rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        if(pos + sizeof(rec) + rec.tag_len + rec.path_len > sb.st_size) break; // cut short by a crash
+        const char *tag = buf + pos + sizeof(rec);
+        tags_apply(t, rec.add, tag, rec.tag_len, tag + rec.tag_len, rec.path_len);
+        pos += sizeof(rec) + rec.tag_len + rec.path_len;
+      }
+      lseek(t->fd, pos, SEEK_SET); // overwrite what's left of a broken record
+    }
+    free(buf);
+    if(t->fd >= 0) return t;
+  }
+  t->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  const dt_db_tags_header_t hdr = { .magic = "vkdttag", .version = DT_DB_TAGS_VERSION };
+  if(t->fd < 0 || write(t->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    dt_log(s_log_db|s_log_err, "could not write tag index `%s'", filename);
+  if(import_dir) tags_import(t, import_dir);
+  return t;
+}
+
+void dt_db_tags_close(dt_db_tags_t *t)
+{
+  if(!t) return;
+  if(t->fd >= 0) close(t->fd);
+  for(uint32_t i=0;i<t->tag_cnt;i++)
+  {
+    free(t->tag[i].id);
+    free(t->tag[i].bits);
+  }
+  free(t->tag);
+  free(t->path);
+  dt_stringpool_cleanup(&t->sp_tag);
+  dt_stringpool_cleanup(&t->sp_path);
+  free(t);
+}
+
+int dt_db_tags_add(dt_db_tags_t *t, const char *tag, const char *path)
+{
+  return tags_write(t, 1, tag, path);
+}
+
+int dt_db_tags_remove(dt_db_tags_t *t, const char *tag, const char *path)
+{
+  return tags_write(t, 0, tag, path);
+}
+
+uint32_t dt_db_tags_image_cnt(const dt_db_tags_t *t)
+{
+  return t->path_cnt;
+}
+
+const char *dt_db_tags_image_path(const dt_db_tags_t *t, uint32_t i)
+{
+  return i < t->path_cnt ? t->path[i] : 0;
+}
+
+typedef struct dt_db_tags_parser_t
+{
+  dt_db_tags_t *t;
+  const char   *c;      // current position in the query
+  uint32_t      words;  // size of the bitsets
+  int           err;
+}
+dt_db_tags_parser_t;
+
+static uint64_t *parse_or(dt_db_tags_parser_t *p);
+
+static void
+parse_space(dt_db_tags_parser_t *p)
+{
+  while(*p->c == ' ' || *p->c == '\t') p->c++;
+}
+
+static uint64_t * // tag name, !factor, or (expression)
+parse_factor(dt_db_tags_parser_t *p)
+{
+  parse_space(p);
+  if(*p->c == '!')
+  {
+    p->c++;
+    uint64_t *b = parse_factor(p);
+    for(uint32_t w=0;w<p->words;w++) b[w] = ~b[w];
+    if(p->t->path_cnt & 63) b[p->words-1] &= (1ull<<(p->t->path_cnt & 63))-1;
+    return b;
+  }
+  if(*p->c == '(')
+  {
+    p->c++;
+    uint64_t *b = parse_or(p);
+    parse_space(p);
+    if(*p->c == ')') p->c++;
+    else p->err = 1;
+    return b;
+  }
+  uint64_t *b = calloc(sizeof(uint64_t), p->words);
+  const char *beg = p->c;
+  while(*p->c && !strchr("&|!()", *p->c)) p->c++;
+  uint32_t len = p->c - beg;
+  while(len && (beg[len-1] == ' ' || beg[len-1] == '\t')) len--;
+  if(!len)
+  {
+    p->err = 1;
+    return b;
+  }
+  const uint32_t tid = tags_tag(p->t, beg, len, 0);
+  if(tid == -1u) return b; // nobody has this tag
+  dt_db_tags_list_t *l = p->t->tag + tid;
+  if(!l->bits || l->words != p->words)
+  { // keep the bitset around, the next query will only combine words
+    free(l->bits);
+    l->bits  = calloc(sizeof(uint64_t), p->words);
+    l->words = p->words;
+    for(uint32_t i=0;i<l->cnt;i++) l->bits[l->id[i]/64] |= 1ull<<(l->id[i]&63);
+  }
+  memcpy(b, l->bits, sizeof(uint64_t)*p->words);
+  return b;
+}
+
+static uint64_t *
+parse_and(dt_db_tags_parser_t *p)
+{
+  uint64_t *b = parse_factor(p);
+  while(parse_space(p), *p->c == '&')
+  {
+    p->c++;
+    uint64_t *f = parse_factor(p);
+    for(uint32_t w=0;w<p->words;w++) b[w] &= f[w];
+    free(f);
+  }
+  return b;
+}
+
+static uint64_t *
+parse_or(dt_db_tags_parser_t *p)
+{
+  uint64_t *b = parse_and(p);
+  while(parse_space(p), *p->c == '|')
+  {
+    p->c++;
+    uint64_t *f = parse_and(p);
+    for(uint32_t w=0;w<p->words;w++) b[w] |= f[w];
+    free(f);
+  }
+  return b;
+}
+
+int dt_db_tags_query(dt_db_tags_t *t, const char *query, uint64_t **bits)
+{
+  dt_db_tags_parser_t p = { .t = t, .c = query, .words = MAX(1, (t->path_cnt + 63)/64) };
+  uint64_t *b = parse_or(&p);
+  if(*p.c) p.err = 1; // stray closing parenthesis
+  if(p.err)
+  {
+    free(b);
+    *bits = 0;
+    return -1;
+  }
+  int cnt = 0;
+  for(uint32_t w=0;w<p.words;w++) cnt += __builtin_popcountll(b[w]);
+  *bits = b;
+  return cnt;
+}
+
+int dt_db_tags_export(dt_db_tags_t *t, const char *query, const char *dirname)
+{
+  uint64_t *bits = 0;
+  const int cnt = dt_db_tags_query(t, query, &bits);
+  if(cnt < 0) return -1;
+  fs_mkdir_p(dirname, 0755);
+  DIR *dp = opendir(dirname);
+  if(!dp)
+  {
+    free(bits);
+    return -1;
+  }
+  char fn[PATH_MAX+300];
+  struct dirent *ep;
+  while((ep = readdir(dp)))
+  { // clear out the last query
+    const size_t len = strlen(ep->d_name);
+    if(len <= 4 || strcasecmp(ep->d_name + len - 4, ".cfg")) continue;
+    snprintf(fn, sizeof(fn), "%s/%s", dirname, ep->d_name);
+    fs_delete(fn);
+  }
+  closedir(dp);
+  // same names as in the tag directories
+  for(uint32_t w=0;w<(t->path_cnt+63)/64;w++) for(uint64_t m=bits[w];m;m&=m-1)
+  {
+    const char *path = t->path[64*w + __builtin_ctzll(m)];
+    snprintf(fn, sizeof(fn), "%s/%"PRIx64".cfg", dirname, hash64(path));
+    fs_symlink(path, fn);
+  }
+  free(bits);
+  return cnt;
+}
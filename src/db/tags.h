@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// index of tags for all images, in ~/.config/vkdt/tags.idx. for every tag
+// it keeps the sorted list of images (full path of the .cfg, resolved). the
+// file is an append-only list of records "add/remove image to/from tag", it
+// is read once into memory.
+//
+// queries combine tags with & (and), | (or), ! (not) and parentheses, for
+// instance "best & (family | friends) & !blurry". tag names may contain
+// spaces. they are evaluated on bitsets with one bit per image in the index.
+//
+// the directories of symlinks in ~/.config/vkdt/tags/<tag>/ are still
+// written, they are what the gui opens as collection. if there is no index
+// file yet, it is created from them.
+
+typedef struct dt_db_tags_t dt_db_tags_t;
+
+// read the index from filename. if the file does not exist, import the
+// symlink directories below import_dir (may be 0). never returns 0.
+dt_db_tags_t *dt_db_tags_open(const char *filename, const char *import_dir);
+void dt_db_tags_close(dt_db_tags_t *t);
+
+// add the image with the given cfg path to the tag, or remove it. both write
+// to the index file right away. return non-zero on failure.
+int dt_db_tags_add   (dt_db_tags_t *t, const char *tag, const char *path);
+int dt_db_tags_remove(dt_db_tags_t *t, const char *tag, const char *path);
+
+// number of images in the index, and the cfg path of image i
+uint32_t    dt_db_tags_image_cnt(const dt_db_tags_t *t);
+const char *dt_db_tags_image_path(const dt_db_tags_t *t, uint32_t i);
+
+// evaluate the query. *bits receives a bitset with one bit per image in the
+// index (free() it). returns the number of matching images, or -1 if the
+// query does not parse. unknown tags match no image.
+int dt_db_tags_query(dt_db_tags_t *t, const char *query, uint64_t **bits);
+
+// make dirname a directory of symlinks to all images matching the query,
+// such that it can be opened as collection. other .cfg files in there are
+// removed. returns the number of images or -1 on failure.
+int dt_db_tags_export(dt_db_tags_t *t, const char *query, const char *dirname);
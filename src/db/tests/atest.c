@@ -0,0 +1,227 @@
+// thumbnail archive: write, replace and remove entries, reopen, compact,
+// time lookups against one file per entry, and garbage collect.
+// make atest && ./atest
+#include "../archive.h"
+#include "core/fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// entry i in generation g: size and content depend on both
+static uint32_t entry_size(uint32_t i, uint32_t g) { return 16 + ((i*2654435761u + g) % 50000); }
+static void
+entry_fill(uint8_t *buf, uint32_t i, uint32_t g)
+{
+  for(uint32_t k=0;k<entry_size(i, g);k++) buf[k] = i + 7*g + k;
+}
+
+static void
+check(dt_archive_t *a, uint32_t cnt, const uint32_t *gen)
+{
+  uint8_t *buf = malloc(100000), *ref = malloc(100000);
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    int64_t len = dt_archive_get(a, 1000+i, buf, 0, 100000);
+    if(gen[i] == -1u) { assert(len == -1); continue; }
+    assert(len == entry_size(i, gen[i]));
+    entry_fill(ref, i, gen[i]);
+    assert(!memcmp(buf, ref, len));
+    uint32_t part[2];
+    assert(dt_archive_get(a, 1000+i, part, 8, 8) == len);
+    assert(!memcmp(part, ref+8, 8));
+  }
+  free(buf);
+  free(ref);
+}
+
+typedef struct reader_t
+{ // looks up entries while the gc runs
+  dt_archive_t *a;
+  uint32_t      cnt;
+  atomic_int    stop;
+  double        max;  // longest lookup
+}
+reader_t;
+
+static void *
+reader(void *arg)
+{
+  reader_t *r = arg;
+  uint8_t *buf = malloc(100000);
+  for(uint32_t i=0;!atomic_load(&r->stop);i=(i+1)%r->cnt)
+  {
+    const double beg = now();
+    dt_archive_get(r->a, 1000+i, buf, 0, 100000);
+    const double t = now() - beg;
+    if(t > r->max) r->max = t;
+  }
+  free(buf);
+  return 0;
+}
+
+static int
+segments(const char *dirname)
+{
+  int cnt = 0;
+  DIR *dp = opendir(dirname);
+  struct dirent *ep;
+  while((ep = readdir(dp))) cnt += strstr(ep->d_name, ".seg") != 0;
+  closedir(dp);
+  return cnt;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *dir = "/tmp/vkdt-atest";
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  if(system(cmd)) exit(1);
+
+  const uint32_t cnt = 20000; // more than the initial index, about 500MB
+  uint32_t *gen = calloc(sizeof(uint32_t), cnt);
+  uint8_t *buf = malloc(100000);
+  dt_archive_t *a = dt_archive_open(dir);
+  assert(a);
+  assert(dt_archive_open(dir) == a); // same one, counted
+  dt_archive_close(a);
+
+  double beg = now();
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    entry_fill(buf, i, 0);
+    assert(!dt_archive_put(a, 1000+i, buf, entry_size(i, 0)));
+  }
+  double end = now();
+  fprintf(stdout, "put %u entries in %.3fs\n", cnt, end-beg);
+  check(a, cnt, gen);
+
+  char fn[256];
+  snprintf(fn, sizeof(fn), "%s/3e8.bc1", dir);
+  uint64_t key = 0;
+  assert(dt_archive_find(fn, &key) == a && key == 1000);
+  assert(!dt_archive_find("/tmp/vkdt-atest/x/3e8.bc1", &key));
+  assert(!dt_archive_find("/tmp/vkdt-atestx/3e8.bc1", &key));
+
+  // replace most of the first half, remove some:
+  for(uint32_t i=0;i<cnt/2;i++)
+  {
+    if(i % 10 == 0) continue;
+    gen[i] = 1;
+    entry_fill(buf, i, 1);
+    assert(!dt_archive_put(a, 1000+i, buf, entry_size(i, 1)));
+  }
+  for(uint32_t i=0;i<cnt;i+=7) { dt_archive_remove(a, 1000+i); gen[i] = -1u; }
+  check(a, cnt, gen);
+  const int seg_before = segments(dir);
+  dt_archive_close(a);
+
+  // reopen: compacts the first segments, which are mostly garbage now
+  beg = now();
+  a = dt_archive_open(dir);
+  end = now();
+  assert(a);
+  fprintf(stdout, "reopen and compact in %.3fs, %d -> %d segments\n", end-beg, seg_before, segments(dir));
+  assert(segments(dir) < seg_before);
+  check(a, cnt, gen);
+
+  // a second process would not get the archive. in this process it's shared:
+  for(uint32_t i=0;i<cnt;i+=7)
+  {
+    gen[i] = 2;
+    entry_fill(buf, i, 2);
+    assert(!dt_archive_put(a, 1000+i, buf, entry_size(i, 2)));
+  }
+  int64_t mtime;
+  assert(dt_archive_stat(a, 1000, &mtime) == entry_size(0, 2) && mtime > 0);
+  dt_archive_close(a);
+  a = dt_archive_open(dir);
+  for(uint32_t i=0;i<cnt;i++) dt_archive_prefetch(a, 1000+i); // also the removed ones
+  dt_archive_prefetch(a, 77);
+  check(a, cnt, gen);
+
+  // random lookups vs files
+  uint32_t *idx = malloc(sizeof(uint32_t)*cnt);
+  for(uint32_t i=0;i<cnt;i++) idx[i] = (i * 2654435761u) % cnt;
+  beg = now();
+  for(uint32_t i=0;i<cnt;i++) dt_archive_get(a, 1000+idx[i], buf, 0, 100000);
+  end = now();
+  fprintf(stdout, "archive: %.2fus per lookup\n", 1e6*(end-beg)/cnt);
+  for(uint32_t i=0;i<2000;i++)
+  {
+    snprintf(fn, sizeof(fn), "%s/%x.file", dir, i);
+    FILE *f = fopen(fn, "wb");
+    fwrite(buf, entry_size(i, 0), 1, f);
+    fclose(f);
+  }
+  beg = now();
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    snprintf(fn, sizeof(fn), "%s/%x.file", dir, idx[i]%2000);
+    FILE *f = fopen(fn, "rb");
+    if(fread(buf, 1, 100000, f) == 0) exit(1);
+    fclose(f);
+  }
+  end = now();
+  fprintf(stdout, "files:   %.2fus per lookup\n", 1e6*(end-beg)/cnt);
+
+  // garbage collect down to half the size. what is left has to be intact:
+  const uint64_t size = dt_archive_size(a);
+  const int seg_full = segments(dir);
+  assert(dt_archive_gc(a, 0) == 0 && dt_archive_gc(a, 2*size) == 0);
+  reader_t rd = { .a = a, .cnt = cnt };
+  pthread_t rt;
+  pthread_create(&rt, 0, reader, &rd);
+  beg = now();
+  const uint64_t freed = dt_archive_gc(a, size/2);
+  end = now();
+  atomic_store(&rd.stop, 1);
+  pthread_join(rt, 0);
+  assert(freed >= size/2 && dt_archive_size(a) == size - freed && dt_archive_size(a) <= size/2/8*7);
+  fprintf(stdout, "gc to half the size in %.3fs, %d -> %d segments, longest lookup meanwhile %.2fms\n",
+      end-beg, seg_full, segments(dir), 1e3*rd.max);
+  assert(segments(dir) < seg_full);
+  uint32_t left = 0;
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    if(gen[i] == -1u) continue;
+    if(dt_archive_get(a, 1000+i, 0, 0, 0) < 0) gen[i] = -1u;
+    else left++;
+  }
+  assert(left > 0);
+  check(a, cnt, gen);
+  dt_archive_close(a);
+  a = dt_archive_open(dir);
+  assert(dt_archive_size(a) == size - freed);
+  check(a, cnt, gen);
+  dt_archive_close(a);
+
+  // a truncated index starts over instead of disabling the archive:
+  snprintf(fn, sizeof(fn), "%s/index", dir);
+  assert(!truncate(fn, 1000));
+  a = dt_archive_open(dir);
+  assert(a && dt_archive_size(a) == 0 && dt_archive_get(a, 1000+1, 0, 0, 0) < 0);
+  entry_fill(buf, 1, 0);
+  assert(!dt_archive_put(a, 1000+1, buf, entry_size(1, 0)));
+  dt_archive_close(a);
+
+  if(system(cmd)) exit(1);
+  free(idx);
+  free(buf);
+  free(gen);
+  fprintf(stdout, "all good\n");
+  exit(0);
+}
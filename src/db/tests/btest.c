@@ -0,0 +1,86 @@
+// bc1 thumbnail throughput for the different worker placement policies.
+// compresses a stack of synthetic thumbnails the way o-bc1 does, one
+// thumbnail per work item, with a couple of workers each (like db/thumbnails.c).
+// clang -Wall -march=native -O3 btest.c ../../core/threads.c -I../../core -o btest -lpthread -lm && ./btest
+#include "threads.h"
+#include "core.h"
+#define STB_DXT_IMPLEMENTATION
+#include "../../pipe/modules/o-bc1/stb_dxt.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NUM_THUMBS 256
+#define THUMB_WD   400
+#define THUMB_HT   268
+
+typedef struct bench_t
+{
+  const uint8_t *in;  // one rgba8 image, the same for all thumbnails
+  uint8_t       *out; // NUM_THUMBS compressed buffers
+}
+bench_t;
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void
+compress(uint32_t item, void *data)
+{
+  bench_t *b = data;
+  const int bx = THUMB_WD/4, by = THUMB_HT/4;
+  uint8_t *out = b->out + 8*bx*by*(size_t)item;
+  for(int j=0;j<4*by;j+=4) for(int i=0;i<4*bx;i+=4)
+  {
+    uint8_t block[64];
+    for(int jj=0;jj<4;jj++) for(int ii=0;ii<4;ii++) for(int c=0;c<4;c++)
+      block[4*(4*jj+ii)+c] = b->in[4*(THUMB_WD*(j+jj)+(i+ii))+c];
+    stb_compress_dxt_block(out + 8*(bx*(j/4)+(i/4)), block, 0, 0);
+  }
+}
+
+int main()
+{
+  uint8_t *in = malloc(4*THUMB_WD*THUMB_HT);
+  for(int j=0;j<THUMB_HT;j++) for(int i=0;i<THUMB_WD;i++)
+  { // something that is not trivially flat
+    in[4*(THUMB_WD*j+i)+0] = i*255/THUMB_WD;
+    in[4*(THUMB_WD*j+i)+1] = j*255/THUMB_HT;
+    in[4*(THUMB_WD*j+i)+2] = (i*j) & 0xff;
+    in[4*(THUMB_WD*j+i)+3] = 255;
+  }
+  bench_t b = { .in = in, .out = malloc(8*(THUMB_WD/4)*(THUMB_HT/4)*(size_t)NUM_THUMBS) };
+  const char *policy[] = { 0, "compact", "spread", "performance" };
+  for(int p=0;p<4;p++)
+  {
+    if(policy[p]) setenv("VKDT_THREAD_PLACEMENT", policy[p], 1);
+    threads_global_init();
+    for(int workers=1;;workers=MIN(2*workers, threads_num()))
+    {
+      double best = 1e10;
+      for(int it=0;it<5;it++)
+      {
+        const double beg = now();
+        int taskid = threads_task("bc1", NUM_THUMBS, -1, &b, compress, 0, s_threads_prio_background);
+        for(int k=1;k<workers;k++)
+          threads_task("bc1", NUM_THUMBS, taskid, &b, compress, 0, s_threads_prio_background);
+        threads_wait(taskid);
+        const double t = now() - beg;
+        if(t < best) best = t;
+      }
+      fprintf(stderr, "%-12s %2d/%2d workers: %8.1f thumbnails/s\n",
+          policy[p] ? policy[p] : "default", workers, threads_num(), NUM_THUMBS/best);
+      if(workers == threads_num()) break;
+    }
+    threads_global_cleanup();
+  }
+  free(b.out);
+  free(in);
+  exit(0);
+}
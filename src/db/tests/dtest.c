@@ -0,0 +1,113 @@
+// task dependencies: run a three stage pipeline (decode -> convert -> write)
+// for a bunch of images. every stage is its own job that waits for the
+// previous stage of the same image, so stages of different images overlap.
+// clang -Wall -march=native -O3 dtest.c ../../core/threads.c -I../../core -o dtest -lpthread -lm && ./dtest
+#include "threads.h"
+#include "core.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_IMG 64
+#define NUM_STAGE 3
+
+typedef struct image_t
+{
+  atomic_uint stage[NUM_STAGE]; // number of finished work items per stage
+  uint32_t    items;            // work items per stage (i.e. tiles)
+}
+image_t;
+
+typedef struct stage_t
+{
+  image_t *img;
+  int      s;
+}
+stage_t;
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void
+run(uint32_t item, void *data)
+{
+  stage_t *st = data;
+  // the previous stage needs to be completely done:
+  if(st->s > 0) assert(st->img->stage[st->s-1] == st->img->items);
+  const double t = now();
+  while(now() - t < 50e-6) ; // pretend to work
+  st->img->stage[st->s]++;
+}
+
+static atomic_int gate;
+static void nop(uint32_t item, void *data) { }
+static void block(uint32_t item, void *data) { while(!atomic_load(&gate)) ; }
+
+int main()
+{
+  threads_global_init();
+  image_t *img = calloc(sizeof(image_t), NUM_IMG);
+  stage_t *st  = calloc(sizeof(stage_t), NUM_IMG*NUM_STAGE);
+  int last[NUM_IMG];
+  const int lag = MAX(0, 10*threads_num()/(2*NUM_STAGE) - 2);
+  const double beg = now();
+  for(int i=0;i<NUM_IMG;i++)
+  {
+    img[i].items = 16;
+    int taskid = -1;
+    for(int s=0;s<NUM_STAGE;s++)
+    {
+      st[NUM_STAGE*i+s] = (stage_t){ .img = img+i, .s = s };
+      int prev = taskid;
+      taskid = threads_task_after("stage", img[i].items, &prev, s ? 1 : 0,
+          st+NUM_STAGE*i+s, run, 0, s_threads_prio_normal);
+      assert(taskid >= 0);
+      // a second thread helping out waits for the same dependencies:
+      threads_task("stage", img[i].items, taskid, st+NUM_STAGE*i+s, run, 0, s_threads_prio_normal);
+    }
+    last[i] = taskid;
+    // don't run out of tasks, the pool only has 10 per thread:
+    if(i >= lag) threads_wait(last[i-lag]);
+  }
+  for(int i=0;i<NUM_IMG;i++) threads_wait(last[i]);
+  const double end = now();
+  for(int i=0;i<NUM_IMG;i++) for(int s=0;s<NUM_STAGE;s++)
+    assert(img[i].stage[s] == img[i].items);
+  fprintf(stderr, "%d images x %d stages x %d items on %d threads: %.2f ms\n",
+      NUM_IMG, NUM_STAGE, img[0].items, threads_num(), 1e3*(end-beg));
+
+  // the id of a finished job must not refer to the next job in the same slot
+  // (the slot is in the low 16 bits of the id):
+  int old = threads_task("old", 1, -1, 0, nop, 0, s_threads_prio_normal);
+  threads_wait(old);
+  usleep(10000); // the worker puts the slot back to the pool right after we woke up
+  int blocker[4096], cnt = 0;
+  while(cnt < 4096)
+  {
+    blocker[cnt] = threads_task("block", 1, -1, 0, block, 0, s_threads_prio_background);
+    assert(blocker[cnt] >= 0);
+    if((blocker[cnt++] & 0xffff) == (old & 0xffff)) break;
+  }
+  assert(blocker[cnt-1] != old);
+  assert(!threads_task_running(old));
+  threads_task_abort(old); // must not hit the blocker
+  atomic_store(&gate, 1);
+  for(int i=0;i<cnt;i++)
+  {
+    assert(threads_task_running(blocker[i]) || threads_task_progress(blocker[i]) == 1.0f);
+    threads_wait(blocker[i]);
+  }
+  free(st);
+  free(img);
+  threads_global_cleanup();
+  exit(0);
+}
@@ -0,0 +1,246 @@
+// exif reader: write small tiff and jpeg files and check what comes back. with
+// arguments, print what is found in these files and the time it took.
+// make etest && ./etest [files..]
+#include "../exif.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+typedef struct buf_t { uint8_t d[4096]; uint32_t n; int be; } buf_t;
+
+static void put16(buf_t *b, uint32_t o, uint16_t v)
+{
+  if(b->be) { b->d[o] = v>>8; b->d[o+1] = v; }
+  else      { b->d[o] = v; b->d[o+1] = v>>8; }
+}
+static void put32(buf_t *b, uint32_t o, uint32_t v)
+{
+  if(b->be) { put16(b, o, v>>16); put16(b, o+2, v); }
+  else      { put16(b, o, v); put16(b, o+2, v>>16); }
+}
+
+static uint32_t // append data, return its offset
+append(buf_t *b, const void *data, uint32_t len)
+{
+  uint32_t o = b->n;
+  memcpy(b->d + o, data, len);
+  b->n += (len + 1) & ~1u;
+  return o;
+}
+
+typedef struct entry_t { uint16_t tag, type; uint32_t cnt, val; } entry_t;
+
+static uint32_t // append a directory, return its offset
+ifd(buf_t *b, const entry_t *e, int cnt, uint32_t next)
+{
+  uint32_t o = b->n;
+  put16(b, o, cnt);
+  for(int i=0;i<cnt;i++)
+  {
+    put16(b, o+2+12*i, e[i].tag);
+    put16(b, o+4+12*i, e[i].type);
+    put32(b, o+6+12*i, e[i].cnt);
+    if(e[i].type == 3 && e[i].cnt == 1) { put32(b, o+10+12*i, 0); put16(b, o+10+12*i, e[i].val); }
+    else put32(b, o+10+12*i, e[i].val);
+  }
+  put32(b, o+2+12*cnt, next);
+  b->n += 6 + 12*cnt;
+  return o;
+}
+
+static uint32_t // rational num/den
+rational(buf_t *b, uint32_t num, uint32_t den)
+{
+  uint32_t o = b->n;
+  put32(b, o, num); put32(b, o+4, den);
+  b->n += 8;
+  return o;
+}
+
+static void // a raw-ish tiff: ifd0 with a preview strip and exif, ifd1 with a small jpeg
+tiff(buf_t *b, int be)
+{
+  memset(b, 0, sizeof(*b));
+  b->be = be;
+  memcpy(b->d, be ? "MM" : "II", 2);
+  put16(b, 2, 42);
+  b->n = 8;
+  const uint8_t jpg[64] = {0xff, 0xd8};
+  uint32_t make  = append(b, "Canon", 6);
+  uint32_t model = append(b, "Canon EOS 5D Mark II", 21);
+  uint32_t date  = append(b, "2011:12:13 14:15:16", 20);
+  uint32_t prv   = append(b, jpg, 64);
+  uint32_t thm   = append(b, jpg, 16);
+  uint32_t exp   = rational(b, 1, 250);
+  uint32_t fnum  = rational(b, 28, 10);
+  uint32_t flen  = rational(b, 85, 1);
+  entry_t ex[] = {
+    {0x829a, 5, 1, exp}, {0x829d, 5, 1, fnum}, {0x8827, 3, 1, 1600},
+    {0x9003, 2, 20, date}, {0x920a, 5, 1, flen}, {0xa002, 4, 1, 5616}, {0xa003, 4, 1, 3744},
+  };
+  uint32_t exif = ifd(b, ex, 7, 0);
+  entry_t e1[] = { {0x0100, 3, 1, 160}, {0x0101, 3, 1, 120}, {0x0201, 4, 1, thm}, {0x0202, 4, 1, 16} };
+  uint32_t ifd1 = ifd(b, e1, 4, 0);
+  entry_t e0[] = {
+    {0x0100, 3, 1, 1024}, {0x0101, 3, 1, 680},
+    {0x0103, 3, 1, 6}, {0x010f, 2, 6, make}, {0x0110, 2, 21, model}, {0x0111, 4, 1, prv},
+    {0x0112, 3, 1, 6}, {0x0117, 4, 1, 64}, {0x8769, 4, 1, exif},
+  };
+  put32(b, 4, ifd(b, e0, 9, ifd1));
+}
+
+static void // wrap the tiff into the app1 segment of a jpeg
+jpeg(buf_t *j, const buf_t *b)
+{
+  const uint8_t h[] = {0xff, 0xd8, 0xff, 0xe0, 0, 4, 0, 0, 0xff, 0xe1, (b->n+8)>>8, (b->n+8)&0xff, 'E', 'x', 'i', 'f', 0, 0};
+  memset(j, 0, sizeof(*j));
+  memcpy(j->d, h, sizeof(h));
+  memcpy(j->d + sizeof(h), b->d, b->n);
+  j->n = sizeof(h) + b->n;
+  memcpy(j->d + j->n, (uint8_t[]){0xff, 0xda, 0, 2, 0xff, 0xd9}, 6);
+  j->n += 6;
+}
+
+static uint32_t // append an iso media box header, return its offset
+box(buf_t *c, const char *type, uint32_t size)
+{
+  const uint32_t o = c->n;
+  c->be = 1;
+  put32(c, o, size);
+  memcpy(c->d + o + 4, type, 4);
+  c->n += 8;
+  return o;
+}
+
+static void
+check(const char *filename, const char *date, uint32_t preview_len)
+{
+  dt_db_exif_t ex;
+  assert(!dt_db_exif_read(filename, &ex));
+  assert(!strcmp(ex.createdate, date));
+  assert(!strcmp(ex.maker, "Canon"));
+  assert(!strcmp(ex.model, "Canon EOS 5D Mark II"));
+  assert(ex.orientation == 6);
+  assert(ex.iso == 1600);
+  assert(fabsf(ex.exposure - 1.0f/250.0f) < 1e-6f);
+  assert(fabsf(ex.aperture - 2.8f) < 1e-6f);
+  assert(ex.focal_length == 85.0f);
+  assert(ex.preview_len == preview_len);
+  assert(ex.wd == 5616 && ex.ht == 3744); // the largest, not the preview or thumbnail
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc > 1)
+  {
+    double beg = now();
+    for(int i=1;i<argc;i++)
+    {
+      dt_db_exif_t ex;
+      int err = dt_db_exif_read(argv[i], &ex);
+      fprintf(stdout, "%s: %s%s %s %s %ux%u iso %u %gs f/%.1f %gmm orientation %u preview %u bytes at %lu\n",
+          argv[i], err ? "(no exif) " : "", ex.createdate, ex.maker, ex.model, ex.wd, ex.ht, ex.iso,
+          ex.exposure, ex.aperture, ex.focal_length, ex.orientation, ex.preview_len, (unsigned long)ex.preview_off);
+    }
+    fprintf(stdout, "%d files in %.3fms\n", argc-1, 1000.0*(now()-beg));
+    exit(0);
+  }
+  buf_t b;
+  for(int be=0;be<2;be++)
+  {
+    tiff(&b, be);
+    FILE *f = fopen("etest.tif", "wb");
+    fwrite(b.d, b.n, 1, f);
+    fclose(f);
+    check("etest.tif", "2011:12:13 14:15:16", 64);
+  }
+  buf_t j, c;
+  { // the same tiff in the app1 segment of a jpeg
+    tiff(&b, 0);
+    jpeg(&j, &b);
+    FILE *f = fopen("etest.jpg", "wb");
+    fwrite(j.d, j.n, 1, f);
+    fclose(f);
+    check("etest.jpg", "2011:12:13 14:15:16", 64);
+  }
+  { // fuji raf: the jpeg behind a header that points to it, the whole jpeg is the preview
+    memset(&c, 0, sizeof(c));
+    c.be = 1;
+    memcpy(c.d, "FUJIFILMCCD-RAW 0201FF383501", 28);
+    put32(&c, 84, 160);
+    put32(&c, 88, j.n);
+    memcpy(c.d + 160, j.d, j.n);
+    c.n = 160 + j.n;
+    FILE *f = fopen("etest.raf", "wb");
+    fwrite(c.d, c.n, 1, f);
+    fclose(f);
+    check("etest.raf", "2011:12:13 14:15:16", j.n);
+  }
+  { // canon cr3: the tiff as CMT1 in the canon uuid in moov, the preview in a uuid box after moov
+    static const uint8_t canon[16] = {0x85,0xc0,0xb6,0x87,0x82,0x0f,0x11,0xe0,0x81,0x11,0xf4,0xce,0x46,0x2b,0x6a,0x48};
+    static const uint8_t preview[16] = {0xea,0xf4,0x2b,0x5e,0x1c,0x98,0x4b,0x88,0xb9,0xfb,0xb7,0xdc,0x40,0x6e,0x4d,0x16};
+    tiff(&b, 0);
+    memset(&c, 0, sizeof(c));
+    box(&c, "ftyp", 24);
+    memcpy(c.d + c.n, "crx \0\0\0\1crx isom", 16);
+    c.n += 16;
+    const uint32_t moov = box(&c, "moov", 0);
+    const uint32_t uuid = box(&c, "uuid", 0);
+    append(&c, canon, 16);
+    box(&c, "CMT1", 8 + b.n);
+    append(&c, b.d, b.n);
+    c.be = 1;
+    put32(&c, uuid, c.n - uuid);
+    put32(&c, moov, c.n - moov);
+    const uint32_t prv = box(&c, "uuid", 8 + 16 + 8 + 24 + 300);
+    append(&c, preview, 16);
+    c.n += 8;
+    box(&c, "PRVW", 24 + 300);
+    c.n += 16; // unknown, width, height, jpeg size
+    c.d[c.n] = 0xff; c.d[c.n+1] = 0xd8;
+    c.n += 300;
+    assert(c.n - prv == 8 + 16 + 8 + 24 + 300);
+    box(&c, "mdat", 16);
+    c.n += 8;
+    FILE *f = fopen("etest.cr3", "wb");
+    fwrite(c.d, c.n, 1, f);
+    fclose(f);
+    check("etest.cr3", "2011:12:13 14:15:16", 300);
+  }
+  { // loop in the directory chain
+    tiff(&b, 0);
+    const uint32_t ifd0 = b.d[4] | (b.d[5]<<8);
+    put32(&b, ifd0 + 2 + 12*9, ifd0);
+    FILE *f = fopen("etest.tif", "wb");
+    fwrite(b.d, b.n, 1, f);
+    fclose(f);
+    check("etest.tif", "2011:12:13 14:15:16", 64);
+    put32(&b, 4, 8); // garbage directory
+    f = fopen("etest.tif", "wb");
+    fwrite(b.d, b.n, 1, f);
+    fclose(f);
+    dt_db_exif_t ex;
+    dt_db_exif_read("etest.tif", &ex);
+    assert(strlen(ex.createdate) == 19); // from the file
+  }
+  double beg = now();
+  for(int i=0;i<10000;i++) check("etest.jpg", "2011:12:13 14:15:16", 64);
+  fprintf(stdout, "%.2fus per file\n", 100.0*(now()-beg));
+  remove("etest.tif");
+  remove("etest.jpg");
+  remove("etest.raf");
+  remove("etest.cr3");
+  fprintf(stdout, "all good\n");
+  exit(0);
+}
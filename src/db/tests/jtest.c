@@ -0,0 +1,123 @@
+// thumbnails from embedded jpeg previews: write a jpeg into the middle of a
+// fake raw file, make bc1 thumbnails of it in different orientations and
+// check size and where the red corner ends up. then time a full size preview.
+// make jtest && ./jtest
+#include "../preview.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jpeglib.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// grey image with a red top left quadrant, behind off bytes of junk
+static size_t
+write_file(const char *fn, int wd, int ht, uint64_t off)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  unsigned char *mem = 0;
+  unsigned long len = 0;
+  jpeg_mem_dest(&cinfo, &mem, &len);
+  cinfo.image_width = wd;
+  cinfo.image_height = ht;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 90, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  uint8_t *row = malloc(3*wd);
+  while(cinfo.next_scanline < ht)
+  {
+    for(int i=0;i<wd;i++)
+    {
+      const int red = i < wd/2 && cinfo.next_scanline < ht/2;
+      row[3*i+0] = red ? 255 : 128;
+      row[3*i+1] = red ?   0 : 128;
+      row[3*i+2] = red ?   0 : 128;
+    }
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(row);
+  FILE *f = fopen(fn, "wb");
+  for(uint64_t k=0;k<off;k++) fputc(k, f);
+  fwrite(mem, len, 1, f);
+  fclose(f);
+  free(mem);
+  return len;
+}
+
+static int // 1 if the block at pixel x, y of the bc1 thumbnail is red
+is_red(const uint32_t *data, int x, int y)
+{
+  const uint8_t *b = (const uint8_t *)(data + 4) + 8*((data[2]/4)*(y/4) + x/4);
+  const uint16_t c = b[0] | (b[1] << 8);
+  const int r = (c >> 11) & 31, g = (c >> 5) & 63;
+  return r > 20 && g < 30;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *fn = "/tmp/vkdt-jtest.raw";
+  const uint64_t off = 12345;
+  const uint32_t len = write_file(fn, 1600, 1066, off);
+  uint32_t *data = 0;
+
+  // 1600x1066 fits 400x400 at 1/4, 266 rows rounded down to full blocks:
+  size_t size = dt_db_preview_bc1(fn, off, len, 1, 0x70316362, 400, 400, &data);
+  assert(size == 16 + 8*100*66);
+  assert(data[0] == 0x70316362 && data[1] == 1 && data[2] == 400 && data[3] == 264);
+  assert( is_red(data, 10, 10));
+  assert(!is_red(data, 390, 10));
+  assert(!is_red(data, 10, 250));
+  free(data);
+
+  const struct { int o, x, y; } corner[] = { // where the red corner goes
+    {2, 1, 0}, {3, 1, 1}, {4, 0, 1}, {5, 0, 0}, {6, 1, 0}, {7, 1, 1}, {8, 0, 1}};
+  for(int k=0;k<7;k++)
+  {
+    size = dt_db_preview_bc1(fn, off, len, corner[k].o, 0x70316362, 400, 400, &data);
+    assert(size);
+    const int wd = data[2], ht = data[3];
+    if(corner[k].o >= 5) assert(wd == 264 && ht == 400);
+    else                 assert(wd == 400 && ht == 264);
+    for(int j=0;j<2;j++) for(int i=0;i<2;i++)
+      assert(is_red(data, i ? wd-8 : 8, j ? ht-8 : 8) == (i == corner[k].x && j == corner[k].y));
+    free(data);
+  }
+
+  // small previews aren't scaled up, and a wrong offset fails:
+  size = dt_db_preview_bc1(fn, off, len, 1, 0x70316362, 4000, 4000, &data);
+  assert(size && data[2] == 1600 && data[3] == 1064);
+  free(data);
+  assert(!dt_db_preview_bc1(fn, off+2, len-2, 1, 0x70316362, 400, 400, &data) && !data);
+  assert(!dt_db_preview_bc1(fn, off, len/2, 1, 0x70316362, 400, 400, &data) && !data);
+  assert(!dt_db_preview_bc1("/tmp/vkdt-jtest-does-not-exist", off, len, 1, 0x70316362, 400, 400, &data));
+
+  // the typical embedded preview is full size:
+  const uint32_t len2 = write_file(fn, 6000, 4000, off);
+  const int cnt = 20;
+  double beg = now();
+  for(int k=0;k<cnt;k++)
+  {
+    assert(dt_db_preview_bc1(fn, off, len2, 6, 0x70316362, 400, 400, &data));
+    free(data);
+  }
+  double end = now();
+  fprintf(stdout, "6000x4000 preview to bc1 thumbnail: %.1fms\n", 1000.0*(end-beg)/cnt);
+  remove(fn);
+  fprintf(stdout, "all good\n");
+  exit(0);
+}
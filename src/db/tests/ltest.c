@@ -0,0 +1,115 @@
+// scheduling latency benchmark: time between threads_task() and the first
+// call of the run function on a worker, for single tasks on an idle pool and
+// for bursts of as many tasks as there are threads, and for interactive tasks
+// while the pool is busy with background work.
+// clang -Wall -march=native -O3 ltest.c ../../core/threads.c -I../../core -o ltest -lpthread -lm && ./ltest
+#include "threads.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+
+typedef struct sample_t
+{
+  double      push;   // time stamp when the task was pushed
+  double      pickup; // time stamp when a worker started running it
+  atomic_uint done;
+}
+sample_t;
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void
+run(uint32_t item, void *data)
+{
+  sample_t *s = data;
+  s->pickup = now();
+  s->done = 1;
+}
+
+static void
+run_busy(uint32_t item, void *data)
+{ // about 100us of background work per item
+  const double t = now();
+  while(now() - t < 100e-6) ;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  const double *da = a, *db = b;
+  return *da < *db ? -1 : *da > *db;
+}
+
+static void
+report(const char *what, double *lat, int cnt)
+{
+  qsort(lat, cnt, sizeof(double), compare);
+  fprintf(stderr, "%-24s p50 %8.2f us  p99 %8.2f us  max %8.2f us\n", what,
+      1e6*lat[cnt/2], 1e6*lat[(int)(cnt*0.99)], 1e6*lat[cnt-1]);
+}
+
+int main()
+{
+  threads_global_init();
+  const int N = 10000, nt = threads_num();
+  sample_t *s = calloc(sizeof(sample_t), nt);
+  double *lat = malloc(sizeof(double)*N*nt);
+
+  for(int i=0;i<N;i++)
+  { // one task at a time, the pool is asleep when it arrives
+    s[0].done = 0;
+    s[0].push = now();
+    int taskid = threads_task("latency", 1, -1, s, run, 0, s_threads_prio_interactive);
+    threads_wait(taskid);
+    while(!s[0].done) ;
+    lat[i] = s[0].pickup - s[0].push;
+  }
+  report("single task:", lat, N);
+
+  int cnt = 0;
+  for(int i=0;i<N/nt;i++)
+  { // burst of one task per thread
+    for(int k=0;k<nt;k++)
+    {
+      s[k].done = 0;
+      s[k].push = now();
+      threads_task("latency", 1, -1, s+k, run, 0, s_threads_prio_interactive);
+    }
+    for(int k=0;k<nt;k++)
+    {
+      while(!s[k].done) sched_yield();
+      lat[cnt++] = s[k].pickup - s[k].push;
+    }
+  }
+  report("burst of #threads tasks:", lat, cnt);
+
+  // keep every thread busy with a background job, one item is ~100us:
+  int bg = -1;
+  for(int k=0;k<nt;k++)
+    bg = threads_task("busy", 1000000, bg, 0, run_busy, 0, s_threads_prio_background);
+  for(int i=0;i<N/10;i++)
+  {
+    s[0].done = 0;
+    s[0].push = now();
+    threads_task("latency", 1, -1, s, run, 0, s_threads_prio_interactive);
+    while(!s[0].done) sched_yield();
+    lat[i] = s[0].pickup - s[0].push;
+  }
+  report("interactive under load:", lat, N/10);
+  threads_task_abort(bg);
+  threads_wait(bg);
+
+  free(lat);
+  free(s);
+  threads_global_cleanup();
+  exit(0);
+}
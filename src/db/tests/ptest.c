@@ -0,0 +1,82 @@
+// microbenchmark: per-item dispatch through threads_task() vs chunked threads_parallel_for()
+// clang -Wall -march=native -O3 ptest.c ../../core/threads.c -I../../core -o ptest -lpthread -lm && ./ptest
+#include "threads.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct bench_t
+{
+  float   *out;
+  uint32_t iter; // amount of work per item
+}
+bench_t;
+
+static inline float
+work(uint32_t item, uint32_t iter)
+{
+  float x = item * 1e-6f;
+  for(uint32_t i=0;i<iter;i++) x = x * 0.999f + sinf(x);
+  return x;
+}
+
+static void
+run_item(uint32_t item, void *data)
+{
+  bench_t *b = data;
+  b->out[item] = work(item, b->iter);
+}
+
+static void
+run_range(uint32_t beg, uint32_t end, void *data)
+{
+  bench_t *b = data;
+  for(uint32_t k=beg;k<end;k++) b->out[k] = work(k, b->iter);
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+int main()
+{
+  threads_global_init();
+  const uint32_t N = 1000000;
+  float *ref = malloc(sizeof(float)*N);
+  bench_t b = { .out = malloc(sizeof(float)*N) };
+  const uint32_t iters[] = {1, 10, 100};
+  for(int i=0;i<sizeof(iters)/sizeof(iters[0]);i++)
+  {
+    b.iter = iters[i];
+    double t = now();
+    for(uint32_t k=0;k<N;k++) ref[k] = work(k, b.iter);
+    const double t_ser = now() - t;
+
+    t = now();
+    int taskid = -1;
+    for(int k=0;k<threads_num();k++)
+      taskid = threads_task("bench", N, taskid, &b, run_item, 0, s_threads_prio_interactive);
+    threads_wait(taskid);
+    const double t_item = now() - t;
+    for(uint32_t k=0;k<N;k++) assert(b.out[k] == ref[k]);
+
+    t = now();
+    threads_parallel_for(0, N, 0, run_range, &b);
+    const double t_pfor = now() - t;
+    for(uint32_t k=0;k<N;k++) assert(b.out[k] == ref[k]);
+
+    fprintf(stderr, "%d threads, %u items x %3u iterations: serial %6.2f ms, per item %6.2f ms, parallel for %6.2f ms\n",
+        threads_num(), N, b.iter, 1e3*t_ser, 1e3*t_item, 1e3*t_pfor);
+  }
+  free(ref);
+  free(b.out);
+  threads_global_cleanup();
+  exit(0);
+}
@@ -1,27 +1,37 @@
-// g++ -fsanitize=address -Wall -ggdb3 -g test.cc -o test -lpthread -lm -fsanitize=address && ./test
-// clang++ -Wall -march=native -O3 test.cc -o rtest -lpthread -lm && ./rtest
-#include "sort.h"
+// make rtest && ./rtest
+#include "radixsort.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
 #include <time.h>
 
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
 int main()
 {
   threads_global_init();
   const int N = 1000000;
   uint64_t *arr = malloc(sizeof(uint64_t)*N);
-  for(int k=0;k<N;k++) arr[k] = ((uint64_t)lrand48() << 32) | lrand48();
-  clock_t t = clock();
-  parallel_sort(arr, N);
-  t = clock() - t;
-  fprintf(stderr, "time to sort %d entries %g s\n", N, t/(double)CLOCKS_PER_SEC);
-  for(int k=1;k<N;k++)
-  {
-    assert(arr[k] > arr[k-1]);
-    // fprintf(stderr, "%lu ", arr[k]);
+  for(int run=0;run<3;run++)
+  { // full random keys, few distinct keys with an id in the low bits (like the
+    // rating sort of the collection), and keys that are sorted already
+    for(int k=0;k<N;k++) arr[k] =
+      run == 0 ? ((uint64_t)lrand48() << 32) | lrand48() :
+      run == 1 ? ((uint64_t)(lrand48() % 6) << 20) | k :
+      k;
+    double beg = now();
+    radix_sort(arr, N);
+    fprintf(stderr, "time to sort %d entries %g s\n", N, now()-beg);
+    for(int k=1;k<N;k++)
+      assert(arr[k] >= arr[k-1]);
   }
-  // fprintf(stderr, "\n");
   free(arr);
   threads_global_cleanup();
   return 0;
@@ -0,0 +1,58 @@
+// benchmark the string pool with camera style file names:
+// make stest && ./stest
+#include "../stringpool.h"
+#include <assert.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+  const uint32_t N = argc > 1 ? atol(argv[1]) : 1000000;
+  char fn[64];
+  const char *ext[] = {"CR2", "NEF", "ARW", "jpg", "CR2.cfg"};
+  dt_stringpool_t sp;
+  // deliberately too small, so we see the cost of growing:
+  dt_stringpool_init(&sp, 1000, 12);
+
+  double beg = now();
+  for(uint32_t i=0;i<N;i++)
+  {
+    const int len = snprintf(fn, sizeof(fn), "DSC_%07u.%s", i, ext[i%5]);
+    const char *dedup = 0;
+    uint32_t id = dt_stringpool_get(&sp, fn, len, i, &dedup);
+    assert(id == i && dedup && !strcmp(dedup, fn));
+  }
+  double end = now();
+  fprintf(stderr, "insert %u names:     %g s (%g ns each)\n", N, end-beg, 1e9*(end-beg)/N);
+
+  beg = now();
+  for(uint32_t i=0;i<N;i++)
+  {
+    const int len = snprintf(fn, sizeof(fn), "DSC_%07u.%s", i, ext[i%5]);
+    uint32_t id = dt_stringpool_get(&sp, fn, len, -1u, 0);
+    assert(id == i);
+  }
+  end = now();
+  fprintf(stderr, "look up %u names:    %g s (%g ns each)\n", N, end-beg, 1e9*(end-beg)/N);
+
+  beg = now();
+  for(uint32_t i=0;i<N;i++)
+  { // not in the pool
+    const int len = snprintf(fn, sizeof(fn), "IMG_%07u.%s", i, ext[i%5]);
+    uint32_t id = dt_stringpool_get(&sp, fn, len, -1u, 0);
+    assert(id == -1u);
+  }
+  end = now();
+  fprintf(stderr, "look up %u misses:   %g s (%g ns each)\n", N, end-beg, 1e9*(end-beg)/N);
+  fprintf(stderr, "%u entries, %u slots, %u string blocks\n", sp.entry_cnt, sp.slot_max, sp.block_cnt+1);
+
+  dt_stringpool_cleanup(&sp);
+  exit(0);
+}
@@ -0,0 +1,97 @@
+// tag index: write 100k tagged images, read them back, and time some queries.
+// make ttest && ./ttest
+#include "../tags.h"
+#include "core/fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// image i has tag k if bit k of i*2654435761 is set
+static int has(uint32_t i, int k) { return ((i*2654435761u) >> k) & 1; }
+
+static void
+check(dt_db_tags_t *t, const uint64_t *bits, int cnt, int (*f)(uint32_t))
+{ // compare to the reference, via the file names
+  int ref = 0;
+  for(uint32_t id=0;id<dt_db_tags_image_cnt(t);id++)
+  {
+    const char *p = dt_db_tags_image_path(t, id);
+    const uint32_t i = atol(strstr(p, "IMG_") + 4);
+    assert(f(i) == ((bits[id/64] >> (id&63)) & 1));
+    ref += f(i);
+  }
+  assert(ref == cnt);
+}
+static int q0(uint32_t i) { return has(i, 3) && has(i, 5); }
+static int q1(uint32_t i) { return (has(i, 3) || has(i, 7)) && !has(i, 11); }
+static int q2(uint32_t i) { return !(has(i, 3) || has(i, 5) || has(i, 7)); }
+
+int main(int argc, char *argv[])
+{
+  const uint32_t N = argc > 1 ? atol(argv[1]) : 100000;
+  const char *fn = "/tmp/vkdt-ttest.idx";
+  fs_delete(fn);
+  dt_db_tags_t *t = dt_db_tags_open(fn, 0);
+  char path[256], tag[32];
+  double beg = now();
+  for(uint32_t i=0;i<N;i++)
+  {
+    snprintf(path, sizeof(path), "/home/user/Pictures/2024/%04u/IMG_%05u.CR2.cfg", i/1000, i);
+    for(int k=0;k<16;k++) if(has(i, k))
+    {
+      snprintf(tag, sizeof(tag), "tag %02d", k);
+      dt_db_tags_add(t, tag, path);
+    }
+  }
+  // removing one and adding it back must not change anything
+  uint32_t i3 = 0;
+  while(!has(i3, 3)) i3++;
+  snprintf(path, sizeof(path), "/home/user/Pictures/2024/%04u/IMG_%05u.CR2.cfg", i3/1000, i3);
+  dt_db_tags_remove(t, "tag 03", path);
+  dt_db_tags_add(t, "tag 03", path);
+  double end = now();
+  fprintf(stderr, "tag %u images:  %g s\n", N, end-beg);
+  dt_db_tags_close(t);
+
+  beg = now();
+  t = dt_db_tags_open(fn, 0);
+  end = now();
+  fprintf(stderr, "read index:      %g s\n", end-beg);
+  assert(dt_db_tags_image_cnt(t) <= N);
+
+  const char *query[] = {"tag 03 & tag 05", "(tag 03 | tag 07) & !tag 11", "!(tag 03|tag 05|tag 07)"};
+  int (*ref[])(uint32_t) = {q0, q1, q2};
+  for(int q=0;q<3;q++)
+  {
+    uint64_t *bits = 0;
+    const int runs = 100;
+    int cnt = 0;
+    beg = now();
+    for(int r=0;r<runs;r++)
+    {
+      free(bits);
+      cnt = dt_db_tags_query(t, query[q], &bits);
+    }
+    end = now();
+    check(t, bits, cnt, ref[q]);
+    fprintf(stderr, "query `%s': %d images, %g us\n", query[q], cnt, 1e6*(end-beg)/runs);
+    free(bits);
+  }
+  uint64_t *bits = 0;
+  assert(dt_db_tags_query(t, "tag 03 & (", &bits) == -1);
+  assert(dt_db_tags_query(t, "no such tag", &bits) == 0);
+  free(bits);
+  dt_db_tags_close(t);
+  fs_delete(fn);
+  return 0;
+}
@@ -3,6 +3,10 @@
 #include "db/db.h"
 #include "db/thumbnails.h"
 #include "db/hash.h"
+#include "db/archive.h"
+#include "db/meta.h"
+#include "db/preview.h"
+#include "db/exif.h"
 #include "qvk/qvk.h"
 #include "pipe/graph-io.h"
 #include "pipe/graph-defaults.h"
@@ -17,6 +21,12 @@
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+
+// over all thumbnail structs, they share the archive:
+static atomic_uint_fast64_t thumbnails_hit;  // loaded from the disk cache
+static atomic_uint_fast64_t thumbnails_miss; // had to be rendered
 
 #if 0
 void
@@ -39,13 +49,18 @@ debug_test_list(
 }
 #endif
 
+static VkResult thumbnails_upload_init(dt_thumbnails_t *tn);
+static void thumbnails_upload_cleanup(dt_thumbnails_t *tn);
+
 VkResult
 dt_thumbnails_init(
     dt_thumbnails_t *tn,
     const int wd,
     const int ht,
     const int cnt,
-    const size_t heap_size)
+    const size_t heap_size,
+    const int decode_cnt,
+    const int render_cnt)
 {
   memset(tn, 0, sizeof(*tn));
 
@@ -60,74 +75,113 @@ dt_thumbnails_init(
   tn->thumb_wd = wd,
   tn->thumb_ht = ht,
   tn->thumb_max = cnt;
+  tn->pin = 1;
 
-  dt_graph_init(tn->graph + 0, s_queue_work0);
-  dt_graph_init(tn->graph + 1, s_queue_work1);
+  char dirname[1100];
+  snprintf(dirname, sizeof(dirname), "%s/thumbs", tn->cachedir);
+  tn->archive = dt_archive_open(dirname); // shared between all thumbnail structs
 
-  threads_mutex_init(tn->graph_lock + 0, 0);
-  threads_mutex_init(tn->graph_lock + 1, 0);
+  tn->render_free = MAX(1, render_cnt);
+  tn->graph_cnt   = MAX(0, decode_cnt) + tn->render_free;
+  tn->graph       = calloc(sizeof(dt_graph_t), tn->graph_cnt);
+  tn->graph_lock  = calloc(sizeof(threads_mutex_t), tn->graph_cnt);
+  for(int i=0;i<tn->graph_cnt;i++)
+  { // spread over both work queues:
+    dt_graph_init(tn->graph + i, (i & 1) ? s_queue_work1 : s_queue_work0);
+    threads_mutex_init(tn->graph_lock + i, 0);
+  }
+  threads_mutex_init(&tn->render_lock, 0);
+  pthread_cond_init(&tn->render_cond, 0);
+  threads_mutex_init(&tn->preview_lock, 0);
 
   // just creating bc1 files in the background, not actually used to serve
   // any thumbnails:
   if(cnt == 0) return VK_SUCCESS;
 
-  tn->thumb = malloc(sizeof(dt_thumbnail_t)*tn->thumb_max);
-  memset(tn->thumb, 0, sizeof(dt_thumbnail_t)*tn->thumb_max);
-  // need at least one extra slot to catch free block (if contiguous, else more)
-  // seems we sometimes get quite fragmented memory after long runs, be sure we can always split free memory:
-  dt_vkalloc_init(&tn->alloc, 3*tn->thumb_max, heap_size);
-
-  // init lru list
-  tn->lru = tn->thumb + 1; // [0] is special: busy bee
-  tn->mru = tn->thumb + tn->thumb_max-1;
-  tn->thumb[1].next = tn->thumb+2;
-  tn->thumb[tn->thumb_max-1].prev = tn->thumb+tn->thumb_max-2;
-  for(int k=2;k<tn->thumb_max-1;k++)
-  {
-    tn->thumb[k].next = tn->thumb+k+1;
-    tn->thumb[k].prev = tn->thumb+k-1;
-  }
-
-  dt_log(s_log_db, "allocating %3.1f MB for thumbnails", heap_size/(1024.0*1024.0));
-
-  // alloc dummy image to get memory type bits and something to display
+  // create the array images, as many as we need for cnt thumbnails or can fit into the heap:
+  tn->layer_wd  = (wd + 3) & ~3;
+  tn->layer_ht  = (ht + 3) & ~3;
+  tn->array_cnt = (cnt + DT_THUMBNAILS_LAYERS - 1) / DT_THUMBNAILS_LAYERS;
+  const int layers = MIN(cnt, DT_THUMBNAILS_LAYERS); // few large previews don't need a whole array
+  tn->array     = calloc(sizeof(VkImage), tn->array_cnt);
   VkFormat format = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
   VkImageCreateInfo images_create_info = {
     .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
     .imageType = VK_IMAGE_TYPE_2D,
     .format = format,
     .extent = {
-      .width  = 24,
-      .height = 24,
+      .width  = tn->layer_wd,
+      .height = tn->layer_ht,
       .depth  = 1
     },
     .mipLevels             = 1,
-    .arrayLayers           = 1,
+    .arrayLayers           = layers,
     .samples               = VK_SAMPLE_COUNT_1_BIT,
     .tiling                = VK_IMAGE_TILING_OPTIMAL,
     .usage                 =
-        VK_IMAGE_ASPECT_COLOR_BIT
-      | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT
       | VK_IMAGE_USAGE_SAMPLED_BIT,
     .sharingMode           = VK_SHARING_MODE_EXCLUSIVE,
     .queueFamilyIndexCount = 0,
     .pQueueFamilyIndices   = 0,
     .initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED,
   };
+  uint64_t *offset = calloc(sizeof(uint64_t), tn->array_cnt);
+  uint64_t size = 0;
+  uint32_t memory_type_bits = ~0u;
+  for(int i=0;i<tn->array_cnt;i++)
+  {
+    QVKR(vkCreateImage(qvk.device, &images_create_info, NULL, tn->array + i));
+    VkMemoryRequirements mem_req;
+    vkGetImageMemoryRequirements(qvk.device, tn->array[i], &mem_req);
+    const uint64_t off = (size + mem_req.alignment - 1) & ~(mem_req.alignment - 1);
+    if(off + mem_req.size > heap_size)
+    { // does not fit, use less thumbnails
+      vkDestroyImage(qvk.device, tn->array[i], 0);
+      tn->array[i]  = 0;
+      tn->array_cnt = i;
+      break;
+    }
+    offset[i] = off;
+    size = off + mem_req.size;
+    memory_type_bits &= mem_req.memoryTypeBits;
+  }
+  if(tn->thumb_max > tn->array_cnt * layers)
+  {
+    dt_log(s_log_err|s_log_db, "[thm] only %d thumbnails fit into %3.1f MB",
+        tn->array_cnt * layers, heap_size/(1024.0*1024.0));
+    tn->thumb_max = tn->array_cnt * layers;
+  }
+  if(tn->thumb_max < 3)
+  {
+    free(offset);
+    return VK_INCOMPLETE;
+  }
 
-  VkImage img;
-  QVKR(vkCreateImage(qvk.device, &images_create_info, NULL, &img));
-  VkMemoryRequirements mem_req;
-  vkGetImageMemoryRequirements(qvk.device, img, &mem_req);
-  tn->memory_type_bits = mem_req.memoryTypeBits;
-  vkDestroyImage(qvk.device, img, VK_NULL_HANDLE);
-
+  dt_log(s_log_db, "allocating %3.1f MB for %d thumbnails", size/(1024.0*1024.0), tn->thumb_max);
   VkMemoryAllocateInfo mem_alloc_info = {
     .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-    .allocationSize  = heap_size,
-    .memoryTypeIndex = qvk_get_memory_type(tn->memory_type_bits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    .allocationSize  = size,
+    .memoryTypeIndex = qvk_get_memory_type(memory_type_bits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
   };
   QVKR(vkAllocateMemory(qvk.device, &mem_alloc_info, 0, &tn->vkmem));
+  for(int i=0;i<tn->array_cnt;i++)
+    QVKR(vkBindImageMemory(qvk.device, tn->array[i], tn->vkmem, offset[i]));
+  free(offset);
+
+  tn->thumb = malloc(sizeof(dt_thumbnail_t)*tn->thumb_max);
+  memset(tn->thumb, 0, sizeof(dt_thumbnail_t)*tn->thumb_max);
+
+  // init lru list
+  tn->lru = tn->thumb + 1; // [0] is special: busy bee
+  tn->mru = tn->thumb + tn->thumb_max-1;
+  tn->thumb[1].next = tn->thumb+2;
+  tn->thumb[tn->thumb_max-1].prev = tn->thumb+tn->thumb_max-2;
+  for(int k=2;k<tn->thumb_max-1;k++)
+  {
+    tn->thumb[k].next = tn->thumb+k+1;
+    tn->thumb[k].prev = tn->thumb+k-1;
+  }
 
   // create descriptor pool (keep at least one for each type)
   VkDescriptorPoolSize pool_sizes[] = {{
@@ -165,9 +219,50 @@ dt_thumbnails_init(
     .descriptorSetCount = 1,
     .pSetLayouts = &tn->dset_layout,
   };
+  VkImageViewCreateInfo images_view_create_info = {
+    .sType      = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .viewType   = VK_IMAGE_VIEW_TYPE_2D,
+    .format     = format,
+    .subresourceRange = {
+      .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel   = 0,
+      .levelCount     = 1,
+      .baseArrayLayer = 0,
+      .layerCount     = 1
+    },
+  };
+  VkDescriptorImageInfo img_info = {
+    .sampler       = qvk.tex_sampler,
+    .imageLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+  };
+  VkWriteDescriptorSet img_dset = {
+    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstBinding      = 0,
+    .dstArrayElement = 0,
+    .descriptorCount = 1,
+    .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .pImageInfo      = &img_info,
+  };
   for(int i=0;i<tn->thumb_max;i++)
-    QVKR(vkAllocateDescriptorSets(qvk.device, &dset_info, &tn->thumb[i].dset));
+  { // every slot gets a fixed layer, a view of it and a descriptor set for it:
+    dt_thumbnail_t *th = tn->thumb + i;
+    th->imgid = -1u;
+    th->image = tn->array[i / DT_THUMBNAILS_LAYERS];
+    th->layer = i % DT_THUMBNAILS_LAYERS;
+    images_view_create_info.image = th->image;
+    images_view_create_info.subresourceRange.baseArrayLayer = th->layer;
+    QVKR(vkCreateImageView(qvk.device, &images_view_create_info, NULL, &th->image_view));
+    QVKR(vkAllocateDescriptorSets(qvk.device, &dset_info, &th->dset));
+    img_dset.dstSet    = th->dset;
+    img_info.imageView = th->image_view;
+    vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+  }
 
+  if(thumbnails_upload_init(tn) != VK_SUCCESS)
+  {
+    dt_log(s_log_err, "[thm] could not create the thumbnail upload buffer, loading through graphs");
+    thumbnails_upload_cleanup(tn);
+  }
   return VK_SUCCESS;
 }
 
@@ -175,24 +270,124 @@ void
 dt_thumbnails_cleanup(
     dt_thumbnails_t *tn)
 {
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  thumbnails_upload_cleanup(tn);
+  for(int i=0;i<tn->graph_cnt;i++)
   {
     dt_graph_cleanup(tn->graph + i);
     pthread_mutex_destroy(tn->graph_lock + i);
   }
-  for(int i=0;i<tn->thumb_max;i++)
-  {
-    if(tn->thumb[i].image)      vkDestroyImage    (qvk.device, tn->thumb[i].image,      0);
+  free(tn->graph);
+  free(tn->graph_lock);
+  tn->graph      = 0;
+  tn->graph_lock = 0;
+  tn->graph_cnt  = 0;
+  pthread_mutex_destroy(&tn->render_lock);
+  pthread_cond_destroy(&tn->render_cond);
+  pthread_mutex_destroy(&tn->preview_lock);
+  for(int i=0;tn->thumb && i<tn->thumb_max;i++)
     if(tn->thumb[i].image_view) vkDestroyImageView(qvk.device, tn->thumb[i].image_view, 0);
-    tn->thumb[i].image      = 0;
-    tn->thumb[i].image_view = 0;
-  }
   free(tn->thumb);
   tn->thumb = 0;
+  for(int i=0;i<tn->array_cnt;i++)
+    if(tn->array[i]) vkDestroyImage(qvk.device, tn->array[i], 0);
+  free(tn->array);
+  tn->array = 0;
+  tn->array_cnt = 0;
   if(tn->dset_layout) vkDestroyDescriptorSetLayout(qvk.device, tn->dset_layout, 0);
   if(tn->dset_pool)   vkDestroyDescriptorPool     (qvk.device, tn->dset_pool,   0);
   if(tn->vkmem)       vkFreeMemory                (qvk.device, tn->vkmem,       0);
-  dt_vkalloc_cleanup(&tn->alloc);
+  dt_archive_close(tn->archive);
+  tn->archive = 0;
+}
+
+static void // file name to write the thumbnail to: in the archive if we have one
+thumbnails_filename(const dt_thumbnails_t *tn, uint64_t hash, char *fn, size_t size)
+{
+  if(tn->archive) snprintf(fn, size, "%s/thumbs/%"PRIx64".bc1", tn->cachedir, hash);
+  else            snprintf(fn, size, "%s/%"PRIx64".bc1", tn->cachedir, hash);
+}
+
+static time_t // find the thumbnail, write its file name to fn and return when it was written, 0 if there is none
+thumbnails_lookup(const dt_thumbnails_t *tn, uint64_t hash, char *fn, size_t size)
+{
+  int64_t mtime = 0;
+  if(tn->archive && dt_archive_stat(tn->archive, hash, &mtime) >= 0)
+  {
+    thumbnails_filename(tn, hash, fn, size);
+    return mtime ? mtime : 1;
+  }
+  // one file per thumbnail, from before the archive:
+  struct stat statbuf = {0};
+  snprintf(fn, size, "%s/%"PRIx64".bc1", tn->cachedir, hash);
+  if(stat(fn, &statbuf)) return 0;
+#ifdef __APPLE__
+  return statbuf.st_mtimespec.tv_sec;
+#else
+  return statbuf.st_mtime;
+#endif
+}
+
+uint64_t
+dt_thumbnails_key_content(
+    const char *filename,
+    uint64_t    content)
+{
+  // the history the thumbnail will be rendered from: the cfg, or the default it'll get
+  const dt_token_t input_module = dt_graph_default_input_module(filename);
+  FILE *f = fopen(filename, "rb");
+  for(int i=0;!f && i<2;i++)
+  {
+    char fn[PATH_MAX+100];
+    snprintf(fn, sizeof(fn), "%s/default.%"PRItkn, i ? dt_pipe.basedir : dt_pipe.homedir,
+        dt_token_str(input_module));
+    f = fopen(fn, "rb");
+  }
+  if(!f) return 0;
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *cfg = malloc(MAX(0, size) + 1);
+  const size_t len = size > 0 ? fread(cfg, 1, size, f) : 0;
+  fclose(f);
+  cfg[len] = 0;
+  uint64_t key = 0;
+  for(char *line = cfg, *end; line < cfg + len; line = end + 1)
+  {
+    end = strchr(line, '\n');
+    if(!end) end = cfg + len;
+    *end = 0;
+    // the main input is identified by its contents below, not by its name:
+    const char *c = strncmp(line, "param:i-", 8) ? 0 : strchr(line + 8, ':');
+    if(c && !strncmp(c, ":main:filename:", 15)) continue;
+    key = hash64_data(line, end - line, key);
+  }
+  free(cfg);
+
+  // the image file, usually from the metadata index:
+  if(!content)
+  {
+    char imgfilename[PATH_MAX];
+    dt_db_meta_image_filename(filename, imgfilename, sizeof(imgfilename));
+    content = dt_db_meta_content(imgfilename);
+  }
+  if(content) key = hash64_data(&content, sizeof(content), key);
+  return key ? key : 1; // 0 means no thumbnail
+}
+
+uint64_t
+dt_thumbnails_key(
+    const char *filename)
+{
+  return dt_thumbnails_key_content(filename, 0);
+}
+
+static uint64_t // the key for an image of the db, with the content hash from the metadata index
+thumbnails_key_db(
+    dt_db_t    *db,
+    uint32_t    imgid,
+    const char *filename)
+{
+  return dt_thumbnails_key_content(filename, dt_db_meta_get(db, imgid)->content);
 }
 
 void
@@ -200,10 +395,13 @@ dt_thumbnails_invalidate(
     dt_thumbnails_t *tn,
     const char      *filename)
 {
-  uint64_t hash = hash64(filename);
+  uint64_t hash = dt_thumbnails_key(filename);
+  if(!hash) return;
   char bc1filename[1040];
   snprintf(bc1filename, sizeof(bc1filename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
   unlink(bc1filename);
+  if(tn->archive) dt_archive_remove(tn->archive, hash);
+  if(tn->archive) dt_archive_remove(tn->archive, dt_archive_key_level(hash, 1));
 }
 
 // process one image and write a .bc1 thumbnail
@@ -212,72 +410,55 @@ VkResult
 dt_thumbnails_cache_one(
     dt_graph_t      *graph,
     dt_thumbnails_t *tn,
-    const char      *filename)  // only accepting .cfg files here (can be non-existent and will be replaced in such case)
+    const char      *filename,  // only accepting .cfg files here (can be non-existent and will be replaced in such case)
+    uint64_t         hash)      // dt_thumbnails_key() of it if known, or 0
 {
   int len = strnlen(filename, 2048); // sizeof thumbnail filename
   if(len <= 4) return VK_INCOMPLETE;
   const char *f2 = filename + len - 4;
   if(strcasecmp(f2, ".cfg")) return VK_INCOMPLETE;
 
-  // use ~/.cache/vkdt/<hash-of-filename>.bc1 as output file name
-  // if that already exists with a newer timestamp than the cfg, bail out
+  // use ~/.cache/vkdt/thumbs/<key>.bc1 as output file name. the key changes
+  // with the cfg and the image, so if it exists already, bail out
 
   dt_token_t input_module = dt_graph_default_input_module(filename);
   char cfgfilename[PATH_MAX+100];
   char deffilename[PATH_MAX+100];
   char bc1filename[PATH_MAX+100];
-  uint64_t hash = hash64(filename);
-  snprintf(bc1filename, sizeof(bc1filename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
+  if(!hash) hash = dt_thumbnails_key(filename);
+  if(!hash) return VK_INCOMPLETE; // no cfg and no default either
   snprintf(cfgfilename, sizeof(cfgfilename), "%s", filename);
   snprintf(deffilename, sizeof(deffilename), "default.%"PRItkn, dt_token_str(input_module));
-  struct stat statbuf = {0};
-  time_t tcfg = 0, tbc1 = 0;
-
-  if(!stat(cfgfilename, &statbuf))
-#ifdef __APPLE__
-    tcfg = statbuf.st_mtimespec.tv_sec;
-#else
-    tcfg = statbuf.st_mtime;
-#endif
-  else
-  {
-    char tmp[PATH_MAX];
-    if(snprintf(tmp, sizeof(tmp), "%s/%s", dt_pipe.basedir, deffilename) >= PATH_MAX)
-      return VK_INCOMPLETE;
-    if(!stat(tmp, &statbuf))
-#ifdef __APPLE__
-      tcfg = statbuf.st_mtimespec.tv_sec;
-#else
-      tcfg = statbuf.st_mtime;
-#endif
-    else return VK_INCOMPLETE;
-  }
 
-  if(!stat(bc1filename, &statbuf))
-  { // check timestamp
-#ifdef __APPLE__
-    tbc1 = statbuf.st_mtimespec.tv_sec;
-#else
-    tbc1 = statbuf.st_mtime;
-#endif
-    if(tcfg && (tbc1 >= tcfg)) return VK_SUCCESS; // already up to date
-  }
+  time_t tbc1 = thumbnails_lookup(tn, hash, bc1filename, sizeof(bc1filename));
+  uint32_t magic = 0;
+  if(tbc1 && tn->archive) dt_archive_get(tn->archive, hash, &magic, 0, sizeof(magic));
+  if(magic == dt_token("bc1p")) tbc1 = 0; // only the embedded preview, render the real thing
+  if(tbc1) return VK_SUCCESS; // already up to date
+  thumbnails_miss++;
+  thumbnails_filename(tn, hash, bc1filename, sizeof(bc1filename));
 
   dt_graph_reset(graph);
 
+  // with a preview size, render that large and let o-bc1 store the thumbnail
+  // size and the full render as level 1 next to it:
+  const int preview = tn->archive && tn->preview_size > MAX(tn->thumb_wd, tn->thumb_ht);
+  char small[64];
+  snprintf(small, sizeof(small), "param:o-bc1:main:small:%d", MAX(tn->thumb_wd, tn->thumb_ht));
   char *extrap[] = {
     "frames:1",                   // only render first frame of animation
+    small,
   };
   dt_graph_export_t param = {
-    .extra_param_cnt = 1,
+    .extra_param_cnt = preview ? 2 : 1,
     .p_extra_param   = extrap,
     .p_cfgfile       = cfgfilename,
     .p_defcfg        = deffilename,
     .input_module    = input_module,
     .output_cnt      = 1,
     .output = {{
-      .max_width  = tn->thumb_wd,
-      .max_height = tn->thumb_ht,
+      .max_width  = preview ? tn->preview_size : tn->thumb_wd,
+      .max_height = preview ? tn->preview_size : tn->thumb_ht,
       .mod        = dt_token("o-bc1"),
       .inst       = dt_token("main"),
       .p_filename = bc1filename,
@@ -286,17 +467,43 @@ dt_thumbnails_cache_one(
     }},
   };
 
-  clock_t beg = clock();
-  if(dt_graph_export(graph, &param) != VK_SUCCESS)
+  double beg = dt_time();
+  VkResult res = dt_graph_export_prepare(graph, &param); // reads and decodes the image on the cpu
+  double mid = dt_time();
+  if(res == VK_SUCCESS)
+  { // wait for our turn on the gpu:
+    threads_mutex_lock(&tn->render_lock);
+    while(tn->render_free == 0) pthread_cond_wait(&tn->render_cond, &tn->render_lock);
+    tn->render_free--;
+    threads_mutex_unlock(&tn->render_lock);
+    mid = dt_time();
+    res = dt_graph_run(graph, s_graph_run_all & ~s_graph_run_roi); // prepare did the roi pass
+    threads_mutex_lock(&tn->render_lock);
+    tn->render_free++;
+    pthread_cond_signal(&tn->render_cond);
+    threads_mutex_unlock(&tn->render_lock);
+  }
+  if(res != VK_SUCCESS)
   {
     dt_log(s_log_db, "[thm] running the thumbnail graph failed on image '%s'!", filename);
     // mark as dead
+    if(tn->archive)
+    { // i-bc1 shows the bomb for an empty image
+      const uint32_t dead[4] = { dt_token("bc1"), 1, 0, 0 };
+      dt_archive_put(tn->archive, hash, dead, sizeof(dead));
+      return 4;
+    }
     snprintf(cfgfilename, sizeof(cfgfilename), "%s/data/bomb.bc1", dt_pipe.basedir);
     fs_link(cfgfilename, bc1filename);
     return 4;
   }
-  clock_t end = clock();
-  dt_log(s_log_perf, "[thm] ran graph in %3.0fms", 1000.0*(end-beg)/CLOCKS_PER_SEC);
+  if(tn->archive)
+  { // the old file would be in the way after a future failure to open the archive
+    snprintf(cfgfilename, sizeof(cfgfilename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
+    unlink(cfgfilename);
+  }
+  double end = dt_time();
+  dt_log(s_log_perf, "[thm] decoded in %3.0fms, rendered in %3.0fms", 1000.0*(mid-beg), 1000.0*(end-mid));
 
   return VK_SUCCESS;
 }
@@ -332,11 +539,13 @@ dt_thumbnails_cache_abort(
     dt_thumbnails_t *tn)
 {
   tn->job_timestamp++;
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  for(int i=0;i<tn->graph_cnt;i++)
     threads_mutex_lock(tn->graph_lock+i);
+  threads_mutex_lock(&tn->preview_lock);
   // now we hold all the locks at the same time. anyone picking up a lock after we return from here
   // will definitely see the new timestamp and abort immediately.
-  for(int i=0;i<DT_THUMBNAILS_THREADS;i++)
+  threads_mutex_unlock(&tn->preview_lock);
+  for(int i=0;i<tn->graph_cnt;i++)
     threads_mutex_unlock(tn->graph_lock+i);
 }
 
@@ -350,10 +559,13 @@ thread_work_coll(
   j->tn->graph[j->gid].io_mutex = j->mutex;
   char filename[1024];
   dt_db_image_path(j->db, j->coll[item], filename, sizeof(filename));
-  (void) dt_thumbnails_cache_one(j->tn->graph + j->gid, j->tn, filename);
+  // the cfg may have changed, so the key may have too:
+  const uint64_t key = thumbnails_key_db(j->db, j->coll[item], filename);
+  (void) dt_thumbnails_cache_one(j->tn->graph + j->gid, j->tn, filename, key);
   // invalidate what we have in memory to trigger a reload:
   threads_mutex_lock(&j->db->image_mutex);
   j->db->image[j->coll[item]].thumbnail = 0;
+  j->db->image[j->coll[item]].thumbnail_key = key;
   threads_mutex_unlock(&j->db->image_mutex);
   j->tn->graph[j->gid].io_mutex = 0;
   if(j->ufn) j->ufn();
@@ -361,22 +573,120 @@ abort:
   threads_mutex_unlock(j->tn->graph_lock+j->gid);
 }
 
-VkResult
-dt_thumbnails_cache_list(
-    dt_thumbnails_t *tn,
-    dt_db_t         *db,
-    const uint32_t  *imgid,
-    uint32_t         imgid_cnt,
-    void           (*updatefn)(void))
+static void thread_free_preview(void *arg)
+{ // the collection belongs to the graph jobs
+  free(arg);
+}
+
+// first pass for images that don't have a thumbnail at all: decode the
+// jpeg preview embedded in the raw. this needs no graph, so all threads can
+// do it at the same time. the graphs replace these thumbnails later.
+static void
+thread_work_preview(
+    uint32_t item, void *arg)
+{
+  cache_coll_job_t *j = arg;
+  dt_thumbnails_t *tn = j->tn;
+  char filename[PATH_MAX], imgfilename[PATH_MAX];
+  dt_db_meta_t meta;
+  threads_mutex_lock(&tn->preview_lock); // same as the graph lock: protects against the db going away
+  if(j->stamp != tn->job_timestamp)
+  {
+    threads_mutex_unlock(&tn->preview_lock);
+    return;
+  }
+  dt_db_image_path(j->db, j->coll[item], filename, sizeof(filename));
+  // only take the record if it's there, reading the file would hold up everybody else:
+  const int peek = dt_db_meta_peek(j->db, j->coll[item], &meta);
+  threads_mutex_unlock(&tn->preview_lock);
+
+  dt_db_meta_image_filename(filename, imgfilename, sizeof(imgfilename));
+  if(peek)
+  { // not in the index yet, look at the file ourselves
+    dt_db_exif_t ex;
+    meta = (dt_db_meta_t){ .filetype = dt_graph_default_input_module(imgfilename) };
+    if(meta.filetype != dt_token("i-raw")) return;
+    dt_db_exif_read(imgfilename, &ex);
+    meta.preview_off = ex.preview_off;
+    meta.preview_len = ex.preview_len;
+    meta.orientation = ex.orientation;
+    meta.content     = 0; // dt_thumbnails_key_content() reads it
+  }
+  if(!meta.preview_len || meta.filetype != dt_token("i-raw")) return;
+  const uint64_t hash = dt_thumbnails_key_content(filename, meta.content);
+  if(!hash) return;
+  char bc1filename[PATH_MAX];
+  if(thumbnails_lookup(tn, hash, bc1filename, sizeof(bc1filename))) return; // have one already
+
+  double beg = dt_time();
+  uint32_t *data = 0;
+  size_t size = dt_db_preview_bc1(imgfilename, meta.preview_off, meta.preview_len, meta.orientation,
+      dt_token("bc1p"), tn->thumb_wd, tn->thumb_ht, &data);
+  if(!size) return; // the graph will do it
+  // the graph of an interactive job may have been faster:
+  if(dt_archive_stat(tn->archive, hash, 0) < 0) dt_archive_put(tn->archive, hash, data, size);
+  free(data);
+  double end = dt_time();
+  dt_log(s_log_perf, "[thm] embedded preview in %3.0fms", 1000.0*(end-beg));
+
+  threads_mutex_lock(&tn->preview_lock);
+  if(j->stamp == tn->job_timestamp)
+  { // invalidate what we have in memory to trigger a reload:
+    threads_mutex_lock(&j->db->image_mutex);
+    j->db->image[j->coll[item]].thumbnail = 0;
+    j->db->image[j->coll[item]].thumbnail_key = hash;
+    threads_mutex_unlock(&j->db->image_mutex);
+  }
+  threads_mutex_unlock(&tn->preview_lock);
+  if(j->ufn) j->ufn();
+}
+
+static void
+thread_work_gc(
+    uint32_t item, void *arg)
+{
+  dt_thumbnails_t *tn = arg;
+  const uint64_t freed = dt_archive_gc(tn->archive, tn->cache_budget);
+  const uint64_t hit = thumbnails_hit, miss = thumbnails_miss;
+  dt_log(s_log_db, "[thm] disk cache %.1f of %.1f MB, evicted %.1f MB, %"PRIu64" hits %"PRIu64" misses (%.0f%% hit rate)",
+      dt_archive_size(tn->archive)/(1024.0*1024.0), tn->cache_budget/(1024.0*1024.0), freed/(1024.0*1024.0),
+      hit, miss, hit+miss ? 100.0*hit/(hit+miss) : 0.0);
+}
+
+static VkResult
+thumbnails_cache_list_prio(
+    dt_thumbnails_t   *tn,
+    dt_db_t           *db,
+    const uint32_t    *imgid,
+    uint32_t           imgid_cnt,
+    void             (*updatefn)(void),
+    threads_priority_t prio,
+    int                preview)   // run the first pass from embedded jpeg previews
 {
   if(imgid_cnt <= 0)
     return VK_INCOMPLETE;
 
   uint32_t *collection = malloc(sizeof(uint32_t) * imgid_cnt);
   memcpy(collection, imgid, sizeof(uint32_t) * imgid_cnt); // take copy because this thing changes
+  int previewid = -1;
+  for(int k=0;preview && tn->archive && k<threads_num();k++)
+  {
+    cache_coll_job_t *job = malloc(sizeof(cache_coll_job_t));
+    *job = (cache_coll_job_t) {
+      .stamp = tn->job_timestamp,
+      .coll  = collection,
+      .gid   = k,
+      .tn    = tn,
+      .db    = db,
+      .ufn   = updatefn,
+    };
+    int id = threads_task("preview", imgid_cnt, previewid, job, thread_work_preview, thread_free_preview, prio);
+    if(id < 0) { free(job); break; }
+    previewid = id;
+  }
   cache_coll_job_t *job0 = 0;
   int taskid = -1;
-  for(int k=0;k<DT_THUMBNAILS_THREADS;k++)
+  for(int k=0;k<MIN(tn->graph_cnt, threads_num());k++)
   {
     cache_coll_job_t *job = malloc(sizeof(cache_coll_job_t));
     if(k == 0)
@@ -404,111 +714,84 @@ dt_thumbnails_cache_list(
     };
     // we only care about internal errors. if we call with stupid values,
     // it just does nothing and returns:
-    taskid = threads_task(
+    if(taskid < 0 && previewid >= 0) // the graphs start when the previews are done
+      taskid = threads_task_after(
+          "thumb",
+          imgid_cnt,
+          &previewid, 1,
+          job,
+          thread_work_coll,
+          thread_free_coll,
+          prio);
+    else taskid = threads_task(
         "thumb",
         imgid_cnt,
         taskid,
         job,
         thread_work_coll,
-        thread_free_coll);
+        thread_free_coll,
+        prio);
     if(taskid < 0) return VK_INCOMPLETE;
   }
+  if(tn->cache_budget && tn->archive) // make room for what we just added
+    threads_task_after("gc", 1, &taskid, 1, tn, thread_work_gc, 0, s_threads_prio_background);
   return VK_SUCCESS;
 }
 
+void
+dt_thumbnails_cache_gc(
+    dt_thumbnails_t *tn,
+    uint64_t         budget)
+{
+  tn->cache_budget = budget;
+  if(tn->cache_budget && tn->archive)
+    threads_task("gc", 1, -1, tn, thread_work_gc, 0, s_threads_prio_background);
+}
+
 VkResult
-dt_thumbnails_cache_collection(
+dt_thumbnails_cache_list(
     dt_thumbnails_t *tn,
     dt_db_t         *db,
+    const uint32_t  *imgid,
+    uint32_t         imgid_cnt,
     void           (*updatefn)(void))
-{
-  return dt_thumbnails_cache_list(tn, db, db->collection, db->collection_cnt, updatefn);
+{ // explicit lists come from user interaction (leaving darkroom, pasting history, ..)
+  return thumbnails_cache_list_prio(tn, db, imgid, imgid_cnt, updatefn, s_threads_prio_interactive, 0);
 }
 
-// 1) if db loads a directory, kick off thumbnail creation of directory in bg
-//    this step is the only thing in the non-gui thread
-// 2) for currently visible collection: batch-update lru and trigger thumbnail loading
-//    if necessary (bc1 file exists but not loaded, maybe need "ready" flag)
-//    this should be fast enough to run every refresh.
-//    start single-thread and maybe interleave with two threads, too
-//    (needs lru mutex then)
-// this function is 2):
-void
-dt_thumbnails_load_list(
+VkResult
+dt_thumbnails_cache_collection(
     dt_thumbnails_t *tn,
     dt_db_t         *db,
-    const uint32_t  *collection,
-    uint32_t         beg,
-    uint32_t         end)
+    void           (*updatefn)(void))
 {
-  for(int k=beg;k<end;k++)
-  { // for all images in given collection
-    const uint32_t imgid = collection[k];
-    if(imgid >= db->image_cnt) break; // safety first. this probably means this job is stale! big danger!
-    dt_image_t *img = db->image + imgid;
-    uint32_t tid = img->thumbnail;
-    if(tid == 0)
-    { // not loaded
-      char filename[1024];
-      dt_db_image_path(db, imgid, filename, sizeof(filename));  
-      uint32_t thumb_index = -1u;
-      if(dt_thumbnails_load_one(tn, filename, &thumb_index) == VK_SUCCESS)
-      {
-        threads_mutex_lock(&db->image_mutex);
-        img->thumbnail = thumb_index;
-        threads_mutex_unlock(&db->image_mutex);
-      }
-    }
-    else if(tid > 0 && tid < tn->thumb_max)
-    { // loaded, update lru
-      // threads_mutex_lock(&tn->lru_lock);
-      dt_thumbnail_t *th = tn->thumb + tid;
-      if(th == tn->lru) tn->lru = tn->lru->next; // move head
-      tn->lru->prev = 0;
-      if(tn->mru == th) tn->mru = th->prev;      // going to remove mru, need to move
-      DLIST_RM_ELEMENT(th);                      // disconnect old head
-      tn->mru = DLIST_APPEND(tn->mru, th);       // append to end and move tail
-      // threads_mutex_unlock(&tn->lru_lock);
-    }
-  }
+  // whole folders go to the back of the queue, the user is not waiting for all of them:
+  // the ones without any thumbnail get the embedded jpeg first, that's quick:
+  return thumbnails_cache_list_prio(tn, db, db->collection, db->collection_cnt, updatefn, s_threads_prio_background, 1);
 }
 
-// load a previously cached thumbnail to a VkImage onto the GPU.
-// returns VK_SUCCESS on success
-VkResult
-dt_thumbnails_load_one(
+// take a thumbnail slot from the lru list (or use the given one) for a
+// thumbnail of the given size. the layer of the slot is simply overwritten.
+static dt_thumbnail_t *
+thumbnails_alloc(
     dt_thumbnails_t *tn,
-    const char      *filename,
-    uint32_t        *thumb_index)
+    uint32_t        *thumb_index,
+    uint32_t         wd,
+    uint32_t         ht)
 {
-  dt_graph_t *graph = tn->graph;
-  char imgfilename[PATH_MAX] = {0};
-  if(strncmp(filename, "data/", 5))
-  { // only hash images that aren't straight from our resource directory:
-    // XXX run through realpath once for windows and / vs \\ confusion?
-    uint64_t hash = hash64(filename);
-    snprintf(imgfilename, sizeof(imgfilename), "%s/%"PRIx64".bc1", tn->cachedir, hash);
-  }
-  else if(snprintf(imgfilename, sizeof(imgfilename), "%s/%s", dt_pipe.basedir, filename) >= sizeof(imgfilename)) return VK_INCOMPLETE;
-  struct stat statbuf = {0};
-  if(stat(imgfilename, &statbuf)) return VK_INCOMPLETE;
-
-  dt_graph_reset(graph);
-  int m0 = dt_module_add(graph, dt_token("i-bc1"), dt_token("main"));
-  int m1 = dt_module_add(graph, dt_token("thumb"), dt_token("main"));
-  if(m0 < 0 || m1 < 0)
-  { // catching a crash here, but this is worrying
-    dt_log(s_log_err, "[thm] failed to add modules to the graph!");
-    return VK_INCOMPLETE;
+  if(wd > tn->layer_wd || ht > tn->layer_ht)
+  {
+    dt_log(s_log_err, "[thm] thumbnail of size %ux%u does not fit %dx%d!", wd, ht, tn->layer_wd, tn->layer_ht);
+    return 0;
   }
-  dt_module_connect(graph, m0, 0, m1, 0);
-
   dt_thumbnail_t *th = 0;
   if(*thumb_index == -1u)
   { // allocate thumbnail from lru list
     // threads_mutex_lock(&tn->lru_lock);
-    th = tn->lru;
-    tn->lru = tn->lru->next;             // move head
+    th = tn->lru; // skip the ones pinned on screen, unless there is nothing else
+    while(th && th->pin == tn->pin) th = th->next;
+    if(!th) th = tn->lru;
+    if(th == tn->lru) tn->lru = tn->lru->next; // move head
     if(tn->mru == th) tn->mru = th->prev;// going to remove mru, need to move
     DLIST_RM_ELEMENT(th);                // disconnect old head
     tn->mru = DLIST_APPEND(tn->mru, th); // append to end and move tail
@@ -517,117 +800,246 @@ dt_thumbnails_load_one(
   }
   else th = tn->thumb + *thumb_index;
 
-  // cache eviction:
-  // clean up memory in case there was something here:
-  if(th->image)      vkDestroyImage(qvk.device, th->image, VK_NULL_HANDLE);
-  if(th->image_view) vkDestroyImageView(qvk.device, th->image_view, VK_NULL_HANDLE);
-  th->image      = 0;
-  th->image_view = 0;
-  th->imgid      = -1u;
-  th->offset     = -1u;
-  if(th->mem)    dt_vkfree(&tn->alloc, th->mem);
-  th->mem        = 0;
-  // keep dset and prev/next dlist pointers! (i.e. don't memset th)
+  // cache eviction is just forgetting about the old image:
+  th->imgid = -1u;
+  th->key   = 0;
+  th->wd    = wd;
+  th->ht    = ht;
 
-  // set param for rawinput
-  // get module
-  dt_module_set_param_string(graph->module + m0, dt_token("filename"), imgfilename);
-
-  // run graph only up to roi computations to get size
-  // run all <= create nodes
-  dt_graph_run_t run = ~-(s_graph_run_create_nodes<<1);
-  if(dt_graph_run(graph, run) != VK_SUCCESS)
-  {
-    dt_log(s_log_err, "[thm] failed to run first half of graph!");
-    return VK_INCOMPLETE;
+  const int nearest = th->wd <= 32;
+  if(nearest != th->nearest)
+  { // tiny images (busy bee etc) look better without interpolation
+    VkDescriptorImageInfo img_info = {
+      .sampler       = nearest ? qvk.tex_sampler_nearest : qvk.tex_sampler,
+      .imageView     = th->image_view,
+      .imageLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    VkWriteDescriptorSet img_dset = {
+      .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet          = th->dset,
+      .dstBinding      = 0,
+      .dstArrayElement = 0,
+      .descriptorCount = 1,
+      .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .pImageInfo      = &img_info,
+    };
+    vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+    th->nearest = nearest;
   }
+  return th;
+}
 
-  // now grab roi size from graph's main output node
-  th->wd = graph->module[m1].connector[0].roi.full_wd;
-  th->ht = graph->module[m1].connector[0].roi.full_ht;
+// the upload ring: bc1 blocks are copied from the archive straight into a
+// host visible staging buffer, and the copies to the thumbnail images are
+// recorded into one command buffer per half of the ring. a full half is
+// submitted and we continue in the other one, so copying on the cpu and
+// transfers on the gpu overlap.
+static VkResult
+thumbnails_upload_init(dt_thumbnails_t *tn)
+{
+  dt_thumbnails_upload_t *u = &tn->upload;
+  u->size = DT_THUMBNAILS_UPLOAD_SIZE;
+  VkBufferCreateInfo buffer_info = {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size        = u->size,
+    .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  QVKR(vkCreateBuffer(qvk.device, &buffer_info, 0, &u->buffer));
+  VkMemoryRequirements mem_req;
+  vkGetBufferMemoryRequirements(qvk.device, u->buffer, &mem_req);
+  VkMemoryAllocateInfo mem_alloc_info = {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = mem_req.size,
+    .memoryTypeIndex = qvk_get_memory_type(mem_req.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+  };
+  QVKR(vkAllocateMemory(qvk.device, &mem_alloc_info, 0, &u->mem));
+  QVKR(vkBindBufferMemory(qvk.device, u->buffer, u->mem, 0));
+  QVKR(vkMapMemory(qvk.device, u->mem, 0, u->size, 0, (void **)&u->mapped));
 
-  VkFormat format = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
-  VkImageCreateInfo images_create_info = {
-    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-    .imageType = VK_IMAGE_TYPE_2D,
-    .format = format,
-    .extent = {
-      .width  = th->wd,
-      .height = th->ht,
-      .depth  = 1
-    },
-    .mipLevels             = 1,
-    .arrayLayers           = 1,
-    .samples               = VK_SAMPLE_COUNT_1_BIT,
-    .tiling                = VK_IMAGE_TILING_OPTIMAL,
-    .usage                 =
-        VK_IMAGE_ASPECT_COLOR_BIT
-      | VK_IMAGE_USAGE_TRANSFER_DST_BIT
-      | VK_IMAGE_USAGE_SAMPLED_BIT,
-    .sharingMode           = VK_SHARING_MODE_EXCLUSIVE,
-    .queueFamilyIndexCount = 0,
-    .pQueueFamilyIndices   = 0,
-    .initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED,
+  // same queue as the graph we use for the rest:
+  VkCommandPoolCreateInfo cmd_pool_create_info = {
+    .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .queueFamilyIndex = qvk.queue[qvk.qid[tn->graph[0].queue_name]].family,
+    .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+  };
+  QVKR(vkCreateCommandPool(qvk.device, &cmd_pool_create_info, 0, &u->command_pool));
+  VkCommandBufferAllocateInfo cmd_buf_alloc_info = {
+    .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .commandPool        = u->command_pool,
+    .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = 2,
   };
+  QVKR(vkAllocateCommandBuffers(qvk.device, &cmd_buf_alloc_info, u->command_buffer));
+  VkFenceCreateInfo fence_info = { .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+  for(int i=0;i<2;i++) QVKR(vkCreateFence(qvk.device, &fence_info, 0, u->fence + i));
+  return VK_SUCCESS;
+}
 
-  QVKR(vkCreateImage(qvk.device, &images_create_info, NULL, &th->image));
-  VkMemoryRequirements mem_req;
-  vkGetImageMemoryRequirements(qvk.device, th->image, &mem_req);
-  if(mem_req.memoryTypeBits != tn->memory_type_bits)
-    dt_log(s_log_qvk|s_log_err, "[thm] memory type bits don't match!");
+static void
+thumbnails_upload_wait(dt_thumbnails_upload_t *u, int part)
+{
+  if(!u->busy[part]) return;
+  QVK(vkWaitForFences(qvk.device, 1, u->fence + part, VK_TRUE, UINT64_MAX));
+  QVK(vkResetFences(qvk.device, 1, u->fence + part));
+  u->busy[part] = 0;
+}
 
-  dt_vkmem_t *mem = dt_vkalloc(&tn->alloc, mem_req.size, mem_req.alignment);
-  if(!mem)
-  {
-    dt_log(s_log_err, "[thm] no more thumbnail gpu memory allocation possible!\n");
-    return VK_INCOMPLETE; // probably fragmented memory
-  }
-  // TODO: if (!mem) we have not enough memory! need to handle this now (more cache eviction?)
-  // TODO: could do batch cleanup in case we need memory:
-  // walk lru list from front and kill all contents (see above)
-  // but leave list as it is
+static void // submit what we have in the current half, and move on to the other one
+thumbnails_upload_submit(dt_thumbnails_t *tn)
+{
+  dt_thumbnails_upload_t *u = &tn->upload;
+  if(!u->cnt) return;
+  QVK(vkEndCommandBuffer(u->command_buffer[u->part]));
+  VkSubmitInfo submit = {
+    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers    = u->command_buffer + u->part,
+  };
+  const int q = qvk.qid[tn->graph[0].queue_name];
+  QVKL(&qvk.queue[q].mutex, vkQueueSubmit(qvk.queue[q].queue, 1, &submit, u->fence[u->part]));
+  u->busy[u->part] = 1;
+  u->part = !u->part;
+  thumbnails_upload_wait(u, u->part);
+  u->end = 0;
+  u->cnt = 0;
+}
 
-  assert(mem);
-  th->mem    = mem;
-  th->offset = mem->offset;
+static void // wait for all uploads to finish. after this, the thumbnails can be drawn.
+thumbnails_upload_flush(dt_thumbnails_t *tn)
+{
+  thumbnails_upload_submit(tn);
+  for(int i=0;i<2;i++) thumbnails_upload_wait(&tn->upload, i);
+}
 
-  VkImageViewCreateInfo images_view_create_info = {
-    .sType      = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-    .viewType   = VK_IMAGE_VIEW_TYPE_2D,
-    .format     = format,
-    .subresourceRange = {
+static void
+thumbnails_upload_cleanup(dt_thumbnails_t *tn)
+{
+  dt_thumbnails_upload_t *u = &tn->upload;
+  if(u->command_pool) thumbnails_upload_flush(tn);
+  for(int i=0;i<2;i++) if(u->fence[i]) vkDestroyFence(qvk.device, u->fence[i], 0);
+  if(u->command_pool) vkDestroyCommandPool(qvk.device, u->command_pool, 0);
+  if(u->buffer)       vkDestroyBuffer     (qvk.device, u->buffer,       0);
+  if(u->mem)          vkFreeMemory        (qvk.device, u->mem,          0);
+  memset(u, 0, sizeof(*u));
+}
+
+// copy the bc1 blocks of the archive entry to the staging ring and record
+// the transfer to the layer of a thumbnail slot. returns VK_INCOMPLETE if this
+// didn't work and the graph should do it instead.
+static VkResult
+thumbnails_upload(
+    dt_thumbnails_t *tn,
+    uint64_t         key,
+    const uint32_t   header[4],
+    uint32_t        *thumb_index)
+{
+  dt_thumbnails_upload_t *u = &tn->upload;
+  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
+  const uint64_t size = 8*(wd/4)*(uint64_t)(ht/4), half = u->size/2;
+  if(!u->mapped || !wd || !ht || size > half) return VK_INCOMPLETE;
+  if(u->end + size > half) thumbnails_upload_submit(tn);
+  uint8_t *dst = u->mapped + u->part*half + u->end;
+  if(dt_archive_get(tn->archive, key, dst, 4*sizeof(uint32_t), size) < 4*sizeof(uint32_t) + size)
+    return VK_INCOMPLETE;
+
+  dt_thumbnail_t *th = thumbnails_alloc(tn, thumb_index, wd, ht);
+  if(!th) return VK_INCOMPLETE;
+
+  VkCommandBuffer cmd_buf = u->command_buffer[u->part];
+  if(!u->cnt)
+  {
+    VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    QVKR(vkBeginCommandBuffer(cmd_buf, &begin_info));
+  }
+  VkImageMemoryBarrier barrier = {
+    .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+    .image               = th->image,
+    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+    .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    .srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT, // the layer may have been written before
+    .dstAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .subresourceRange    = {
       .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-      .baseMipLevel   = 0,
       .levelCount     = 1,
-      .baseArrayLayer = 0,
-      .layerCount     = 1
+      .baseArrayLayer = th->layer,
+      .layerCount     = 1,
     },
   };
-  VkDescriptorImageInfo img_info = {
-    .sampler       = th->wd > 32 ? qvk.tex_sampler : qvk.tex_sampler_nearest,
-    .imageLayout   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-  };
-  VkWriteDescriptorSet img_dset = {
-    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-    .dstBinding      = 0,
-    .dstArrayElement = 0,
-    .descriptorCount = 1,
-    .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-    .pImageInfo      = &img_info,
+  vkCmdPipelineBarrier(cmd_buf,
+      VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+      0, NULL, 0, NULL, 1, &barrier);
+  VkBufferImageCopy copy = {
+    .bufferOffset      = u->part*half + u->end,
+    .imageSubresource  = {
+      .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseArrayLayer = th->layer,
+      .layerCount     = 1,
+    },
+    .imageExtent = { wd, ht, 1 },
   };
+  vkCmdCopyBufferToImage(cmd_buf, u->buffer, th->image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+  barrier.oldLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cmd_buf,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+      0, NULL, 0, NULL, 1, &barrier);
+  u->end += (size + 15) & ~15; // keep the offsets aligned to the bc1 block size (and then some)
+  u->cnt++;
+  return VK_SUCCESS;
+}
 
-  // bind image memory, create image view and descriptor set (used to display later on):
-  vkBindImageMemory(qvk.device, th->image, tn->vkmem, th->offset);
-  images_view_create_info.image = th->image;
-  QVKR(vkCreateImageView(qvk.device, &images_view_create_info, NULL, &th->image_view));
+// load a thumbnail file through a graph with i-bc1 and thumb modules.
+// this is for the gzipped .bc1 files (resources and old thumbnails).
+static VkResult
+thumbnails_load_graph(
+    dt_thumbnails_t *tn,
+    const char      *imgfilename,
+    uint32_t        *thumb_index)
+{
+  dt_graph_t *graph = tn->graph;
+  dt_graph_reset(graph);
+  int m0 = dt_module_add(graph, dt_token("i-bc1"), dt_token("main"));
+  int m1 = dt_module_add(graph, dt_token("thumb"), dt_token("main"));
+  if(m0 < 0 || m1 < 0)
+  { // catching a crash here, but this is worrying
+    dt_log(s_log_err, "[thm] failed to add modules to the graph!");
+    return VK_INCOMPLETE;
+  }
+  dt_module_connect(graph, m0, 0, m1, 0);
 
-  img_dset.dstSet    = th->dset;
-  img_info.imageView = th->image_view;
-  vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+  // set param for rawinput
+  // get module
+  dt_module_set_param_string(graph->module + m0, dt_token("filename"), imgfilename);
+
+  // run graph only up to roi computations to get size
+  // run all <= create nodes
+  dt_graph_run_t run = ~-(s_graph_run_create_nodes<<1);
+  if(dt_graph_run(graph, run) != VK_SUCCESS)
+  {
+    dt_log(s_log_err, "[thm] failed to run first half of graph!");
+    return VK_INCOMPLETE;
+  }
+
+  // now grab roi size from graph's main output node
+  dt_thumbnail_t *th = thumbnails_alloc(tn, thumb_index,
+      graph->module[m1].connector[0].roi.full_wd,
+      graph->module[m1].connector[0].roi.full_ht);
+  if(!th) return VK_INCOMPLETE;
 
   // now run the rest of the graph and copy over VkImage
   // let graph render into our thumbnail:
-  graph->thumbnail_image = tn->thumb[*thumb_index].image;
+  graph->thumbnail_image = th->image;
+  graph->thumbnail_layer = th->layer;
 
   clock_t beg = clock();
   // run all the rest we didn't run above
@@ -645,3 +1057,229 @@ dt_thumbnails_load_one(
 
   return VK_SUCCESS;
 }
+
+// start loading a previously cached thumbnail to a VkImage onto the GPU.
+// thumbnails from the archive go through the upload ring, call
+// thumbnails_upload_flush() before using them.
+static VkResult
+thumbnails_load(
+    dt_thumbnails_t *tn,
+    const char      *filename,
+    uint64_t         hash,        // dt_thumbnails_key() of the file name if known, or 0
+    uint32_t        *thumb_index)
+{
+  char imgfilename[PATH_MAX] = {0};
+  if(strncmp(filename, "data/", 5))
+  { // only hash images that aren't straight from our resource directory:
+    if(!hash) hash = dt_thumbnails_key(filename);
+    if(!hash) return VK_INCOMPLETE;
+    uint32_t header[4] = {0};
+    if(tn->archive && dt_archive_get(tn->archive, hash, header, 0, sizeof(header)) >= (int64_t)sizeof(header))
+    {
+      if(header[2] == 0) return thumbnails_load_graph(tn, "data/bomb.bc1", thumb_index); // dead
+      if(thumbnails_upload(tn, hash, header, thumb_index) == VK_SUCCESS)
+      {
+        thumbnails_hit++;
+        return VK_SUCCESS;
+      }
+    }
+    if(!thumbnails_lookup(tn, hash, imgfilename, sizeof(imgfilename))) return VK_INCOMPLETE;
+  }
+  else
+  {
+    if(snprintf(imgfilename, sizeof(imgfilename), "%s/%s", dt_pipe.basedir, filename) >= sizeof(imgfilename)) return VK_INCOMPLETE;
+    struct stat statbuf = {0};
+    if(stat(imgfilename, &statbuf)) return VK_INCOMPLETE;
+  }
+  return thumbnails_load_graph(tn, imgfilename, thumb_index);
+}
+
+// move the thumbnail to the most recently used end of the lru list
+static void
+thumbnails_touch(
+    dt_thumbnails_t *tn,
+    dt_thumbnail_t  *th)
+{
+  // threads_mutex_lock(&tn->lru_lock);
+  if(th == tn->mru) return;
+  if(th == tn->lru) tn->lru = tn->lru->next; // move head
+  tn->lru->prev = 0;
+  DLIST_RM_ELEMENT(th);                      // disconnect old head
+  tn->mru = DLIST_APPEND(tn->mru, th);       // append to end and move tail
+  // threads_mutex_unlock(&tn->lru_lock);
+}
+
+// make sure the thumbnail of the image is loaded and most recently used.
+// returns 1 if it had to be loaded, 0 if it was there already, -1 on error.
+static int
+thumbnails_load_image(
+    dt_thumbnails_t *tn,
+    dt_db_t         *db,
+    uint32_t         imgid,
+    int              pin)
+{
+  dt_image_t *img = db->image + imgid;
+  uint32_t tid = img->thumbnail;
+  if(tid > 0 && tid < tn->thumb_max && tn->thumb[tid].imgid != -1u && tn->thumb[tid].imgid != imgid)
+    tid = 0; // the slot has been given to another image since
+  if(tid == 0)
+  { // not loaded
+    char filename[1024];
+    dt_db_image_path(db, imgid, filename, sizeof(filename));
+    uint64_t key = img->thumbnail_key;
+    if(!key) key = thumbnails_key_db(db, imgid, filename); // reads the cfg, remember it
+    uint32_t thumb_index = -1u;
+    VkResult res = thumbnails_load(tn, filename, key, &thumb_index);
+    // the gui thread does not draw before we return, and we flush the uploads before that:
+    threads_mutex_lock(&db->image_mutex);
+    img->thumbnail_key = key;
+    if(res == VK_SUCCESS) img->thumbnail = thumb_index;
+    threads_mutex_unlock(&db->image_mutex);
+    if(res != VK_SUCCESS) return -1;
+    tn->thumb[thumb_index].imgid = imgid;
+    if(pin) tn->thumb[thumb_index].pin = tn->pin;
+    return 1;
+  }
+  else if(tid > 0 && tid < tn->thumb_max)
+  { // loaded, update lru
+    thumbnails_touch(tn, tn->thumb + tid);
+    if(pin) tn->thumb[tid].pin = tn->pin;
+  }
+  return 0;
+}
+
+// 1) if db loads a directory, kick off thumbnail creation of directory in bg
+//    this step is the only thing in the non-gui thread
+// 2) for currently visible collection: batch-update lru and trigger thumbnail loading
+//    if necessary (bc1 file exists but not loaded, maybe need "ready" flag)
+//    this should be fast enough to run every refresh.
+//    start single-thread and maybe interleave with two threads, too
+//    (needs lru mutex then)
+// this function is 2):
+void
+dt_thumbnails_load_list(
+    dt_thumbnails_t *tn,
+    dt_db_t         *db,
+    const uint32_t  *collection,
+    uint32_t         beg,
+    uint32_t         end)
+{
+  double clock_beg = dt_time();
+  int loaded = 0;
+  for(int k=beg;k<end;k++)
+  { // for all images in given collection
+    const uint32_t imgid = collection[k];
+    if(imgid >= db->image_cnt) break; // safety first. this probably means this job is stale! big danger!
+    if(thumbnails_load_image(tn, db, imgid, 1) > 0) loaded++;
+  }
+  thumbnails_upload_flush(tn);
+  if(loaded)
+  {
+    double clock_end = dt_time();
+    dt_log(s_log_perf, "[thm] loaded %d thumbnails in %.3fms, %.0f/s", loaded,
+        1000.0*(clock_end-clock_beg), loaded/(clock_end-clock_beg));
+  }
+}
+
+void
+dt_thumbnails_prefetch(
+    dt_thumbnails_t *tn,
+    dt_db_t         *db,
+    const uint32_t  *collection,
+    uint32_t         collection_cnt,
+    uint32_t         beg,
+    uint32_t         end,
+    float            velocity)
+{
+  double clock_beg = dt_time();
+  // look ahead about half a second of scrolling at 60fps, at least one
+  // screen and at most four, and never so much that we cycle the cache:
+  const int vis   = MAX(1, (int)end - (int)beg);
+  const int ahead = MIN(tn->thumb_max/4, CLAMP((int)(fabsf(velocity) * 30.0f), vis, 4*vis));
+  const int dir   = velocity < 0.0f ? -1 : 1;
+  int loaded = 0;
+  for(int k=0;k<ahead;k++)
+  { // walk away from the visible edge in scroll direction
+    const int i = dir > 0 ? (int)end + k : (int)beg - 1 - k;
+    if(i < 0 || i >= collection_cnt) break;
+    const uint32_t imgid = collection[i];
+    if(imgid >= db->image_cnt) break;
+    if(k < vis && dt_time() - clock_beg < DT_THUMBNAILS_PREFETCH_BUDGET)
+    { // upload the next screen right away, as much as fits into this frame:
+      if(thumbnails_load_image(tn, db, imgid, 0) > 0) loaded++;
+    }
+    else if(tn->archive && db->image[imgid].thumbnail == 0)
+    { // only have the kernel read the rest from disk in the background:
+      uint64_t key = db->image[imgid].thumbnail_key;
+      if(!key && dt_time() - clock_beg < DT_THUMBNAILS_PREFETCH_BUDGET)
+      { // the key needs a look into the files
+        char filename[1024];
+        dt_db_image_path(db, imgid, filename, sizeof(filename));
+        key = thumbnails_key_db(db, imgid, filename);
+        threads_mutex_lock(&db->image_mutex);
+        db->image[imgid].thumbnail_key = key;
+        threads_mutex_unlock(&db->image_mutex);
+      }
+      if(key) dt_archive_prefetch(tn->archive, key);
+    }
+  }
+  thumbnails_upload_flush(tn);
+  tn->pin++; // the visible ones of this frame are free to go now
+  if(loaded)
+  {
+    double clock_end = dt_time();
+    dt_log(s_log_perf, "[thm] prefetched %d thumbnails in %.3fms", loaded, 1000.0*(clock_end-clock_beg));
+  }
+}
+
+// load a previously cached thumbnail to a VkImage onto the GPU.
+// returns VK_SUCCESS on success
+uint32_t
+dt_thumbnails_load_level(
+    dt_thumbnails_t *tn,
+    dt_db_t         *db,
+    uint32_t         imgid,
+    int              level)
+{
+  if(imgid >= db->image_cnt) return -1u;
+  dt_image_t *img = db->image + imgid;
+  uint64_t key = img->thumbnail_key;
+  char filename[1024];
+  if(!key)
+  {
+    dt_db_image_path(db, imgid, filename, sizeof(filename));
+    key = thumbnails_key_db(db, imgid, filename);
+    if(!key) return -1u;
+    threads_mutex_lock(&db->image_mutex);
+    img->thumbnail_key = key;
+    threads_mutex_unlock(&db->image_mutex);
+  }
+  key = dt_archive_key_level(key, level);
+  for(int i=1;i<tn->thumb_max;i++)
+  { // few slots in here, look for the one that has it:
+    dt_thumbnail_t *th = tn->thumb + i;
+    if(th->imgid != imgid || th->key != key) continue;
+    thumbnails_touch(tn, th);
+    return i;
+  }
+  if(!tn->archive) return -1u; // the levels only live in there
+  uint32_t header[4] = {0}, thumb_index = -1u;
+  if(dt_archive_get(tn->archive, key, header, 0, sizeof(header)) < (int64_t)sizeof(header) ||
+     thumbnails_upload(tn, key, header, &thumb_index) != VK_SUCCESS)
+    return -1u;
+  thumbnails_upload_flush(tn);
+  tn->thumb[thumb_index].imgid = imgid;
+  tn->thumb[thumb_index].key   = key;
+  return thumb_index;
+}
+
+VkResult
+dt_thumbnails_load_one(
+    dt_thumbnails_t *tn,
+    const char      *filename,
+    uint32_t        *thumb_index)
+{
+  VkResult res = thumbnails_load(tn, filename, 0, thumb_index);
+  thumbnails_upload_flush(tn);
+  return res;
+}
@@ -1,7 +1,6 @@
 #pragma once
 
 #include "pipe/graph.h"
-#include "pipe/alloc.h"
 #include "core/threads.h"
 
 #include <vulkan/vulkan.h>
@@ -16,36 +15,77 @@
 //
 // create thumbnails and default history here
 // /<full path from root>/imgname.raw.cfg
-// ~/.cache/vkdt/imgnamehash.bc1
+// ~/.cache/vkdt/thumbs/imgnamehash.bc1
+// the latter is not a file but an entry in the thumbnail archive (see
+// db/archive.h), o-bc1 and i-bc1 write and read it there. thumbnails from
+// before the archive are still read from ~/.cache/vkdt/imgnamehash.bc1.
 
 typedef struct dt_db_t dt_db_t;
+typedef struct dt_archive_t dt_archive_t;
+// the thumbnails live in the layers of a few large bc1 array images, one
+// fixed layer per thumbnail slot. the slot's descriptor set points to a view
+// of its layer, so loading a thumbnail is only a copy and eviction reuses the
+// slot. a thumbnail may be smaller than the layer, draw the (0,0,wd,ht) part.
 typedef struct dt_thumbnail_t
 {
   VkDescriptorSet        dset;
-  VkImage                image;
-  VkImageView            image_view;
-  dt_vkmem_t            *mem;
-  uint64_t               offset;
+  VkImage                image;   // the array image, owned by dt_thumbnails_t
+  VkImageView            image_view; // 2d view of our layer
+  uint32_t               layer;   // layer index in the array image
+  int                    nearest; // the dset uses the nearest sampler, for tiny images
   struct dt_thumbnail_t *prev;    // dlist for lru cache
   struct dt_thumbnail_t *next;
   uint32_t               imgid;   // index into images->image[] or -1u
+  uint32_t               pin;     // equals dt_thumbnails_t::pin while on screen, not evicted then
+  uint64_t               key;     // archive key if loaded by dt_thumbnails_load_level(), or 0
   uint32_t               wd;
   uint32_t               ht;
 }
 dt_thumbnail_t;
 
-#define DT_THUMBNAILS_THREADS 2
+// staging ring for thumbnail uploads, two halves of 8MB (a 400x400 bc1 is 80kB)
+#define DT_THUMBNAILS_UPLOAD_SIZE (16u<<20)
+typedef struct dt_thumbnails_upload_t
+{
+  VkBuffer               buffer;
+  VkDeviceMemory         mem;
+  uint8_t               *mapped;
+  uint64_t               size;               // of the whole ring
+  uint64_t               end;                // fill position in the current half
+  int                    part;               // the half we fill
+  int                    cnt;                // number of copies recorded for it
+  VkCommandPool          command_pool;
+  VkCommandBuffer        command_buffer[2];  // one per half
+  VkFence                fence[2];
+  int                    busy[2];            // submitted and not waited for
+}
+dt_thumbnails_upload_t;
+
+#define DT_THUMBNAILS_PREFETCH_BUDGET 0.004 // seconds per frame spent uploading thumbnails ahead of time
+#define DT_THUMBNAILS_LAYERS 256 // per array image, the guaranteed minimum of maxImageArrayLayers
 typedef struct dt_thumbnails_t
 {
-  dt_graph_t            graph[DT_THUMBNAILS_THREADS];
-  threads_mutex_t       graph_lock[DT_THUMBNAILS_THREADS]; // needed for overscheduling thumbnail creation
+  // thumbnail creation runs one job per graph. a job decodes the input on the
+  // cpu first (dt_graph_export_prepare()) and then waits until one of the
+  // render_cnt slots for the gpu is free. so with more graphs than render
+  // slots, the ones waiting are a queue of decoded images for the gpu.
+  dt_graph_t           *graph;
+  threads_mutex_t      *graph_lock;   // one per graph, needed for overscheduling thumbnail creation
+  int                   graph_cnt;
+  threads_mutex_t       render_lock;  // protects render_free
+  pthread_cond_t        render_cond;  // signalled when a render slot becomes free
+  int                   render_free;  // number of graphs that may go to the gpu now
+  threads_mutex_t       preview_lock; // the same for the jobs that decode embedded jpeg previews
   uint64_t              job_timestamp;
 
   int                   thumb_wd;
   int                   thumb_ht;
+  int                   layer_wd;  // size of one layer: thumb_wd and thumb_ht rounded up to bc1 blocks
+  int                   layer_ht;
+  int                   preview_size; // also render and keep a level 1 this large, 0 for none
 
-  dt_vkalloc_t          alloc;
-  uint32_t              memory_type_bits;
+  VkImage              *array;     // bc1 array images with DT_THUMBNAILS_LAYERS layers each
+  int                   array_cnt;
   VkDeviceMemory        vkmem;
   VkDescriptorPool      dset_pool;
   VkDescriptorSetLayout dset_layout;
@@ -55,7 +95,12 @@ typedef struct dt_thumbnails_t
   // threads_mutex_t       lru_lock; // currently not needed, only using lru cache in gui thread
   dt_thumbnail_t       *lru;   // least recently used thumbnail, delete this first
   dt_thumbnail_t       *mru;   // most  recently used thumbnail, append here
+  uint32_t              pin;   // counts frames, see dt_thumbnails_prefetch()
 
+  dt_thumbnails_upload_t upload; // copies bc1 from the archive to the thumbnails, without graph
+
+  dt_archive_t         *archive;  // where the bc1 go, 0 if it can't be opened
+  uint64_t              cache_budget; // max bytes in the archive, 0 for no limit
   char                  cachedir[1024];
 }
 dt_thumbnails_t;
@@ -67,16 +112,23 @@ VkResult dt_thumbnails_init(
     const int wd,            // max width of thumbnail
     const int ht,            // max height of thumbnail
     const int cnt,           // max number of thumbnails
-    const size_t heap_size); // max heap size in bytes (allocated on GPU)
+    const size_t heap_size,  // max heap size in bytes (allocated on GPU), cnt is reduced to fit
+    const int decode_cnt,    // number of graphs that can decode images while others render
+    const int render_cnt);   // number of graphs that render on the gpu at the same time
 
 // free all resources
 void dt_thumbnails_cleanup(dt_thumbnails_t *tn);
 
 // create bc1 thumbnails for the current collection in given db.
-// this is a convenience wrapper around dt_thumbnails_cache_list().
+// this is like dt_thumbnails_cache_list(), but runs at background priority.
+// images without any thumbnail first get one from the jpeg preview embedded
+// in the raw file (see db/preview.h), decoded on all threads. these are
+// marked with magic "bc1p" and replaced by the graph afterwards.
 VkResult dt_thumbnails_cache_collection(dt_thumbnails_t *tn, dt_db_t *db, void (*ufn)(void));
 
 // create bc1 thumbnails for the given list, in background threads.
+// the list is assumed to come from user interaction and jumps the queue
+// (interactive priority).
 VkResult dt_thumbnails_cache_list(
     dt_thumbnails_t *tn,               // thumbnail struct used to create the thumbnails (will not load thumbs here)
     dt_db_t         *db,               // database to map imageid to filename.
@@ -90,14 +142,30 @@ VkResult dt_thumbnails_cache_list(
 VkResult dt_thumbnails_cache_one(
     dt_graph_t      *graph,
     dt_thumbnails_t *tn,
-    const char      *filename);
+    const char      *filename,
+    uint64_t         key);             // dt_thumbnails_key() of the file if known, or 0
+
+// keep the thumbnail archive on disk below budget bytes (0 for no limit). the
+// thumbnails that have not been looked at for the longest time go first. this
+// runs in the background now and after every dt_thumbnails_cache_list() and
+// dt_thumbnails_cache_collection(), and logs hit and miss counts to help
+// choosing the budget.
+void dt_thumbnails_cache_gc(dt_thumbnails_t *tn, uint64_t budget);
 
 // abort the caching in background threads. blocks until we're sure we're safe
 // (may have to wait for a thumbnail or two to finish rendering).
 void dt_thumbnails_cache_abort( dt_thumbnails_t *tn);
 
+// load the given level of the thumbnail of the image from the archive, level
+// 1 being the large version made when preview_size is set (see
+// dt_archive_key_level()). this is meant for a second dt_thumbnails_t with few
+// large slots, for full screen previews. returns the thumbnail index, or -1u
+// if there is no such level (yet).
+uint32_t dt_thumbnails_load_level(dt_thumbnails_t *tn, struct dt_db_t *db, uint32_t imgid, int level);
+
 // load one bc1 thumbnail for a given filename. fills thumb_index and returns
-// VK_SUCCESS if all went well.
+// VK_SUCCESS if all went well. thumbnails in the archive are uploaded
+// directly, only other files go through an i-bc1 graph.
 VkResult dt_thumbnails_load_one(dt_thumbnails_t *tn, const char *filename, uint32_t *thumb_index);
 
 // update thumbnails for a list of image ids. this will run in this thread
@@ -112,7 +180,35 @@ dt_thumbnails_load_list(
     uint32_t         beg,          // update collection[k] with k in [beg, end)
     uint32_t         end);         // 
 
-// explitly delete the cached bc1 thumbnail in ~/.cache/vkdt/
+// load the thumbnails the user is about to scroll to, after the visible ones
+// went through dt_thumbnails_load_list(). the screen following in scroll
+// direction is uploaded (as much as fits DT_THUMBNAILS_PREFETCH_BUDGET), the
+// screens after that are read from the archive in the background, so they
+// are ready when we get there. the thumbnails loaded by load_list() since the
+// last call are pinned: prefetching does not evict what is on screen. call
+// once per frame.
+void
+dt_thumbnails_prefetch(
+    dt_thumbnails_t *tn,
+    struct dt_db_t  *db,
+    const uint32_t  *collection,
+    uint32_t         collection_cnt,
+    uint32_t         beg,          // visible images are collection[k] with k in [beg, end)
+    uint32_t         end,
+    float            velocity);    // scroll speed in images per frame, positive is down
+
+// the key of the thumbnail of the given .cfg file in the archive. it is a hash
+// of the processing history (the cfg or the default cfg it'll get, without the
+// file name of the main input) and of the image file (dt_db_meta_content()).
+// so copied and renamed images keep their thumbnails, touching a file does not
+// make them stale, and every edit gets a new one. returns 0 if there is
+// neither a cfg nor a default. this reads the image file, pass the content
+// hash from the metadata index to the second version to only read the cfg.
+uint64_t dt_thumbnails_key(const char *filename);
+uint64_t dt_thumbnails_key_content(const char *filename, uint64_t content);
+
+// explitly delete the cached bc1 thumbnail of the current history. call this
+// before changing the cfg, the thumbnail is found by the key of the old one.
 void
 dt_thumbnails_invalidate(
     dt_thumbnails_t *tn,
@@ -0,0 +1,284 @@
+#include "db.h"
+#include "watch.h"
+#include "thumbnails.h"
+#include "stringpool.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef struct dt_db_watch_event_t
+{
+  uint32_t mask;   // inotify event mask
+  uint32_t cookie; // pairs IN_MOVED_FROM with IN_MOVED_TO
+  uint32_t off;    // file name in buf
+}
+dt_db_watch_event_t;
+
+typedef struct dt_db_watch_t
+{
+  int                  fd;        // inotify instance
+  int                  stop[2];   // pipe to wake up the thread when stopping
+  pthread_t            thread;
+  void               (*ufn)(void);
+  threads_mutex_t      mutex;     // protects the queue below
+  dt_db_watch_event_t *event;
+  uint32_t             event_cnt, event_max;
+  char                *buf;
+  size_t               buf_cnt, buf_max;
+  int                  overflow;  // the kernel dropped events
+  char                 dirname[1024];
+}
+dt_db_watch_t;
+
+typedef enum dt_db_watch_op_t
+{
+  s_watch_none   = 0,
+  s_watch_add    = 1,
+  s_watch_remove = 2,
+  s_watch_moved  = 3, // moved here, took over the image id of a removed one
+}
+dt_db_watch_op_t;
+
+static void
+watch_push(dt_db_watch_t *w, uint32_t mask, uint32_t cookie, const char *name)
+{
+  const size_t len = strlen(name);
+  if(w->event_cnt == w->event_max)
+  {
+    w->event_max = w->event_max ? 2*w->event_max : 256;
+    w->event = realloc(w->event, sizeof(w->event[0])*w->event_max);
+  }
+  if(w->buf_cnt + len + 1 > w->buf_max)
+  {
+    w->buf_max = MAX(2*w->buf_max, 4096 + len);
+    w->buf = realloc(w->buf, w->buf_max);
+  }
+  memcpy(w->buf + w->buf_cnt, name, len+1);
+  w->event[w->event_cnt++] = (dt_db_watch_event_t){ .mask = mask, .cookie = cookie, .off = w->buf_cnt };
+  w->buf_cnt += len + 1;
+}
+
+static void*
+watch_thread(void *arg)
+{
+  dt_db_watch_t *w = arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char fn[PATH_MAX];
+  struct pollfd pfd[] = {{ .fd = w->fd, .events = POLLIN }, { .fd = w->stop[0], .events = POLLIN }};
+  while(1)
+  {
+    if(poll(pfd, 2, -1) < 0)
+    {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(pfd[1].revents) break; // dt_db_watch_stop()
+    const ssize_t len = read(w->fd, buf, sizeof(buf));
+    if(len <= 0)
+    {
+      if(len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      break;
+    }
+    int wake = 0;
+    threads_mutex_lock(&w->mutex);
+    for(const char *c = buf; c < buf + len; )
+    {
+      const struct inotify_event *ev = (const struct inotify_event *)c;
+      c += sizeof(*ev) + ev->len;
+      if(ev->mask & IN_Q_OVERFLOW) w->overflow = wake = 1;
+      if(!ev->len || (ev->mask & IN_ISDIR) || !dt_db_accept_filename(ev->name)) continue;
+      if(ev->mask & IN_CREATE)
+      { // regular files are still being written, wait for IN_CLOSE_WRITE. links are done.
+        snprintf(fn, sizeof(fn), "%s/%s", w->dirname, ev->name);
+        if(!fs_islnk_file(fn)) continue;
+      }
+      watch_push(w, ev->mask, ev->cookie, ev->name);
+      wake = 1;
+    }
+    threads_mutex_unlock(&w->mutex);
+    if(wake && w->ufn) w->ufn();
+  }
+  return 0;
+}
+
+void dt_db_watch_start(dt_db_t *db, void (*ufn)(void))
+{
+  if(!db->dirname[0] || db->watch) return;
+  dt_db_watch_t *w = calloc(sizeof(dt_db_watch_t), 1);
+  w->ufn = ufn;
+  w->stop[0] = w->stop[1] = -1;
+  snprintf(w->dirname, sizeof(w->dirname), "%s", db->dirname);
+  w->fd = inotify_init1(IN_CLOEXEC);
+  if(w->fd < 0) goto error;
+  if(inotify_add_watch(w->fd, w->dirname,
+        IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR) < 0)
+    goto error;
+  if(pipe(w->stop)) goto error;
+  threads_mutex_init(&w->mutex, 0);
+  if(pthread_create(&w->thread, 0, watch_thread, w))
+  {
+    threads_mutex_destroy(&w->mutex);
+    goto error;
+  }
+  db->watch = w;
+  return;
+error:
+  dt_log(s_log_db|s_log_err, "could not watch `%s' for changes", w->dirname);
+  if(w->fd >= 0) close(w->fd);
+  if(w->stop[0] >= 0) close(w->stop[0]);
+  if(w->stop[1] >= 0) close(w->stop[1]);
+  free(w);
+}
+
+void dt_db_watch_stop(dt_db_t *db)
+{
+  dt_db_watch_t *w = db->watch;
+  if(!w) return;
+  if(write(w->stop[1], "", 1) == 1) pthread_join(w->thread, 0);
+  else pthread_cancel(w->thread);
+  close(w->fd);
+  close(w->stop[0]);
+  close(w->stop[1]);
+  threads_mutex_destroy(&w->mutex);
+  free(w->event);
+  free(w->buf);
+  free(w);
+  db->watch = 0;
+}
+
+static int // same rule as dt_db_load_directory(): the cfg or the image file itself is there
+watch_present(const char *dirname, const char *name)
+{
+  char fn[PATH_MAX];
+  snprintf(fn, sizeof(fn), "%s/%s.cfg", dirname, name);
+  if(fs_isreg_file(fn) || fs_islnk_file(fn)) return 1;
+  const size_t len = strlen(name);
+  if(len > 4 && !strcasecmp(name + len - 4, ".cfg")) return 0;
+  snprintf(fn, sizeof(fn), "%s/%s", dirname, name);
+  return fs_isreg_file(fn) || fs_islnk_file(fn);
+}
+
+int dt_db_watch_apply(
+    dt_db_t         *db,
+    dt_thumbnails_t *thumbnails,
+    dt_thumbnails_t *thumbnail_gen,
+    void           (*ufn)(void))
+{
+  dt_db_watch_t *w = db->watch;
+  if(!w) return 0;
+  // take the queue, the thread starts a new one
+  threads_mutex_lock(&w->mutex);
+  dt_db_watch_event_t *event = w->event;
+  char *buf = w->buf;
+  const uint32_t cnt = w->event_cnt;
+  const int overflow = w->overflow;
+  w->event = 0;
+  w->buf = 0;
+  w->event_cnt = w->event_max = 0;
+  w->buf_cnt = w->buf_max = 0;
+  w->overflow = 0;
+  threads_mutex_unlock(&w->mutex);
+  if(overflow)
+    dt_log(s_log_db|s_log_err, "missed changes to `%s', reload the folder to see all images", db->dirname);
+  if(!cnt) return 0;
+
+  // one change per image, no matter how many events it got
+  struct
+  {
+    const char *name;
+    uint32_t    from, to; // move cookies
+    uint32_t    imgid;
+    uint32_t    op;       // dt_db_watch_op_t
+  } *ch = calloc(sizeof(ch[0]), cnt);
+  uint32_t ch_cnt = 0;
+  dt_stringpool_t names;
+  dt_stringpool_init(&names, cnt, 32);
+  for(uint32_t e=0;e<cnt;e++)
+  {
+    char *n = buf + event[e].off;
+    size_t len = strlen(n);
+    if(len > 4 && !strcasecmp(n + len - 4, ".cfg")) n[len -= 4] = 0; // the image the cfg belongs to
+    const uint32_t c = dt_stringpool_get(&names, n, len, ch_cnt, 0);
+    if(c == -1u) continue;
+    if(c == ch_cnt) ch[ch_cnt++].name = n;
+    if(event[e].mask & IN_MOVED_FROM) ch[c].from = event[e].cookie;
+    if(event[e].mask & IN_MOVED_TO)   ch[c].to   = event[e].cookie;
+  }
+
+  // compare what's on disk now to what we have
+  uint32_t add_cnt = 0, rm_cnt = 0, mv_cnt = 0;
+  for(uint32_t c=0;c<ch_cnt;c++)
+  {
+    ch[c].imgid = dt_db_image_id(db, ch[c].name);
+    const int present = watch_present(db->dirname, ch[c].name);
+    if( present && ch[c].imgid == -1u) { ch[c].op = s_watch_add;    add_cnt++; }
+    if(!present && ch[c].imgid != -1u) { ch[c].op = s_watch_remove; rm_cnt++;  }
+  }
+
+  // files moved within the folder keep their image id, rating and labels
+  for(uint32_t c=0;c<ch_cnt;c++)
+  {
+    if(ch[c].op != s_watch_add || !ch[c].to) continue;
+    for(uint32_t r=0;r<ch_cnt;r++)
+    {
+      if(ch[r].op != s_watch_remove || ch[r].from != ch[c].to) continue;
+      if(!dt_db_rename_image(db, ch[r].imgid, ch[c].name))
+      {
+        ch[r].op = s_watch_none;
+        ch[c].op = s_watch_moved;
+        rm_cnt--; add_cnt--; mv_cnt++;
+      }
+      break;
+    }
+  }
+
+  // the thumbnail threads hold image ids and pointers into the image array:
+  const int restart = rm_cnt || db->image_cnt + add_cnt > db->image_max;
+  if(restart) dt_thumbnails_cache_abort(thumbnail_gen);
+
+  for(uint32_t c=0;c<ch_cnt;c++) if(ch[c].op == s_watch_remove) // look up again, ids move around
+    dt_db_remove_image(db, thumbnails, dt_db_image_id(db, ch[c].name));
+
+  const char **add = malloc(sizeof(const char *)*ch_cnt);
+  uint32_t *imgid = malloc(sizeof(uint32_t)*ch_cnt);
+  uint32_t n = 0;
+  for(uint32_t c=0;c<ch_cnt;c++) if(ch[c].op == s_watch_add) add[n++] = ch[c].name;
+  dt_db_add_images(db, add, n, imgid);
+  for(uint32_t c=0;c<ch_cnt;c++) if(ch[c].op == s_watch_moved) // the bc1 goes by file name too
+    imgid[n++] = dt_db_image_id(db, ch[c].name);
+  uint32_t th_cnt = 0;
+  for(uint32_t i=0;i<n;i++) if(imgid[i] != -1u) imgid[th_cnt++] = imgid[i];
+
+  // pick up the rest of the folder where the threads left off, but do the new ones first
+  if(restart) dt_thumbnails_cache_collection(thumbnail_gen, db, ufn);
+  if(th_cnt) dt_thumbnails_cache_list(thumbnail_gen, db, imgid, th_cnt, ufn);
+  if(add_cnt || rm_cnt || mv_cnt)
+    dt_log(s_log_db, "`%s' changed: %u new, %u removed, %u moved", db->dirname, add_cnt, rm_cnt, mv_cnt);
+
+  free(add);
+  free(imgid);
+  free(ch);
+  dt_stringpool_cleanup(&names);
+  free(event);
+  free(buf);
+  return rm_cnt > 0;
+}
+
+#else // no inotify
+void dt_db_watch_start(dt_db_t *db, void (*ufn)(void)) {}
+void dt_db_watch_stop(dt_db_t *db) {}
+int dt_db_watch_apply(dt_db_t *db, dt_thumbnails_t *thumbnails, dt_thumbnails_t *thumbnail_gen, void (*ufn)(void))
+{
+  return 0;
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+// follow changes to the open directory while we're looking at it, so images
+// copied there (by the files view, a card reader script, tethering) show up
+// without reloading the folder. a background thread waits for inotify events
+// and queues the names, the gui thread applies them to the db in one go: new
+// images are appended, images that are gone are removed, and moved files keep
+// their rating, labels and thumbnail under the new name. thumbnails are only
+// created for the new images.
+//
+// an image counts as present if it has a .cfg or if the image file itself is
+// there, same as when loading the directory. files are picked up when they
+// are closed after writing, not when they appear, so half copied files are
+// not thumbnailed.
+//
+// only implemented on linux, elsewhere this does nothing.
+
+typedef struct dt_db_t dt_db_t;
+typedef struct dt_thumbnails_t dt_thumbnails_t;
+
+// start watching the directory of the db. ufn is called from the watcher
+// thread when there are changes to apply (wake up the gui, say).
+void dt_db_watch_start(dt_db_t *db, void (*ufn)(void));
+
+// stop the thread and drop pending changes. called by dt_db_cleanup().
+void dt_db_watch_stop(dt_db_t *db);
+
+// apply the queued changes to db and collection, in the thread that owns the
+// db. thumbnails is the cache that is displayed, thumbnail_gen creates the
+// bc1 files for the new images, calling ufn after each. returns non-zero if
+// images have been removed, which changes the image ids of others.
+int dt_db_watch_apply(
+    dt_db_t         *db,
+    dt_thumbnails_t *thumbnails,
+    dt_thumbnails_t *thumbnail_gen,
+    void           (*ufn)(void));
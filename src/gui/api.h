@@ -3,6 +3,8 @@
 #include "pipe/graph-history.h"
 #include "gui/gui.h"
 #include "gui/darkroom.h"
+#include "db/journal.h"
+#include "db/watch.h"
 #include "pipe/draw.h"
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -223,6 +225,7 @@ dt_gui_dr_advance_rate(int rate)
   assert(vkdt.view_mode == s_view_darkroom);
   const uint32_t ci = dt_db_current_imgid(&vkdt.db);
   if(ci != -1u) vkdt.db.image[ci].rating = CLAMP(vkdt.db.image[ci].rating + rate, 0, 5);
+  if(ci != -1u) dt_db_update_image_in_place(&vkdt.db, ci);
 
   uint32_t next = dt_db_current_colid(&vkdt.db) + 1;
   if(next < vkdt.db.collection_cnt)
@@ -487,12 +490,16 @@ dt_gui_rate(int rate)
   {
     const uint32_t *sel = dt_db_selection_get(&vkdt.db);
     for(uint32_t i=0;i<vkdt.db.selection_cnt;i++)
+    {
       vkdt.db.image[sel[i]].rating = rate;
+      dt_db_update_image(&vkdt.db, sel[i]);
+    }
   }
   else if(vkdt.view_mode == s_view_darkroom)
-  {
+  { // leave the collection alone, we're stepping through it
     const uint32_t ci = dt_db_current_imgid(&vkdt.db);
     if(ci != -1u) vkdt.db.image[ci].rating = rate;
+    if(ci != -1u) dt_db_update_image_in_place(&vkdt.db, ci);
   }
 }
 
@@ -503,12 +510,16 @@ dt_gui_label_unset(dt_image_label_t l)
   {
     const uint32_t *sel = dt_db_selection_get(&vkdt.db);
     for(uint32_t i=0;i<vkdt.db.selection_cnt;i++)
+    {
       vkdt.db.image[sel[i]].labels &= ~l;
+      dt_db_update_image(&vkdt.db, sel[i]);
+    }
   }
   else if(vkdt.view_mode == s_view_darkroom)
   {
     const uint32_t ci = dt_db_current_imgid(&vkdt.db);
     if(ci != -1u) vkdt.db.image[ci].labels &= ~l;
+    if(ci != -1u) dt_db_update_image_in_place(&vkdt.db, ci);
   }
 }
 
@@ -519,12 +530,16 @@ dt_gui_label_set(dt_image_label_t l)
   {
     const uint32_t *sel = dt_db_selection_get(&vkdt.db);
     for(uint32_t i=0;i<vkdt.db.selection_cnt;i++)
+    {
       vkdt.db.image[sel[i]].labels |= l;
+      dt_db_update_image(&vkdt.db, sel[i]);
+    }
   }
   else if(vkdt.view_mode == s_view_darkroom)
   {
     const uint32_t ci = dt_db_current_imgid(&vkdt.db);
     if(ci != -1u) vkdt.db.image[ci].labels |= l;
+    if(ci != -1u) dt_db_update_image_in_place(&vkdt.db, ci);
   }
 }
 
@@ -535,12 +550,16 @@ dt_gui_label(int label)
   {
     const uint32_t *sel = dt_db_selection_get(&vkdt.db);
     for(uint32_t i=0;i<vkdt.db.selection_cnt;i++)
+    {
       vkdt.db.image[sel[i]].labels ^= 1<<(label-1);
+      dt_db_update_image(&vkdt.db, sel[i]);
+    }
   }
   else if(vkdt.view_mode == s_view_darkroom)
   {
     const uint32_t ci = dt_db_current_imgid(&vkdt.db);
     if(ci != -1u) vkdt.db.image[ci].labels ^= 1<<(label-1);
+    if(ci != -1u) dt_db_update_image_in_place(&vkdt.db, ci);
   }
 }
 
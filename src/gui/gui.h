@@ -175,6 +175,7 @@ typedef struct dt_gui_t
 
   dt_db_t          db;            // image list and current query
   dt_thumbnails_t  thumbnails;    // for light table mode
+  dt_thumbnails_t  thumbnail_big; // few large previews, level 1 of the thumbnails
   dt_thumbnails_t  thumbnail_gen; // to generate thumbnails asynchronously
   dt_gui_view_t    view_mode;     // current view mode
 
@@ -5,6 +5,7 @@
 #include "pipe/modules/api.h"
 #include "db/thumbnails.h"
 #include "core/log.h"
+#include "core/trace.h"
 #include "core/signal.h"
 #include "core/version.h"
 #include "core/tools.h"
@@ -12,6 +13,7 @@
 #include "gui/render.h"
 #include "gui/view.h"
 #include "db/db.h"
+#include "db/watch.h"
 #include "nk.h"
 
 #define GLFW_INCLUDE_VULKAN
@@ -249,6 +251,8 @@ int main(int argc, char *argv[])
   int lastarg = dt_log_init_arg(argc, argv);
   dt_log(s_log_gui, "vkdt "VKDT_VERSION" (c) 2020--2025 johannes hanika");
   dt_pipe_global_init();
+  dt_trace_init();
+  dt_trace_thread_name("gui");
   threads_global_init();
   dt_set_signal_handlers();
 
@@ -284,8 +288,21 @@ int main(int argc, char *argv[])
   // also we have a temporary thumbnails struct and background threads
   // to create thumbnails, if necessary.
   // only width/height will matter here
-  dt_thumbnails_init(&vkdt.thumbnail_gen, 400, 400, 0, 0);
-  dt_thumbnails_init(&vkdt.thumbnails, 400, 400, 3000, 1ul<<30);
+  // the generator decodes images on the cpu while others render on the gpu:
+  const int thumb_decode = dt_rc_get_int(&vkdt.rc, "thumbnails/decode", 1);
+  const int thumb_render = dt_rc_get_int(&vkdt.rc, "thumbnails/render", 1);
+  dt_thumbnails_init(&vkdt.thumbnail_gen, 400, 400, 0, 0, thumb_decode, thumb_render);
+  dt_thumbnails_init(&vkdt.thumbnails, 400, 400, 3000, 1ul<<30, 0, 1);
+  // a few large ones for full screen previews, rendered along with the thumbnails.
+  // opt in, every thumbnail then renders about 6.5x the pixels (1024^2 vs 400^2):
+  const int preview_size = dt_rc_get_int(&vkdt.rc, "thumbnails/preview_size", 0);
+  if(preview_size > 400)
+  {
+    vkdt.thumbnail_gen.preview_size = preview_size;
+    dt_thumbnails_init(&vkdt.thumbnail_big, preview_size, preview_size, 5, 1ul<<26, 0, 1);
+  }
+  // keep the disk cache bounded, 4GB are about 50000 thumbnails:
+  dt_thumbnails_cache_gc(&vkdt.thumbnail_gen, (uint64_t)dt_rc_get_int(&vkdt.rc, "thumbnails/cache_mb", 4096) << 20);
   dt_db_init(&vkdt.db);
   char *filename = 0;
   {
@@ -304,6 +321,7 @@ int main(int argc, char *argv[])
   {
     vkdt.view_mode = -1;
     dt_db_load_directory(&vkdt.db, &vkdt.thumbnails, filename);
+    dt_db_watch_start(&vkdt.db, &glfwPostEmptyEvent);
     dt_view_switch(s_view_lighttable);
     dt_thumbnails_cache_collection(&vkdt.thumbnail_gen, &vkdt.db, &glfwPostEmptyEvent);
   }
@@ -388,6 +406,11 @@ int main(int argc, char *argv[])
       }
     }
 
+    // pick up files that appeared in or vanished from the folder. not in darkroom, the image ids might change:
+    if(vkdt.view_mode == s_view_lighttable &&
+       dt_db_watch_apply(&vkdt.db, &vkdt.thumbnails, &vkdt.thumbnail_gen, &glfwPostEmptyEvent))
+      vkdt.wstate.copied_imgid = -1u;
+
     dt_view_process(); // process before render/preset because this might swap the output image backbuffers
     if(vkdt.graph_dev.gui_msg && vkdt.graph_dev.gui_msg[0]) dt_gui_notification(vkdt.graph_dev.gui_msg);
 
@@ -414,7 +437,9 @@ int main(int argc, char *argv[])
 
   threads_shutdown();
   threads_global_cleanup(); // join worker threads before killing their resources
+  dt_trace_cleanup();
   dt_thumbnails_cleanup(&vkdt.thumbnails);
+  if(vkdt.thumbnail_gen.preview_size) dt_thumbnails_cleanup(&vkdt.thumbnail_big);
   dt_thumbnails_cleanup(&vkdt.thumbnail_gen);
   dt_gui_cleanup();
   dt_db_cleanup(&vkdt.db);
@@ -363,6 +363,8 @@ void render_darkroom()
     }
     float wd = 0.8*win_y;
     const uint32_t ci = dt_db_current_imgid(&vkdt.db);
+    if(ci != -1u && vkdt.graph_res[0] != VK_SUCCESS && vkdt.graph_res[1] != VK_SUCCESS)
+      dt_thumbnail_preview(ci, bounds); // placeholder until the graph has processed the first frame
     if(ci != -1u)
     { // this should *always* be the case
       const uint16_t labels = vkdt.db.image[ci].labels;
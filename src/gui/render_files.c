@@ -57,25 +57,44 @@ typedef struct copy_job_t
   uint32_t move;  // set to non-zero to remove src after copy
   _Atomic uint32_t abort;
   _Atomic uint32_t state;
-  int taskid;
+  int taskid;     // copying
+  int taskid_del; // removing the sources after all copies went through, if moving
 } copy_job_t;
 void copy_job_cleanup(void *arg)
 { // task is done, every thread will call this (but we put only one)
   copy_job_t *j = (copy_job_t *)arg;
   if(j->ent) free(j->ent);
+  j->taskid = j->taskid_del = -1; // the pool may hand out the ids again
   j->state = 2;
 }
 void copy_job_work(uint32_t item, void *arg)
 {
   copy_job_t *j = (copy_job_t *)arg;
-  if(j->abort) return;
+  if(j->abort || threads_task_yield()) return;
   char src[1300], dst[1300];
   snprintf(src, sizeof(src), "%s/%s", j->src, j->ent[item].d_name);
   snprintf(dst, sizeof(dst), "%s/%s", j->dst, j->ent[item].d_name);
-  if(fs_copy(dst, src)) j->abort = 2;
-  else if(j->move) fs_delete(src);
+  if(fs_copy(dst, src))
+  { // don't delete anything if moving, the delete stage is aborted with us
+    j->abort = 2;
+    threads_task_abort(j->taskid);
+  }
   glfwPostEmptyEvent(); // redraw status bar
 }
+void copy_job_delete(uint32_t item, void *arg)
+{
+  copy_job_t *j = (copy_job_t *)arg;
+  if(j->abort || threads_task_yield()) return;
+  char src[1300];
+  snprintf(src, sizeof(src), "%s/%s", j->src, j->ent[item].d_name);
+  fs_delete(src);
+  glfwPostEmptyEvent();
+}
+float copy_job_progress(const copy_job_t *j)
+{
+  const float p = threads_task_progress(j->taskid);
+  return j->move ? 0.5f*(p + threads_task_progress(j->taskid_del)) : p;
+}
 int copy_job(
     copy_job_t *j,
     const char *dst, // destination directory
@@ -104,7 +123,20 @@ int copy_job(
       j->ent[j->cnt++] = *ent;
   closedir(dirp);
 
-  j->taskid = threads_task("copy", j->cnt, -1, j, copy_job_work, copy_job_cleanup);
+  j->taskid_del = -1;
+  j->taskid = threads_task("copy", j->cnt, -1, j, copy_job_work, j->move ? 0 : copy_job_cleanup, s_threads_prio_background);
+  if(j->taskid >= 0 && j->move)
+  { // when moving, only delete once everything has been copied
+    j->taskid_del = threads_task_after("delete", j->cnt, &j->taskid, 1, j, copy_job_delete, copy_job_cleanup, s_threads_prio_background);
+    if(j->taskid_del < 0)
+    { // no cleanup would run now, and we don't want to delete what we could not copy
+      j->abort = 2;
+      threads_task_abort(j->taskid);
+      threads_wait(j->taskid);
+      copy_job_cleanup(j);
+      return j->taskid_del;
+    }
+  }
   return j->taskid;
 }
 
@@ -257,13 +289,18 @@ void render_files()
         else if(job[k].state == 1)
         { // running
           dt_tooltip("copying %s to %s", job[k].src, job[k].dst);
-          float progress = threads_task_progress(job[k].taskid);
+          float progress = copy_job_progress(job+k);
           struct nk_rect bb = nk_widget_bounds(ctx);
           nk_prog(ctx, 1024*progress, 1024, nk_false);
           char text[50];
           snprintf(text, sizeof(text), "%.0f%%", 100.0*progress);
           nk_draw_text(nk_window_get_canvas(ctx), bb, text, strlen(text), nk_glfw3_font(0), nk_rgba(0,0,0,0), nk_rgba(255,255,255,255));
-          if(nk_button_label(ctx, "abort")) job[k].abort = 1;
+          if(nk_button_label(ctx, "abort"))
+          {
+            job[k].abort = 1;
+            const int taskid = job[k].taskid;
+            if(taskid >= 0) threads_task_abort(taskid);
+          }
         }
         else
         { // done/aborted
@@ -47,6 +47,7 @@ static hk_t hk_lighttable[] = {
   {"label purple",  "toggle purple label",              {GLFW_KEY_F5}},
   {"zoom in",       "decrease images per row",          {GLFW_KEY_LEFT_CONTROL, GLFW_KEY_UP}},
   {"zoom out",      "increase images per row",          {GLFW_KEY_LEFT_CONTROL, GLFW_KEY_DOWN}},
+  {"preview",       "toggle large preview of the image", {GLFW_KEY_W}},
 };
 typedef enum hotkey_names_t
 {
@@ -73,11 +74,15 @@ typedef enum hotkey_names_t
   s_hotkey_label_5       = 20,
   s_hotkey_zoom_in       = 21,
   s_hotkey_zoom_out      = 22,
+  s_hotkey_preview       = 23,
 } hotkey_names_t;
 static int g_hotkey = -1; // to pass hotkey from handler to rendering. necessary for scrolling/export
 static int g_scroll_colid = -1; // to scroll to certain file name
 static int g_scroll_offset = 0; // remember last offset for leave/reenter
 static int g_image_cursor = -1; // gui keyboard navigation in the center view, cursor
+static int g_scroll_last = 0; // scroll position of the last frame
+static float g_scroll_velocity = 0.0f; // smoothed, in images per frame, for thumbnail prefetching
+static int g_preview = 0; // show the image under the cursor large instead of the grid
 
 void
 lighttable_keyboard(GLFWwindow *w, int key, int scancode, int action, int mods)
@@ -131,13 +136,17 @@ lighttable_keyboard(GLFWwindow *w, int key, int scancode, int action, int mods)
     case s_hotkey_zoom_out:
       dt_gui_lt_zoom_out();
       return;
+    case s_hotkey_preview:
+      g_preview ^= 1;
+      return;
     default: break;
   }
 
   if(action != GLFW_PRESS) return; // only handle key down events
   if(key == GLFW_KEY_ESCAPE)
   {
-    dt_view_switch(s_view_files);
+    if(g_preview) g_preview = 0;
+    else dt_view_switch(s_view_files);
   }
   else if(key == GLFW_KEY_ENTER)
   {
@@ -262,6 +271,17 @@ void render_lighttable_center()
     return;
   }
 
+  if(g_preview)
+  { // level 1 of the thumbnail, the arrow keys still move the cursor:
+    const uint32_t imgid = g_image_cursor >= 0 && g_image_cursor < vkdt.db.collection_cnt ?
+      vkdt.db.collection[g_image_cursor] : dt_db_current_imgid(&vkdt.db);
+    dt_thumbnail_preview(imgid, bounds);
+    NK_UPDATE_ACTIVE;
+    nk_end(&vkdt.ctx);
+    nk_style_pop_style_item(&vkdt.ctx);
+    return;
+  }
+
   const int ipl = vkdt.wstate.lighttable_images_per_row;
   const int border = 0.004 * vkdt.win.width;
   const int spacing = border/2;
@@ -280,6 +300,7 @@ void render_lighttable_center()
     if(g_image_cursor == -1) g_image_cursor = -2; // no current image
   }
 
+  int vis_beg = -1, vis_end = -1; // visible part of the collection
   nk_style_push_vec2(&vkdt.ctx, &vkdt.ctx.style.window.spacing, nk_vec2(spacing, spacing));
   for(int i=0;i<vkdt.db.collection_cnt;i++)
   {
@@ -304,13 +325,17 @@ void render_lighttable_center()
     }
     if(row.y - vkdt.ctx.current->scrollbar.y > content.y + 10*content.h) break; // okay this list is really long
 
-    // precache
-    if((i % ipl) == 0)
+    // load what's on screen, dt_thumbnails_prefetch() below takes care of the rest
+    if((i % ipl) == 0 && row.y + row.h > content.y && row.y <= content.y + content.h)
+    {
+      if(vis_beg < 0) vis_beg = i;
+      vis_end = MIN(vkdt.db.collection_cnt, i+ipl);
       dt_thumbnails_load_list(
           &vkdt.thumbnails,
           &vkdt.db,
           vkdt.db.collection,
-          i, MIN(vkdt.db.collection_cnt, i+ipl));
+          i, vis_end);
+    }
 
     if(row.y + row.h <= content.y ||
        row.y > content.y + content.h)
@@ -334,14 +359,20 @@ void render_lighttable_center()
     //   hov = vkdt.style.colour[NK_COLOR_BUTTON];
     //   col = vkdt.style.colour[NK_COLOR_BUTTON_HOVER];
     // }
+    const dt_thumbnail_t *th = vkdt.thumbnails.thumb + tid;
     float scale = MIN(
-        wd/(float)vkdt.thumbnails.thumb[tid].wd,
-        ht/(float)vkdt.thumbnails.thumb[tid].ht);
-    float w = vkdt.thumbnails.thumb[tid].wd * scale;
-    float h = vkdt.thumbnails.thumb[tid].ht * scale;
+        wd/(float)th->wd,
+        ht/(float)th->ht);
+    float w = th->wd * scale;
+    float h = th->ht * scale;
+    // the thumbnail is the top left of its layer, in units of half texels to
+    // stay off the edge and not filter in what's next to it:
+    struct nk_image img = nk_subimage_ptr(th->dset,
+        2*vkdt.thumbnails.layer_wd, 2*vkdt.thumbnails.layer_ht,
+        nk_rect(1, 1, 2*th->wd-2, 2*th->ht-2));
     uint32_t ret = dt_thumbnail_image(
         &vkdt.ctx,
-        vkdt.thumbnails.thumb[tid].dset,
+        img,
         (struct nk_vec2){w, h},
         hov, col,
         vkdt.db.image[vkdt.db.collection[i]].rating,
@@ -393,6 +424,20 @@ void render_lighttable_center()
   }
   nk_style_pop_vec2(&vkdt.ctx);
 
+  { // estimate where the user is scrolling to and load the thumbnails there
+    const float v = ((int)vkdt.ctx.current->scrollbar.y - g_scroll_last) * ipl / (float)(ht + 2*border + spacing);
+    g_scroll_velocity = 0.8f*g_scroll_velocity + 0.2f*v;
+    g_scroll_last = vkdt.ctx.current->scrollbar.y;
+    if(vis_beg >= 0)
+      dt_thumbnails_prefetch(
+          &vkdt.thumbnails,
+          &vkdt.db,
+          vkdt.db.collection,
+          vkdt.db.collection_cnt,
+          vis_beg, vis_end,
+          g_scroll_velocity);
+  }
+
   // lt hotkeys in same scope as center window (scroll)
   switch(g_hotkey)
   {
@@ -467,6 +512,7 @@ void export_job_cleanup(void *arg)
   free(j->sel);
   free(j->pdata);
   dt_graph_cleanup(&j->graph);
+  j->taskid = -1; // the pool may hand out the id again
   j->state = 2;
 }
 void export_job_work(uint32_t item, void *arg)
@@ -475,7 +521,8 @@ void export_job_work(uint32_t item, void *arg)
   char dir[512];
   dt_graph_export_t param = {0};
   export_job_t *j = (export_job_t *)arg;
-  if(j->abort) goto out;
+  // let thumbnails and the darkroom go first, one whole image export is long
+  if(j->abort || threads_task_yield()) goto out;
 
   dt_db_image_path(&vkdt.db, j->sel[item], filedir, sizeof(filedir));
   fs_expand_export_filename(j->basename, sizeof(j->basename), filename, sizeof(filename), filedir, item);
@@ -549,7 +596,7 @@ int export_job(
   j->pdata = (uint8_t *)malloc(sizeof(uint8_t)*psize);
   memcpy(j->pdata, w->pdata[w->format], psize);
   dt_graph_init(&j->graph, s_queue_compute);
-  j->taskid = threads_task("export", j->cnt, -1, j, export_job_work, export_job_cleanup);
+  j->taskid = threads_task("export", j->cnt, -1, j, export_job_work, export_job_cleanup, s_threads_prio_normal);
   return j->taskid;
 }
 // end export bg job stuff
@@ -836,6 +883,19 @@ void render_lighttable_right_panel()
         dt_gui_switch_collection(filename);
       }
     }
+    // query combining tags:
+    nk_layout_row_dynamic(ctx, row_height, 1);
+    static char query[256] = "";
+    dt_tooltip("combine tags with & (and), | (or), ! (not) and parentheses,\n"
+        "for instance `all time best & !blurry'.\n"
+        "press enter to open all images that match");
+    nk_flags ret = nk_tab_edit_string_zero_terminated(ctx, NK_EDIT_FIELD|NK_EDIT_SIG_ENTER, query, sizeof(query), nk_filter_default);
+    if(ret & NK_EDIT_COMMITED)
+    {
+      if(dt_db_query_tags(&vkdt.db, query, filename, sizeof(filename)) < 0)
+        dt_gui_notification("could not parse tag query `%s'", query);
+      else dt_gui_switch_collection(filename);
+    }
     // button to jump to original folder of selected image if it is a symlink
     uint32_t main_imgid = dt_db_current_imgid(&vkdt.db);
     if(main_imgid != -1u)
@@ -922,8 +982,8 @@ void render_lighttable_right_panel()
       {
         dt_db_image_path(&vkdt.db, sel[i], filename, sizeof(filename));
         fs_realpath(filename, realname);
+        dt_thumbnails_invalidate(&vkdt.thumbnail_gen, filename); // while it still has the old history
         dt_db_reset_to_defaults(realname);
-        dt_thumbnails_invalidate(&vkdt.thumbnail_gen, filename);
       }
       dt_gui_label_unset(s_image_label_video);
       dt_gui_label_unset(s_image_label_bracket);
@@ -953,6 +1013,7 @@ void render_lighttable_right_panel()
         const uint32_t *sel = dt_db_selection_get(&vkdt.db);
         char filename[1024] = {0};
         dt_db_image_path(&vkdt.db, sel[0], filename, sizeof(filename));
+        dt_thumbnails_invalidate(&vkdt.thumbnail_gen, filename); // while it still has the old history
         FILE *f = fopen(filename, "rb");
         int len = strlen(filename); // we'll work with the full file name, symlinks do not work
         if(len > 4) filename[len-4] = 0; // cut away ".cfg"
@@ -990,7 +1051,6 @@ void render_lighttable_right_panel()
             fprintf(f, "fps:24\n");
             fclose(f);
             filename[len-4] = '.';
-            dt_thumbnails_invalidate(&vkdt.thumbnail_gen, filename);
             dt_thumbnails_cache_list(
                 &vkdt.thumbnail_gen,
                 &vkdt.db,
@@ -1192,7 +1252,12 @@ void render_lighttable_right_panel()
         char text[50];
         snprintf(text, sizeof(text), "%d%%", (int)(100.0*progress));
         nk_draw_text(nk_window_get_canvas(ctx), bb, text, strlen(text), nk_glfw3_font(0), nk_rgba(0,0,0,0), nk_rgba(255,255,255,255));
-        if(nk_button_label(ctx, "abort")) job[k].abort = 1;
+        if(nk_button_label(ctx, "abort"))
+        {
+          job[k].abort = 1;
+          const int taskid = job[k].taskid;
+          if(taskid >= 0) threads_task_abort(taskid);
+        }
         // technically a race condition on frame_cnt being inited by graph
         // loading during the async job. do we care?
         if(job[k].graph.frame_cnt > 1)
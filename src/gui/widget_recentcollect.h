@@ -25,6 +25,7 @@ recently_used_collections_parse(
     dt_db_init(&vkdt.db);
     QVKL(&qvk.queue[qvk.qid[s_queue_graphics]].mutex, vkQueueWaitIdle(qvk.queue[qvk.qid[s_queue_graphics]].queue));
     dt_db_load_directory(&vkdt.db, &vkdt.thumbnails, dir);
+    dt_db_watch_start(&vkdt.db, &glfwPostEmptyEvent);
     dt_thumbnails_cache_collection(&vkdt.thumbnail_gen, &vkdt.db, &glfwPostEmptyEvent);
   }
 
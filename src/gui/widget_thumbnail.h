@@ -58,7 +58,7 @@ static inline void dt_draw_labels(float x, float y, float wd, uint16_t labels)
 static inline uint32_t
 dt_thumbnail_image(
     struct nk_context *ctx,
-    VkDescriptorSet dset,
+    struct nk_image img,          // the thumbnail, usually a sub image of its layer
     const struct nk_vec2 size,
     const struct nk_color hov_col,
     const struct nk_color reg_col,
@@ -67,7 +67,6 @@ dt_thumbnail_image(
     const char *text)
 {
   int ret = 0;
-  struct nk_image img = nk_image_ptr(dset);
   int wd = MAX(size.x, size.y);
 
   struct nk_rect full = nk_widget_bounds(ctx);
@@ -92,3 +91,32 @@ dt_thumbnail_image(
 
   return ret;
 }
+
+// draw the large preview of the image (level 1 of the thumbnail) to fit the
+// bounds, or the regular thumbnail if there is no preview. returns 0 if
+// neither is there.
+static inline int
+dt_thumbnail_preview(
+    uint32_t       imgid,
+    struct nk_rect bounds)
+{
+  if(imgid >= vkdt.db.image_cnt) return 0;
+  const dt_thumbnails_t *tn = &vkdt.thumbnail_big;
+  uint32_t tid = tn->thumb_max ? dt_thumbnails_load_level(&vkdt.thumbnail_big, &vkdt.db, imgid, 1) : -1u;
+  if(tid == -1u)
+  { // fall back to the small one if it is loaded
+    tn  = &vkdt.thumbnails;
+    tid = vkdt.db.image[imgid].thumbnail;
+    if(tid == 0 || tid >= tn->thumb_max || tn->thumb[tid].imgid != imgid) return 0;
+  }
+  const dt_thumbnail_t *th = tn->thumb + tid;
+  const float scale = MIN(bounds.w/th->wd, bounds.h/th->ht);
+  const float w = th->wd * scale, h = th->ht * scale;
+  struct nk_image img = nk_subimage_ptr(th->dset,
+      2*tn->layer_wd, 2*tn->layer_ht,
+      nk_rect(1, 1, 2*th->wd-2, 2*th->ht-2));
+  nk_draw_image(nk_window_get_canvas(&vkdt.ctx),
+      nk_rect(bounds.x + (bounds.w-w)/2, bounds.y + (bounds.h-h)/2, w, h),
+      &img, (struct nk_color){0xff,0xff,0xff,0xff});
+  return 1;
+}
@@ -105,10 +105,13 @@ dt_graph_disconnect_display_modules(
       dt_module_remove(graph, m); // disconnect and reset/ignore
 }
 
-VkResult
-dt_graph_export(
-    dt_graph_t        *graph,  // graph to run, will overwrite filename param
-    dt_graph_export_t *param)
+// read the config, replace the display nodes and set the output parameters.
+// fills mod_out[] with the output module ids.
+static VkResult
+export_setup(
+    dt_graph_t        *graph,
+    dt_graph_export_t *param,
+    int               *mod_out)
 {
   if(param->p_cfgfile)
   {
@@ -164,9 +167,7 @@ dt_graph_export(
   // insert default:
   if(!param->output[0].inst) param->output[0].inst = dt_token("main");
 
-  int mod_out[20];
   for(int i=0;i<param->output_cnt;i++) mod_out[i] = -1;
-  assert(param->output_cnt <= sizeof(mod_out)/sizeof(mod_out[0]));
   if(!found_main)
   { // replace requested display node by export node:
     int cnt = 0;
@@ -235,6 +236,37 @@ dt_graph_export(
     if(param->output[i].quality > 0)
       dt_module_set_param_float(graph->module+mod_out[i], dt_token("quality"), param->output[i].quality);
   }
+  return VK_SUCCESS;
+}
+
+VkResult
+dt_graph_export_prepare(
+    dt_graph_t        *graph,
+    dt_graph_export_t *param)
+{
+  int mod_out[20];
+  assert(param->output_cnt <= sizeof(mod_out)/sizeof(mod_out[0]));
+  VkResult res = export_setup(graph, param, mod_out);
+  if(res != VK_SUCCESS) return res;
+  if(graph->frame_cnt > 1)
+  {
+    dt_log(s_log_pipe|s_log_err, "can't prepare the export of animations");
+    return VK_INCOMPLETE;
+  }
+  // the input modules read their sources in modify_roi_out():
+  return dt_graph_run(graph, s_graph_run_roi);
+}
+
+VkResult
+dt_graph_export(
+    dt_graph_t        *graph,  // graph to run, will overwrite filename param
+    dt_graph_export_t *param)
+{
+  int mod_out[20];
+  assert(param->output_cnt <= sizeof(mod_out)/sizeof(mod_out[0]));
+  VkResult res = export_setup(graph, param, mod_out);
+  if(res != VK_SUCCESS) return res;
+  char filename[256];
 
   int audio_mod = -1;
   uint16_t *audio_samples;
@@ -250,7 +282,7 @@ dt_graph_export(
 
   if(graph->frame_cnt > 1)
   {
-    VkResult res = VK_SUCCESS;
+    res = VK_SUCCESS;
     dt_graph_apply_keyframes(graph);
     dt_graph_run(graph, s_graph_run_all
         ^(param->last_frame_only ? s_graph_run_download_sink : 0));
@@ -50,3 +50,13 @@ dt_graph_export(
     dt_graph_t *graph,         // graph to run, will overwrite filename param
     dt_graph_export_t *param);
 
+// like dt_graph_export(), but for single frames only run the region of
+// interest pass. this is where the input modules read (and decode) their
+// sources, so it only uses the cpu. finish with dt_graph_run(graph,
+// s_graph_run_all & ~s_graph_run_roi), which does the rest on the gpu and
+// writes the outputs. callers must leave out the roi pass there, or else the
+// input modules read their sources a second time.
+VkResult
+dt_graph_export_prepare(
+    dt_graph_t *graph,
+    dt_graph_export_t *param);
@@ -468,6 +468,7 @@ dt_graph_run_modules(
   // walk all inputs and determine roi on all outputs
   if(*run & s_graph_run_roi)
   {
+    const uint64_t trace_beg = dt_trace_now();
     if(main_input_module >= 0) // may set metadata required by others (such as find the right lut)
       modify_roi_out(graph, graph->module + main_input_module);
     for(int i=0;i<cnt;i++)
@@ -475,6 +476,7 @@ dt_graph_run_modules(
     for(int i=0;i<cnt;i++) // potentially init remaining feedback rois:
       if(graph->module[modid[i]].connector[0].roi.full_wd == 0)
         modify_roi_out(graph, graph->module + modid[i]);
+    dt_trace_event("graph", "roi out", trace_beg);
   }
 
 
@@ -581,12 +583,14 @@ dt_graph_run_modules(
     graph->uniform_global_size = 2*qvk.uniform_alignment; // global data, aligned
     uint64_t uniform_offset = graph->uniform_global_size;
     // skip modules with uninited roi! (these are disconnected/dead code elimination cases)
+    const uint64_t trace_beg = dt_trace_now();
     for(int i=cnt-1;i>=0;i--)
       if(graph->module[modid[i]].connector[0].roi.full_wd > 0)
         modify_roi_in(graph, graph->module+modid[i]);
     for(int i=0;i<cnt;i++)
       if(graph->module[modid[i]].connector[0].roi.full_wd > 0)
         create_nodes(graph, graph->module+modid[i], &uniform_offset);
+    dt_trace_event("graph", "create nodes", trace_beg);
     // make sure connectors are zero inited:
     memset(graph->conn_image_pool, 0, sizeof(dt_connector_image_t)*graph->conn_image_end);
     graph->uniform_size = uniform_offset;
@@ -24,8 +24,10 @@ dt_graph_run_nodes_download(
            (run & s_graph_run_download_sink)))
         {
           dt_write_sink_params_t p = { .node = node, .c = 0, .a = 0 };
+          const uint64_t trace_beg = dt_trace_now();
           node->module->so->write_sink(node->module,
               mapped + node->connector[0].offset_staging[graph->double_buffer], &p);
+          dt_trace_event_tkn("io", node->module->name, trace_beg);
         }
       }
     }
@@ -156,7 +156,7 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
       .dstSubresource = {
         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .mipLevel = 0,
-        .baseArrayLayer = 0,
+        .baseArrayLayer = graph->thumbnail_layer,
         .layerCount = 1,
       },
       .dstOffset = {0},
@@ -169,7 +169,19 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
     dt_connector_image_t *img = dt_graph_connector_image(graph,
         node-graph->node, 0, 0, 0);
     IMG_LAYOUT(img, UNDEFINED, TRANSFER_SRC_OPTIMAL);
-    BARRIER_IMG_LAYOUT(graph->thumbnail_image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1);
+    VkImageSubresourceRange range = {
+      .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+      .levelCount     = 1,
+      .baseArrayLayer = graph->thumbnail_layer,
+      .layerCount     = 1,
+    };
+    IMAGE_BARRIER(cmd_buf,
+        .image            = graph->thumbnail_image,
+        .subresourceRange = range,
+        .srcAccessMask    = VK_ACCESS_SHADER_READ_BIT|VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .oldLayout        = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     vkCmdCopyImage(cmd_buf,
         img->image,
         VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
@@ -177,7 +189,13 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         1,
         &cp);
-    BARRIER_IMG_LAYOUT(graph->thumbnail_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1);
+    IMAGE_BARRIER(cmd_buf,
+        .image            = graph->thumbnail_image,
+        .subresourceRange = range,
+        .srcAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask    = VK_ACCESS_SHADER_READ_BIT,
+        .oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout        = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     return VK_SUCCESS;
   }
 
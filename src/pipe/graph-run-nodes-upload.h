@@ -73,8 +73,10 @@ dt_graph_run_nodes_upload(
               }
               dt_read_source_params_t p = { .node = node, .c = c, .a = a };
               size_t offset = node->connector[c].offset_staging[graph->double_buffer];
+              const uint64_t trace_beg = dt_trace_now();
               node->module->so->read_source(node->module,
                   mapped + offset, &p);
+              dt_trace_event_tkn("io", node->module->name, trace_beg);
               if(node->connector[c].array_length > 1)
               {
                 if(!dt_graph_connector_image(graph, node-graph->node, c, a, graph->double_buffer)->image)
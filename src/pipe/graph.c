@@ -7,6 +7,7 @@
 #include "modules/api.h"
 #include "modules/localsize.h"
 #include "core/log.h"
+#include "core/trace.h"
 #include "qvk/qvk.h"
 #include "graph-print.h"
 #ifdef DEBUG_MARKERS
@@ -324,6 +325,8 @@ VkResult dt_graph_run(
     dt_graph_run_t  run)
 {
   double clock_beg = dt_time();
+  const uint64_t trace_run = dt_trace_now();
+  uint64_t trace_beg = trace_run;
   dt_module_flags_t module_flags = 0;
   // double_buffer is initialised to 0 and has to be set from the outside if flipping the double buffer is requested.
   const int buf_curr = graph->double_buffer & 1; // recording this pipeline and writing to this buffer index now
@@ -337,6 +340,7 @@ VkResult dt_graph_run(
     .pValues        = &graph->process_dbuffer[buf_curr],
   };
   QVKR(vkWaitSemaphores(qvk.device, &wait_info, UINT64_MAX));
+  dt_trace_event("graph", "wait previous", trace_beg);
 
   { // module scope
     uint32_t modid[100]; // storage for list of modules after tree traversal
@@ -349,7 +353,11 @@ VkResult dt_graph_run(
   } // end scope, done with modules
 
   // if no more action than generating the output roi was requested, exit now:
-  if(run < s_graph_run_create_nodes<<1) return VK_SUCCESS;
+  if(run < s_graph_run_create_nodes<<1)
+  {
+    dt_trace_event("graph", "run", trace_run);
+    return VK_SUCCESS;
+  }
 
   { // node scope
     int cnt = 0;
@@ -395,10 +403,14 @@ VkResult dt_graph_run(
 
     // potentially free/re-allocate memory, create buffers, images, image_views, and descriptor sets:
     int dynamic_array = 0;
+    trace_beg = dt_trace_now();
     QVKR(dt_graph_run_nodes_allocate(graph, &run, nodeid, cnt, &dynamic_array));
+    dt_trace_event("graph", "alloc", trace_beg);
 
     // upload all source data to staging memory
+    trace_beg = dt_trace_now();
     QVKR(dt_graph_run_nodes_upload(graph, run, nodeid, cnt, module_flags, dynamic_array));
+    dt_trace_event("graph", "upload", trace_beg);
 
     // now upload uniform data before submitting the command buffer. this runs
     // on module scope, but needs to interlude here, so ray tracing nodes can
@@ -408,7 +420,9 @@ VkResult dt_graph_run(
     QVKR(dt_graph_run_modules_upload_uniforms(graph, run));
 
     // record command buffer, including memory barriers for transfers (to uniforms and staging)
+    trace_beg = dt_trace_now();
     QVKR(dt_graph_run_nodes_record_cmd(graph, run, nodeid, cnt, module_flags));
+    dt_trace_event("graph", "record", trace_beg);
   } // end scope, done with nodes
 
   if(run & s_graph_run_alloc)
@@ -451,8 +465,10 @@ VkResult dt_graph_run(
       .pSignalSemaphores    = &graph->semaphore_process,
     };
 
+    trace_beg = dt_trace_now();
     QVKLR(&qvk.queue[qvk.qid[graph->queue_name]].mutex,
         vkQueueSubmit(qvk.queue[qvk.qid[graph->queue_name]].queue, 1, &submit, 0));
+    dt_trace_event("graph", "submit", trace_beg);
 
     VkSemaphoreWaitInfo wait_info = {
       .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
@@ -461,11 +477,17 @@ VkResult dt_graph_run(
       .pValues        = &graph->process_dbuffer[buf_curr],
     };
     if(run & s_graph_run_wait_done) // no timeout
+    {
+      trace_beg = dt_trace_now();
       QVKR(vkWaitSemaphores(qvk.device, &wait_info, UINT64_MAX));
+      dt_trace_event("graph", "wait gpu", trace_beg);
+    }
   }
   
   // download sink data from GPU to CPU
+  trace_beg = dt_trace_now();
   dt_graph_run_nodes_download(graph, run, module_flags);
+  dt_trace_event("graph", "download", trace_beg);
 
   if(dt_log_global.mask & s_log_perf)
   {
@@ -523,6 +545,7 @@ VkResult dt_graph_run(
   // reset run flags and gui error message
   graph->runflags = 0;
   graph->gui_msg = 0;
+  dt_trace_event("graph", "run", trace_run);
   return VK_SUCCESS;
 }
 
@@ -586,6 +609,7 @@ void dt_graph_reset(dt_graph_t *g)
   g->runflags = 0;
   g->frame = 0;
   g->thumbnail_image = 0;
+  g->thumbnail_layer = 0;
   g->query[0].cnt = g->query[1].cnt = 0;
   g->params_end = 0;
   g->double_buffer = 0;
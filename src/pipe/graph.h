@@ -122,6 +122,7 @@ typedef struct dt_graph_t
 
   // scale output resolution to fit and copy the main display to the given buffer:
   VkImage               thumbnail_image;
+  uint32_t              thumbnail_layer; // array layer of the thumbnail image to copy to
   void                 *io_mutex;      // if this is set to != 0 will be locked during read_source() calls
 
   int                   gui_attached;  // can't free the output images while still used etc.
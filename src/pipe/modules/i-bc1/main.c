@@ -1,45 +1,92 @@
 #include "modules/api.h"
+#include "db/archive.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <zlib.h>
 
-// this callback is responsible to set the full_{wd,ht} dimensions on the
-// regions of interest on all "write"|"source" channels
-void modify_roi_out(
-    dt_graph_t  *graph,
-    dt_module_t *mod)
+// thumbnails come from the archive (raw blocks, magic "bc1" or "bc1p"),
+// everything else is a gzipped file (magic "bc1z"). all start with the same header.
+typedef struct bc1_source_t
+{
+  dt_archive_t *archive;
+  uint64_t      key;
+  gzFile        f;
+  uint32_t      header[4]; // magic, version, width, height
+}
+bc1_source_t;
+
+static int // open the file or archive entry and read the header, returns 0 on success
+bc1_open(dt_module_t *mod, bc1_source_t *s)
 {
-  // load only header
   const char *filename = dt_module_param_string(mod, 0);
+  memset(s, 0, sizeof(*s));
   char resolved[512];
+  if((s->archive = dt_archive_find(filename, &s->key)))
+  {
+    if(dt_archive_get(s->archive, s->key, s->header, 0, sizeof(s->header)) < (int64_t)sizeof(s->header))
+    {
+      fprintf(stderr, "[i-bc1] %s: not in the thumbnail archive!\n", filename);
+      return 1;
+    }
+    if(s->header[0] == dt_token("bc1") && s->header[2] == 0)
+    { // thumbnail creation failed, show the bomb instead
+      s->archive = 0;
+      filename = "data/bomb.bc1";
+    }
+    else goto check;
+  }
   if(dt_graph_get_resource_filename(mod, filename, 0, resolved, sizeof(resolved)))
   {
     fprintf(stderr, "[i-bc1] %s: can't resolve filename!\n", filename);
-    return;
+    return 1;
   }
-
-  uint32_t header[4] = {0};
-  gzFile f = gzopen(resolved, "rb");
-  if(!f || gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4)
+  s->f = gzopen(resolved, "rb");
+  if(!s->f || gzread(s->f, s->header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4)
   {
     fprintf(stderr, "[i-bc1] %s: can't open file!\n", resolved);
-    if(f) gzclose(f);
-    return;
+    if(s->f) gzclose(s->f);
+    s->f = 0;
+    return 1;
   }
+check:
   // checks: magic != dt_token("bc1z") || version != 1
-  if(header[0] != dt_token("bc1z") || header[1] != 1)
+  // the archive also has "bc1p", made from the jpeg embedded in the raw
+  const int magic_ok = s->archive ?
+    (s->header[0] == dt_token("bc1") || s->header[0] == dt_token("bc1p")) :
+    (s->header[0] == dt_token("bc1z"));
+  if(!magic_ok || s->header[1] != 1)
   {
-    fprintf(stderr, "[i-bc1] %s: wrong magic number or version!\n", resolved);
-    gzclose(f);
-    return;
+    fprintf(stderr, "[i-bc1] %s: wrong magic number or version!\n", filename);
+    if(s->f) gzclose(s->f);
+    s->f = 0;
+    return 1;
   }
-  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
+  return 0;
+}
+
+static void
+bc1_close(bc1_source_t *s)
+{
+  if(s->f) gzclose(s->f);
+  s->f = 0;
+}
+
+// this callback is responsible to set the full_{wd,ht} dimensions on the
+// regions of interest on all "write"|"source" channels
+void modify_roi_out(
+    dt_graph_t  *graph,
+    dt_module_t *mod)
+{
+  // load only header
+  bc1_source_t s;
+  if(bc1_open(mod, &s)) return;
+  const uint32_t wd = 4*(s.header[2]/4), ht = 4*(s.header[3]/4);
   mod->connector[0].roi.full_wd = wd;
   mod->connector[0].roi.full_ht = ht;
   mod->img_param.colour_primaries = s_colour_primaries_2020;
   mod->img_param.colour_trc       = s_colour_trc_srgb;
-  gzclose(f);
+  bc1_close(&s);
 }
 
 int read_source(
@@ -47,34 +94,15 @@ int read_source(
     void                    *mapped,
     dt_read_source_params_t *p)
 {
-  const char *filename = dt_module_param_string(mod, 0);
-  char resolved[512];
-  if(dt_graph_get_resource_filename(mod, filename, 0, resolved, sizeof(resolved)))
-  {
-    fprintf(stderr, "[i-bc1] %s: can't resolve filename!\n", filename);
-    return 1;
-  }
-
-  uint32_t header[4] = {0};
-  gzFile f = gzopen(resolved, "rb");
-  if(!f || gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4)
-  {
-    fprintf(stderr, "[i-bc1] %s: can't open file!\n", resolved);
-    if(f) gzclose(f);
-    return 1;
-  }
-  // checks: magic != dt_token("bc1z") || version != 1
-  if(header[0] != dt_token("bc1z") || header[1] != 1)
-  {
-    fprintf(stderr, "[i-bc1] %s: wrong magic number or version!\n", resolved);
-    gzclose(f);
-    return 1;
-  }
-  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
+  bc1_source_t s;
+  if(bc1_open(mod, &s)) return 1;
+  const uint32_t wd = 4*(s.header[2]/4), ht = 4*(s.header[3]/4);
   // fprintf(stderr, "[i-bc1] %s magic %"PRItkn" version %u dim %u x %u\n",
-  //     resolved, dt_token_str(header[0]),
-  //     header[1], header[2], header[3]);
-  gzread(f, mapped, sizeof(uint8_t)*8*(wd/4)*(ht/4));
-  gzclose(f);
+  //     resolved, dt_token_str(s.header[0]),
+  //     s.header[1], s.header[2], s.header[3]);
+  const size_t size = sizeof(uint8_t)*8*(wd/4)*(ht/4);
+  if(s.archive) dt_archive_get(s.archive, s.key, mapped, sizeof(s.header), size);
+  else gzread(s.f, mapped, size);
+  bc1_close(&s);
   return 0;
 }
@@ -8,7 +8,11 @@ extern "C" {
 #include "mat3.h"
 #include <omp.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
 #include <ctime>
 #include <math.h>
 #ifdef VKDT_USE_EXIV2
@@ -21,6 +25,10 @@ extern "C" {
 extern "C" {
 #include "modules/api.h"
 #include "core/log.h"
+#include "core/threads.h"
+#include "core/fs.h"
+#include "db/archive.h"
+#include "db/hash.h"
 
 static rawspeed::CameraMetaData *meta = 0;
 
@@ -35,16 +43,59 @@ int rawspeed_get_number_of_processor_cores()
 #endif
 }
 
+// decoding in the background on the thread pool. whoever gets to it first
+// decodes: a worker picking up the task, or load_raw() when read_source needs
+// the pixels before that. this way we never wait for a queued task, and the
+// pool can't deadlock on jobs (such as thumbnails) that wait for their raw.
+typedef struct rawinput_job_t
+{
+  std::atomic<int>        state;  // 0 queued, 1 decoding, 2 done
+  std::atomic<int>        ref;    // the module and the pool task hold one each
+  std::mutex              lock;
+  std::condition_variable done;
+  dt_module_t            *mod;
+  std::string             filename;
+}
+rawinput_job_t;
+
 typedef struct rawinput_buf_t
 {
   std::unique_ptr<rawspeed::RawDecoder> d;
   char filename[PATH_MAX] = {0};
+  rawinput_job_t *job = 0; // pending background decode, started by modify_roi_out
   int ox, oy;
   dt_dng_opcode_list_t *dng_opcode_lists[3];
   dt_image_metadata_dngop_t dngop;
 }
 rawinput_buf_t;
 
+// everything modify_roi_out needs to know about a raw, without the pixels.
+// rawspeed only knows the dimensions after decoding the whole image, so we
+// keep these around for the images we have seen: in memory for the last few,
+// and in the thumbnail archive (if this process has it open) for all of them,
+// so the next session still knows. the next graph on the same image (darkroom
+// after thumbnails, export, thumbnail after edit) gets them from here.
+typedef struct rawinput_probe_t
+{
+  int64_t  mtime;           // of the file, the entry is stale if it changed
+  int64_t  size;
+  int      wd, ht;          // uncropped dimensions
+  int      cpp;             // components per pixel, 3 for colour "raw"
+  int      crop[4];         // top left and dimensions of the cropped image
+  float    black[4];
+  float    white;
+  float    wb[4];
+  float    xyz_to_cam[9];
+  int      matrix;          // 1 if xyz_to_cam is valid
+  uint32_t filters;         // dcraw filters relative to the crop
+  uint8_t  xtrans[6][6];    // cfa of the uncropped image if filters == 9
+  char     maker[32];
+  char     model[32];
+  float    iso;
+  char     filename[PATH_MAX]; // last, everything before goes to the archive
+}
+rawinput_probe_t;
+
 namespace {
 
 inline int
@@ -86,37 +137,236 @@ rawspeed_load_meta(const dt_module_t *mod)
   }
 }
 
+#define RAWINPUT_PROBE_CNT 64
+#define RAWINPUT_PROBE_VERSION 1 // bump when rawinput_probe_t changes
+#define RAWINPUT_PROBE_BYTES offsetof(rawinput_probe_t, filename)
+rawinput_probe_t probe_cache[RAWINPUT_PROBE_CNT];
+int probe_next = 0;
+std::mutex probe_lock;
+
+// the thumbnail archive, if it is open in this process, and our key in it
+dt_archive_t *
+probe_archive(
+    const char        *filename,
+    const struct stat *statbuf,
+    uint64_t          *key)
+{
+  static char name[PATH_MAX] = {0}; // any file name in the archive directory will do
+  if(!name[0])
+  {
+    char cachedir[PATH_MAX];
+    fs_cachedir(cachedir, sizeof(cachedir));
+    snprintf(name, sizeof(name), "%s/thumbs/0.probe", cachedir);
+  }
+  uint64_t k = hash64_data(filename, strlen(filename), RAWINPUT_PROBE_VERSION);
+  const int64_t stamp[] = { (int64_t)statbuf->st_mtime, (int64_t)statbuf->st_size };
+  k = hash64_data(stamp, sizeof(stamp), k);
+  dt_archive_t *a = dt_archive_find(name, key);
+  *key = k;
+  return a;
+}
+
+int // returns 0 and fills the probe if we have seen this file before
+probe_get(
+    const char       *filename,
+    rawinput_probe_t *probe)
+{
+  struct stat statbuf;
+  if(stat(filename, &statbuf)) return 1;
+  {
+    std::lock_guard<std::mutex> guard(probe_lock);
+    for(int i=0;i<RAWINPUT_PROBE_CNT;i++)
+    {
+      const rawinput_probe_t *p = probe_cache + i;
+      if(p->mtime == statbuf.st_mtime && p->size == statbuf.st_size && !strcmp(p->filename, filename))
+      {
+        *probe = *p;
+        return 0;
+      }
+    }
+  }
+  uint64_t key;
+  dt_archive_t *a = probe_archive(filename, &statbuf, &key);
+  if(!a || dt_archive_get(a, key, probe, 0, RAWINPUT_PROBE_BYTES) != (int64_t)RAWINPUT_PROBE_BYTES)
+    return 1;
+  if(probe->mtime != statbuf.st_mtime || probe->size != statbuf.st_size) return 1;
+  snprintf(probe->filename, sizeof(probe->filename), "%s", filename);
+  std::lock_guard<std::mutex> guard(probe_lock);
+  probe_cache[probe_next++ % RAWINPUT_PROBE_CNT] = *probe;
+  return 0;
+}
+
+void
+probe_put(
+    const char       *filename,
+    rawinput_probe_t *probe)
+{
+  struct stat statbuf;
+  if(stat(filename, &statbuf)) return;
+  snprintf(probe->filename, sizeof(probe->filename), "%s", filename);
+  probe->mtime = statbuf.st_mtime;
+  probe->size  = statbuf.st_size;
+  {
+    std::lock_guard<std::mutex> guard(probe_lock);
+    int i = 0;
+    for(;i<RAWINPUT_PROBE_CNT;i++) if(!strcmp(probe_cache[i].filename, filename)) break;
+    if(i == RAWINPUT_PROBE_CNT) i = probe_next++ % RAWINPUT_PROBE_CNT;
+    probe_cache[i] = *probe;
+  }
+  uint64_t key;
+  dt_archive_t *a = probe_archive(filename, &statbuf, &key);
+  if(a) dt_archive_put(a, key, probe, RAWINPUT_PROBE_BYTES);
+}
+
+// read what modify_roi_out needs from the decoded raw
+void
+probe_read(
+    rawinput_buf_t   *mod_data,
+    rawinput_probe_t *probe)
+{
+  rawspeed::RawImage r = mod_data->d->mRaw;
+  memset(probe, 0, sizeof(*probe));
+  rawspeed::iPoint2D dim_uncropped = r->getUncroppedDim();
+  rawspeed::iPoint2D dimCropped = r->dim;
+  rawspeed::iPoint2D cropTL = r->getCropOffset();
+  probe->wd  = dim_uncropped.x;
+  probe->ht  = dim_uncropped.y;
+  probe->cpp = r->getCpp();
+  probe->crop[0] = cropTL.x;
+  probe->crop[1] = cropTL.y;
+  probe->crop[2] = dimCropped.x;
+  probe->crop[3] = dimCropped.y;
+
+  if(!r->blackAreas.empty() || !r->blackLevelSeparate)
+    r->calculateBlackAreas();
+  const auto bl = *(r->blackLevelSeparate->getAsArray1DRef());
+  for(int k=0;k<4;k++)
+  {
+    probe->black[k] = bl(k);
+    probe->wb[k]    = r->metadata.wbCoeffs[k];
+  }
+  probe->white = r->whitePoint.value_or((1u << 16)-1);
+
+  if(r->metadata.colorMatrix.size() > 0)
+  {
+    probe->matrix = 1;
+    for(int k=0;k<9;k++)
+      probe->xyz_to_cam[k] = float(r->metadata.colorMatrix[k]);
+  }
+
+  // uncrop bayer sensor filter
+  probe->filters = r->cfa.getDcrawFilter();
+  if(probe->cpp == 3) probe->filters = 0;
+  else if(probe->filters != 9u)
+    probe->filters = rawspeed::ColorFilterArray::shiftDcrawFilter(
+        r->cfa.getDcrawFilter(), cropTL.x, cropTL.y);
+  else for(int i = 0; i < 6; ++i)
+    for(int j = 0; j < 6; ++j)
+      probe->xtrans[j][i] = static_cast<uint8_t>(r->cfa.getColorAt(i, j));
+
+  snprintf(probe->maker, sizeof(probe->maker), "%s", r->metadata.canonical_make.c_str());
+  snprintf(probe->model, sizeof(probe->model), "%s", r->metadata.canonical_model.c_str());
+  probe->iso = r->metadata.isoSpeed;
+}
+
+int decode_raw(dt_module_t *mod, const char *filename);
+
+void
+job_unref(rawinput_job_t *job)
+{
+  if(job->ref.fetch_sub(1) == 1) delete job;
+}
+
+void
+job_free(void *data)
+{
+  job_unref((rawinput_job_t *)data);
+}
+
+void
+job_run(uint32_t item, void *data)
+{
+  rawinput_job_t *job = (rawinput_job_t *)data;
+  int queued = 0;
+  if(!job->state.compare_exchange_strong(queued, 1)) return; // claimed by load_raw()
+  decode_raw(job->mod, job->filename.c_str());
+  std::lock_guard<std::mutex> guard(job->lock);
+  job->state = 2;
+  job->done.notify_all();
+}
+
+void
+job_sync(
+    rawinput_buf_t *mod_data,
+    int             decode) // decode right here if no worker started yet, or drop the job
+{
+  rawinput_job_t *job = mod_data->job;
+  if(!job) return;
+  mod_data->job = 0;
+  int queued = 0;
+  if(job->state.compare_exchange_strong(queued, 1))
+  { // the task will find it claimed and do nothing
+    if(decode) decode_raw(job->mod, job->filename.c_str());
+  }
+  else
+  {
+    std::unique_lock<std::mutex> guard(job->lock);
+    job->done.wait(guard, [job]{ return job->state == 2; });
+  }
+  job_unref(job);
+}
+
+void
+job_start(
+    dt_module_t *mod,
+    const char  *filename)
+{
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  rawinput_job_t *job = new rawinput_job_t();
+  job->state    = 0;
+  job->ref      = 2;
+  job->mod      = mod;
+  job->filename = filename;
+  const threads_priority_t prio = threads_i_am_gui() ? s_threads_prio_interactive : thr_tls.prio;
+  if(threads_task("i-raw", 1, -1, job, job_run, job_free, prio) < 0)
+  { // no free task, load_raw() will decode when it's needed
+    delete job;
+    return;
+  }
+  mod_data->job = job;
+}
+
 void
 free_raw(dt_module_t *mod)
 { // free auto pointers
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  job_sync(mod_data, 0);
   for(int i=0;i<3;i++)
   {
     dng_opcode_list_free(mod_data->dng_opcode_lists[i]);
     mod_data->dng_opcode_lists[i] = NULL;
   }
   if(mod_data->d.get()) mod_data->d.reset();
+  mod_data->filename[0] = 0;
 }
 
+// decode the whole raw. this may run on a pool worker, and only
+// touches mod_data->d and mod_data->filename then.
 int
-load_raw(
+decode_raw(
     dt_module_t *mod,
     const char *filename)
 {
   clock_t beg = clock();
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
-  if(mod_data)
-  {
-    if(!strcmp(mod_data->filename, filename))
-      return 0; // already loaded
-    else free_raw(mod); // maybe loaded the wrong one
-  }
-  else
-  {
-    assert(0); // this should be inited in init()
-  }
-
   rawspeed::FileReader f(filename);
+  // rawspeed decodes with an openmp team started from this thread. on a pool
+  // worker that would inherit the worker's single cpu, so let it (and the team
+  // threads that may still be around from last time) use all of them.
+  threads_unpin();
+#pragma omp parallel
+  threads_unpin();
+  struct repin_t { ~repin_t() { threads_pin(); } } repin;
 
   try
   {
@@ -163,6 +413,20 @@ load_raw(
   return 0;
 }
 
+int
+load_raw(
+    dt_module_t *mod,
+    const char *filename)
+{
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  assert(mod_data); // this should be inited in init()
+  job_sync(mod_data, 1); // finish the background decode
+  if(!strcmp(mod_data->filename, filename))
+    return 0; // already loaded
+  free_raw(mod); // maybe loaded the wrong one
+  return decode_raw(mod, filename);
+}
+
 } // end anonymous namespace
 
 int init(dt_module_t *mod)
@@ -223,12 +487,35 @@ void modify_roi_out(
     mod->flags = s_module_request_read_source;
   }
   
-  if(load_raw(mod, filename)) return;
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
-  rawspeed::iPoint2D dim_uncropped = mod_data->d->mRaw->getUncroppedDim();
+  rawinput_probe_t probe;
+  if(probe_get(filename, &probe))
+  { // never seen this one, decode right here to find out
+    if(load_raw(mod, filename)) return;
+    probe_read(mod_data, &probe);
+    probe_put(filename, &probe);
+  }
+  else if(!graph->gui_attached)
+  { // thumbnails and export: decode right here, before the graph waits for a
+    // render slot. read_source is only the upload then.
+    if(load_raw(mod, filename)) return;
+  }
+  else
+  { // darkroom: only need the pixels in read_source, decode on the thread pool
+    // while the graph creates its nodes and allocates buffers.
+    if(!mod_data->job || mod_data->job->filename != filename)
+    {
+      job_sync(mod_data, 0); // drop the decode of some other image
+      if(strcmp(mod_data->filename, filename))
+      {
+        free_raw(mod);
+        job_start(mod, filename);
+      }
+    }
+  }
   // we know we only have one connector called "output" (see our "connectors" file)
-  mod->connector[0].roi.full_wd = dim_uncropped.x;
-  mod->connector[0].roi.full_ht = dim_uncropped.y;
+  mod->connector[0].roi.full_wd = probe.wd;
+  mod->connector[0].roi.full_ht = probe.ht;
 
   // TODO: data type, channels, bpp
 
@@ -242,8 +529,11 @@ void modify_roi_out(
   mod->img_param.cam_to_rec2020[k] = 0.0f/0.0f; // mark as uninitialised
   mod->img_param.colour_primaries = s_colour_primaries_custom;
   mod->img_param.colour_trc       = s_colour_trc_linear;
-  for(int i =0;i<3;i++)
+  for(int i=0;i<3;i++)
+  { // from the last time we've been here
+    dng_opcode_list_free(mod_data->dng_opcode_lists[i]);
     mod_data->dng_opcode_lists[i] = nullptr;
+  }
   mod->img_param.meta = 0;
 #ifdef VKDT_USE_EXIV2 // now essentially only for exposure time/aperture value and DNG opcodes
   dt_exif_read(&mod->img_param, filename, mod_data->dng_opcode_lists); // FIXME: will not work for timelapses
@@ -258,9 +548,9 @@ void modify_roi_out(
   }
 #endif
   // set a bit of metadata from rawspeed, overwrite exiv2 because this one is more consistent:
-  snprintf(mod->img_param.maker, sizeof(mod->img_param.maker), "%s", mod_data->d->mRaw->metadata.canonical_make.c_str());
-  snprintf(mod->img_param.model, sizeof(mod->img_param.model), "%s", mod_data->d->mRaw->metadata.canonical_model.c_str());
-  mod->img_param.iso = mod_data->d->mRaw->metadata.isoSpeed;
+  snprintf(mod->img_param.maker, sizeof(mod->img_param.maker), "%s", probe.maker);
+  snprintf(mod->img_param.model, sizeof(mod->img_param.model), "%s", probe.model);
+  mod->img_param.iso = probe.iso;
   if(noise_a[0] == 0.0f && noise_b[0] == 0.0f)
   {
     char pname[512];
@@ -288,21 +578,16 @@ void modify_roi_out(
   }
 
   // dimensions of cropped image (cut away black borders for noise estimation)
-  rawspeed::iPoint2D dimCropped = mod_data->d->mRaw->dim;
-  rawspeed::iPoint2D cropTL = mod_data->d->mRaw->getCropOffset();
-  mod->img_param.crop_aabb[0] = cropTL.x;
-  mod->img_param.crop_aabb[1] = cropTL.y;
-  mod->img_param.crop_aabb[2] = cropTL.x + dimCropped.x;
-  mod->img_param.crop_aabb[3] = cropTL.y + dimCropped.y;
-
-  if(!mod_data->d->mRaw->blackAreas.empty() || !mod_data->d->mRaw->blackLevelSeparate)
-    mod_data->d->mRaw->calculateBlackAreas();
-  const auto bl = *(mod_data->d->mRaw->blackLevelSeparate->getAsArray1DRef());
+  mod->img_param.crop_aabb[0] = probe.crop[0];
+  mod->img_param.crop_aabb[1] = probe.crop[1];
+  mod->img_param.crop_aabb[2] = probe.crop[0] + probe.crop[2];
+  mod->img_param.crop_aabb[3] = probe.crop[1] + probe.crop[3];
+
   for(int k=0;k<4;k++)
   {
-    mod->img_param.black[k]        = bl(k);
-    mod->img_param.white[k]        = mod_data->d->mRaw->whitePoint.value_or((1u << 16)-1);
-    mod->img_param.whitebalance[k] = mod_data->d->mRaw->metadata.wbCoeffs[k];
+    mod->img_param.black[k]        = probe.black[k];
+    mod->img_param.white[k]        = probe.white;
+    mod->img_param.whitebalance[k] = probe.wb[k];
   }
   // normalise wb
   mod->img_param.whitebalance[0] /= mod->img_param.whitebalance[1];
@@ -314,10 +599,10 @@ void modify_roi_out(
   if(!(test == test))
   { // camera matrix not found in exif or compiled without exiv2
     float xyz_to_cam[12], mat[9] = {0};
-    if(mod_data->d->mRaw->metadata.colorMatrix.size() > 0)
+    if(probe.matrix)
     { // get d65 camera matrix from rawspeed
       for(int k=0;k<9;k++)
-        xyz_to_cam[k] = float(mod_data->d->mRaw->metadata.colorMatrix[k]);
+        xyz_to_cam[k] = probe.xyz_to_cam[k];
       mat3inv(mat, xyz_to_cam);
     }
     else mat[0] = mat[4] = mat[8] = 1.0;
@@ -341,17 +626,10 @@ void modify_roi_out(
       mod->img_param.cam_to_rec2020[k] = cam_to_rec2020[k];
   }
 
-  // uncrop bayer sensor filter
-  mod->img_param.filters = mod_data->d->mRaw->cfa.getDcrawFilter();
-  if(mod_data->d->mRaw->getCpp() == 3)
-  {
-    mod->img_param.filters = 0;
+  // bayer sensor filter, uncropped in probe_read()
+  mod->img_param.filters = probe.filters;
+  if(probe.cpp == 3)
     mod->connector[0].chan = dt_token("rgba");
-  }
-  else if(mod->img_param.filters != 9u)
-    mod->img_param.filters = rawspeed::ColorFilterArray::shiftDcrawFilter(
-        mod_data->d->mRaw->cfa.getDcrawFilter(),
-        cropTL.x, cropTL.y);
 
   // now we need to account for the pixel shift due to an offset filter:
   dt_roi_t *ro = &mod->connector[0].roi;
@@ -360,16 +638,13 @@ void modify_roi_out(
   // special handling for x-trans sensors
   if(mod->img_param.filters == 9u)
   {
-    uint8_t f[6][6];
     // get 6x6 CFA offset from top left of cropped image
     // NOTE: This is different from how things are done with Bayer
     // sensors. For these, the CFA in cameras.xml is pre-offset
     // depending on the distance modulo 2 between raw and usable
     // image data. For X-Trans, the CFA in cameras.xml is
     // (currently) aligned with the top left of the raw data.
-    for(int i = 0; i < 6; ++i)
-      for(int j = 0; j < 6; ++j)
-        f[j][i] = static_cast<uint8_t>(mod_data->d->mRaw->cfa.getColorAt(i, j));
+    const uint8_t (*f)[6] = probe.xtrans;
 
     // find first green in same row
     for(ox=0;ox<6&&FCxtrans(0,ox,f)!=1;ox++)
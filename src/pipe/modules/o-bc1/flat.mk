@@ -1,3 +1,3 @@
-MOD_LDFLAGS=-lz
+MOD_LDFLAGS=-lz -lm
 # actually unused currently:
 #MOD_CFLAGS=-fopenmp
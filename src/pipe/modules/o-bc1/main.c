@@ -1,6 +1,7 @@
 #include "modules/api.h"
 #include "core/core.h"
 #include "core/fs.h"
+#include "db/archive.h"
 #define STB_DXT_IMPLEMENTATION
 #include "stb_dxt.h"
 
@@ -8,29 +9,28 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
 #include <zlib.h>
 
-// called after pipeline finished up to here.
-// our input buffer will come in memory mapped.
-void write_sink(
-    dt_module_t            *module,
-    void                   *buf,
-    dt_write_sink_params_t *p)
+// compress rgba8 pixels to bc1 blocks behind the header {magic, version, width, height}.
+// returns the header, to be free()d, and the size in *size.
+static uint32_t *
+compress_bc1(
+    const uint8_t *in,
+    uint32_t       wd,
+    uint32_t       ht,
+    size_t        *size)
 {
-  const char *filename = dt_module_param_string(module, 0);
-
-  const uint32_t wd = module->connector[0].roi.wd;
-  const uint32_t ht = module->connector[0].roi.ht;
-  const uint8_t *in = (const uint8_t *)buf;
-
-  // fprintf(stderr, "[o-bc1] graph %lx writing '%s' %d x %d\n", module->graph, filename, wd, ht);
-
   // go through all 4x4 blocks
   // parallelise via our thread pool or openmp or what?
   // probably usually bc1 thumbnails are too small to warrant a good speedup.
   const int bx = wd/4, by = ht/4;
   size_t num_blocks = bx * (uint64_t)by;
-  uint8_t *out = (uint8_t *)malloc(sizeof(uint8_t)*8*num_blocks);
+  // leave room for the header in front of the blocks:
+  *size = sizeof(uint32_t)*4 + sizeof(uint8_t)*8*num_blocks;
+  uint32_t *header = (uint32_t *)malloc(*size);
+  uint8_t *out = (uint8_t *)(header + 4);
 // #pragma omp parallel for collapse(2) schedule(static)
   for(int j=0;j<4*by;j+=4)
   {
@@ -47,16 +47,116 @@ void write_sink(
           0); // or slower: STB_DXT_HIGHQUAL
     }
   }
+  header[0] = dt_token("bc1"); // magic, version, width, height
+  header[1] = 1;
+  header[2] = bx*4;
+  header[3] = by*4;
+  return header;
+}
+
+static float   lut_lin[256];   // srgb byte -> linear
+static uint8_t lut_srgb[4096]; // linear -> srgb byte
+
+static void
+init_luts()
+{
+  for(int i=0;i<256;i++)
+  {
+    const float v = i/255.0f;
+    lut_lin[i] = v <= 0.04045f ? v/12.92f : powf((v+0.055f)/1.055f, 2.4f);
+  }
+  for(int i=0;i<4096;i++)
+  {
+    const float v = i/4095.0f;
+    const float e = v <= 0.0031308f ? 12.92f*v : 1.055f*powf(v, 1.0f/2.4f)-0.055f;
+    lut_srgb[i] = (uint8_t)fminf(255.0f, fmaxf(0.0f, 255.0f*e + 0.5f));
+  }
+}
+
+// box filter rgba8 down to fit max x max. averages in linear light (same as
+// db/preview.c does for the embedded jpg), alpha as is.
+static uint8_t *
+downscale(
+    const uint8_t *in,
+    uint32_t       wd,
+    uint32_t       ht,
+    uint32_t       max,
+    uint32_t      *owd,
+    uint32_t      *oht)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_luts);
+  const float scale = MIN(max/(float)wd, max/(float)ht);
+  const uint32_t dw = MAX(4, wd*scale), dh = MAX(4, ht*scale);
+  uint8_t *out = malloc(sizeof(uint8_t)*4*dw*dh);
+  for(uint32_t j=0;j<dh;j++) for(uint32_t i=0;i<dw;i++)
+  {
+    const uint32_t x0 = i*wd/dw, x1 = MAX(x0+1, (i+1)*wd/dw), y0 = j*ht/dh, y1 = MAX(y0+1, (j+1)*ht/dh);
+    float sum[3] = {0};
+    uint32_t alpha = 0;
+    for(uint32_t y=y0;y<y1;y++) for(uint32_t x=x0;x<x1;x++)
+    {
+      const uint8_t *px = in + 4*(wd*y+x);
+      for(int c=0;c<3;c++) sum[c] += lut_lin[px[c]];
+      alpha += px[3];
+    }
+    const uint32_t n = (x1-x0)*(y1-y0);
+    for(int c=0;c<3;c++)
+      out[4*(dw*j+i)+c] = lut_srgb[(int)(4095.0f*fminf(1.0f, sum[c]/n) + 0.5f)];
+    out[4*(dw*j+i)+3] = (alpha + n/2)/n;
+  }
+  *owd = dw;
+  *oht = dh;
+  return out;
+}
+
+// called after pipeline finished up to here.
+// our input buffer will come in memory mapped.
+void write_sink(
+    dt_module_t            *module,
+    void                   *buf,
+    dt_write_sink_params_t *p)
+{
+  const char *filename = dt_module_param_string(module, 0);
+  const int small = dt_module_param_int(module, dt_module_get_param(module->so, dt_token("small")))[0];
+
+  uint32_t wd = module->connector[0].roi.wd;
+  uint32_t ht = module->connector[0].roi.ht;
+  const uint8_t *in = (const uint8_t *)buf;
+
+  // fprintf(stderr, "[o-bc1] graph %lx writing '%s' %d x %d\n", module->graph, filename, wd, ht);
+
+  uint64_t key;
+  dt_archive_t *archive = dt_archive_find(filename, &key);
+  uint8_t *scaled = 0;
+  if(small > 0 && (wd > small || ht > small))
+  { // the full size is the larger level of a thumbnail, it only goes to the archive
+    size_t size;
+    uint32_t *header = compress_bc1(in, wd, ht, &size);
+    if(archive && dt_archive_put(archive, dt_archive_key_level(key, 1), header, size))
+      fprintf(stderr, "[o-bc1] could not write '%s' to the thumbnail archive!\n", filename);
+    free(header);
+    in = scaled = downscale(in, wd, ht, small, &wd, &ht);
+  }
+  size_t size;
+  uint32_t *header = compress_bc1(in, wd, ht, &size);
+  free(scaled);
+  if(archive)
+  { // thumbnail archive: bc1 is compressed already, store it as is. replaces the old one atomically
+    if(dt_archive_put(archive, key, header, size))
+      fprintf(stderr, "[o-bc1] could not write '%s' to the thumbnail archive!\n", filename);
+    free(header);
+    return;
+  }
 
   char tmpfile[1024];
   snprintf(tmpfile, sizeof(tmpfile), "%s.temp", filename);
   gzFile f = gzopen(tmpfile, "wb");
   // write magic, version, width, height
-  uint32_t header[4] = { dt_token("bc1z"), 1, bx*4, by*4 };
-  gzwrite(f, header, sizeof(uint32_t)*4);
-  gzwrite(f, out, sizeof(uint8_t)*8*num_blocks);
+  header[0] = dt_token("bc1z");
+  gzwrite(f, header, size);
   gzclose(f);
-  free(out);
+  free(header);
   // atomically create filename only when we're quite done writing:
   unlink(filename); // just to be sure the link will work
   fs_link(tmpfile, filename);
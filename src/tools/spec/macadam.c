@@ -96,7 +96,7 @@ int main(int argc, char *argv[])
   const int nt = threads_num();
   int taskid = -1;
   for(int i=0;i<nt;i++)
-    taskid = threads_task("macadam", work_item_cnt, taskid, buf, parallel_run, 0);
+    taskid = threads_task("macadam", work_item_cnt, taskid, buf, parallel_run, 0, s_threads_prio_normal);
   threads_wait(taskid);
 #else // single threaded version:
   for(int k=0;k<work_item_cnt;k++)
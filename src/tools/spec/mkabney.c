@@ -520,7 +520,7 @@ mac_error:
   const int nt = threads_num();
   int taskid = -1;
   for(int i=0;i<nt;i++)
-    taskid = threads_task("mkabney", res*res, taskid, &par, parallel_run, 0);
+    taskid = threads_task("mkabney", res*res, taskid, &par, parallel_run, 0, s_threads_prio_normal);
   threads_wait(taskid);
 #else
   for(int k=0;k<res*res;k++)
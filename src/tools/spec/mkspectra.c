@@ -348,6 +348,12 @@ void parallel_run(uint32_t item, void *data)
   d->out[4*idx + 3] = m;
 }
 
+void parallel_run_range(uint32_t beg, uint32_t end, void *data)
+{
+  for(uint32_t k=beg;k<end;k++)
+    parallel_run(k, data);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -408,17 +414,10 @@ mac_error:
     .res   = res,
   };
 
-  // threads_global_init();
-#if 0 // note that with proper atomics this is slower than single thread:
-  const int nt = threads_num();
-  int taskid = -1;
-  for(int i=0;i<nt;i++)
-    taskid = threads_task("mkabney", res*res, taskid, &par, parallel_run, 0);
-  threads_wait(taskid);
-#else
-  for(int k=0;k<res*res;k++)
-    parallel_run(k, &par);
-#endif
+  // one row of the table per chunk, the per item dispatch used to be slower than single thread:
+  threads_global_init();
+  threads_parallel_for(0, res*res, res, parallel_run_range, &par);
+  threads_global_cleanup();
   {
     dt_inpaint_buf_t inpaint_buf = {
       .dat = (float *)out,
@@ -462,6 +461,5 @@ mac_error:
   }
   free(out);
   free(max_b);
-  // threads_global_cleanup();
   printf("\n");
 }